@@ -0,0 +1,135 @@
+#include "atlas.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+
+bool atlas_packer_init(struct atlas_packer *packer, uint32_t width,
+        uint32_t height) {
+    memset(packer, 0, sizeof(*packer));
+    if (width == 0 || height == 0) {
+        fake_log(ERROR, "Invalid atlas size %ux%u", width, height);
+        return false;
+    }
+    packer->width = width;
+    packer->height = height;
+    packer->capacity = 16;
+    packer->nodes = malloc(packer->capacity * sizeof(*packer->nodes));
+    if (!packer->nodes) {
+        fake_log(ERROR, "Allocation failed");
+        return false;
+    }
+    atlas_packer_reset(packer);
+    return true;
+}
+
+void atlas_packer_reset(struct atlas_packer *packer) {
+    packer->nodes[0] = (struct atlas_skyline_node){ 0, 0, packer->width };
+    packer->len = 1;
+    packer->used_height = 0;
+    packer->used_area = 0;
+}
+
+// Lowest y a width x height rectangle can sit at with its left edge on
+// node index, or UINT32_MAX
+static uint32_t fit(const struct atlas_packer *packer, size_t index,
+        uint32_t width, uint32_t height) {
+    uint32_t x = packer->nodes[index].x;
+    if (x + width > packer->width) {
+        return UINT32_MAX;
+    }
+    uint32_t y = 0;
+    uint32_t left = width;
+    for (size_t i = index; left > 0; i++) {
+        const struct atlas_skyline_node *node = &packer->nodes[i];
+        if (node->y > y) {
+            y = node->y;
+        }
+        if (y + height > packer->height) {
+            return UINT32_MAX;
+        }
+        left -= node->width < left ? node->width : left;
+    }
+    return y;
+}
+
+bool atlas_packer_add(struct atlas_packer *packer, uint32_t width,
+        uint32_t height, uint32_t *x, uint32_t *y) {
+    if (width == 0 || height == 0) {
+        return false;
+    }
+    size_t best = SIZE_MAX;
+    uint32_t best_y = UINT32_MAX, best_width = UINT32_MAX;
+    for (size_t i = 0; i < packer->len; i++) {
+        uint32_t node_y = fit(packer, i, width, height);
+        // Lowest top edge, then the narrowest segment to waste less
+        if (node_y == UINT32_MAX || node_y + height > best_y ||
+                (node_y + height == best_y &&
+                 packer->nodes[i].width >= best_width)) {
+            continue;
+        }
+        best = i;
+        best_y = node_y + height;
+        best_width = packer->nodes[i].width;
+    }
+    if (best == SIZE_MAX) {
+        return false;
+    }
+
+    if (packer->len == packer->capacity) {
+        size_t capacity = packer->capacity * 2;
+        struct atlas_skyline_node *nodes = realloc(packer->nodes,
+                capacity * sizeof(*nodes));
+        if (!nodes) {
+            fake_log(ERROR, "Allocation failed");
+            return false;
+        }
+        packer->nodes = nodes;
+        packer->capacity = capacity;
+    }
+
+    *x = packer->nodes[best].x;
+    *y = best_y - height;
+    memmove(&packer->nodes[best + 1], &packer->nodes[best],
+            (packer->len - best) * sizeof(*packer->nodes));
+    packer->nodes[best] = (struct atlas_skyline_node){ *x, best_y, width };
+    packer->len++;
+
+    // Cut what the new segment now covers off the ones after it
+    size_t i = best + 1;
+    uint32_t end = *x + width;
+    while (i < packer->len && packer->nodes[i].x < end) {
+        struct atlas_skyline_node *node = &packer->nodes[i];
+        uint32_t node_end = node->x + node->width;
+        if (node_end <= end) {
+            memmove(node, node + 1,
+                    (packer->len - i - 1) * sizeof(*packer->nodes));
+            packer->len--;
+            continue;
+        }
+        node->width = node_end - end;
+        node->x = end;
+        break;
+    }
+    // Merge neighbours at the same height
+    for (i = 0; i + 1 < packer->len;) {
+        if (packer->nodes[i].y != packer->nodes[i + 1].y) {
+            i++;
+            continue;
+        }
+        packer->nodes[i].width += packer->nodes[i + 1].width;
+        memmove(&packer->nodes[i + 1], &packer->nodes[i + 2],
+                (packer->len - i - 2) * sizeof(*packer->nodes));
+        packer->len--;
+    }
+
+    if (best_y > packer->used_height) {
+        packer->used_height = best_y;
+    }
+    packer->used_area += (uint64_t)width * height;
+    return true;
+}
+
+void atlas_packer_finish(struct atlas_packer *packer) {
+    free(packer->nodes);
+    memset(packer, 0, sizeof(*packer));
+}
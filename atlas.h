@@ -0,0 +1,35 @@
+#ifndef FAKE_CHEN_ATLAS_H
+#define FAKE_CHEN_ATLAS_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// One segment of the skyline, width columns from x all filled up to y
+struct atlas_skyline_node {
+    uint32_t x, y, width;
+};
+
+/**
+ * Skyline bottom-left packer: rectangles go where their top edge ends up
+ * lowest, so the used part of the atlas stays a short band that a single
+ * readback covers. Feeding it tallest first packs tighter.
+ */
+struct atlas_packer {
+    uint32_t width, height;
+    // Highest row in use, what a readback of every tile has to cover
+    uint32_t used_height;
+    uint64_t used_area;
+    struct atlas_skyline_node *nodes;
+    size_t len, capacity;
+};
+
+bool atlas_packer_init(struct atlas_packer *packer, uint32_t width,
+        uint32_t height);
+/** Empty the atlas, keeping its size. */
+void atlas_packer_reset(struct atlas_packer *packer);
+/** Place a width x height rectangle, false when it does not fit. */
+bool atlas_packer_add(struct atlas_packer *packer, uint32_t width,
+        uint32_t height, uint32_t *x, uint32_t *y);
+void atlas_packer_finish(struct atlas_packer *packer);
+
+#endif
@@ -0,0 +1,743 @@
+#include "batch.h"
+#include "log.h"
+#include "trace.h"
+#include <drm_fourcc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef GL_STREAM_READ
+#define GL_STREAM_READ 0x88E1
+#endif
+
+static const long NSEC_PER_SEC = 1000000000;
+
+// Offset of a job whose format cannot be read back
+#define JOB_FAILED SIZE_MAX
+
+static uint32_t job_format(const struct render_job *job) {
+    return job->format == DRM_FORMAT_INVALID ? DRM_FORMAT_ABGR8888 :
+        job->format;
+}
+
+static int compare_jobs(const void *a, const void *b) {
+    const struct render_job *x = a, *y = b;
+    uint32_t xf = job_format(x), yf = job_format(y);
+    if (xf != yf) {
+        return xf < yf ? -1 : 1;
+    }
+    if (x->width != y->width) {
+        return x->width < y->width ? -1 : 1;
+    }
+    if (x->height != y->height) {
+        return x->height < y->height ? -1 : 1;
+    }
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+// Tallest first within a format, which keeps the skyline flat
+static int compare_jobs_atlas(const void *a, const void *b) {
+    const struct render_job *x = a, *y = b;
+    uint32_t xf = job_format(x), yf = job_format(y);
+    if (xf != yf) {
+        return xf < yf ? -1 : 1;
+    }
+    if (x->height != y->height) {
+        return x->height > y->height ? -1 : 1;
+    }
+    if (x->width != y->width) {
+        return x->width > y->width ? -1 : 1;
+    }
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+struct render_batcher *render_batcher_create(struct egl *egl,
+        struct gles_renderer *gles, size_t batch_jobs) {
+    if (batch_jobs < 1) {
+        fake_log(ERROR, "Invalid batch size %zu", batch_jobs);
+        return NULL;
+    }
+    struct render_batcher *batcher = calloc(1, sizeof(*batcher));
+    if (!batcher) {
+        fake_log(ERROR, "Allocation failed");
+        return NULL;
+    }
+    batcher->egl = egl;
+    batcher->gles = gles;
+    batcher->context = eglGetCurrentContext();
+    batcher->batch_jobs = batch_jobs;
+    if (!gles->exts.pixel_buffer_object) {
+        fake_log(INFO, "Pixel pack buffers not supported, "
+                "batches are read back synchronously");
+    }
+    return batcher;
+}
+
+bool render_batcher_use_atlas(struct render_batcher *batcher,
+        uint32_t size) {
+    GLint max_size = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    if (size > (uint32_t)max_size) {
+        fake_log(ERROR, "Atlas of %u exceeds GL_MAX_TEXTURE_SIZE %d", size,
+                max_size);
+        return false;
+    }
+    atlas_packer_finish(&batcher->packer);
+    batcher->atlas_size = 0;
+    if (size == 0) {
+        return true;
+    }
+    if (!atlas_packer_init(&batcher->packer, size, size)) {
+        return false;
+    }
+    batcher->atlas_size = size;
+    return true;
+}
+
+static struct render_batch *batch_get(struct render_batcher *batcher) {
+    struct render_batch *batch = batcher->free_batches;
+    if (batch) {
+        batcher->free_batches = batch->next;
+        batch->next = NULL;
+        return batch;
+    }
+    batch = calloc(1, sizeof(*batch));
+    if (!batch) {
+        fake_log(ERROR, "Allocation failed");
+    }
+    return batch;
+}
+
+static void batch_destroy(struct render_batcher *batcher,
+        struct render_batch *batch) {
+    struct egl *egl = batcher->egl;
+    if (batch->fence != EGL_NO_SYNC_KHR) {
+        egl->procs.eglDestroySyncKHR(egl->display, batch->fence);
+    }
+    if (batch->pixels && batch->pbo) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER_NV, batch->pbo);
+        batcher->gles->procs.glUnmapBuffer(GL_PIXEL_PACK_BUFFER_NV);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER_NV, 0);
+    }
+    if (batch->pbo) {
+        glDeleteBuffers(1, &batch->pbo);
+    }
+    free(batch->cpu_buffer);
+    free(batch->jobs);
+    free(batch->slots);
+    free(batch->pages);
+    free(batch);
+}
+
+bool render_batcher_submit(struct render_batcher *batcher,
+        const struct render_job *job) {
+    if (!batcher->pending) {
+        batcher->pending = batch_get(batcher);
+        if (!batcher->pending) {
+            return false;
+        }
+    }
+    struct render_batch *batch = batcher->pending;
+    if (batch->len == batch->capacity) {
+        size_t capacity = batch->capacity ? batch->capacity * 2 : 64;
+        struct render_job *jobs = realloc(batch->jobs,
+                capacity * sizeof(*jobs));
+        if (!jobs) {
+            fake_log(ERROR, "Allocation failed");
+            return false;
+        }
+        batch->jobs = jobs;
+        struct render_batch_slot *slots = realloc(batch->slots,
+                capacity * sizeof(*slots));
+        if (!slots) {
+            fake_log(ERROR, "Allocation failed");
+            return false;
+        }
+        batch->slots = slots;
+        batch->capacity = capacity;
+    }
+    batch->jobs[batch->len++] = *job;
+    if (batch->len >= batcher->batch_jobs) {
+        return render_batcher_flush(batcher);
+    }
+    return true;
+}
+
+// (Re)allocate target storage at width x height, leaving its FBO bound
+static bool target_alloc(struct render_batcher *batcher,
+        struct render_batch_target *target, uint32_t width, uint32_t height) {
+    if (!target->fbo) {
+        glGenFramebuffers(1, &target->fbo);
+        glGenTextures(1, &target->texture);
+    }
+    glBindTexture(GL_TEXTURE_2D, target->texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA,
+            GL_UNSIGNED_BYTE, NULL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, target->fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+            GL_TEXTURE_2D, target->texture, 0);
+    target->width = width;
+    target->height = height;
+    batcher->target_allocs++;
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        fake_log(ERROR, "Batch target %ux%u: FBO creation failed", width,
+                height);
+        target->width = target->height = 0;
+        return false;
+    }
+    return true;
+}
+
+// The FBO for a width x height group, bound. Storage is kept for the last
+// few sizes, the least recently used one is reallocated.
+static bool bind_target(struct render_batcher *batcher, uint32_t width,
+        uint32_t height) {
+    struct render_batch_target *target = &batcher->targets[0];
+    for (int i = 0; i < RENDER_BATCH_TARGETS; i++) {
+        struct render_batch_target *t = &batcher->targets[i];
+        if (t->fbo && t->width == width && t->height == height) {
+            target = t;
+            goto bind;
+        }
+        if (t->last_used < target->last_used) {
+            target = t;
+        }
+    }
+    if (!target_alloc(batcher, target, width, height)) {
+        return false;
+    }
+
+bind:
+    target->last_used = ++batcher->target_clock;
+    glBindFramebuffer(GL_FRAMEBUFFER, target->fbo);
+    glViewport(0, 0, width, height);
+    return true;
+}
+
+// Room for size bytes of pixels, in the pack buffer when there is one
+static bool batch_reserve(struct render_batcher *batcher,
+        struct render_batch *batch, size_t size) {
+    if (batcher->gles->exts.pixel_buffer_object) {
+        if (!batch->pbo) {
+            glGenBuffers(1, &batch->pbo);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER_NV, batch->pbo);
+        if (batch->buffer_size < size) {
+            glBufferData(GL_PIXEL_PACK_BUFFER_NV, size, NULL, GL_STREAM_READ);
+            batch->buffer_size = size;
+        }
+        return true;
+    }
+    if (batch->buffer_size < size) {
+        void *buffer = realloc(batch->cpu_buffer, size);
+        if (!buffer) {
+            fake_log(ERROR, "Allocation failed");
+            return false;
+        }
+        batch->cpu_buffer = buffer;
+        batch->buffer_size = size;
+    }
+    return true;
+}
+
+static bool batch_add_page(struct render_batch *batch, uint32_t format) {
+    if (batch->page_count == batch->page_capacity) {
+        size_t capacity = batch->page_capacity ? batch->page_capacity * 2 : 4;
+        struct render_batch_page *pages = realloc(batch->pages,
+                capacity * sizeof(*pages));
+        if (!pages) {
+            fake_log(ERROR, "Allocation failed");
+            return false;
+        }
+        batch->pages = pages;
+        batch->page_capacity = capacity;
+    }
+    batch->pages[batch->page_count++] =
+        (struct render_batch_page){ .format = format };
+    return true;
+}
+
+// Close the last page: its readback covers the rows the tiles reach
+static void batch_close_page(struct render_batcher *batcher,
+        struct render_batch *batch, size_t *size) {
+    struct render_batch_page *page = &batch->pages[batch->page_count - 1];
+    page->height = batcher->packer.used_height;
+    page->offset = *size;
+    *size += (size_t)batcher->atlas_size * page->height * 4;
+    batcher->atlas_pages++;
+    batcher->atlas_tile_area += batcher->packer.used_area;
+    batcher->atlas_read_area += (uint64_t)batcher->atlas_size * page->height;
+}
+
+// Give every job its place in the batch buffer: atlas tiles when they fit,
+// packed page after page, or else a slot of their own. Returns the bytes
+// needed, SIZE_MAX on failure.
+static size_t batch_layout(struct render_batcher *batcher,
+        struct render_batch *batch) {
+    struct gles_renderer *gles = batcher->gles;
+    uint32_t atlas_size = batcher->atlas_size;
+    size_t size = 0;
+    batch->page_count = 0;
+    for (size_t i = 0; i < batch->len; i++) {
+        const struct render_job *job = &batch->jobs[i];
+        struct render_batch_slot *slot = &batch->slots[i];
+        slot->page = -1;
+        GLenum gl_format;
+        if (!render_job_read_format(gles, job, &gl_format)) {
+            fake_log(ERROR, "Job %lu: unsupported format 0x%08x",
+                    (unsigned long)job->id, job->format);
+            slot->offset = JOB_FAILED;
+            continue;
+        }
+        if (atlas_size == 0 || job->width > atlas_size ||
+                job->height > atlas_size) {
+            slot->offset = size;
+            slot->stride = job->width * 4;
+            size += (size_t)slot->stride * job->height;
+            continue;
+        }
+
+        struct render_batch_page *page = batch->page_count ?
+            &batch->pages[batch->page_count - 1] : NULL;
+        if (!page || page->format != job_format(job) ||
+                !atlas_packer_add(&batcher->packer, job->width, job->height,
+                    &slot->x, &slot->y)) {
+            if (page) {
+                batch_close_page(batcher, batch, &size);
+            }
+            if (!batch_add_page(batch, job_format(job))) {
+                return SIZE_MAX;
+            }
+            atlas_packer_reset(&batcher->packer);
+            atlas_packer_add(&batcher->packer, job->width, job->height,
+                    &slot->x, &slot->y);
+        }
+        slot->page = batch->page_count - 1;
+        batcher->atlas_tiles++;
+    }
+    if (batch->page_count) {
+        batch_close_page(batcher, batch, &size);
+    }
+
+    for (size_t i = 0; i < batch->len; i++) {
+        struct render_batch_slot *slot = &batch->slots[i];
+        if (slot->page >= 0) {
+            slot->stride = atlas_size * 4;
+            slot->offset = batch->pages[slot->page].offset +
+                (size_t)slot->y * slot->stride + (size_t)slot->x * 4;
+        }
+    }
+    return size;
+}
+
+static bool bind_atlas(struct render_batcher *batcher) {
+    struct render_batch_target *atlas = &batcher->atlas;
+    if (atlas->width != batcher->atlas_size &&
+            !target_alloc(batcher, atlas, batcher->atlas_size,
+                batcher->atlas_size)) {
+        return false;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, atlas->fbo);
+    return true;
+}
+
+// Every tile of the page in one go, bottom row first like a single job
+static void read_page(struct render_batcher *batcher,
+        const struct render_batch_page *page, uint8_t *base) {
+    struct render_job job = { .format = page->format };
+    GLenum gl_format;
+    render_job_read_format(batcher->gles, &job, &gl_format);
+    glDisable(GL_SCISSOR_TEST);
+    glReadPixels(0, 0, batcher->atlas_size, page->height, gl_format,
+            GL_UNSIGNED_BYTE, base + page->offset);
+}
+
+bool render_batcher_flush(struct render_batcher *batcher) {
+    struct render_batch *batch = batcher->pending;
+    if (!batch || batch->len == 0) {
+        return true;
+    }
+    TRACE_SCOPE("render_batcher_flush");
+    struct gles_renderer *gles = batcher->gles;
+    struct egl *egl = batcher->egl;
+
+    qsort(batch->jobs, batch->len, sizeof(*batch->jobs),
+            batcher->atlas_size ? compare_jobs_atlas : compare_jobs);
+    size_t size = batch_layout(batcher, batch);
+    if (size == SIZE_MAX || !batch_reserve(batcher, batch, size)) {
+        return false;
+    }
+    uint8_t *base = batch->pbo ? NULL : batch->cpu_buffer;
+
+    const struct render_job *group = NULL;
+    int page = -1;
+    bool bound = false;
+    for (size_t i = 0; i < batch->len; i++) {
+        const struct render_job *job = &batch->jobs[i];
+        struct render_batch_slot *slot = &batch->slots[i];
+        if (slot->offset == JOB_FAILED) {
+            continue;
+        }
+        if (slot->page != page) {
+            if (page >= 0) {
+                read_page(batcher, &batch->pages[page], base);
+            }
+            page = slot->page;
+            if (page >= 0) {
+                bound = bind_atlas(batcher);
+                glEnable(GL_SCISSOR_TEST);
+                batcher->groups++;
+            }
+            group = NULL;
+        }
+
+        if (page >= 0) {
+            if (!bound) {
+                slot->offset = JOB_FAILED;
+                continue;
+            }
+            // The tile only, the rest of the atlas is left alone
+            glViewport(slot->x, slot->y, job->width, job->height);
+            glScissor(slot->x, slot->y, job->width, job->height);
+            glClearColor(job->color[0], job->color[1], job->color[2],
+                    job->color[3]);
+            glClear(GL_COLOR_BUFFER_BIT);
+            continue;
+        }
+
+        if (!group || job_format(group) != job_format(job) ||
+                group->width != job->width || group->height != job->height) {
+            bound = bind_target(batcher, job->width, job->height);
+            batcher->groups++;
+            group = job;
+        }
+        if (!bound) {
+            slot->offset = JOB_FAILED;
+            continue;
+        }
+        GLenum gl_format;
+        render_job_read_format(gles, job, &gl_format);
+        glClearColor(job->color[0], job->color[1], job->color[2],
+                job->color[3]);
+        glClear(GL_COLOR_BUFFER_BIT);
+        // Queued behind the clear when a pack buffer is bound
+        glReadPixels(0, 0, job->width, job->height, gl_format,
+                GL_UNSIGNED_BYTE, base + slot->offset);
+    }
+    if (page >= 0) {
+        read_page(batcher, &batch->pages[page], base);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    if (batch->pbo) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER_NV, 0);
+        if (egl->exts.KHR_fence_sync) {
+            batch->fence = egl->procs.eglCreateSyncKHR(egl->display,
+                    EGL_SYNC_FENCE_KHR, NULL);
+        }
+        glFlush();
+    } else {
+        // Already read, hand it out as is
+        batch->pixels = batch->cpu_buffer;
+    }
+
+    batcher->pending = NULL;
+    batch->next_job = 0;
+    if (batcher->in_flight_tail) {
+        batcher->in_flight_tail->next = batch;
+    } else {
+        batcher->in_flight = batch;
+    }
+    batcher->in_flight_tail = batch;
+    batcher->jobs += batch->len;
+    batcher->batches++;
+    return glGetError() == GL_NO_ERROR;
+}
+
+// Map the head batch once its fence signalled. Without wait, gives up if it
+// has not.
+static bool batch_finish(struct render_batcher *batcher,
+        struct render_batch *batch, bool wait) {
+    struct egl *egl = batcher->egl;
+    if (batch->fence != EGL_NO_SYNC_KHR) {
+        EGLint ret = egl->procs.eglClientWaitSyncKHR(egl->display,
+                batch->fence, wait ? EGL_SYNC_FLUSH_COMMANDS_BIT_KHR : 0,
+                wait ? EGL_FOREVER_KHR : 0);
+        if (ret == EGL_TIMEOUT_EXPIRED_KHR) {
+            return false;
+        }
+        if (ret == EGL_FALSE) {
+            fake_log(ERROR, "eglClientWaitSyncKHR failed");
+        }
+        egl->procs.eglDestroySyncKHR(egl->display, batch->fence);
+        batch->fence = EGL_NO_SYNC_KHR;
+        if (wait) {
+            batcher->fence_waits++;
+        }
+    } else if (!wait) {
+        // No way to tell whether it is done without blocking in the map
+        return false;
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER_NV, batch->pbo);
+    batch->pixels = batcher->gles->procs.glMapBufferRange(
+            GL_PIXEL_PACK_BUFFER_NV, 0, batch->buffer_size,
+            GL_MAP_READ_BIT_EXT);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER_NV, 0);
+    if (!batch->pixels) {
+        fake_log(ERROR, "Failed to map a batch of %zu jobs", batch->len);
+        for (size_t i = 0; i < batch->len; i++) {
+            batch->slots[i].offset = JOB_FAILED;
+        }
+    }
+    return true;
+}
+
+// Unmap a fully handed out batch and keep it, buffers and all, for reuse
+static void batch_recycle(struct render_batcher *batcher,
+        struct render_batch *batch) {
+    if (batch->pbo && batch->pixels) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER_NV, batch->pbo);
+        batcher->gles->procs.glUnmapBuffer(GL_PIXEL_PACK_BUFFER_NV);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER_NV, 0);
+    }
+    batch->pixels = NULL;
+    batch->len = 0;
+    batch->next_job = 0;
+    batch->next = batcher->free_batches;
+    batcher->free_batches = batch;
+}
+
+bool render_batcher_next(struct render_batcher *batcher, bool wait,
+        struct render_completion *completion) {
+    struct render_batch *batch = batcher->in_flight;
+    while (batch && batch->next_job == batch->len) {
+        batcher->in_flight = batch->next;
+        if (!batcher->in_flight) {
+            batcher->in_flight_tail = NULL;
+        }
+        batch_recycle(batcher, batch);
+        batch = batcher->in_flight;
+    }
+    if (!batch) {
+        return false;
+    }
+    if (!batch->pixels && !batch_finish(batcher, batch, wait)) {
+        return false;
+    }
+
+    size_t i = batch->next_job++;
+    const struct render_batch_slot *slot = &batch->slots[i];
+    completion->job = batch->jobs[i];
+    completion->stride = slot->stride;
+    completion->ok = batch->pixels && slot->offset != JOB_FAILED;
+    completion->pixels = completion->ok ?
+        batch->pixels + slot->offset : NULL;
+    return true;
+}
+
+void render_batcher_log_stats(const struct render_batcher *batcher) {
+    if (batcher->batches == 0) {
+        return;
+    }
+    fake_log(INFO, "Batcher: %lu jobs in %lu batches, %.1f groups/batch, "
+            "%lu target allocations, %lu fence waits",
+            (unsigned long)batcher->jobs, (unsigned long)batcher->batches,
+            (double)batcher->groups / batcher->batches,
+            (unsigned long)batcher->target_allocs,
+            (unsigned long)batcher->fence_waits);
+    if (batcher->atlas_pages) {
+        fake_log(INFO, "Atlas %u: %lu tiles on %lu pages, %.1f%% of the "
+                "rows read back covered by tiles", batcher->atlas_size,
+                (unsigned long)batcher->atlas_tiles,
+                (unsigned long)batcher->atlas_pages,
+                100.0 * batcher->atlas_tile_area /
+                (batcher->atlas_read_area ? batcher->atlas_read_area : 1));
+    }
+}
+
+void render_batcher_destroy(struct render_batcher *batcher) {
+    if (!batcher) {
+        return;
+    }
+    if (batcher->pending) {
+        batch_destroy(batcher, batcher->pending);
+    }
+    while (batcher->in_flight) {
+        struct render_batch *batch = batcher->in_flight;
+        batcher->in_flight = batch->next;
+        batch_destroy(batcher, batch);
+    }
+    while (batcher->free_batches) {
+        struct render_batch *batch = batcher->free_batches;
+        batcher->free_batches = batch->next;
+        batch_destroy(batcher, batch);
+    }
+    for (int i = 0; i < RENDER_BATCH_TARGETS; i++) {
+        if (batcher->targets[i].fbo) {
+            glDeleteFramebuffers(1, &batcher->targets[i].fbo);
+            glDeleteTextures(1, &batcher->targets[i].texture);
+        }
+    }
+    if (batcher->atlas.fbo) {
+        glDeleteFramebuffers(1, &batcher->atlas.fbo);
+        glDeleteTextures(1, &batcher->atlas.texture);
+    }
+    atlas_packer_finish(&batcher->packer);
+    free(batcher);
+}
+
+static void benchmark_job(struct render_job *job, uint64_t i, uint32_t width,
+        uint32_t height) {
+    float t = (float)(i % 16) / 16.0f;
+    // Interleaved, so grouping has something to do
+    bool small = i % 2;
+    *job = (struct render_job){
+        .id = i,
+        .width = small ? width / 2 : width,
+        .height = small ? height / 2 : height,
+        .format = i % 4 < 2 ? DRM_FORMAT_ABGR8888 : DRM_FORMAT_ARGB8888,
+        .color = { t, 1.0f - t, 0.5f, 1.0f },
+    };
+}
+
+static double elapsed_s(const struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) +
+        (double)(end.tv_nsec - start->tv_nsec) / NSEC_PER_SEC;
+}
+
+// Whether the first pixel handed back is the job's clear color
+static bool completion_matches(const struct render_completion *completion) {
+    const uint8_t *pixel = completion->pixels;
+    int red = completion->job.format == DRM_FORMAT_ARGB8888 ?
+        pixel[2] : pixel[0];
+    int expected = (int)(completion->job.color[0] * 255.0f + 0.5f);
+    return abs(red - expected) <= 1;
+}
+
+static bool run_batched(struct gles_renderer *gles, uint64_t jobs,
+        size_t batch_jobs, uint32_t width, uint32_t height,
+        uint32_t atlas_size, double single) {
+    struct render_batcher *batcher = render_batcher_create(gles->egl, gles,
+            batch_jobs);
+    if (!batcher) {
+        return false;
+    }
+    if (!render_batcher_use_atlas(batcher, atlas_size)) {
+        render_batcher_destroy(batcher);
+        return false;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t completed = 0, failed = 0, wrong = 0;
+    struct render_completion completion;
+    for (uint64_t i = 0; i < jobs; i++) {
+        struct render_job job;
+        benchmark_job(&job, i, width, height);
+        if (!render_batcher_submit(batcher, &job)) {
+            break;
+        }
+        // Whatever the GPU finished meanwhile
+        while (render_batcher_next(batcher, false, &completion)) {
+            completed++;
+            failed += !completion.ok;
+            wrong += completion.ok && !completion_matches(&completion);
+        }
+    }
+    render_batcher_flush(batcher);
+    while (render_batcher_next(batcher, true, &completion)) {
+        completed++;
+        failed += !completion.ok;
+        wrong += completion.ok && !completion_matches(&completion);
+    }
+    double batched = elapsed_s(&start);
+
+    if (atlas_size) {
+        fake_log(INFO, "batches of %zu, atlas %u: %.1f jobs/s, %.2fx",
+                batch_jobs, atlas_size, jobs / batched, single / batched);
+    } else {
+        fake_log(INFO, "batches of %zu: %.1f jobs/s, %.2fx", batch_jobs,
+                jobs / batched, single / batched);
+    }
+    fake_log(INFO, "%lu completions, %lu failed, %lu wrong color",
+            (unsigned long)completed, (unsigned long)failed,
+            (unsigned long)wrong);
+    render_batcher_log_stats(batcher);
+    render_batcher_destroy(batcher);
+    return completed == jobs && wrong == 0;
+}
+
+bool render_batcher_benchmark(struct gles_renderer *gles, uint64_t jobs,
+        size_t batch_jobs, uint32_t width, uint32_t height,
+        uint32_t atlas_size) {
+    struct egl *egl = gles->egl;
+    if (!gles->exts.EXT_read_format_bgra) {
+        fake_log(INFO, "No BGRA readback, ARGB8888 jobs will fail");
+    }
+    if (!egl_make_current(egl)) {
+        return false;
+    }
+    uint8_t *pixels = malloc((size_t)width * height * 4);
+    if (!pixels) {
+        fake_log(ERROR, "Allocation failed");
+        return false;
+    }
+    GLuint fbo, texture;
+    glGenFramebuffers(1, &fbo);
+    glGenTextures(1, &texture);
+
+    // One job at a time, the way the draw functions go about it
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint32_t target_width = 0, target_height = 0;
+    for (uint64_t i = 0; i < jobs; i++) {
+        struct render_job job;
+        benchmark_job(&job, i, width, height);
+        GLenum gl_format;
+        eglMakeCurrent(egl->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                egl->context);
+        if (!render_job_read_format(gles, &job, &gl_format)) {
+            continue;
+        }
+        if (target_width != job.width || target_height != job.height) {
+            glBindTexture(GL_TEXTURE_2D, texture);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, job.width, job.height, 0,
+                    GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+            glBindTexture(GL_TEXTURE_2D, 0);
+            target_width = job.width;
+            target_height = job.height;
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                GL_TEXTURE_2D, texture, 0);
+        glViewport(0, 0, job.width, job.height);
+        glClearColor(job.color[0], job.color[1], job.color[2], job.color[3]);
+        glClear(GL_COLOR_BUFFER_BIT);
+        glFlush();
+        glReadPixels(0, 0, job.width, job.height, gl_format,
+                GL_UNSIGNED_BYTE, pixels);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        eglMakeCurrent(egl->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                EGL_NO_CONTEXT);
+    }
+    double single = elapsed_s(&start);
+    egl_make_current(egl);
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteTextures(1, &texture);
+    free(pixels);
+
+    fake_log(INFO, "%lu jobs of %ux%u and %ux%u, per job: %.1f jobs/s",
+            (unsigned long)jobs, width, height, width / 2, height / 2,
+            jobs / single);
+    bool ok = run_batched(gles, jobs, batch_jobs, width, height, 0, single);
+    if (ok && atlas_size) {
+        ok = run_batched(gles, jobs, batch_jobs, width, height, atlas_size,
+                single);
+    }
+    eglMakeCurrent(egl->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+            EGL_NO_CONTEXT);
+    return ok;
+}
@@ -0,0 +1,136 @@
+#ifndef FAKE_CHEN_BATCH_H
+#define FAKE_CHEN_BATCH_H
+#include "atlas.h"
+#include "egl_gbm.h"
+#include "worker.h"
+
+// Render targets kept around for the sizes seen last
+#define RENDER_BATCH_TARGETS 4
+
+struct render_batch_target {
+    GLuint fbo, texture;
+    uint32_t width, height;
+    uint64_t last_used;
+};
+
+struct render_batch_slot {
+    // Where the job's pixels start in the batch buffer, rows stride apart
+    size_t offset;
+    uint32_t stride;
+    // Tile in the atlas page, page -1 when the job has a target of its own
+    uint32_t x, y;
+    int page;
+};
+
+// One fill of the atlas, all tiles in one format read back together
+struct render_batch_page {
+    uint32_t format;
+    uint32_t height;
+    size_t offset;
+};
+
+/**
+ * Jobs recorded together: one flush and one fence, their pixels packed
+ * into one pack buffer.
+ */
+struct render_batch {
+    struct render_job *jobs;
+    struct render_batch_slot *slots;
+    size_t len, capacity;
+    struct render_batch_page *pages;
+    size_t page_count, page_capacity;
+
+    // Pack buffer, or cpu_buffer without PBO support
+    GLuint pbo;
+    void *cpu_buffer;
+    size_t buffer_size;
+    EGLSyncKHR fence;
+
+    // Set once the batch finished, while its completions are handed out
+    const uint8_t *pixels;
+    size_t next_job;
+    struct render_batch *next;
+};
+
+/** One finished job, see render_batcher_next(). */
+struct render_completion {
+    struct render_job job;
+    bool ok;
+    // Bottom row first like glReadPixels, stride bytes apart
+    const void *pixels;
+    uint32_t stride;
+};
+
+/**
+ * Collects jobs and records them in batches instead of one draw call
+ * setup per job: jobs are sorted by format and size so each group binds
+ * its target once, the whole batch gets a single glFlush and fence, and
+ * results come back through a completion queue once the GPU is done.
+ *
+ * In atlas mode jobs are tiles of one large texture instead, placed by a
+ * skyline packer and cleared through viewport and scissor, and each atlas
+ * fill is one readback of the band the tiles cover. Jobs larger than the
+ * atlas still get a target of their own.
+ *
+ * Like the readback ring, the context current at creation must be current
+ * for every call, including destroy. Nothing here makes contexts current.
+ */
+struct render_batcher {
+    struct egl *egl;
+    struct gles_renderer *gles;
+    EGLContext context;
+    // Jobs per batch, submit flushes once this many are queued
+    size_t batch_jobs;
+
+    struct render_batch *pending;
+    // Submitted batches in order, the head one is being handed out
+    struct render_batch *in_flight, *in_flight_tail;
+    struct render_batch *free_batches;
+
+    struct render_batch_target targets[RENDER_BATCH_TARGETS];
+    uint64_t target_clock;
+
+    // Square atlas side, 0 when off
+    uint32_t atlas_size;
+    struct render_batch_target atlas;
+    struct atlas_packer packer;
+
+    uint64_t jobs, batches, groups, target_allocs, fence_waits;
+    uint64_t atlas_pages, atlas_tiles, atlas_tile_area, atlas_read_area;
+};
+
+struct render_batcher *render_batcher_create(struct egl *egl,
+        struct gles_renderer *gles, size_t batch_jobs);
+/**
+ * Pack jobs into a size x size atlas from the next flush on, 0 to go back
+ * to a target per group.
+ */
+bool render_batcher_use_atlas(struct render_batcher *batcher, uint32_t size);
+/** Queue a job, recording the batch when it is full. */
+bool render_batcher_submit(struct render_batcher *batcher,
+        const struct render_job *job);
+/** Record every queued job now. */
+bool render_batcher_flush(struct render_batcher *batcher);
+/**
+ * Pop the next finished job, batches in the order they were flushed and
+ * jobs grouped within them. Returns false when none is ready; with wait,
+ * only once nothing flushed is left. The pixels stay valid until the next
+ * call.
+ */
+bool render_batcher_next(struct render_batcher *batcher, bool wait,
+        struct render_completion *completion);
+void render_batcher_log_stats(const struct render_batcher *batcher);
+/** Drops unread completions and jobs not flushed yet. */
+void render_batcher_destroy(struct render_batcher *batcher);
+
+/**
+ * Run jobs jobs of two sizes and two formats once with a makeCurrent,
+ * clear, flush and readback per job, as the draw functions do, then
+ * through a batcher with batch_jobs per batch, and with atlas_size also
+ * in atlas mode, and log each.
+ */
+bool render_batcher_benchmark(struct gles_renderer *gles, uint64_t jobs,
+        size_t batch_jobs, uint32_t width, uint32_t height,
+        uint32_t atlas_size);
+
+#endif
@@ -0,0 +1,606 @@
+#include "caps_cache.h"
+#include "egl_gbm.h"
+#include "log.h"
+#include "pixconv.h"
+#include "render_bench.h"
+#include <drm_fourcc.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const int64_t NSEC_PER_SEC = 1000000000;
+
+static int64_t get_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+// xorshift64*, deterministic so runs compare
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ull;
+}
+
+// Keeps the optimizer from dropping lookups whose result is unused
+static volatile uint64_t bench_sink;
+
+// formats: the drm_format_set as it was before hashing, linear format scan
+// and unsorted modifiers, kept as the baseline
+
+struct linear_set {
+    size_t len, capacity;
+    struct drm_format **formats;
+};
+
+static struct drm_format *linear_get(const struct linear_set *set,
+        uint32_t format) {
+    for (size_t i = 0; i < set->len; i++) {
+        if (set->formats[i]->format == format) {
+            return set->formats[i];
+        }
+    }
+    return NULL;
+}
+
+static bool linear_format_has(const struct drm_format *fmt,
+        uint64_t modifier) {
+    for (size_t i = 0; i < fmt->len; i++) {
+        if (fmt->modifiers[i] == modifier) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void linear_add(struct linear_set *set, uint32_t format,
+        uint64_t modifier) {
+    struct drm_format *fmt = linear_get(set, format);
+    size_t index = 0;
+    if (!fmt) {
+        if (set->len == set->capacity) {
+            set->capacity = set->capacity ? set->capacity * 2 : 4;
+            set->formats = realloc(set->formats,
+                    sizeof(*set->formats) * set->capacity);
+        }
+        fmt = calloc(1, sizeof(*fmt) + sizeof(fmt->modifiers[0]) * 4);
+        fmt->format = format;
+        fmt->capacity = 4;
+        index = set->len;
+        set->formats[set->len++] = fmt;
+    } else {
+        if (linear_format_has(fmt, modifier)) {
+            return;
+        }
+        for (index = 0; set->formats[index] != fmt; index++) {
+        }
+    }
+    if (fmt->len == fmt->capacity) {
+        fmt->capacity *= 2;
+        fmt = realloc(fmt, sizeof(*fmt) +
+                sizeof(fmt->modifiers[0]) * fmt->capacity);
+        set->formats[index] = fmt;
+    }
+    fmt->modifiers[fmt->len++] = modifier;
+}
+
+static bool linear_has(const struct linear_set *set, uint32_t format,
+        uint64_t modifier) {
+    const struct drm_format *fmt = linear_get(set, format);
+    return fmt && linear_format_has(fmt, modifier);
+}
+
+static void linear_finish(struct linear_set *set) {
+    for (size_t i = 0; i < set->len; i++) {
+        free(set->formats[i]);
+    }
+    free(set->formats);
+}
+
+struct format_pair {
+    uint32_t format;
+    uint64_t modifier;
+};
+
+static uint32_t random_fourcc(void) {
+    static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    uint64_t r = rng_next();
+    return fourcc_code(chars[r % 36], chars[(r >> 8) % 36],
+            chars[(r >> 16) % 36], chars[(r >> 24) % 36]);
+}
+
+static uint64_t random_modifier(void) {
+    switch (rng_next() % 8) {
+    case 0:
+        return DRM_FORMAT_MOD_LINEAR;
+    case 1:
+        return DRM_FORMAT_MOD_INVALID;
+    default:
+        // Vendor in the top byte like fourcc_mod_code()
+        return ((rng_next() % 10 + 1) << 56) | (rng_next() & 0xFFFFFFFFull);
+    }
+}
+
+// EGL and KMS lists look like this: a few hundred formats, most with a
+// handful of modifiers, handed over in driver order
+static struct format_pair *make_pairs(size_t formats, size_t modifiers,
+        size_t *len) {
+    struct format_pair *pairs = calloc(formats * modifiers, sizeof(*pairs));
+    if (!pairs) {
+        return NULL;
+    }
+    for (size_t i = 0; i < formats; i++) {
+        uint32_t format = random_fourcc();
+        for (size_t j = 0; j < modifiers; j++) {
+            pairs[i * modifiers + j] = (struct format_pair){
+                .format = format,
+                .modifier = random_modifier(),
+            };
+        }
+    }
+    *len = formats * modifiers;
+    return pairs;
+}
+
+static void bench_formats(size_t formats, size_t modifiers, size_t lookups) {
+    size_t len;
+    struct format_pair *pairs = make_pairs(formats, modifiers, &len);
+    // Half the queries miss, like probing a format the plane does not take
+    struct format_pair *queries = calloc(lookups, sizeof(*queries));
+    if (!pairs || !queries) {
+        fake_log(ERROR, "Allocation failed");
+        free(pairs);
+        free(queries);
+        return;
+    }
+    for (size_t i = 0; i < lookups; i++) {
+        queries[i] = pairs[rng_next() % len];
+        if (rng_next() & 1) {
+            queries[i].modifier = random_modifier();
+        }
+    }
+
+    int64_t start = get_time_ns();
+    struct linear_set linear = {0};
+    for (size_t i = 0; i < len; i++) {
+        linear_add(&linear, pairs[i].format, pairs[i].modifier);
+    }
+    int64_t linear_build = get_time_ns() - start;
+
+    start = get_time_ns();
+    struct drm_format_set hashed = {0};
+    for (size_t i = 0; i < len; i++) {
+        drm_format_set_add(&hashed, pairs[i].format, pairs[i].modifier);
+    }
+    int64_t hashed_build = get_time_ns() - start;
+
+    uint64_t hits = 0;
+    start = get_time_ns();
+    for (size_t i = 0; i < lookups; i++) {
+        hits += linear_has(&linear, queries[i].format, queries[i].modifier);
+    }
+    int64_t linear_lookup = get_time_ns() - start;
+    bench_sink = hits;
+
+    uint64_t hashed_hits = 0;
+    start = get_time_ns();
+    for (size_t i = 0; i < lookups; i++) {
+        hashed_hits += drm_format_set_has(&hashed, queries[i].format,
+                queries[i].modifier);
+    }
+    int64_t hashed_lookup = get_time_ns() - start;
+    bench_sink = hashed_hits;
+    if (hits != hashed_hits) {
+        fake_log(ERROR, "Lookup mismatch: %lu vs %lu hits",
+                (unsigned long)hits, (unsigned long)hashed_hits);
+    }
+
+    // Render formats against a plane taking every other format/modifier pair
+    struct drm_format_set plane = {0};
+    for (size_t i = 0; i < len; i += 2) {
+        drm_format_set_add(&plane, pairs[i].format, pairs[i].modifier);
+    }
+    struct drm_format_set both = {0};
+    start = get_time_ns();
+    drm_format_set_intersect(&both, &hashed, &plane);
+    int64_t intersect = get_time_ns() - start;
+
+    fake_log(INFO, "%zu formats x %zu modifiers (%zu unique formats)",
+            formats, modifiers, hashed.len);
+    fake_log(INFO, "  build:     linear %9.3f ms  hashed %9.3f ms",
+            (double)linear_build / 1000000, (double)hashed_build / 1000000);
+    fake_log(INFO, "  has():     linear %9.1f ns  hashed %9.1f ns per lookup",
+            (double)linear_lookup / lookups, (double)hashed_lookup / lookups);
+    fake_log(INFO, "  intersect: %.3f ms, %zu formats in common",
+            (double)intersect / 1000000, both.len);
+
+    drm_format_set_finish(&both);
+    drm_format_set_finish(&plane);
+    drm_format_set_finish(&hashed);
+    linear_finish(&linear);
+    free(queries);
+    free(pairs);
+}
+
+// caps: the capability cache on synthetic format sets, store and load
+// timed against building the sets, then checked for a lossless round trip
+// and for rejecting another key
+
+// Every format/modifier pair of a is in b
+static bool set_contains(const struct drm_format_set *a,
+        const struct drm_format_set *b) {
+    for (size_t i = 0; i < a->len; i++) {
+        const struct drm_format *fmt = a->formats[i];
+        for (size_t j = 0; j < fmt->len; j++) {
+            if (!drm_format_set_has(b, fmt->format, fmt->modifiers[j])) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool set_equal(const struct drm_format_set *a,
+        const struct drm_format_set *b) {
+    return a->len == b->len && set_contains(a, b) && set_contains(b, a);
+}
+
+static bool bench_caps(size_t formats, size_t modifiers) {
+    size_t len;
+    struct format_pair *pairs = make_pairs(formats, modifiers, &len);
+    if (!pairs) {
+        fake_log(ERROR, "Allocation failed");
+        return false;
+    }
+    const char *tmp = getenv("TMPDIR");
+    char path[256];
+    snprintf(path, sizeof(path), "%s/egl_gbm_caps.%d.bin",
+            tmp && tmp[0] ? tmp : "/tmp", getpid());
+    const char *key = "bench 1.0.0 synthetic|vendor|1.5|0123456789abcdef";
+
+    // Render formats are a subset of the texture ones, like on real drivers
+    struct egl probed = { .has_modifiers = true };
+    int64_t start = get_time_ns();
+    for (size_t i = 0; i < len; i++) {
+        drm_format_set_add(&probed.dmabuf_texture_formats, pairs[i].format,
+                pairs[i].modifier);
+        if (i % 2 == 0) {
+            drm_format_set_add(&probed.dmabuf_render_formats,
+                    pairs[i].format, pairs[i].modifier);
+        }
+    }
+    int64_t build = get_time_ns() - start;
+
+    start = get_time_ns();
+    bool ok = caps_cache_store(&probed, path, key);
+    int64_t store = get_time_ns() - start;
+
+    struct egl loaded = {0};
+    start = get_time_ns();
+    ok = ok && caps_cache_load(&loaded, path, key);
+    int64_t load = get_time_ns() - start;
+    if (ok && (!loaded.has_modifiers ||
+            !set_equal(&probed.dmabuf_texture_formats,
+                &loaded.dmabuf_texture_formats) ||
+            !set_equal(&probed.dmabuf_render_formats,
+                &loaded.dmabuf_render_formats))) {
+        fake_log(ERROR, "Capability cache round trip lost formats");
+        ok = false;
+    }
+
+    struct egl other = {0};
+    if (ok && caps_cache_load(&other, path, "bench 1.0.1 synthetic|vendor|"
+                "1.5|0123456789abcdef")) {
+        fake_log(ERROR, "Capability cache loaded under another key");
+        ok = false;
+    }
+
+    if (ok) {
+        fake_log(INFO, "%zu formats x %zu modifiers (%zu unique formats)",
+                formats, modifiers, probed.dmabuf_texture_formats.len);
+        fake_log(INFO, "  build %9.3f ms  store %9.3f ms  load %9.3f ms",
+                (double)build / 1000000, (double)store / 1000000,
+                (double)load / 1000000);
+    }
+
+    unlink(path);
+    drm_format_set_finish(&other.dmabuf_texture_formats);
+    drm_format_set_finish(&other.dmabuf_render_formats);
+    drm_format_set_finish(&loaded.dmabuf_texture_formats);
+    drm_format_set_finish(&loaded.dmabuf_render_formats);
+    drm_format_set_finish(&probed.dmabuf_texture_formats);
+    drm_format_set_finish(&probed.dmabuf_render_formats);
+    free(pairs);
+    return ok;
+}
+
+// exts: the strcspn scan renderer.c used per extension check, against
+// parsing once into an ext_set
+
+static bool scan_has_ext(const char *exts, const char *ext) {
+    size_t extlen = strlen(ext);
+    const char *end = exts + strlen(exts);
+    while (exts < end) {
+        if (*exts == ' ') {
+            exts++;
+            continue;
+        }
+        size_t n = strcspn(exts, " ");
+        if (n == extlen && strncmp(ext, exts, n) == 0) {
+            return true;
+        }
+        exts += n;
+    }
+    return false;
+}
+
+static void bench_exts(size_t count, size_t rounds) {
+    static const char *const known[] = {
+#define KNOWN_EXT_STRING(name) #name,
+        KNOWN_EXTENSIONS(KNOWN_EXT_STRING)
+#undef KNOWN_EXT_STRING
+    };
+    // Driver strings run to a few hundred names, ours scattered among them
+    size_t len = count * 32 + EXT_COUNT * 48 + 1;
+    char *exts = malloc(len);
+    if (!exts) {
+        fake_log(ERROR, "Allocation failed");
+        return;
+    }
+    size_t pos = 0;
+    for (size_t i = 0; i < count; i++) {
+        pos += snprintf(exts + pos, len - pos, "GL_VENDOR_filler_ext_%lx ",
+                (unsigned long)(rng_next() & 0xFFFFFF));
+        if (i % (count / EXT_COUNT + 1) == 0 && i / (count / EXT_COUNT + 1) <
+                EXT_COUNT) {
+            pos += snprintf(exts + pos, len - pos, "%s ",
+                    known[i / (count / EXT_COUNT + 1)]);
+        }
+    }
+
+    // One round is what startup does: every known extension checked once
+    uint64_t hits = 0;
+    int64_t start = get_time_ns();
+    for (size_t r = 0; r < rounds; r++) {
+        for (int i = 0; i < EXT_COUNT; i++) {
+            hits += scan_has_ext(exts, known[i]);
+        }
+    }
+    int64_t scan = get_time_ns() - start;
+    bench_sink = hits;
+
+    uint64_t set_hits = 0;
+    start = get_time_ns();
+    for (size_t r = 0; r < rounds; r++) {
+        struct ext_set set;
+        ext_set_init(&set, exts);
+        for (int i = 0; i < EXT_COUNT; i++) {
+            set_hits += ext_set_has_known(&set, i);
+        }
+        ext_set_finish(&set);
+    }
+    int64_t parsed = get_time_ns() - start;
+    bench_sink = set_hits;
+    if (hits != set_hits) {
+        fake_log(ERROR, "Lookup mismatch: %lu vs %lu hits",
+                (unsigned long)hits, (unsigned long)set_hits);
+    }
+
+    struct ext_set set;
+    ext_set_init(&set, exts);
+    uint64_t unknown_hits = 0;
+    start = get_time_ns();
+    for (size_t r = 0; r < rounds; r++) {
+        unknown_hits += ext_set_has(&set, "GL_OES_not_in_the_list");
+        unknown_hits += ext_set_has(&set, known[r % EXT_COUNT]);
+    }
+    int64_t unknown = get_time_ns() - start;
+    bench_sink = unknown_hits;
+
+    fake_log(INFO, "%zu extensions, %zu bytes", set.len, pos);
+    fake_log(INFO, "  %d checks: strcspn %9.1f us  ext_set %9.1f us "
+            "(including parse)", EXT_COUNT, (double)scan / rounds / 1000,
+            (double)parsed / rounds / 1000);
+    fake_log(INFO, "  ext_set_has(): %.1f ns per lookup",
+            (double)unknown / rounds / 2);
+    ext_set_finish(&set);
+    free(exts);
+}
+
+// log: fake_log() call latency as the render thread sees it, with the
+// synchronous writes, the async ring and the binary log. stderr goes to
+// /dev/null while it runs.
+
+struct log_thread {
+    pthread_t thread;
+    size_t messages;
+    bool filtered;
+    int64_t *latency_ns;
+};
+
+static void *log_thread_run(void *data) {
+    struct log_thread *t = data;
+    for (size_t i = 0; i < t->messages; i++) {
+        int64_t start = get_time_ns();
+        if (t->filtered) {
+            fake_log(DEBUG, "handle = %zu pitch = %d", i, 7680);
+        } else {
+            fake_log(INFO, "handle = %zu pitch = %d", i, 7680);
+        }
+        t->latency_ns[i] = get_time_ns() - start;
+    }
+    return NULL;
+}
+
+static int compare_i64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void bench_log_mode(const char *mode, size_t messages, int threads) {
+    bool binary = strcmp(mode, "binary") == 0;
+    bool async = binary || strcmp(mode, "async") == 0;
+    bool filtered = strcmp(mode, "filtered") == 0;
+    struct log_thread *t = calloc(threads, sizeof(*t));
+    int64_t *latency_ns = calloc(messages * threads, sizeof(*latency_ns));
+    if (!t || !latency_ns) {
+        fake_log(ERROR, "Allocation failed");
+        free(t);
+        free(latency_ns);
+        return;
+    }
+
+    int saved = dup(STDERR_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDERR_FILENO);
+    close(null_fd);
+    uint64_t dropped = log_async_dropped();
+    if (binary) {
+        log_start_binary("/dev/null");
+    } else if (async) {
+        log_start_async();
+    }
+    int64_t start = get_time_ns();
+    for (int i = 0; i < threads; i++) {
+        t[i].messages = messages;
+        t[i].filtered = filtered;
+        t[i].latency_ns = latency_ns + i * messages;
+        pthread_create(&t[i].thread, NULL, log_thread_run, &t[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(t[i].thread, NULL);
+    }
+    int64_t produced = get_time_ns() - start;
+    if (async) {
+        log_stop_async();
+    }
+    int64_t written = get_time_ns() - start;
+    dropped = log_async_dropped() - dropped;
+    dup2(saved, STDERR_FILENO);
+    close(saved);
+
+    size_t total = messages * threads;
+    qsort(latency_ns, total, sizeof(*latency_ns), compare_i64);
+    fake_log(INFO, "  %-8s %10.0f msgs/s (%10.0f written/s)  p50 %6ld ns  "
+            "p99 %6ld ns  max %8ld ns  %lu dropped", mode,
+            total * 1e9 / produced, (total - dropped) * 1e9 / written,
+            (long)latency_ns[total / 2], (long)latency_ns[total * 99 / 100],
+            (long)latency_ns[total - 1], (unsigned long)dropped);
+    free(latency_ns);
+    free(t);
+}
+
+static void bench_log(size_t messages, int threads) {
+    fake_log(INFO, "%zu messages on each of %d thread(s)", messages, threads);
+    bench_log_mode("sync", messages, threads);
+    bench_log_mode("async", messages, threads);
+    bench_log_mode("binary", messages, threads);
+    bench_log_mode("filtered", messages, threads);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s formats [formats] [modifiers] [lookups]\n"
+            "       %s caps [formats] [modifiers]\n"
+            "       %s exts [extensions] [rounds]\n"
+            "       %s log [messages] [threads]\n"
+            "       %s render [frames] [WxH...]\n"
+            "       %s convert [iterations] [WxH...]\n", prog, prog, prog, prog,
+            prog, prog);
+}
+
+int main(int argc, char **argv) {
+    log_init(INFO, NULL);
+
+    const char *cmd = argc > 1 ? argv[1] : NULL;
+    if (cmd && strcmp(cmd, "formats") == 0) {
+        if (argc > 2) {
+            bench_formats(strtoul(argv[2], NULL, 10),
+                    argc > 3 ? strtoul(argv[3], NULL, 10) : 8,
+                    argc > 4 ? strtoul(argv[4], NULL, 10) : 1000000);
+            return 0;
+        }
+        static const size_t sizes[] = { 50, 200, 500 };
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            bench_formats(sizes[i], 8, 1000000);
+        }
+        return 0;
+    }
+    if (cmd && strcmp(cmd, "caps") == 0) {
+        if (argc > 2) {
+            return bench_caps(strtoul(argv[2], NULL, 10),
+                    argc > 3 ? strtoul(argv[3], NULL, 10) : 8) ? 0 : 1;
+        }
+        return bench_caps(50, 8) && bench_caps(500, 8) ? 0 : 1;
+    }
+    if (cmd && strcmp(cmd, "exts") == 0) {
+        bench_exts(argc > 2 ? strtoul(argv[2], NULL, 10) : 300,
+                argc > 3 ? strtoul(argv[3], NULL, 10) : 10000);
+        return 0;
+    }
+    if (cmd && strcmp(cmd, "log") == 0) {
+        size_t messages = argc > 2 ? strtoul(argv[2], NULL, 10) : 100000;
+        if (argc > 3) {
+            bench_log(messages, atoi(argv[3]));
+            return 0;
+        }
+        bench_log(messages, 1);
+        bench_log(messages, 4);
+        return 0;
+    }
+    // render: needs no display, EGL_RENDERER_ALLOW_SOFTWARE=1 runs it on
+    // llvmpipe
+    if (cmd && strcmp(cmd, "render") == 0) {
+        uint64_t frames = argc > 2 ? strtoull(argv[2], NULL, 10) : 300;
+        struct render_bench_size sizes[16] = {
+            { 640, 480 }, { 1280, 720 }, { 1920, 1080 },
+        };
+        size_t count = 3;
+        if (argc > 3) {
+            count = 0;
+            for (int i = 3; i < argc && count < 16; i++) {
+                if (sscanf(argv[i], "%ux%u", &sizes[count].width,
+                            &sizes[count].height) != 2 ||
+                        !sizes[count].width || !sizes[count].height) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                count++;
+            }
+        }
+        if (frames == 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        return render_bench_run(sizes, count, frames) ? 0 : 1;
+    }
+    // convert: CPU pixel conversion, every SIMD variant against scalar
+    if (cmd && strcmp(cmd, "convert") == 0) {
+        uint64_t iterations = argc > 2 ? strtoull(argv[2], NULL, 10) : 50;
+        bool ok = true;
+        if (argc <= 3) {
+            ok = pixconv_benchmark(1280, 720, iterations) &&
+                pixconv_benchmark(1920, 1080, iterations) &&
+                pixconv_benchmark(1917, 1079, iterations);
+        }
+        for (int i = 3; i < argc && ok; i++) {
+            uint32_t width, height;
+            if (sscanf(argv[i], "%ux%u", &width, &height) != 2 ||
+                    !width || !height) {
+                usage(argv[0]);
+                return 1;
+            }
+            ok = pixconv_benchmark(width, height, iterations);
+        }
+        return ok ? 0 : 1;
+    }
+    usage(argv[0]);
+    return 1;
+}
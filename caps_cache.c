@@ -0,0 +1,391 @@
+#define _GNU_SOURCE
+#include "caps_cache.h"
+#include "log.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef EGL_EXT_device_persistent_id
+#define EGL_DEVICE_UUID_EXT 0x335C
+#define EGL_DRIVER_UUID_EXT 0x335D
+#endif
+
+#define CAPS_CACHE_MAGIC "EGLGBMCP"
+#define CAPS_CACHE_VERSION 1
+
+// Native endianness, the cache never leaves the machine
+struct caps_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t key_len;
+    uint64_t size;
+    uint32_t has_modifiers;
+    uint32_t set_count;
+};
+
+// Followed by len modifiers
+struct caps_format {
+    uint32_t format;
+    uint32_t len;
+};
+
+static size_t align8(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
+
+static uint64_t fnv1a(const char *str) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (; *str; str++) {
+        hash ^= (uint8_t)*str;
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static uint64_t fnv1a_bytes(uint64_t hash, const void *data, size_t len) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static void hex_string(char *out, const uint8_t *bytes, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        sprintf(out + i * 2, "%02x", bytes[i]);
+    }
+}
+
+// EGL_DEVICE_UUID_EXT or EGL_DRIVER_UUID_EXT as hex, false without them
+static bool query_uuid(struct egl *egl, EGLint name, char out[33]) {
+#ifdef EGL_EXT_device_persistent_id
+    uint8_t uuid[16];
+    EGLint len = 0;
+    if (egl->exts.EXT_device_persistent_id &&
+            egl->procs.eglQueryDeviceBinaryEXT(egl->device, name,
+                sizeof(uuid), uuid, &len) && len == sizeof(uuid)) {
+        hex_string(out, uuid, sizeof(uuid));
+        return true;
+    }
+#endif
+    return false;
+}
+
+// The DRM fd of the display's GPU, opened from the EGL device's render
+// node when there is no card_fd. -1 for software devices.
+static int device_drm_fd(struct egl *egl, bool *opened) {
+    *opened = false;
+    if (egl->card_fd >= 0) {
+        return egl->card_fd;
+    }
+    if (egl->render_fd >= 0) {
+        return egl->render_fd;
+    }
+#ifdef EGL_DRM_RENDER_NODE_FILE_EXT
+    if (egl->exts.EXT_device_drm_render_node) {
+        const char *name = egl->procs.eglQueryDeviceStringEXT(egl->device,
+                EGL_DRM_RENDER_NODE_FILE_EXT);
+        int fd = name ? open(name, O_RDWR | O_CLOEXEC) : -1;
+        *opened = fd >= 0;
+        return fd;
+    }
+#endif
+    return -1;
+}
+
+// Two GPUs on one kernel driver can take different modifiers, tell them
+// apart by their model
+static void device_identity(int fd, char *out, size_t size) {
+    drmDevice *device = NULL;
+    if (fd < 0 || drmGetDevice(fd, &device) != 0) {
+        snprintf(out, size, "no-drm-device");
+        return;
+    }
+    if (device->bustype == DRM_BUS_PCI) {
+        const drmPciDeviceInfo *pci = device->deviceinfo.pci;
+        snprintf(out, size, "pci %04x:%04x:%02x %04x:%04x", pci->vendor_id,
+                pci->device_id, pci->revision_id, pci->subvendor_id,
+                pci->subdevice_id);
+    } else if (device->bustype == DRM_BUS_PLATFORM) {
+        // Device tree paths run long, the hash keeps the key bounded
+        snprintf(out, size, "platform %016llx",
+                (unsigned long long)fnv1a(device->businfo.platform->fullname));
+    } else {
+        snprintf(out, size, "bus %d", device->bustype);
+    }
+    drmFreeDevice(&device);
+}
+
+static int hash_library(struct dl_phdr_info *info, size_t size, void *data) {
+    uint64_t *hash = data;
+    struct stat st;
+    if (!info->dlpi_name[0] || stat(info->dlpi_name, &st) != 0) {
+        return 0;
+    }
+    *hash = fnv1a_bytes(*hash, info->dlpi_name, strlen(info->dlpi_name));
+    uint64_t id[4] = {
+        st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+    };
+    *hash = fnv1a_bytes(*hash, id, sizeof(id));
+    return 0;
+}
+
+// Mesa reports EGL 1.5 from "Mesa Project" whatever its release, and DRM
+// driver versions rarely move: without a driver UUID, any change to a
+// loaded library, the EGL and GL drivers among them, makes a new key
+bool caps_cache_key(struct egl *egl, char *key, size_t size) {
+    const char *vendor = eglQueryString(egl->display, EGL_VENDOR);
+    const char *version = eglQueryString(egl->display, EGL_VERSION);
+    const char *exts = eglQueryString(egl->display, EGL_EXTENSIONS);
+    if (!vendor || !version || !exts) {
+        return false;
+    }
+
+    bool opened;
+    int fd = device_drm_fd(egl, &opened);
+    char device[96], build[40];
+    if (!query_uuid(egl, EGL_DEVICE_UUID_EXT, device)) {
+        device_identity(fd, device, sizeof(device));
+    }
+    if (!query_uuid(egl, EGL_DRIVER_UUID_EXT, build)) {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        dl_iterate_phdr(hash_library, &hash);
+        snprintf(build, sizeof(build), "libs %016llx",
+                (unsigned long long)hash);
+    }
+
+    drmVersion *drm = fd >= 0 ? drmGetVersion(fd) : NULL;
+    int n;
+    if (drm) {
+        n = snprintf(key, size, "%s|%s|%s %d.%d.%d %s|%s|%s|%016llx",
+                device, build, drm->name, drm->version_major,
+                drm->version_minor, drm->version_patchlevel,
+                drm->desc ? drm->desc : "", vendor, version,
+                (unsigned long long)fnv1a(exts));
+        drmFreeVersion(drm);
+    } else {
+        n = snprintf(key, size, "%s|%s|no-drm|%s|%s|%016llx", device, build,
+                vendor, version, (unsigned long long)fnv1a(exts));
+    }
+    if (opened) {
+        close(fd);
+    }
+    return n > 0 && (size_t)n < size;
+}
+
+const char *caps_cache_path(void) {
+    static char path[PATH_MAX];
+    const char *env = getenv("EGL_GBM_CAPS_CACHE");
+    if (env) {
+        return env[0] ? env : NULL;
+    }
+    const char *cache_home = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    int n;
+    if (cache_home && cache_home[0]) {
+        n = snprintf(path, sizeof(path), "%s/egl_gbm/caps.bin", cache_home);
+    } else if (home && home[0]) {
+        n = snprintf(path, sizeof(path), "%s/.cache/egl_gbm/caps.bin", home);
+    } else {
+        return NULL;
+    }
+    return n > 0 && (size_t)n < sizeof(path) ? path : NULL;
+}
+
+static bool load_set(struct drm_format_set *set, const uint8_t **cur,
+        const uint8_t *end) {
+    uint32_t count;
+    if (end - *cur < 8) {
+        return false;
+    }
+    memcpy(&count, *cur, sizeof(count));
+    *cur += 8;
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct caps_format fmt;
+        if ((size_t)(end - *cur) < sizeof(fmt)) {
+            return false;
+        }
+        memcpy(&fmt, *cur, sizeof(fmt));
+        *cur += sizeof(fmt);
+        if ((size_t)(end - *cur) / sizeof(uint64_t) < fmt.len) {
+            return false;
+        }
+        const uint64_t *modifiers = (const uint64_t *)*cur;
+        for (uint32_t j = 0; j < fmt.len; j++) {
+            if (!drm_format_set_add(set, fmt.format, modifiers[j])) {
+                return false;
+            }
+        }
+        *cur += fmt.len * sizeof(uint64_t);
+    }
+    return true;
+}
+
+bool caps_cache_load(struct egl *egl, const char *path, const char *key) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fake_log(DEBUG, "No capability cache at %s", path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct caps_header)) {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    const uint8_t *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fake_log_errno(ERROR, "mmap of %s failed", path);
+        return false;
+    }
+
+    bool ok = false;
+    struct caps_header header;
+    memcpy(&header, data, sizeof(header));
+    size_t key_len = strlen(key);
+    const uint8_t *cur = data + sizeof(header);
+    const uint8_t *end = data + size;
+    if (memcmp(header.magic, CAPS_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != CAPS_CACHE_VERSION || header.size != size ||
+            header.set_count != 2 || header.key_len != key_len ||
+            (size_t)(end - cur) < align8(key_len) ||
+            memcmp(cur, key, key_len) != 0) {
+        fake_log(INFO, "Capability cache %s is stale, probing again", path);
+        goto out;
+    }
+    cur += align8(key_len);
+
+    if (!load_set(&egl->dmabuf_texture_formats, &cur, end) ||
+            !load_set(&egl->dmabuf_render_formats, &cur, end)) {
+        fake_log(ERROR, "Capability cache %s is corrupt", path);
+        drm_format_set_finish(&egl->dmabuf_texture_formats);
+        drm_format_set_finish(&egl->dmabuf_render_formats);
+        goto out;
+    }
+    egl->has_modifiers = header.has_modifiers;
+    ok = true;
+
+out:
+    munmap((void *)data, size);
+    return ok;
+}
+
+struct buffer {
+    uint8_t *data;
+    size_t len, capacity;
+    bool failed;
+};
+
+static void buffer_append(struct buffer *buf, const void *data, size_t len) {
+    if (buf->failed) {
+        return;
+    }
+    if (buf->len + len > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity : 4096;
+        while (capacity < buf->len + len) {
+            capacity *= 2;
+        }
+        uint8_t *tmp = realloc(buf->data, capacity);
+        if (!tmp) {
+            buf->failed = true;
+            return;
+        }
+        buf->data = tmp;
+        buf->capacity = capacity;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void store_set(struct buffer *buf, const struct drm_format_set *set) {
+    uint32_t count[2] = { set->len, 0 };
+    buffer_append(buf, count, sizeof(count));
+    for (size_t i = 0; i < set->len; i++) {
+        const struct drm_format *fmt = set->formats[i];
+        struct caps_format entry = {
+            .format = fmt->format,
+            .len = fmt->len,
+        };
+        buffer_append(buf, &entry, sizeof(entry));
+        buffer_append(buf, fmt->modifiers,
+                fmt->len * sizeof(fmt->modifiers[0]));
+    }
+}
+
+// mkdir -p of the directory part of path
+static void make_parent_dirs(const char *path) {
+    char dir[PATH_MAX];
+    if (snprintf(dir, sizeof(dir), "%s", path) >= (int)sizeof(dir)) {
+        return;
+    }
+    for (char *p = dir + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(dir, 0755);
+            *p = '/';
+        }
+    }
+}
+
+bool caps_cache_store(const struct egl *egl, const char *path,
+        const char *key) {
+    size_t key_len = strlen(key);
+    struct caps_header header = {
+        .version = CAPS_CACHE_VERSION,
+        .key_len = key_len,
+        .has_modifiers = egl->has_modifiers,
+        .set_count = 2,
+    };
+    memcpy(header.magic, CAPS_CACHE_MAGIC, sizeof(header.magic));
+
+    static const uint8_t zeros[8] = {0};
+    struct buffer buf = {0};
+    buffer_append(&buf, &header, sizeof(header));
+    buffer_append(&buf, key, key_len);
+    buffer_append(&buf, zeros, align8(key_len) - key_len);
+    store_set(&buf, &egl->dmabuf_texture_formats);
+    store_set(&buf, &egl->dmabuf_render_formats);
+    if (buf.failed) {
+        fake_log(ERROR, "Allocation failed");
+        free(buf.data);
+        return false;
+    }
+    header.size = buf.len;
+    memcpy(buf.data, &header, sizeof(header));
+
+    // Readers never see a partial file
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, getpid()) >=
+            (int)sizeof(tmp_path)) {
+        free(buf.data);
+        return false;
+    }
+    make_parent_dirs(path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fake_log_errno(ERROR, "Failed to create %s", tmp_path);
+        free(buf.data);
+        return false;
+    }
+    bool ok = write(fd, buf.data, buf.len) == (ssize_t)buf.len;
+    ok = close(fd) == 0 && ok;
+    if (ok && rename(tmp_path, path) == 0) {
+        fake_log(DEBUG, "Wrote %zu byte capability cache to %s", buf.len,
+                path);
+    } else {
+        fake_log_errno(ERROR, "Failed to write capability cache %s", path);
+        unlink(tmp_path);
+        ok = false;
+    }
+    free(buf.data);
+    return ok;
+}
@@ -0,0 +1,34 @@
+#ifndef FAKE_CHEN_CAPS_CACHE_H
+#define FAKE_CHEN_CAPS_CACHE_H
+#include "egl_gbm.h"
+
+/**
+ * Probed capabilities saved across runs: the dmabuf texture and render
+ * format sets, which take one EGL query per format to build. The cache is
+ * only used by a run whose key matches, see caps_cache_key().
+ */
+
+/**
+ * Describe the GPU, the driver build, the DRM driver and its version, the
+ * EGL vendor and version, and a hash of the EGL display extensions. The
+ * GPU is its EGL device UUID, else the PCI IDs or platform name of its DRM
+ * device. The build is the EGL driver UUID, else the identity of every
+ * loaded library file, which a Mesa update replaces. Needs an initialized
+ * display, card_fd or an EGL device with a render node.
+ */
+bool caps_cache_key(struct egl *egl, char *key, size_t size);
+
+/**
+ * EGL_GBM_CAPS_CACHE if set, $XDG_CACHE_HOME/egl_gbm/caps.bin or
+ * ~/.cache/egl_gbm/caps.bin otherwise. NULL when the cache is disabled by
+ * setting EGL_GBM_CAPS_CACHE to an empty string.
+ */
+const char *caps_cache_path(void);
+
+/** Fill the format sets from path. Returns false on any mismatch. */
+bool caps_cache_load(struct egl *egl, const char *path, const char *key);
+/** Write the format sets to path, replacing it atomically. */
+bool caps_cache_store(const struct egl *egl, const char *path,
+        const char *key);
+
+#endif
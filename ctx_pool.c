@@ -0,0 +1,140 @@
+#include "ctx_pool.h"
+#include "log.h"
+#include <stdlib.h>
+#include <time.h>
+
+static const int64_t NSEC_PER_SEC = 1000000000;
+
+static int64_t get_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+// Called with the lock held
+static struct ctx_pool_entry *ctx_pool_grow(struct ctx_pool *pool) {
+    if (pool->len == pool->capacity) {
+        int capacity = pool->capacity ? pool->capacity * 2 : 4;
+        struct ctx_pool_entry *entries = realloc(pool->entries,
+                capacity * sizeof(*entries));
+        if (!entries) {
+            fake_log(ERROR, "Allocation failed");
+            return NULL;
+        }
+        pool->entries = entries;
+        pool->capacity = capacity;
+    }
+
+    static const EGLint context_attribs[] = {
+        EGL_CONTEXT_CLIENT_VERSION, 2,
+        EGL_NONE
+    };
+    int64_t start = get_time_ns();
+    EGLContext context = eglCreateContext(pool->egl->display,
+            EGL_NO_CONFIG_KHR, pool->share, context_attribs);
+    int64_t elapsed = get_time_ns() - start;
+    if (context == EGL_NO_CONTEXT) {
+        fake_log(ERROR, "Failed to create pooled EGL context");
+        return NULL;
+    }
+    pool->created++;
+    pool->create_ns += elapsed;
+    if (elapsed > pool->create_max_ns) {
+        pool->create_max_ns = elapsed;
+    }
+
+    struct ctx_pool_entry *entry = &pool->entries[pool->len++];
+    entry->context = context;
+    entry->in_use = false;
+    return entry;
+}
+
+struct ctx_pool *ctx_pool_create(struct egl *egl, EGLContext share,
+        int count) {
+    struct ctx_pool *pool = calloc(1, sizeof(*pool));
+    if (!pool) {
+        fake_log(ERROR, "Allocation failed");
+        return NULL;
+    }
+    pool->egl = egl;
+    pool->share = share;
+    pthread_mutex_init(&pool->lock, NULL);
+
+    for (int i = 0; i < count; i++) {
+        if (!ctx_pool_grow(pool)) {
+            ctx_pool_destroy(pool);
+            return NULL;
+        }
+    }
+    fake_log(DEBUG, "Context pool: %d contexts created in %.3f ms", count,
+            (double)pool->create_ns / 1000000);
+    return pool;
+}
+
+EGLContext ctx_pool_acquire(struct ctx_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    struct ctx_pool_entry *entry = NULL;
+    for (int i = 0; i < pool->len; i++) {
+        if (!pool->entries[i].in_use) {
+            entry = &pool->entries[i];
+            break;
+        }
+    }
+    if (entry) {
+        pool->hits++;
+    } else {
+        entry = ctx_pool_grow(pool);
+        pool->misses++;
+    }
+    EGLContext context = EGL_NO_CONTEXT;
+    if (entry) {
+        entry->in_use = true;
+        context = entry->context;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return context;
+}
+
+void ctx_pool_release(struct ctx_pool *pool, EGLContext context) {
+    if (eglGetCurrentContext() == context) {
+        eglMakeCurrent(pool->egl->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                EGL_NO_CONTEXT);
+    }
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 0; i < pool->len; i++) {
+        if (pool->entries[i].context == context) {
+            pool->entries[i].in_use = false;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void ctx_pool_log_stats(struct ctx_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    fake_log(INFO, "Context pool: %lu contexts, creation avg %.3f ms "
+            "max %.3f ms, %lu acquires reused a context, %lu created one",
+            (unsigned long)pool->created,
+            pool->created ? (double)pool->create_ns / pool->created / 1000000 :
+                0.0,
+            (double)pool->create_max_ns / 1000000,
+            (unsigned long)pool->hits, (unsigned long)pool->misses);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void ctx_pool_destroy(struct ctx_pool *pool) {
+    if (!pool) {
+        return;
+    }
+    EGLContext current = eglGetCurrentContext();
+    for (int i = 0; i < pool->len; i++) {
+        if (pool->entries[i].context == current) {
+            eglMakeCurrent(pool->egl->display, EGL_NO_SURFACE,
+                    EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        }
+        eglDestroyContext(pool->egl->display, pool->entries[i].context);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->entries);
+    free(pool);
+}
@@ -0,0 +1,48 @@
+#ifndef FAKE_CHEN_CTX_POOL_H
+#define FAKE_CHEN_CTX_POOL_H
+#include "egl_gbm.h"
+#include <pthread.h>
+
+struct ctx_pool_entry {
+    EGLContext context;
+    bool in_use;
+};
+
+/**
+ * Surfaceless, configless GLES2 contexts created ahead of time and handed
+ * out again after release, so drawing never pays for eglCreateContext.
+ */
+struct ctx_pool {
+    struct egl *egl;
+    EGLContext share;
+
+    pthread_mutex_t lock;
+    struct ctx_pool_entry *entries;
+    int len, capacity;
+
+    // Creation cost, kept apart from the draw timings of the users
+    uint64_t created;
+    int64_t create_ns, create_max_ns;
+    // acquires served by an existing context vs by creating one
+    uint64_t hits, misses;
+};
+
+/**
+ * Create count contexts sharing with share, which may be EGL_NO_CONTEXT.
+ * Needs EGL_KHR_no_config_context and EGL_KHR_surfaceless_context, which
+ * egl_init_display() already requires.
+ */
+struct ctx_pool *ctx_pool_create(struct egl *egl, EGLContext share,
+        int count);
+/**
+ * Hand out an idle context, creating one if they are all in use. Returns
+ * EGL_NO_CONTEXT on failure.
+ */
+EGLContext ctx_pool_acquire(struct ctx_pool *pool);
+/** Give back a context from ctx_pool_acquire(), unbinding it if current. */
+void ctx_pool_release(struct ctx_pool *pool, EGLContext context);
+void ctx_pool_log_stats(struct ctx_pool *pool);
+/** Destroys every context, released or not. */
+void ctx_pool_destroy(struct ctx_pool *pool);
+
+#endif
@@ -0,0 +1,215 @@
+#include "dmabuf.h"
+#include "log.h"
+#include "trace.h"
+#include <drm_fourcc.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+bool dmabuf_force_linear(void) {
+    static int force_linear = -1;
+    if (force_linear < 0) {
+        force_linear = env_parse_bool("EGL_GBM_FORCE_LINEAR");
+    }
+    return force_linear;
+}
+
+// Explicit modifiers usable for format, NULL to let the allocator decide
+static struct drm_format *alloc_modifiers(struct egl *egl, uint32_t format,
+        const struct drm_format_set *scanout) {
+    if (dmabuf_force_linear()) {
+        struct drm_format *fmt = drm_format_create(format);
+        if (fmt) {
+            drm_format_add(&fmt, DRM_FORMAT_MOD_LINEAR);
+        }
+        return fmt;
+    }
+    if (!egl->has_modifiers) {
+        return NULL;
+    }
+    const struct drm_format *render =
+        drm_format_set_get(&egl->dmabuf_render_formats, format);
+    if (!render) {
+        return NULL;
+    }
+
+    struct drm_format *fmt;
+    const struct drm_format *plane =
+        scanout ? drm_format_set_get(scanout, format) : NULL;
+    if (plane) {
+        fmt = drm_format_intersect(render, plane);
+    } else {
+        fmt = drm_format_intersect(render, render);
+    }
+    if (!fmt) {
+        return NULL;
+    }
+
+    // gbm_bo_create_with_modifiers2() only takes explicit modifiers
+    size_t len = 0;
+    for (size_t i = 0; i < fmt->len; i++) {
+        if (fmt->modifiers[i] != DRM_FORMAT_MOD_INVALID) {
+            fmt->modifiers[len++] = fmt->modifiers[i];
+        }
+    }
+    fmt->len = len;
+    if (len == 0) {
+        free(fmt);
+        return NULL;
+    }
+    return fmt;
+}
+
+struct gbm_bo *dmabuf_alloc_bo(struct egl *egl, uint32_t width,
+        uint32_t height, uint32_t format,
+        const struct drm_format_set *scanout) {
+    uint32_t flags = GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING;
+    struct drm_format *fmt = alloc_modifiers(egl, format, scanout);
+    struct gbm_bo *bo = NULL;
+    if (fmt) {
+        bo = gbm_bo_create_with_modifiers2(egl->gbm_device, width, height,
+                format, fmt->modifiers, fmt->len, flags);
+        if (!bo) {
+            fake_log_errno(ERROR, "gbm_bo_create_with_modifiers2 failed "
+                    "with %zu modifiers, retrying without", fmt->len);
+        }
+        free(fmt);
+    }
+    if (!bo) {
+        if (dmabuf_force_linear()) {
+            flags |= GBM_BO_USE_LINEAR;
+        }
+        bo = gbm_bo_create(egl->gbm_device, width, height, format, flags);
+    }
+    if (!bo) {
+        fake_log_errno(ERROR, "gbm_bo_create failed");
+        return NULL;
+    }
+    fake_log(DEBUG, "Allocated %ux%u %.4s buffer, modifier 0x%016lx, "
+            "%d plane(s)", width, height, (const char *)&format,
+            (unsigned long)gbm_bo_get_modifier(bo),
+            gbm_bo_get_plane_count(bo));
+    return bo;
+}
+
+EGLImageKHR dmabuf_import_bo(struct egl *egl, struct gbm_bo *bo) {
+    static const EGLint plane_attribs[MAX_BUFFER_PLANES][5] = {
+        {
+            EGL_DMA_BUF_PLANE0_FD_EXT,
+            EGL_DMA_BUF_PLANE0_OFFSET_EXT,
+            EGL_DMA_BUF_PLANE0_PITCH_EXT,
+            EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT,
+            EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT,
+        },
+        {
+            EGL_DMA_BUF_PLANE1_FD_EXT,
+            EGL_DMA_BUF_PLANE1_OFFSET_EXT,
+            EGL_DMA_BUF_PLANE1_PITCH_EXT,
+            EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT,
+            EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT,
+        },
+        {
+            EGL_DMA_BUF_PLANE2_FD_EXT,
+            EGL_DMA_BUF_PLANE2_OFFSET_EXT,
+            EGL_DMA_BUF_PLANE2_PITCH_EXT,
+            EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT,
+            EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT,
+        },
+        {
+            EGL_DMA_BUF_PLANE3_FD_EXT,
+            EGL_DMA_BUF_PLANE3_OFFSET_EXT,
+            EGL_DMA_BUF_PLANE3_PITCH_EXT,
+            EGL_DMA_BUF_PLANE3_MODIFIER_LO_EXT,
+            EGL_DMA_BUF_PLANE3_MODIFIER_HI_EXT,
+        },
+    };
+
+    int n_planes = gbm_bo_get_plane_count(bo);
+    if (n_planes < 1 || n_planes > MAX_BUFFER_PLANES) {
+        fake_log(ERROR, "Unsupported plane count %d", n_planes);
+        return EGL_NO_IMAGE_KHR;
+    }
+    uint64_t modifier = gbm_bo_get_modifier(bo);
+    bool with_modifier = modifier != DRM_FORMAT_MOD_INVALID &&
+        egl->exts.EXT_image_dma_buf_import_modifiers;
+
+    int fds[MAX_BUFFER_PLANES];
+    EGLint attribs[6 + MAX_BUFFER_PLANES * 10 + 1];
+    size_t n = 0;
+    attribs[n++] = EGL_WIDTH;
+    attribs[n++] = gbm_bo_get_width(bo);
+    attribs[n++] = EGL_HEIGHT;
+    attribs[n++] = gbm_bo_get_height(bo);
+    attribs[n++] = EGL_LINUX_DRM_FOURCC_EXT;
+    attribs[n++] = gbm_bo_get_format(bo);
+
+    EGLImageKHR image = EGL_NO_IMAGE_KHR;
+    int i;
+    for (i = 0; i < n_planes; i++) {
+        fds[i] = gbm_bo_get_fd_for_plane(bo, i);
+        if (fds[i] < 0) {
+            fake_log(ERROR, "gbm_bo_get_fd_for_plane(%d) failed", i);
+            goto out;
+        }
+        attribs[n++] = plane_attribs[i][0];
+        attribs[n++] = fds[i];
+        attribs[n++] = plane_attribs[i][1];
+        attribs[n++] = gbm_bo_get_offset(bo, i);
+        attribs[n++] = plane_attribs[i][2];
+        attribs[n++] = gbm_bo_get_stride_for_plane(bo, i);
+        if (with_modifier) {
+            attribs[n++] = plane_attribs[i][3];
+            attribs[n++] = modifier & 0xFFFFFFFF;
+            attribs[n++] = plane_attribs[i][4];
+            attribs[n++] = modifier >> 32;
+        }
+    }
+    attribs[n++] = EGL_NONE;
+
+    struct trace_scope scope = trace_scope_begin("eglCreateImageKHR");
+    image = egl->procs.eglCreateImageKHR(egl->display, EGL_NO_CONTEXT,
+            EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+    trace_scope_end(&scope);
+    if (image == EGL_NO_IMAGE_KHR) {
+        fake_log(ERROR, "eglCreateImageKHR failed for modifier 0x%016lx",
+                (unsigned long)modifier);
+    }
+
+out:
+    // EGL holds its own references on the dma-bufs
+    while (i-- > 0) {
+        close(fds[i]);
+    }
+    return image;
+}
+
+int dmabuf_add_fb(int drm_fd, struct gbm_bo *bo, uint32_t *fb_id) {
+    uint32_t width = gbm_bo_get_width(bo);
+    uint32_t height = gbm_bo_get_height(bo);
+    uint64_t modifier = gbm_bo_get_modifier(bo);
+    int ret;
+    if (modifier == DRM_FORMAT_MOD_INVALID) {
+        ret = drmModeAddFB(drm_fd, width, height, 24, 32,
+                gbm_bo_get_stride(bo), gbm_bo_get_handle(bo).u32, fb_id);
+        if (ret) {
+            fake_log_errno(ERROR, "drmModeAddFB failed");
+        }
+        return ret;
+    }
+
+    uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
+    uint64_t modifiers[4] = {0};
+    int n_planes = gbm_bo_get_plane_count(bo);
+    for (int i = 0; i < n_planes && i < 4; i++) {
+        handles[i] = gbm_bo_get_handle_for_plane(bo, i).u32;
+        pitches[i] = gbm_bo_get_stride_for_plane(bo, i);
+        offsets[i] = gbm_bo_get_offset(bo, i);
+        modifiers[i] = modifier;
+    }
+    ret = drmModeAddFB2WithModifiers(drm_fd, width, height,
+            gbm_bo_get_format(bo), handles, pitches, offsets, modifiers,
+            fb_id, DRM_MODE_FB_MODIFIERS);
+    if (ret) {
+        fake_log_errno(ERROR, "drmModeAddFB2WithModifiers failed");
+    }
+    return ret;
+}
@@ -0,0 +1,25 @@
+#ifndef FAKE_CHEN_DMABUF_H
+#define FAKE_CHEN_DMABUF_H
+#include "egl_gbm.h"
+
+/**
+ * Allocate a render and scanout buffer with an explicit modifier list: the
+ * modifiers EGL can render to, intersected with scanout when not NULL, so
+ * the driver can pick a tiled or compressed layout. Falls back to implicit
+ * modifiers when the driver has no modifier support or the list ends up
+ * empty. EGL_GBM_FORCE_LINEAR=1 only allows DRM_FORMAT_MOD_LINEAR, to
+ * compare against.
+ */
+struct gbm_bo *dmabuf_alloc_bo(struct egl *egl, uint32_t width,
+        uint32_t height, uint32_t format, const struct drm_format_set *scanout);
+
+/** Import every plane of bo, with its modifier when it has one. */
+EGLImageKHR dmabuf_import_bo(struct egl *egl, struct gbm_bo *bo);
+
+/** Add a framebuffer for every plane of bo, with its modifier. */
+int dmabuf_add_fb(int drm_fd, struct gbm_bo *bo, uint32_t *fb_id);
+
+/** True when EGL_GBM_FORCE_LINEAR is set. */
+bool dmabuf_force_linear(void);
+
+#endif
@@ -0,0 +1,245 @@
+#include "egl_gbm.h"
+#include "log.h"
+#include <assert.h>
+#include <drm_fourcc.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct drm_format *drm_format_create(uint32_t format) {
+    size_t capacity = 4;
+    struct drm_format *fmt =
+        calloc(1, sizeof(*fmt) + sizeof(fmt->modifiers[0]) * capacity);
+    if (!fmt) {
+        fake_log(ERROR, "Allocation failed");
+        return NULL;
+    }
+    fmt->format = format;
+    fmt->capacity = capacity;
+    return fmt;
+}
+
+// Index of the first modifier not below modifier
+static size_t modifier_lower_bound(const struct drm_format *fmt,
+        uint64_t modifier) {
+    size_t lo = 0, hi = fmt->len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (fmt->modifiers[mid] < modifier) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+bool drm_format_has(const struct drm_format *fmt, uint64_t modifier) {
+    size_t i = modifier_lower_bound(fmt, modifier);
+    return i < fmt->len && fmt->modifiers[i] == modifier;
+}
+
+bool drm_format_add(struct drm_format **fmt_ptr, uint64_t modifier) {
+    struct drm_format *fmt = *fmt_ptr;
+
+    size_t i = modifier_lower_bound(fmt, modifier);
+    if (i < fmt->len && fmt->modifiers[i] == modifier) {
+        return true;
+    }
+
+    if (fmt->len == fmt->capacity) {
+        size_t capacity = fmt->capacity ? fmt->capacity * 2 : 4;
+
+        fmt = realloc(fmt, sizeof(*fmt) + sizeof(fmt->modifiers[0]) * capacity);
+        if (!fmt) {
+            fake_log(ERROR, "Allocation failed");
+            return false;
+        }
+
+        fmt->capacity = capacity;
+        *fmt_ptr = fmt;
+    }
+
+    memmove(&fmt->modifiers[i + 1], &fmt->modifiers[i],
+            sizeof(fmt->modifiers[0]) * (fmt->len - i));
+    fmt->modifiers[i] = modifier;
+    fmt->len++;
+    return true;
+}
+
+struct drm_format *drm_format_intersect(const struct drm_format *a,
+        const struct drm_format *b) {
+    assert(a->format == b->format);
+
+    size_t capacity = a->len < b->len ? a->len : b->len;
+    struct drm_format *fmt =
+        calloc(1, sizeof(*fmt) + sizeof(fmt->modifiers[0]) * capacity);
+    if (!fmt) {
+        fake_log(ERROR, "Allocation failed");
+        return NULL;
+    }
+    fmt->format = a->format;
+    fmt->capacity = capacity;
+
+    // Both sides are sorted, a single merge pass does it
+    size_t i = 0, j = 0;
+    while (i < a->len && j < b->len) {
+        if (a->modifiers[i] < b->modifiers[j]) {
+            i++;
+        } else if (a->modifiers[i] > b->modifiers[j]) {
+            j++;
+        } else {
+            fmt->modifiers[fmt->len++] = a->modifiers[i];
+            i++;
+            j++;
+        }
+    }
+    return fmt;
+}
+
+static size_t format_hash(uint32_t format, size_t table_size) {
+    // Fibonacci hashing, fourccs are ASCII and cluster badly otherwise
+    return (uint32_t)(format * 2654435769u) & (table_size - 1);
+}
+
+// Slot holding format, or the empty slot it would go in
+static size_t format_set_slot(const struct drm_format_set *set,
+        uint32_t format) {
+    size_t slot = format_hash(format, set->table_size);
+    while (set->table[slot] != 0 &&
+            set->formats[set->table[slot] - 1]->format != format) {
+        slot = (slot + 1) & (set->table_size - 1);
+    }
+    return slot;
+}
+
+static bool format_set_rehash(struct drm_format_set *set, size_t table_size) {
+    uint32_t *table = calloc(table_size, sizeof(*table));
+    if (!table) {
+        fake_log(ERROR, "Allocation failed");
+        return false;
+    }
+    free(set->table);
+    set->table = table;
+    set->table_size = table_size;
+    for (size_t i = 0; i < set->len; i++) {
+        size_t slot = format_set_slot(set, set->formats[i]->format);
+        set->table[slot] = i + 1;
+    }
+    return true;
+}
+
+static struct drm_format **format_set_get_ref(struct drm_format_set *set,
+        uint32_t format) {
+    if (set->table_size == 0) {
+        return NULL;
+    }
+    uint32_t index = set->table[format_set_slot(set, format)];
+    return index ? &set->formats[index - 1] : NULL;
+}
+
+const struct drm_format *drm_format_set_get(const struct drm_format_set *set,
+        uint32_t format) {
+    if (set->table_size == 0) {
+        return NULL;
+    }
+    uint32_t index = set->table[format_set_slot(set, format)];
+    return index ? set->formats[index - 1] : NULL;
+}
+
+bool drm_format_set_has(const struct drm_format_set *set, uint32_t format,
+        uint64_t modifier) {
+    const struct drm_format *fmt = drm_format_set_get(set, format);
+    return fmt && drm_format_has(fmt, modifier);
+}
+
+// Takes ownership of fmt, which must not be in set yet
+static bool format_set_insert(struct drm_format_set *set,
+        struct drm_format *fmt) {
+    if (set->len == set->capacity) {
+        size_t new = set->capacity ? set->capacity * 2 : 4;
+
+        struct drm_format **tmp =
+            realloc(set->formats, sizeof(*tmp) * new);
+        if (!tmp) {
+            fake_log(ERROR, "Allocation failed");
+            free(fmt);
+            return false;
+        }
+
+        set->capacity = new;
+        set->formats = tmp;
+    }
+    // Keep the table at most half full so probes stay short
+    if ((set->len + 1) * 2 > set->table_size &&
+            !format_set_rehash(set, set->table_size ? set->table_size * 2 : 8)) {
+        free(fmt);
+        return false;
+    }
+
+    size_t slot = format_set_slot(set, fmt->format);
+    set->formats[set->len++] = fmt;
+    set->table[slot] = set->len;
+    return true;
+}
+
+bool drm_format_set_add(struct drm_format_set *set, uint32_t format,
+        uint64_t modifier) {
+    assert(format != DRM_FORMAT_INVALID);
+
+    struct drm_format **ptr = format_set_get_ref(set, format);
+    if (ptr) {
+        return drm_format_add(ptr, modifier);
+    }
+
+    struct drm_format *fmt = drm_format_create(format);
+    if (!fmt) {
+        return false;
+    }
+
+    if (!drm_format_add(&fmt, modifier)) {
+        free(fmt);
+        return false;
+    }
+
+    return format_set_insert(set, fmt);
+}
+
+bool drm_format_set_intersect(struct drm_format_set *dst,
+        const struct drm_format_set *a, const struct drm_format_set *b) {
+    assert(dst != a && dst != b);
+
+    struct drm_format_set out = {0};
+    for (size_t i = 0; i < a->len; i++) {
+        const struct drm_format *other =
+            drm_format_set_get(b, a->formats[i]->format);
+        if (!other) {
+            continue;
+        }
+        struct drm_format *fmt = drm_format_intersect(a->formats[i], other);
+        if (!fmt) {
+            drm_format_set_finish(&out);
+            return false;
+        }
+        if (fmt->len == 0) {
+            free(fmt);
+            continue;
+        }
+        if (!format_set_insert(&out, fmt)) {
+            drm_format_set_finish(&out);
+            return false;
+        }
+    }
+
+    drm_format_set_finish(dst);
+    *dst = out;
+    return true;
+}
+
+void drm_format_set_finish(struct drm_format_set *set) {
+    for (size_t i = 0; i < set->len; ++i) {
+        free(set->formats[i]);
+    }
+    free(set->formats);
+    free(set->table);
+    memset(set, 0, sizeof(*set));
+}
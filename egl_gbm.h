@@ -0,0 +1,287 @@
+#ifndef FAKE_CHEN_EGL_GBM_H
+#define FAKE_CHEN_EGL_GBM_H
+#include "ext_set.h"
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+#include <gbm.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+/** A single DRM format, with a set of modifiers attached. */
+struct drm_format {
+    // The actual DRM format, from `drm_fourcc.h`
+    uint32_t format;
+    // The number of modifiers
+    size_t len;
+    // The capacity of the array; do not use.
+    size_t capacity;
+    // The actual modifiers, sorted in ascending order
+    uint64_t modifiers[];
+};
+
+struct drm_format_set {
+    // The number of formats
+    size_t len;
+    // The capacity of the array; private to wlroots
+    size_t capacity;
+    // A pointer to an array of `struct wlr_drm_format *` of length `len`.
+    struct drm_format **formats;
+    // Open-addressed fourcc lookup, each slot holds an index into formats
+    // plus one, 0 when empty. Power of two size, at most half full.
+    uint32_t *table;
+    size_t table_size;
+};
+
+struct gles2_tex_shader {
+    GLuint program;
+    GLint proj;
+    GLint tex;
+    GLint alpha;
+    GLint pos_attrib;
+    GLint tex_attrib;
+};
+
+#define MAX_BUFFER_PLANES 4
+struct egl {
+    int card_fd;
+    int render_fd;
+
+    EGLDisplay display;
+    EGLContext context;
+    EGLContext off_screen_context;
+    EGLSurface window_surface;
+    EGLDeviceEXT device; // may be EGL_NO_DEVICE_EXT
+
+    struct gbm_device *gbm_device;
+    struct gbm_surface *gbm_surface;
+    struct gbm_bo *gbm_bo;
+    struct gbm_bo *gbm_rbo;
+    EGLImageKHR egl_image;
+    int plane_count;
+    int dmabuf_fds[MAX_BUFFER_PLANES];
+    uint32_t strides[MAX_BUFFER_PLANES];
+    uint32_t offsets[MAX_BUFFER_PLANES];
+
+
+    unsigned int handle;
+    unsigned int pitch;
+    unsigned int fb_id;
+    uint64_t modifier;
+
+    unsigned int connector_id;
+    drmModeResPtr resources;
+    drmModeConnectorPtr connector;
+    drmModeModeInfo mode;
+    drmModeEncoderPtr encoder;
+    drmModeCrtcPtr crtc;
+
+    // Display extensions, parsed once in egl_init_display()
+    struct ext_set ext_set;
+
+    bool has_modifiers;
+    struct drm_format_set dmabuf_texture_formats;
+    struct drm_format_set dmabuf_render_formats;
+
+    // Time spent in each startup phase, logged by init_opengles()
+    struct {
+        int64_t client_ns, display_ns, formats_ns, context_ns, gles_ns;
+        // dmabuf formats came from the capability cache
+        bool formats_cached;
+    } startup;
+
+    struct {
+        PFNEGLGETPLATFORMDISPLAYEXTPROC eglGetPlatformDisplayEXT;
+        PFNEGLCREATEPLATFORMWINDOWSURFACEEXTPROC
+            eglCreatePlatformWindowSurfaceEXT;
+        PFNEGLCREATEIMAGEKHRPROC eglCreateImageKHR;
+        PFNEGLDESTROYIMAGEKHRPROC eglDestroyImageKHR;
+        PFNEGLQUERYWAYLANDBUFFERWL eglQueryWaylandBufferWL;
+        PFNEGLBINDWAYLANDDISPLAYWL eglBindWaylandDisplayWL;
+        PFNEGLUNBINDWAYLANDDISPLAYWL eglUnbindWaylandDisplayWL;
+        PFNEGLQUERYDMABUFFORMATSEXTPROC eglQueryDmaBufFormatsEXT;
+        PFNEGLQUERYDMABUFMODIFIERSEXTPROC eglQueryDmaBufModifiersEXT;
+        PFNEGLDEBUGMESSAGECONTROLKHRPROC eglDebugMessageControlKHR;
+        PFNEGLQUERYDISPLAYATTRIBEXTPROC eglQueryDisplayAttribEXT;
+        PFNEGLQUERYDEVICESTRINGEXTPROC eglQueryDeviceStringEXT;
+        PFNEGLQUERYDEVICESEXTPROC eglQueryDevicesEXT;
+#ifdef EGL_EXT_device_persistent_id
+        PFNEGLQUERYDEVICEBINARYEXTPROC eglQueryDeviceBinaryEXT;
+#endif
+        PFNEGLCREATESYNCKHRPROC eglCreateSyncKHR;
+        PFNEGLDESTROYSYNCKHRPROC eglDestroySyncKHR;
+        PFNEGLCLIENTWAITSYNCKHRPROC eglClientWaitSyncKHR;
+        PFNEGLWAITSYNCKHRPROC eglWaitSyncKHR;
+        PFNEGLDUPNATIVEFENCEFDANDROIDPROC eglDupNativeFenceFDANDROID;
+    } procs;
+
+    struct {
+        // Display extensions
+        bool KHR_image_base;
+        bool EXT_image_dma_buf_import;
+        bool EXT_image_dma_buf_import_modifiers;
+        bool IMG_context_priority;
+        bool EGL_bind_display;
+        bool KHR_fence_sync;
+        // Both needed for explicit sync with KMS
+        bool ANDROID_native_fence_sync;
+        bool KHR_wait_sync;
+
+        // Device extensions
+        bool EXT_device_drm;
+        bool EXT_device_drm_render_node;
+        bool EXT_device_persistent_id;
+
+        // Client extensions
+        bool EXT_device_query;
+        bool KHR_platform_gbm;
+        bool EXT_platform_device;
+        bool MESA_platform_surfaceless;
+    } exts;
+
+    // FBO
+    GLuint fbo;
+    GLuint texture_target_1;
+    GLuint renderbuffer;
+    GLuint texture_load;
+    GLuint texture_render;
+
+    // EGLImage image;
+    uint16_t m_width;
+    uint16_t m_height;
+    // uint16_t m_handle;
+    uint32_t m_frame_cnt;
+    int m_data[4];
+};
+
+struct gles_renderer {
+    float projection[9];
+    struct egl *egl;
+    int drm_fd;
+
+    const char *exts_str;
+    struct ext_set ext_set;
+    struct {
+        bool EXT_read_format_bgra;
+        bool KHR_debug;
+        bool OES_egl_image_external;
+        bool OES_egl_image;
+        bool EXT_texture_type_2_10_10_10_REV;
+        bool OES_texture_half_float_linear;
+        bool EXT_texture_norm16;
+        // GLES3 core, or NV_pixel_buffer_object + EXT_map_buffer_range
+        bool pixel_buffer_object;
+        bool EXT_disjoint_timer_query;
+    } exts;
+
+    struct {
+        PFNGLEGLIMAGETARGETTEXTURE2DOESPROC glEGLImageTargetTexture2DOES;
+        PFNGLDEBUGMESSAGECALLBACKKHRPROC glDebugMessageCallbackKHR;
+        PFNGLDEBUGMESSAGECONTROLKHRPROC glDebugMessageControlKHR;
+        PFNGLPOPDEBUGGROUPKHRPROC glPopDebugGroupKHR;
+        PFNGLPUSHDEBUGGROUPKHRPROC glPushDebugGroupKHR;
+        PFNGLEGLIMAGETARGETRENDERBUFFERSTORAGEOESPROC
+            glEGLImageTargetRenderbufferStorageOES;
+        PFNGLMAPBUFFERRANGEEXTPROC glMapBufferRange;
+        PFNGLUNMAPBUFFEROESPROC glUnmapBuffer;
+        PFNGLGENQUERIESEXTPROC glGenQueriesEXT;
+        PFNGLDELETEQUERIESEXTPROC glDeleteQueriesEXT;
+        PFNGLQUERYCOUNTEREXTPROC glQueryCounterEXT;
+        PFNGLGETQUERYIVEXTPROC glGetQueryivEXT;
+        PFNGLGETQUERYOBJECTIVEXTPROC glGetQueryObjectivEXT;
+        PFNGLGETQUERYOBJECTUI64VEXTPROC glGetQueryObjectui64vEXT;
+        PFNGLGETINTEGER64VEXTPROC glGetInteger64vEXT;
+    } procs;
+
+    struct {
+        struct {
+            GLuint program;
+            GLint proj;
+            GLint color;
+            GLint pos_attrib;
+        } quad;
+        struct gles2_tex_shader tex_rgba;
+        struct gles2_tex_shader tex_rgbx;
+        struct gles2_tex_shader tex_ext;
+    } shaders;
+    uint32_t viewport_width, viewport_height;
+};
+
+struct dmabuf_dumb_buffer {
+	uint32_t handle;
+	uint32_t stride;
+	uint64_t size;
+	int prime_fd;
+    uint32_t fb_id;
+};
+
+enum egl_image_target {
+    texture,
+    renderbuffer,
+};
+
+// The instance main() drives, the rest of the code takes its state as
+// arguments
+extern struct egl egl_gbm;
+extern struct gles_renderer gles_fake;
+
+// drm_format_set.c
+struct drm_format *drm_format_create(uint32_t format);
+/** Binary search over the sorted modifiers. */
+bool drm_format_has(const struct drm_format *fmt, uint64_t modifier);
+/** Inserts modifier in order, may reallocate *fmt_ptr. */
+bool drm_format_add(struct drm_format **fmt_ptr, uint64_t modifier);
+/** Modifiers found in both a and b, which must be the same format. */
+struct drm_format *drm_format_intersect(const struct drm_format *a,
+        const struct drm_format *b);
+bool drm_format_set_add(struct drm_format_set *set, uint32_t format,
+        uint64_t modifier);
+/** NULL if format is not in set. Constant time. */
+const struct drm_format *drm_format_set_get(const struct drm_format_set *set,
+        uint32_t format);
+bool drm_format_set_has(const struct drm_format_set *set, uint32_t format,
+        uint64_t modifier);
+/**
+ * Replace dst with the formats and modifiers found in both a and b,
+ * leaving out formats with no modifier in common. dst may not be a or b.
+ */
+bool drm_format_set_intersect(struct drm_format_set *dst,
+        const struct drm_format_set *a, const struct drm_format_set *b);
+void drm_format_set_finish(struct drm_format_set *set);
+
+// renderer.c
+bool check_basic_egl(struct egl *egl);
+/** Needs egl->card_fd and egl->mode, creates the GBM device and surface. */
+bool init_egl(struct egl *egl);
+/**
+ * No display needed: a DRM device through EGL_EXT_platform_device, else
+ * EGL_MESA_platform_surfaceless. Software devices are taken when
+ * EGL_RENDERER_ALLOW_SOFTWARE is set, and then preferred so runs compare
+ * across machines. Creates the GBM device when the EGL device has a render
+ * node, leaves egl->card_fd alone.
+ */
+bool init_egl_headless(struct egl *egl);
+/** Also compiles gles->shaders, the context stays current. */
+bool init_opengles(struct gles_renderer *gles, struct egl *egl);
+/** Compile and link a program, 0 on failure with the info log logged. */
+GLuint gles_link_program(const GLchar *vert_src, const GLchar *frag_src);
+bool egl_make_current(struct egl *egl);
+/**
+ * Flush and return a sync_file fd signalled once the GPU is done with
+ * everything submitted so far on the current context, for KMS IN_FENCE_FD.
+ * -1 without EGL_ANDROID_native_fence_sync, the caller then relies on
+ * implicit sync.
+ */
+int egl_dup_render_fence(struct egl *egl);
+/**
+ * Make the GPU wait on a sync_file fd before running anything submitted
+ * after this, without blocking the CPU. Takes over fd. Falls back to a CPU
+ * wait without EGL_KHR_wait_sync.
+ */
+bool egl_wait_fence_fd(struct egl *egl, int fd);
+bool env_parse_bool(const char *option);
+#endif
@@ -0,0 +1,134 @@
+#include "ext_set.h"
+#include "log.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define KNOWN_TABLE_SIZE 256
+
+static const char *const known_names[EXT_COUNT] = {
+#define KNOWN_EXT_NAME(name) #name,
+    KNOWN_EXTENSIONS(KNOWN_EXT_NAME)
+#undef KNOWN_EXT_NAME
+};
+
+// known_table[hash & (KNOWN_TABLE_SIZE - 1)] is the only candidate for a
+// token, -1 when no known extension hashes there
+static int16_t known_table[KNOWN_TABLE_SIZE];
+static uint32_t known_seed;
+static pthread_once_t known_once = PTHREAD_ONCE_INIT;
+
+static uint32_t ext_hash(const char *str, size_t len, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Find a seed that sends every known name to its own slot. The list is
+// fixed at build time, so this always ends on the same seed after a few
+// dozen tries.
+static void known_table_init(void) {
+    for (uint32_t seed = 0;; seed++) {
+        memset(known_table, -1, sizeof(known_table));
+        bool collision = false;
+        for (int i = 0; i < EXT_COUNT && !collision; i++) {
+            uint32_t slot = ext_hash(known_names[i], strlen(known_names[i]),
+                    seed) & (KNOWN_TABLE_SIZE - 1);
+            collision = known_table[slot] >= 0;
+            known_table[slot] = i;
+        }
+        if (!collision) {
+            known_seed = seed;
+            return;
+        }
+    }
+}
+
+// Slot holding name, or the empty slot it would go in
+static size_t find_slot(const struct ext_set *set, const char *name,
+        size_t len, uint32_t hash) {
+    size_t mask = set->slot_count - 1;
+    size_t slot = hash & mask;
+    while (set->slots[slot].name && (set->slots[slot].len != len ||
+                memcmp(set->slots[slot].name, name, len) != 0)) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static bool grow(struct ext_set *set) {
+    size_t count = set->slot_count ? set->slot_count * 2 : 64;
+    struct ext_slot *slots = calloc(count, sizeof(*slots));
+    if (!slots) {
+        fake_log(ERROR, "Allocation failed");
+        return false;
+    }
+    struct ext_slot *old = set->slots;
+    size_t old_count = set->slot_count;
+    set->slots = slots;
+    set->slot_count = count;
+    for (size_t i = 0; i < old_count; i++) {
+        if (old[i].name) {
+            uint32_t hash = ext_hash(old[i].name, old[i].len, known_seed);
+            set->slots[find_slot(set, old[i].name, old[i].len, hash)] = old[i];
+        }
+    }
+    free(old);
+    return true;
+}
+
+bool ext_set_init(struct ext_set *set, const char *exts) {
+    pthread_once(&known_once, known_table_init);
+    memset(set, 0, sizeof(*set));
+    if (!grow(set)) {
+        return false;
+    }
+
+    const char *p = exts;
+    while (*p) {
+        if (*p == ' ') {
+            p++;
+            continue;
+        }
+        const char *name = p;
+        while (*p && *p != ' ') {
+            p++;
+        }
+        size_t len = p - name;
+        uint32_t hash = ext_hash(name, len, known_seed);
+
+        int known = known_table[hash & (KNOWN_TABLE_SIZE - 1)];
+        if (known >= 0 && strncmp(known_names[known], name, len) == 0 &&
+                known_names[known][len] == '\0') {
+            set->known[known / 64] |= (uint64_t)1 << (known % 64);
+        }
+
+        if ((set->len + 1) * 2 > set->slot_count && !grow(set)) {
+            ext_set_finish(set);
+            return false;
+        }
+        size_t slot = find_slot(set, name, len, hash);
+        if (!set->slots[slot].name) {
+            set->slots[slot] = (struct ext_slot){ .name = name, .len = len };
+            set->len++;
+        }
+    }
+    return true;
+}
+
+void ext_set_finish(struct ext_set *set) {
+    free(set->slots);
+    memset(set, 0, sizeof(*set));
+}
+
+bool ext_set_has(const struct ext_set *set, const char *name) {
+    if (!set->slot_count) {
+        return false;
+    }
+    size_t len = strlen(name);
+    uint32_t hash = ext_hash(name, len, known_seed);
+    return set->slots[find_slot(set, name, len, hash)].name != NULL;
+}
@@ -0,0 +1,82 @@
+#ifndef FAKE_CHEN_EXT_SET_H
+#define FAKE_CHEN_EXT_SET_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Every extension the renderer looks for, add new ones here. */
+#define KNOWN_EXTENSIONS(X) \
+    X(EGL_ANDROID_native_fence_sync) \
+    X(EGL_EXT_device_base) \
+    X(EGL_EXT_device_drm) \
+    X(EGL_EXT_device_drm_render_node) \
+    X(EGL_EXT_device_enumeration) \
+    X(EGL_EXT_device_persistent_id) \
+    X(EGL_EXT_device_query) \
+    X(EGL_EXT_image_dma_buf_import) \
+    X(EGL_EXT_image_dma_buf_import_modifiers) \
+    X(EGL_EXT_platform_base) \
+    X(EGL_EXT_platform_device) \
+    X(EGL_IMG_context_priority) \
+    X(EGL_KHR_debug) \
+    X(EGL_KHR_fence_sync) \
+    X(EGL_KHR_image_base) \
+    X(EGL_KHR_no_config_context) \
+    X(EGL_KHR_platform_gbm) \
+    X(EGL_KHR_surfaceless_context) \
+    X(EGL_KHR_wait_sync) \
+    X(EGL_MESA_configless_context) \
+    X(EGL_MESA_device_software) \
+    X(EGL_MESA_platform_surfaceless) \
+    X(GL_EXT_disjoint_timer_query) \
+    X(GL_EXT_map_buffer_range) \
+    X(GL_EXT_read_format_bgra) \
+    X(GL_EXT_texture_format_BGRA8888) \
+    X(GL_EXT_texture_norm16) \
+    X(GL_EXT_texture_type_2_10_10_10_REV) \
+    X(GL_EXT_unpack_subimage) \
+    X(GL_KHR_debug) \
+    X(GL_NV_pixel_buffer_object) \
+    X(GL_OES_EGL_image) \
+    X(GL_OES_EGL_image_external) \
+    X(GL_OES_texture_half_float_linear)
+
+enum known_ext {
+#define KNOWN_EXT_ENUM(name) EXT_##name,
+    KNOWN_EXTENSIONS(KNOWN_EXT_ENUM)
+#undef KNOWN_EXT_ENUM
+    EXT_COUNT,
+};
+
+struct ext_slot {
+    const char *name;
+    uint32_t len;
+};
+
+/**
+ * An extension string split once. Known extensions land in a bitset
+ * through a collision-free hash, every token also goes in a small hash
+ * table so any other name is still a constant-time lookup.
+ */
+struct ext_set {
+    uint64_t known[(EXT_COUNT + 63) / 64];
+    // Slices of the string passed to ext_set_init(), which must outlive
+    // the set. Power of two size, at most half full.
+    struct ext_slot *slots;
+    size_t slot_count;
+    size_t len;
+};
+
+/** Tokenize exts in one pass. Returns false on allocation failure. */
+bool ext_set_init(struct ext_set *set, const char *exts);
+void ext_set_finish(struct ext_set *set);
+
+static inline bool ext_set_has_known(const struct ext_set *set,
+        enum known_ext ext) {
+    return set->known[ext / 64] & ((uint64_t)1 << (ext % 64));
+}
+
+/** Any extension name, known or not. */
+bool ext_set_has(const struct ext_set *set, const char *name);
+
+#endif
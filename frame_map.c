@@ -0,0 +1,101 @@
+#include "frame_map.h"
+#include "log.h"
+#include <errno.h>
+#include <linux/dma-buf.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+static bool map_fd(struct frame_map *map, int fd, off_t offset,
+        uint64_t size) {
+    map->data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, offset);
+    if (map->data == MAP_FAILED) {
+        fake_log_errno(ERROR, "mmap of %s buffer failed",
+                map->mode == FRAME_MAP_DUMB ? "dumb" : "dma-buf");
+        map->data = NULL;
+        return false;
+    }
+    map->size = size;
+    return true;
+}
+
+bool frame_map_dumb(struct frame_map *map, int card_fd, uint32_t handle,
+        uint64_t size, uint32_t width, uint32_t height, uint32_t stride) {
+    memset(map, 0, sizeof(*map));
+    map->mode = FRAME_MAP_DUMB;
+    map->fd = card_fd;
+    map->width = width;
+    map->height = height;
+    map->stride = stride;
+
+    struct drm_mode_map_dumb req = {
+        .handle = handle,
+    };
+    if (drmIoctl(card_fd, DRM_IOCTL_MODE_MAP_DUMB, &req)) {
+        fake_log_errno(ERROR, "DRM_IOCTL_MODE_MAP_DUMB failed");
+        return false;
+    }
+    return map_fd(map, card_fd, req.offset, size);
+}
+
+bool frame_map_dmabuf(struct frame_map *map, int prime_fd, uint64_t size,
+        uint32_t width, uint32_t height, uint32_t stride) {
+    memset(map, 0, sizeof(*map));
+    map->mode = FRAME_MAP_DMABUF;
+    map->fd = prime_fd;
+    map->width = width;
+    map->height = height;
+    map->stride = stride;
+    return map_fd(map, prime_fd, 0, size);
+}
+
+void frame_map_unmap(struct frame_map *map) {
+    if (map->reading) {
+        frame_map_end_read(map);
+    }
+    if (map->data) {
+        munmap(map->data, map->size);
+        map->data = NULL;
+    }
+}
+
+static bool dmabuf_sync(int fd, uint64_t flags) {
+    struct dma_buf_sync sync = {
+        .flags = flags,
+    };
+    while (ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync) < 0) {
+        if (errno != EINTR && errno != EAGAIN) {
+            fake_log_errno(ERROR, "DMA_BUF_IOCTL_SYNC failed");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool frame_map_begin_read(struct frame_map *map, struct egl *egl) {
+    if (egl->exts.KHR_fence_sync) {
+        EGLSyncKHR fence = egl->procs.eglCreateSyncKHR(egl->display,
+                EGL_SYNC_FENCE_KHR, NULL);
+        if (fence != EGL_NO_SYNC_KHR) {
+            egl->procs.eglClientWaitSyncKHR(egl->display, fence,
+                    EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, EGL_FOREVER_KHR);
+            egl->procs.eglDestroySyncKHR(egl->display, fence);
+        }
+    } else if (map->mode == FRAME_MAP_DUMB) {
+        glFinish();
+    }
+
+    if (map->mode == FRAME_MAP_DMABUF &&
+            !dmabuf_sync(map->fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ)) {
+        return false;
+    }
+    map->reading = true;
+    return true;
+}
+
+void frame_map_end_read(struct frame_map *map) {
+    if (map->mode == FRAME_MAP_DMABUF) {
+        dmabuf_sync(map->fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+    }
+    map->reading = false;
+}
@@ -0,0 +1,39 @@
+#ifndef FAKE_CHEN_FRAME_MAP_H
+#define FAKE_CHEN_FRAME_MAP_H
+#include "egl_gbm.h"
+
+enum frame_map_mode {
+    // DRM_IOCTL_MODE_MAP_DUMB offset, mmap on the card fd
+    FRAME_MAP_DUMB,
+    // mmap on the prime fd, bracketed with DMA_BUF_IOCTL_SYNC
+    FRAME_MAP_DMABUF,
+};
+
+/**
+ * CPU view of a buffer the GPU renders into, mapped once and read in place.
+ * Rows are top row first, unlike glReadPixels.
+ */
+struct frame_map {
+    enum frame_map_mode mode;
+    int fd;
+    void *data;
+    size_t size;
+    uint32_t width, height, stride;
+    bool reading;
+};
+
+bool frame_map_dumb(struct frame_map *map, int card_fd, uint32_t handle,
+        uint64_t size, uint32_t width, uint32_t height, uint32_t stride);
+bool frame_map_dmabuf(struct frame_map *map, int prime_fd, uint64_t size,
+        uint32_t width, uint32_t height, uint32_t stride);
+void frame_map_unmap(struct frame_map *map);
+
+/**
+ * Make the GPU writes visible to the CPU. Waits on an EGL fence for the
+ * current context when EGL_KHR_fence_sync is there, which the dumb mapping
+ * needs since it has no implicit synchronization of its own.
+ */
+bool frame_map_begin_read(struct frame_map *map, struct egl *egl);
+void frame_map_end_read(struct frame_map *map);
+
+#endif
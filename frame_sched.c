@@ -0,0 +1,102 @@
+#include "frame_sched.h"
+#include "log.h"
+#include <string.h>
+
+void frame_sched_init(struct frame_sched *sched, int64_t period_ns,
+        int64_t margin_ns) {
+    memset(sched, 0, sizeof(*sched));
+    sched->period_ns = period_ns;
+    sched->margin_ns = margin_ns;
+}
+
+int64_t frame_sched_predict(const struct frame_sched *sched) {
+    // The longest recent frame rather than the average: one spike costs a
+    // missed vblank, starting a little early only costs some latency
+    int64_t predicted = 0;
+    for (int i = 0; i < sched->duration_count; i++) {
+        if (sched->durations[i] > predicted) {
+            predicted = sched->durations[i];
+        }
+    }
+    return predicted;
+}
+
+int64_t frame_sched_begin(struct frame_sched *sched, int64_t now_ns) {
+    int64_t budget = frame_sched_predict(sched) + sched->margin_ns;
+    int64_t period = sched->period_ns;
+
+    if (!sched->last_vblank_ns) {
+        // No phase yet: go now, no deadline to make or miss
+        sched->target_ns = 0;
+        sched->deadline_ns = 0;
+        sched->in_flight = false;
+        return now_ns;
+    }
+
+    // First vblank after the last one that leaves budget from now
+    int64_t target = sched->last_vblank_ns + period;
+    if (target - budget < now_ns) {
+        target += (now_ns + budget - target + period - 1) / period * period;
+    }
+    sched->in_flight = true;
+    sched->target_ns = target;
+    sched->deadline_ns = target - sched->margin_ns;
+    return target - budget;
+}
+
+void frame_sched_rendered(struct frame_sched *sched, int64_t start_ns,
+        int64_t done_ns) {
+    int64_t duration = done_ns - start_ns;
+    sched->durations[sched->duration_next] = duration;
+    sched->duration_next = (sched->duration_next + 1) % FRAME_SCHED_HISTORY;
+    if (sched->duration_count < FRAME_SCHED_HISTORY) {
+        sched->duration_count++;
+    }
+    sched->frames++;
+    sched->render_ns += duration;
+    if (!sched->deadline_ns) {
+        return;
+    }
+
+    int64_t slack = sched->deadline_ns - done_ns;
+    if (slack >= 0) {
+        sched->early++;
+        sched->early_ns += slack;
+    } else {
+        sched->late++;
+        sched->late_ns -= slack;
+        if (-slack > sched->max_late_ns) {
+            sched->max_late_ns = -slack;
+        }
+    }
+}
+
+void frame_sched_vblank(struct frame_sched *sched, int64_t vblank_ns) {
+    // Timestamps jitter a little around the predicted vblank
+    if (sched->in_flight &&
+            vblank_ns > sched->target_ns + sched->period_ns / 2) {
+        sched->missed++;
+    }
+    sched->in_flight = false;
+    sched->last_vblank_ns = vblank_ns;
+}
+
+void frame_sched_log_stats(const struct frame_sched *sched,
+        uint32_t crtc_id) {
+    if (!sched->frames) {
+        return;
+    }
+    fake_log(INFO, "CRTC %u pacing: %lu frames, avg render %.3f ms, "
+            "predicted %.3f ms, %lu missed vblanks",
+            crtc_id, (unsigned long)sched->frames,
+            (double)sched->render_ns / sched->frames / 1000000,
+            (double)frame_sched_predict(sched) / 1000000,
+            (unsigned long)sched->missed);
+    fake_log(INFO, "CRTC %u deadlines: %lu made, avg %.3f ms to spare; "
+            "%lu late, avg %.3f ms, max %.3f ms", crtc_id,
+            (unsigned long)sched->early, sched->early ?
+                (double)sched->early_ns / sched->early / 1000000 : 0.0,
+            (unsigned long)sched->late, sched->late ?
+                (double)sched->late_ns / sched->late / 1000000 : 0.0,
+            (double)sched->max_late_ns / 1000000);
+}
@@ -0,0 +1,59 @@
+#ifndef FAKE_CHEN_FRAME_SCHED_H
+#define FAKE_CHEN_FRAME_SCHED_H
+#include <stdbool.h>
+#include <stdint.h>
+
+// Render durations the prediction looks back over
+#define FRAME_SCHED_HISTORY 16
+
+/**
+ * Paces one output: each frame starts as late as it can while still being
+ * ready for the vblank it aims for, so what it shows is as fresh as it can
+ * be. The render time is predicted as the longest of the last
+ * FRAME_SCHED_HISTORY frames, measured up to their fence, plus a margin
+ * for the commit to reach the display. Times are CLOCK_MONOTONIC
+ * nanoseconds, which is what page-flip event timestamps use.
+ */
+struct frame_sched {
+    int64_t period_ns;
+    int64_t margin_ns;
+    // Latest vblank a flip landed on, 0 until the first one
+    int64_t last_vblank_ns;
+
+    int64_t durations[FRAME_SCHED_HISTORY];
+    int duration_count;
+    int duration_next;
+
+    // The frame being rendered or waiting for its flip
+    int64_t target_ns;
+    int64_t deadline_ns;
+    bool in_flight;
+
+    uint64_t frames;
+    // Flips landing on a later vblank than aimed for
+    uint64_t missed;
+    // Renders done before and after their deadline, and by how much
+    uint64_t early, late;
+    int64_t early_ns, late_ns;
+    int64_t max_late_ns;
+    int64_t render_ns;
+};
+
+void frame_sched_init(struct frame_sched *sched, int64_t period_ns,
+        int64_t margin_ns);
+/** Predicted render duration, margin not included. */
+int64_t frame_sched_predict(const struct frame_sched *sched);
+/**
+ * Aim the next frame at the earliest vblank it can still make from now_ns
+ * and return when to start rendering it, now_ns or later. Renders right
+ * away until a flip gave the vblank phase.
+ */
+int64_t frame_sched_begin(struct frame_sched *sched, int64_t now_ns);
+/** The frame started at start_ns finished rendering at done_ns. */
+void frame_sched_rendered(struct frame_sched *sched, int64_t start_ns,
+        int64_t done_ns);
+/** A flip landed on the vblank at vblank_ns, from its page-flip event. */
+void frame_sched_vblank(struct frame_sched *sched, int64_t vblank_ns);
+void frame_sched_log_stats(const struct frame_sched *sched, uint32_t crtc_id);
+
+#endif
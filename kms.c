@@ -0,0 +1,1235 @@
+#define _GNU_SOURCE
+#include "kms.h"
+#include "dmabuf.h"
+#include "log.h"
+#include "trace.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include <drm_fourcc.h>
+#include <xf86drm.h>
+
+static const int64_t NSEC_PER_SEC = 1000000000;
+
+int64_t kms_refresh_nsec(const struct kms_backend *kms) {
+    const drmModeModeInfo *mode = &kms->mode;
+    int64_t mhz = 0;
+    if (mode->htotal && mode->vtotal) {
+        int64_t total = (int64_t)mode->htotal * mode->vtotal;
+        mhz = ((int64_t)mode->clock * 1000000 + total / 2) / total;
+    }
+    if (mhz <= 0 && mode->vrefresh) {
+        mhz = (int64_t)mode->vrefresh * 1000;
+    }
+    if (mhz <= 0) {
+        mhz = 60000;
+    }
+    return NSEC_PER_SEC * 1000 / mhz;
+}
+
+void kms_mock_mode(drmModeModeInfo *mode, uint16_t width, uint16_t height,
+        uint32_t refresh_hz) {
+    memset(mode, 0, sizeof(*mode));
+    mode->hdisplay = width;
+    mode->vdisplay = height;
+    mode->htotal = width + 280;
+    mode->vtotal = height + 45;
+    mode->vrefresh = refresh_hz;
+    mode->clock = (uint32_t)((uint64_t)mode->htotal * mode->vtotal *
+            refresh_hz / 1000);
+    snprintf(mode->name, sizeof(mode->name), "%ux%u", width, height);
+}
+
+bool kms_wait_event(struct kms_backend *kms, int timeout_ms) {
+    return kms_wait_events(&kms, 1, timeout_ms);
+}
+
+bool kms_wait_events(struct kms_backend **backends, int count,
+        int timeout_ms) {
+    int ret = kms_poll_events(backends, count, NULL, 0,
+            (int64_t)timeout_ms * 1000000);
+    if (ret == 0) {
+        fake_log(ERROR, "Timed out waiting for %s page-flip event",
+                backends[0]->impl->name);
+    }
+    return ret > 0;
+}
+
+int kms_poll_events(struct kms_backend **backends, int count,
+        const int *wait_fds, int wait_count, int64_t timeout_ns) {
+    struct pollfd pfds[KMS_MAX_OUTPUTS * 2];
+    struct kms_backend *owners[KMS_MAX_OUTPUTS];
+    int nfds = 0;
+    for (int i = 0; i < count && nfds < KMS_MAX_OUTPUTS; i++) {
+        int fd = backends[i]->impl->get_event_fd(backends[i]);
+        bool seen = false;
+        for (int j = 0; j < nfds && !seen; j++) {
+            seen = pfds[j].fd == fd;
+        }
+        if (!seen) {
+            pfds[nfds] = (struct pollfd){ .fd = fd, .events = POLLIN };
+            owners[nfds++] = backends[i];
+        }
+    }
+    int event_fds = nfds;
+    for (int i = 0; i < wait_count && i < KMS_MAX_OUTPUTS; i++) {
+        pfds[nfds++] = (struct pollfd){ .fd = wait_fds[i], .events = POLLIN };
+    }
+    // Nanoseconds, poll() would round a render start to the millisecond
+    struct timespec timeout = {
+        .tv_sec = timeout_ns / NSEC_PER_SEC,
+        .tv_nsec = timeout_ns % NSEC_PER_SEC,
+    };
+    int ret;
+    do {
+        ret = ppoll(pfds, nfds, timeout_ns < 0 ? NULL : &timeout, NULL);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        fake_log_errno(ERROR, "poll on KMS event fd failed");
+        return -1;
+    }
+    if (ret == 0) {
+        return 0;
+    }
+    for (int i = 0; i < event_fds; i++) {
+        if ((pfds[i].revents & POLLIN) &&
+                owners[i]->impl->dispatch(owners[i]) < 0) {
+            return -1;
+        }
+    }
+    return ret;
+}
+
+static const char *connector_type_name(uint32_t type) {
+    switch (type) {
+    case DRM_MODE_CONNECTOR_VGA:
+        return "VGA";
+    case DRM_MODE_CONNECTOR_DVII:
+        return "DVI-I";
+    case DRM_MODE_CONNECTOR_DVID:
+        return "DVI-D";
+    case DRM_MODE_CONNECTOR_LVDS:
+        return "LVDS";
+    case DRM_MODE_CONNECTOR_DisplayPort:
+        return "DP";
+    case DRM_MODE_CONNECTOR_HDMIA:
+        return "HDMI-A";
+    case DRM_MODE_CONNECTOR_HDMIB:
+        return "HDMI-B";
+    case DRM_MODE_CONNECTOR_eDP:
+        return "eDP";
+    case DRM_MODE_CONNECTOR_VIRTUAL:
+        return "Virtual";
+    case DRM_MODE_CONNECTOR_DSI:
+        return "DSI";
+    default:
+        return "Unknown";
+    }
+}
+
+// Connector to CRTC matching. possible and current are CRTC indices into
+// drmModeRes.crtcs, the way possible_crtcs counts them.
+struct crtc_match {
+    int count;
+    uint32_t possible[KMS_MAX_OUTPUTS];
+    int current[KMS_MAX_OUTPUTS];
+    int trial[KMS_MAX_OUTPUTS];
+    int best[KMS_MAX_OUTPUTS];
+    int best_assigned, best_kept;
+};
+
+// Exhaustive, but a handful of connectors and CRTCs keeps it tiny: most
+// connectors lit first, then the fewest CRTC changes
+static void match_crtcs(struct crtc_match *m, int index, uint32_t used,
+        int assigned, int kept) {
+    if (index == m->count) {
+        if (assigned > m->best_assigned ||
+                (assigned == m->best_assigned && kept > m->best_kept)) {
+            memcpy(m->best, m->trial, sizeof(m->best));
+            m->best_assigned = assigned;
+            m->best_kept = kept;
+        }
+        return;
+    }
+    uint32_t free_crtcs = m->possible[index] & ~used;
+    for (int crtc = 0; crtc < 32; crtc++) {
+        if (!(free_crtcs & (1u << crtc))) {
+            continue;
+        }
+        m->trial[index] = crtc;
+        match_crtcs(m, index + 1, used | (1u << crtc), assigned + 1,
+                kept + (crtc == m->current[index]));
+    }
+    m->trial[index] = -1;
+    match_crtcs(m, index + 1, used, assigned, kept);
+}
+
+static const drmModeModeInfo *preferred_mode(const drmModeConnector *conn) {
+    for (int i = 0; i < conn->count_modes; i++) {
+        if (conn->modes[i].type & DRM_MODE_TYPE_PREFERRED) {
+            return &conn->modes[i];
+        }
+    }
+    return &conn->modes[0];
+}
+
+int kms_find_outputs(int fd, struct kms_output_config *outputs, int max) {
+    drmModeRes *res = drmModeGetResources(fd);
+    if (!res) {
+        fake_log_errno(ERROR, "drmModeGetResources failed");
+        return 0;
+    }
+    if (max > KMS_MAX_OUTPUTS) {
+        max = KMS_MAX_OUTPUTS;
+    }
+
+    struct crtc_match match = { .best_assigned = -1 };
+    drmModeConnector *connectors[KMS_MAX_OUTPUTS];
+    for (int i = 0; i < res->count_connectors; i++) {
+        drmModeConnector *conn = drmModeGetConnector(fd, res->connectors[i]);
+        if (!conn) {
+            continue;
+        }
+        if (conn->connection != DRM_MODE_CONNECTED ||
+                conn->count_modes == 0 || match.count == max) {
+            if (conn->connection == DRM_MODE_CONNECTED &&
+                    conn->count_modes > 0) {
+                fake_log(INFO, "More than %d connected outputs, ignoring "
+                        "%s-%u", max, connector_type_name(conn->connector_type),
+                        conn->connector_type_id);
+            }
+            drmModeFreeConnector(conn);
+            continue;
+        }
+
+        int index = match.count++;
+        connectors[index] = conn;
+        match.possible[index] = 0;
+        match.current[index] = -1;
+        for (int j = 0; j < conn->count_encoders; j++) {
+            drmModeEncoder *enc = drmModeGetEncoder(fd, conn->encoders[j]);
+            if (!enc) {
+                continue;
+            }
+            match.possible[index] |= enc->possible_crtcs;
+            if (enc->encoder_id == conn->encoder_id && enc->crtc_id) {
+                for (int k = 0; k < res->count_crtcs; k++) {
+                    if (res->crtcs[k] == enc->crtc_id) {
+                        match.current[index] = k;
+                    }
+                }
+            }
+            drmModeFreeEncoder(enc);
+        }
+    }
+    match_crtcs(&match, 0, 0, 0, 0);
+
+    int count = 0;
+    for (int i = 0; i < match.count; i++) {
+        drmModeConnector *conn = connectors[i];
+        const char *type = connector_type_name(conn->connector_type);
+        fake_log(DEBUG, "%s-%u modes:", type, conn->connector_type_id);
+        for (int j = 0; j < conn->count_modes; j++) {
+            fake_log(DEBUG, "    Mode %d: %s@%u%s", j, conn->modes[j].name,
+                    conn->modes[j].vrefresh,
+                    conn->modes[j].type & DRM_MODE_TYPE_PREFERRED ?
+                        " (preferred)" : "");
+        }
+
+        int crtc = match.best[i];
+        if (crtc < 0 || crtc >= res->count_crtcs) {
+            fake_log(INFO, "No CRTC left for %s-%u, leaving it dark", type,
+                    conn->connector_type_id);
+        } else {
+            struct kms_output_config *out = &outputs[count++];
+            out->connector_id = conn->connector_id;
+            out->crtc_id = res->crtcs[crtc];
+            out->mode = *preferred_mode(conn);
+            snprintf(out->name, sizeof(out->name), "%s-%u", type,
+                    conn->connector_type_id);
+            fake_log(INFO, "Output %s: CRTC %u%s, mode %s@%u", out->name,
+                    out->crtc_id, crtc == match.current[i] ? "" : " (new)",
+                    out->mode.name, out->mode.vrefresh);
+        }
+        drmModeFreeConnector(conn);
+    }
+    drmModeFreeResources(res);
+    return count;
+}
+
+struct kms_fb {
+    struct kms_backend *kms;
+    uint32_t fb_id;
+    // Passed impl->test_fb, scanouts add framebuffers without it
+    bool tested;
+};
+
+static void kms_fb_destroy(struct gbm_bo *bo, void *data) {
+    struct kms_fb *fb = data;
+    fb->kms->impl->rm_fb(fb->kms, fb->fb_id);
+    free(fb);
+}
+
+static struct kms_fb *fb_from_bo(struct kms_backend *kms,
+        struct gbm_bo *bo) {
+    struct kms_fb *fb = gbm_bo_get_user_data(bo);
+    if (fb) {
+        kms->fb_cache_hits++;
+        return fb;
+    }
+
+    kms->fb_cache_misses++;
+    fb = calloc(1, sizeof(*fb));
+    if (!fb) {
+        fake_log(ERROR, "Allocation failed");
+        return 0;
+    }
+    fb->kms = kms;
+    if (kms->impl->add_fb(kms, bo, &fb->fb_id)) {
+        free(fb);
+        return NULL;
+    }
+    gbm_bo_set_user_data(bo, fb, kms_fb_destroy);
+    return fb;
+}
+
+uint32_t kms_fb_from_bo(struct kms_backend *kms, struct gbm_bo *bo) {
+    struct kms_fb *fb = fb_from_bo(kms, bo);
+    if (!fb) {
+        return 0;
+    }
+    // A failed test keeps the framebuffer, scanouts may still use it
+    if (!fb->tested && kms->impl->test_fb) {
+        if (kms->impl->test_fb(kms, fb->fb_id)) {
+            return 0;
+        }
+        fb->tested = true;
+    }
+    return fb->fb_id;
+}
+
+bool kms_get_formats(struct kms_backend *kms, struct drm_format_set *set) {
+    return kms->impl->get_formats && kms->impl->get_formats(kms, set);
+}
+
+int kms_scanout(struct kms_backend *kms, const struct kms_layer *layer,
+        void *user_data) {
+    if (!kms->impl->scanout) {
+        if (kms->in_fence_fd >= 0) {
+            close(kms->in_fence_fd);
+            kms->in_fence_fd = -1;
+        }
+        return -ENOTSUP;
+    }
+    return kms->impl->scanout(kms, layer, user_data);
+}
+
+void kms_backend_destroy(struct kms_backend *kms) {
+    if (kms) {
+        fake_log(DEBUG, "%s framebuffer cache: %lu hits, %lu misses",
+                kms->impl->name, (unsigned long)kms->fb_cache_hits,
+                (unsigned long)kms->fb_cache_misses);
+        kms->impl->destroy(kms);
+    }
+}
+
+// DRM backend
+
+static int drm_add_fb(struct kms_backend *kms, struct gbm_bo *bo,
+        uint32_t *fb_id) {
+    return dmabuf_add_fb(kms->fd, bo, fb_id);
+}
+
+static void drm_rm_fb(struct kms_backend *kms, uint32_t fb_id) {
+    if (drmModeRmFB(kms->fd, fb_id)) {
+        fake_log_errno(ERROR, "drmModeRmFB(%u) failed", fb_id);
+    }
+}
+
+static int drm_set_crtc(struct kms_backend *kms, uint32_t fb_id) {
+    TRACE_SCOPE("drmModeSetCrtc");
+    int ret = drmModeSetCrtc(kms->fd, kms->crtc_id, fb_id, 0, 0,
+            &kms->connector_id, 1, &kms->mode);
+    if (ret) {
+        fake_log_errno(ERROR, "drmModeSetCrtc failed");
+    }
+    return ret;
+}
+
+static int drm_page_flip(struct kms_backend *kms, uint32_t fb_id,
+        void *user_data) {
+    // Only one flip can be queued per CRTC, the kernel would say EBUSY
+    if (kms->flip_pending) {
+        return -EBUSY;
+    }
+    struct trace_scope scope = trace_scope_begin("drmModePageFlip");
+    int ret = drmModePageFlip(kms->fd, kms->crtc_id, fb_id,
+            DRM_MODE_PAGE_FLIP_EVENT, kms);
+    trace_scope_end(&scope);
+    if (ret) {
+        fake_log_errno(ERROR, "drmModePageFlip failed");
+        return ret;
+    }
+    kms->pending_data = user_data;
+    kms->flip_pending = true;
+    return 0;
+}
+
+static int drm_get_event_fd(struct kms_backend *kms) {
+    return kms->fd;
+}
+
+static void drm_page_flip_handler(int fd, unsigned int sequence,
+        unsigned int tv_sec, unsigned int tv_usec, void *data) {
+    struct kms_backend *kms = data;
+    void *user_data = kms->pending_data;
+    kms->pending_data = NULL;
+    kms->flip_pending = false;
+    if (kms->flip_handler) {
+        kms->flip_handler(sequence, tv_sec, tv_usec, user_data);
+    }
+}
+
+static int drm_dispatch(struct kms_backend *kms) {
+    drmEventContext evctx = {
+        .version = 2,
+        .page_flip_handler = drm_page_flip_handler,
+    };
+    int ret = drmHandleEvent(kms->fd, &evctx);
+    if (ret) {
+        fake_log_errno(ERROR, "drmHandleEvent failed");
+    }
+    return ret;
+}
+
+static void drm_destroy(struct kms_backend *kms) {
+    free(kms);
+}
+
+static uint64_t get_prop_value(int fd, uint32_t object_id,
+        uint32_t object_type, const char *name, bool *found) {
+    *found = false;
+    drmModeObjectProperties *props =
+        drmModeObjectGetProperties(fd, object_id, object_type);
+    if (!props) {
+        return 0;
+    }
+    uint64_t value = 0;
+    for (uint32_t i = 0; i < props->count_props && !*found; i++) {
+        drmModePropertyRes *prop = drmModeGetProperty(fd, props->props[i]);
+        if (prop && strcmp(prop->name, name) == 0) {
+            value = props->prop_values[i];
+            *found = true;
+        }
+        drmModeFreeProperty(prop);
+    }
+    drmModeFreeObjectProperties(props);
+    return value;
+}
+
+static bool add_in_formats(int fd, uint32_t blob_id,
+        struct drm_format_set *set) {
+    drmModePropertyBlobRes *blob = drmModeGetPropertyBlob(fd, blob_id);
+    if (!blob) {
+        return false;
+    }
+    const struct drm_format_modifier_blob *data = blob->data;
+    const uint32_t *formats =
+        (const uint32_t *)((const char *)data + data->formats_offset);
+    const struct drm_format_modifier *mods =
+        (const struct drm_format_modifier *)((const char *)data +
+                data->modifiers_offset);
+    for (uint32_t i = 0; i < data->count_modifiers; i++) {
+        // Each entry covers up to 64 formats starting at offset
+        for (uint32_t j = 0; j < 64; j++) {
+            uint32_t index = mods[i].offset + j;
+            if (index < data->count_formats &&
+                    (mods[i].formats & ((uint64_t)1 << j))) {
+                drm_format_set_add(set, formats[index], mods[i].modifier);
+            }
+        }
+    }
+    drmModeFreePropertyBlob(blob);
+    return true;
+}
+
+static int crtc_index(int fd, uint32_t crtc_id) {
+    int index = -1;
+    drmModeRes *res = drmModeGetResources(fd);
+    if (!res) {
+        return -1;
+    }
+    for (int i = 0; i < res->count_crtcs; i++) {
+        if (res->crtcs[i] == crtc_id) {
+            index = i;
+        }
+    }
+    drmModeFreeResources(res);
+    return index;
+}
+
+// IDs of the planes of the given type that can be put on the CRTC, at
+// most max. Returns how many were found.
+static int find_planes(int fd, uint32_t crtc_id, uint64_t plane_type,
+        uint32_t *plane_ids, int max) {
+    int index = crtc_index(fd, crtc_id);
+    if (index < 0) {
+        return 0;
+    }
+
+    // Primary planes are hidden without this
+    if (drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1)) {
+        fake_log_errno(ERROR, "DRM_CLIENT_CAP_UNIVERSAL_PLANES unsupported");
+        return 0;
+    }
+    drmModePlaneRes *planes = drmModeGetPlaneResources(fd);
+    if (!planes) {
+        return 0;
+    }
+    int count = 0;
+    for (uint32_t i = 0; i < planes->count_planes && count < max; i++) {
+        drmModePlane *plane = drmModeGetPlane(fd, planes->planes[i]);
+        if (!plane) {
+            continue;
+        }
+        bool found;
+        uint64_t type = get_prop_value(fd, plane->plane_id,
+                DRM_MODE_OBJECT_PLANE, "type", &found);
+        if (found && type == plane_type &&
+                (plane->possible_crtcs & (1u << index))) {
+            plane_ids[count++] = plane->plane_id;
+        }
+        drmModeFreePlane(plane);
+    }
+    drmModeFreePlaneResources(planes);
+    return count;
+}
+
+static bool plane_get_formats(int fd, uint32_t plane_id,
+        struct drm_format_set *set) {
+    bool found;
+    uint64_t blob_id = get_prop_value(fd, plane_id, DRM_MODE_OBJECT_PLANE,
+            "IN_FORMATS", &found);
+    if (found && add_in_formats(fd, blob_id, set)) {
+        return true;
+    }
+    // No modifier support, only implicit layouts
+    drmModePlane *plane = drmModeGetPlane(fd, plane_id);
+    if (!plane) {
+        return false;
+    }
+    for (uint32_t i = 0; i < plane->count_formats; i++) {
+        drm_format_set_add(set, plane->formats[i], DRM_FORMAT_MOD_INVALID);
+    }
+    drmModeFreePlane(plane);
+    return true;
+}
+
+static bool drm_get_formats(struct kms_backend *kms,
+        struct drm_format_set *set) {
+    uint32_t plane_id;
+    return find_planes(kms->fd, kms->crtc_id, DRM_PLANE_TYPE_PRIMARY,
+            &plane_id, 1) && plane_get_formats(kms->fd, plane_id, set);
+}
+
+static const struct kms_backend_impl drm_impl = {
+    .name = "drm",
+    .add_fb = drm_add_fb,
+    .rm_fb = drm_rm_fb,
+    .set_crtc = drm_set_crtc,
+    .page_flip = drm_page_flip,
+    .get_event_fd = drm_get_event_fd,
+    .dispatch = drm_dispatch,
+    .destroy = drm_destroy,
+    .get_formats = drm_get_formats,
+};
+
+struct kms_backend *kms_backend_create_drm(int fd, uint32_t crtc_id,
+        uint32_t connector_id, const drmModeModeInfo *mode) {
+    struct kms_backend *kms = calloc(1, sizeof(*kms));
+    if (!kms) {
+        fake_log(ERROR, "Allocation failed");
+        return NULL;
+    }
+    kms->impl = &drm_impl;
+    kms->fd = fd;
+    kms->crtc_id = crtc_id;
+    kms->connector_id = connector_id;
+    kms->mode = *mode;
+    kms->in_fence_fd = -1;
+    kms->out_fence_fd = -1;
+    return kms;
+}
+
+// Atomic backend
+
+enum atomic_connector_prop {
+    CONNECTOR_CRTC_ID,
+    CONNECTOR_PROP_COUNT,
+};
+
+enum atomic_crtc_prop {
+    CRTC_MODE_ID,
+    CRTC_ACTIVE,
+    CRTC_PROP_COUNT,
+};
+
+enum atomic_plane_prop {
+    PLANE_FB_ID,
+    PLANE_CRTC_ID,
+    PLANE_SRC_X,
+    PLANE_SRC_Y,
+    PLANE_SRC_W,
+    PLANE_SRC_H,
+    PLANE_CRTC_X,
+    PLANE_CRTC_Y,
+    PLANE_CRTC_W,
+    PLANE_CRTC_H,
+    PLANE_PROP_COUNT,
+};
+
+static const char *const connector_prop_names[CONNECTOR_PROP_COUNT] = {
+    [CONNECTOR_CRTC_ID] = "CRTC_ID",
+};
+
+static const char *const crtc_prop_names[CRTC_PROP_COUNT] = {
+    [CRTC_MODE_ID] = "MODE_ID",
+    [CRTC_ACTIVE] = "ACTIVE",
+};
+
+static const char *const plane_prop_names[PLANE_PROP_COUNT] = {
+    [PLANE_FB_ID] = "FB_ID",
+    [PLANE_CRTC_ID] = "CRTC_ID",
+    [PLANE_SRC_X] = "SRC_X",
+    [PLANE_SRC_Y] = "SRC_Y",
+    [PLANE_SRC_W] = "SRC_W",
+    [PLANE_SRC_H] = "SRC_H",
+    [PLANE_CRTC_X] = "CRTC_X",
+    [PLANE_CRTC_Y] = "CRTC_Y",
+    [PLANE_CRTC_W] = "CRTC_W",
+    [PLANE_CRTC_H] = "CRTC_H",
+};
+
+#define ATOMIC_MAX_PLANES 8
+
+struct atomic_plane {
+    uint32_t id;
+    uint64_t type;
+    uint32_t props[PLANE_PROP_COUNT];
+    // IN_FORMATS, what a client buffer must match to be put on it
+    struct drm_format_set formats;
+};
+
+struct atomic_backend {
+    struct kms_backend base;
+    // Optional, explicit sync needs both
+    uint32_t in_fence_prop;
+    uint32_t out_fence_prop;
+    // Primary plane first, then the overlays
+    struct atomic_plane planes[ATOMIC_MAX_PLANES];
+    int plane_count;
+    // Overlay showing a client buffer, disabled by the next flip of the
+    // primary plane
+    struct atomic_plane *active_overlay;
+    // Property IDs, looked up once at creation
+    uint32_t connector_props[CONNECTOR_PROP_COUNT];
+    uint32_t crtc_props[CRTC_PROP_COUNT];
+    uint32_t mode_blob_id;
+    uint64_t commits;
+    uint64_t test_failures;
+    uint64_t scanouts;
+    uint64_t scanout_format_misses;
+};
+
+static struct atomic_backend *atomic_from_kms(struct kms_backend *kms) {
+    return (struct atomic_backend *)kms;
+}
+
+// IDs of every named property of the object, in one pass over its
+// properties. Fails when one is missing.
+static bool get_prop_ids(int fd, uint32_t object_id, uint32_t object_type,
+        const char *const *names, uint32_t *ids, int count) {
+    drmModeObjectProperties *props =
+        drmModeObjectGetProperties(fd, object_id, object_type);
+    if (!props) {
+        fake_log_errno(ERROR, "drmModeObjectGetProperties(%u) failed",
+                object_id);
+        return false;
+    }
+    memset(ids, 0, count * sizeof(*ids));
+    for (uint32_t i = 0; i < props->count_props; i++) {
+        drmModePropertyRes *prop = drmModeGetProperty(fd, props->props[i]);
+        if (!prop) {
+            continue;
+        }
+        for (int j = 0; j < count; j++) {
+            if (strcmp(prop->name, names[j]) == 0) {
+                ids[j] = prop->prop_id;
+            }
+        }
+        drmModeFreeProperty(prop);
+    }
+    drmModeFreeObjectProperties(props);
+
+    for (int i = 0; i < count; i++) {
+        if (!ids[i]) {
+            fake_log(ERROR, "KMS object %u has no %s property", object_id,
+                    names[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Explicit sync of a commit changing the primary plane: consumes
+// in_fence_fd, and has the kernel write the out-fence to out_fence_fd
+static void atomic_add_fences(struct atomic_backend *atomic,
+        drmModeAtomicReq *req) {
+    struct kms_backend *kms = &atomic->base;
+    if (!kms->explicit_sync) {
+        return;
+    }
+    if (kms->in_fence_fd >= 0) {
+        drmModeAtomicAddProperty(req, atomic->planes[0].id,
+                atomic->in_fence_prop, kms->in_fence_fd);
+    }
+    kms->out_fence_fd = -1;
+    drmModeAtomicAddProperty(req, kms->crtc_id, atomic->out_fence_prop,
+            (uint64_t)(uintptr_t)&kms->out_fence_fd);
+}
+
+// The kernel took its own reference to the in-fence, and only installs the
+// out-fence fd when the commit went through
+static void atomic_finish_fences(struct kms_backend *kms, int ret) {
+    if (kms->in_fence_fd >= 0) {
+        close(kms->in_fence_fd);
+        kms->in_fence_fd = -1;
+    }
+    if (ret) {
+        kms->out_fence_fd = -1;
+    }
+}
+
+// Show the whole of a src_width x src_height fb_id at the layer rectangle
+static void atomic_add_plane(struct atomic_backend *atomic,
+        drmModeAtomicReq *req, const struct atomic_plane *plane,
+        uint32_t fb_id, uint32_t src_width, uint32_t src_height,
+        int32_t x, int32_t y, uint32_t width, uint32_t height) {
+    const uint32_t *props = plane->props;
+    drmModeAtomicAddProperty(req, plane->id, props[PLANE_FB_ID], fb_id);
+    drmModeAtomicAddProperty(req, plane->id, props[PLANE_CRTC_ID],
+            atomic->base.crtc_id);
+    // Source rectangle in 16.16 fixed point
+    drmModeAtomicAddProperty(req, plane->id, props[PLANE_SRC_X], 0);
+    drmModeAtomicAddProperty(req, plane->id, props[PLANE_SRC_Y], 0);
+    drmModeAtomicAddProperty(req, plane->id, props[PLANE_SRC_W],
+            (uint64_t)src_width << 16);
+    drmModeAtomicAddProperty(req, plane->id, props[PLANE_SRC_H],
+            (uint64_t)src_height << 16);
+    // Signed, but carried in the u64 property value
+    drmModeAtomicAddProperty(req, plane->id, props[PLANE_CRTC_X],
+            (uint64_t)(int64_t)x);
+    drmModeAtomicAddProperty(req, plane->id, props[PLANE_CRTC_Y],
+            (uint64_t)(int64_t)y);
+    drmModeAtomicAddProperty(req, plane->id, props[PLANE_CRTC_W], width);
+    drmModeAtomicAddProperty(req, plane->id, props[PLANE_CRTC_H], height);
+}
+
+// ID of an optional property, 0 when the object does not have it
+static uint32_t get_prop_id(int fd, uint32_t object_id,
+        uint32_t object_type, const char *name) {
+    drmModeObjectProperties *props =
+        drmModeObjectGetProperties(fd, object_id, object_type);
+    if (!props) {
+        return 0;
+    }
+    uint32_t id = 0;
+    for (uint32_t i = 0; i < props->count_props && !id; i++) {
+        drmModePropertyRes *prop = drmModeGetProperty(fd, props->props[i]);
+        if (prop && strcmp(prop->name, name) == 0) {
+            id = prop->prop_id;
+        }
+        drmModeFreeProperty(prop);
+    }
+    drmModeFreeObjectProperties(props);
+    return id;
+}
+
+// The primary plane showing fb_id over the whole mode
+static void atomic_add_primary(struct atomic_backend *atomic,
+        drmModeAtomicReq *req, uint32_t fb_id) {
+    uint32_t width = atomic->base.mode.hdisplay;
+    uint32_t height = atomic->base.mode.vdisplay;
+    atomic_add_plane(atomic, req, &atomic->planes[0], fb_id, width, height,
+            0, 0, width, height);
+}
+
+static void atomic_add_disable(drmModeAtomicReq *req,
+        const struct atomic_plane *plane) {
+    drmModeAtomicAddProperty(req, plane->id, plane->props[PLANE_FB_ID], 0);
+    drmModeAtomicAddProperty(req, plane->id, plane->props[PLANE_CRTC_ID], 0);
+}
+
+// Everything a modeset needs: connector routed to the CRTC, mode, plane
+static void atomic_add_modeset(struct atomic_backend *atomic,
+        drmModeAtomicReq *req, uint32_t fb_id) {
+    struct kms_backend *kms = &atomic->base;
+    drmModeAtomicAddProperty(req, kms->connector_id,
+            atomic->connector_props[CONNECTOR_CRTC_ID], kms->crtc_id);
+    drmModeAtomicAddProperty(req, kms->crtc_id,
+            atomic->crtc_props[CRTC_MODE_ID], atomic->mode_blob_id);
+    drmModeAtomicAddProperty(req, kms->crtc_id,
+            atomic->crtc_props[CRTC_ACTIVE], 1);
+    atomic_add_primary(atomic, req, fb_id);
+}
+
+static int atomic_commit(struct atomic_backend *atomic, drmModeAtomicReq *req,
+        uint32_t flags, void *user_data, const char *what) {
+    int ret = drmModeAtomicCommit(atomic->base.fd, req, flags, user_data);
+    if (ret) {
+        ret = -errno;
+        if (flags & DRM_MODE_ATOMIC_TEST_ONLY) {
+            atomic->test_failures++;
+        }
+        fake_log_errno(ERROR, "Atomic %s commit on CRTC %u failed", what,
+                atomic->base.crtc_id);
+        return ret;
+    }
+    if (!(flags & DRM_MODE_ATOMIC_TEST_ONLY)) {
+        atomic->commits++;
+    }
+    return 0;
+}
+
+// A framebuffer is only handed out once a TEST_ONLY commit of the full
+// modeset with it passed, so a layout the plane cannot scan out fails here
+// rather than on a flip. Flips then only swap validated framebuffers.
+static int atomic_test_fb(struct kms_backend *kms, uint32_t fb_id) {
+    struct atomic_backend *atomic = atomic_from_kms(kms);
+    drmModeAtomicReq *req = drmModeAtomicAlloc();
+    if (!req) {
+        fake_log(ERROR, "Allocation failed");
+        return -ENOMEM;
+    }
+    atomic_add_modeset(atomic, req, fb_id);
+    int ret = atomic_commit(atomic, req,
+            DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET, NULL,
+            "TEST_ONLY");
+    drmModeAtomicFree(req);
+    return ret;
+}
+
+static int atomic_set_crtc(struct kms_backend *kms, uint32_t fb_id) {
+    struct atomic_backend *atomic = atomic_from_kms(kms);
+    drmModeAtomicReq *req = drmModeAtomicAlloc();
+    if (!req) {
+        fake_log(ERROR, "Allocation failed");
+        atomic_finish_fences(kms, -ENOMEM);
+        return -ENOMEM;
+    }
+    atomic_add_modeset(atomic, req, fb_id);
+    atomic_add_fences(atomic, req);
+    TRACE_SCOPE("drmModeAtomicCommit modeset");
+    int ret = atomic_commit(atomic, req, DRM_MODE_ATOMIC_ALLOW_MODESET, NULL,
+            "modeset");
+    atomic_finish_fences(kms, ret);
+    drmModeAtomicFree(req);
+    return ret;
+}
+
+static int atomic_page_flip(struct kms_backend *kms, uint32_t fb_id,
+        void *user_data) {
+    struct atomic_backend *atomic = atomic_from_kms(kms);
+    // One commit in flight per CRTC, the kernel would say EBUSY
+    if (kms->flip_pending) {
+        atomic_finish_fences(kms, -EBUSY);
+        return -EBUSY;
+    }
+    drmModeAtomicReq *req = drmModeAtomicAlloc();
+    if (!req) {
+        fake_log(ERROR, "Allocation failed");
+        atomic_finish_fences(kms, -ENOMEM);
+        return -ENOMEM;
+    }
+    atomic_add_primary(atomic, req, fb_id);
+    atomic_add_fences(atomic, req);
+    // A composed frame covers whatever a client buffer showed
+    if (atomic->active_overlay) {
+        atomic_add_disable(req, atomic->active_overlay);
+    }
+    struct trace_scope scope = trace_scope_begin("drmModeAtomicCommit");
+    // Completes on the next vblank through the same page-flip event as the
+    // legacy path, with kms as its user data
+    int ret = atomic_commit(atomic, req,
+            DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, kms,
+            "flip");
+    trace_scope_end(&scope);
+    atomic_finish_fences(kms, ret);
+    drmModeAtomicFree(req);
+    if (ret) {
+        return ret;
+    }
+    atomic->active_overlay = NULL;
+    kms->pending_data = user_data;
+    kms->flip_pending = true;
+    return 0;
+}
+
+static bool plane_takes(const struct atomic_plane *plane, uint32_t format,
+        uint64_t modifier) {
+    // Implicit modifier: the format is all that can be checked, the
+    // TEST_ONLY commit has the final word
+    if (modifier == DRM_FORMAT_MOD_INVALID) {
+        return drm_format_set_get(&plane->formats, format) != NULL;
+    }
+    return drm_format_set_has(&plane->formats, format, modifier);
+}
+
+// A client buffer straight on a plane: the primary when it covers the mode,
+// else the first overlay whose IN_FORMATS has its format and modifier and
+// whose TEST_ONLY commit passes. Nothing is committed when no plane takes
+// it, the caller composes it instead.
+static int atomic_scanout(struct kms_backend *kms,
+        const struct kms_layer *layer, void *user_data) {
+    struct atomic_backend *atomic = atomic_from_kms(kms);
+    if (kms->flip_pending) {
+        atomic_finish_fences(kms, -EBUSY);
+        return -EBUSY;
+    }
+    uint32_t format = gbm_bo_get_format(layer->bo);
+    uint64_t modifier = gbm_bo_get_modifier(layer->bo);
+    bool fullscreen = layer->x == 0 && layer->y == 0 &&
+        layer->width == kms->mode.hdisplay &&
+        layer->height == kms->mode.vdisplay;
+
+    // Not kms_fb_from_bo(): the TEST_ONLY below is this buffer's check, the
+    // modeset test is left for when it gets flipped as a ring buffer
+    uint32_t fb_id = 0;
+    int ret = -EINVAL;
+    for (int i = fullscreen ? 0 : 1; i < atomic->plane_count; i++) {
+        struct atomic_plane *plane = &atomic->planes[i];
+        if (!plane_takes(plane, format, modifier)) {
+            atomic->scanout_format_misses++;
+            continue;
+        }
+        if (!fb_id) {
+            struct kms_fb *fb = fb_from_bo(kms, layer->bo);
+            if (!fb) {
+                atomic_finish_fences(kms, -EINVAL);
+                return -EINVAL;
+            }
+            fb_id = fb->fb_id;
+        }
+
+        drmModeAtomicReq *req = drmModeAtomicAlloc();
+        if (!req) {
+            fake_log(ERROR, "Allocation failed");
+            atomic_finish_fences(kms, -ENOMEM);
+            return -ENOMEM;
+        }
+        atomic_add_plane(atomic, req, plane, fb_id,
+                gbm_bo_get_width(layer->bo), gbm_bo_get_height(layer->bo),
+                layer->x, layer->y, layer->width, layer->height);
+        if (atomic->active_overlay && atomic->active_overlay != plane) {
+            atomic_add_disable(req, atomic->active_overlay);
+        }
+        // A rejected plane is no error, the next one may do
+        if (drmModeAtomicCommit(kms->fd, req, DRM_MODE_ATOMIC_TEST_ONLY,
+                    NULL)) {
+            atomic->test_failures++;
+            fake_log(DEBUG, "Plane %u rejected %.4s buffer: %s", plane->id,
+                    (const char *)&format, strerror(errno));
+            drmModeAtomicFree(req);
+            continue;
+        }
+        // The primary plane replaces the composed frame, which gets its
+        // release fence like on a flip. Overlays stay implicitly synced.
+        if (plane == &atomic->planes[0]) {
+            atomic_add_fences(atomic, req);
+        }
+        struct trace_scope scope =
+            trace_scope_begin("drmModeAtomicCommit scanout");
+        ret = atomic_commit(atomic, req,
+                DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, kms,
+                "scanout");
+        trace_scope_end(&scope);
+        atomic_finish_fences(kms, ret);
+        drmModeAtomicFree(req);
+        if (ret) {
+            return ret;
+        }
+        atomic->active_overlay = plane->type == DRM_PLANE_TYPE_OVERLAY ?
+            plane : NULL;
+        atomic->scanouts++;
+        kms->pending_data = user_data;
+        kms->flip_pending = true;
+        return 0;
+    }
+    atomic_finish_fences(kms, ret);
+    return ret;
+}
+
+static bool atomic_get_formats(struct kms_backend *kms,
+        struct drm_format_set *set) {
+    return plane_get_formats(kms->fd, atomic_from_kms(kms)->planes[0].id,
+            set);
+}
+
+static void atomic_destroy(struct kms_backend *kms) {
+    struct atomic_backend *atomic = atomic_from_kms(kms);
+    fake_log(DEBUG, "atomic CRTC %u: %lu commits, %lu direct scanouts, "
+            "%lu plane format misses, %lu rejected by TEST_ONLY",
+            kms->crtc_id, (unsigned long)atomic->commits,
+            (unsigned long)atomic->scanouts,
+            (unsigned long)atomic->scanout_format_misses,
+            (unsigned long)atomic->test_failures);
+    if (atomic->mode_blob_id) {
+        drmModeDestroyPropertyBlob(kms->fd, atomic->mode_blob_id);
+    }
+    if (kms->in_fence_fd >= 0) {
+        close(kms->in_fence_fd);
+    }
+    if (kms->out_fence_fd >= 0) {
+        close(kms->out_fence_fd);
+    }
+    for (int i = 0; i < atomic->plane_count; i++) {
+        drm_format_set_finish(&atomic->planes[i].formats);
+    }
+    free(atomic);
+}
+
+static const struct kms_backend_impl atomic_impl = {
+    .name = "atomic",
+    .add_fb = drm_add_fb,
+    .rm_fb = drm_rm_fb,
+    .set_crtc = atomic_set_crtc,
+    .page_flip = atomic_page_flip,
+    .get_event_fd = drm_get_event_fd,
+    .dispatch = drm_dispatch,
+    .destroy = atomic_destroy,
+    .get_formats = atomic_get_formats,
+    .scanout = atomic_scanout,
+    .test_fb = atomic_test_fb,
+};
+
+static bool atomic_plane_init(struct atomic_backend *atomic,
+        struct atomic_plane *plane, uint32_t plane_id, uint64_t type) {
+    int fd = atomic->base.fd;
+    plane->id = plane_id;
+    plane->type = type;
+    return get_prop_ids(fd, plane_id, DRM_MODE_OBJECT_PLANE,
+            plane_prop_names, plane->props, PLANE_PROP_COUNT) &&
+        plane_get_formats(fd, plane_id, &plane->formats);
+}
+
+struct kms_backend *kms_backend_create_atomic(int fd, uint32_t crtc_id,
+        uint32_t connector_id, const drmModeModeInfo *mode) {
+    // Implies universal planes
+    if (drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
+        fake_log(INFO, "DRM_CLIENT_CAP_ATOMIC unsupported");
+        return NULL;
+    }
+    struct atomic_backend *atomic = calloc(1, sizeof(*atomic));
+    if (!atomic) {
+        fake_log(ERROR, "Allocation failed");
+        return NULL;
+    }
+    atomic->base.impl = &atomic_impl;
+    atomic->base.fd = fd;
+    atomic->base.crtc_id = crtc_id;
+    atomic->base.connector_id = connector_id;
+    atomic->base.mode = *mode;
+    atomic->base.in_fence_fd = -1;
+    atomic->base.out_fence_fd = -1;
+
+    uint32_t plane_ids[ATOMIC_MAX_PLANES];
+    if (!find_planes(fd, crtc_id, DRM_PLANE_TYPE_PRIMARY, plane_ids, 1)) {
+        fake_log(ERROR, "No primary plane for CRTC %u", crtc_id);
+        goto error;
+    }
+    int overlays = find_planes(fd, crtc_id, DRM_PLANE_TYPE_OVERLAY,
+            plane_ids + 1, ATOMIC_MAX_PLANES - 1);
+    for (int i = 0; i <= overlays; i++) {
+        struct atomic_plane *plane = &atomic->planes[atomic->plane_count++];
+        if (!atomic_plane_init(atomic, plane, plane_ids[i], i == 0 ?
+                    DRM_PLANE_TYPE_PRIMARY : DRM_PLANE_TYPE_OVERLAY)) {
+            goto error;
+        }
+    }
+    if (!get_prop_ids(fd, connector_id, DRM_MODE_OBJECT_CONNECTOR,
+                connector_prop_names, atomic->connector_props,
+                CONNECTOR_PROP_COUNT) ||
+            !get_prop_ids(fd, crtc_id, DRM_MODE_OBJECT_CRTC,
+                crtc_prop_names, atomic->crtc_props, CRTC_PROP_COUNT)) {
+        goto error;
+    }
+    if (drmModeCreatePropertyBlob(fd, mode, sizeof(*mode),
+                &atomic->mode_blob_id)) {
+        fake_log_errno(ERROR, "drmModeCreatePropertyBlob failed");
+        goto error;
+    }
+    atomic->in_fence_prop = get_prop_id(fd, atomic->planes[0].id,
+            DRM_MODE_OBJECT_PLANE, "IN_FENCE_FD");
+    atomic->out_fence_prop = get_prop_id(fd, crtc_id, DRM_MODE_OBJECT_CRTC,
+            "OUT_FENCE_PTR");
+    atomic->base.explicit_sync = atomic->in_fence_prop &&
+        atomic->out_fence_prop;
+    fake_log(INFO, "Atomic KMS on CRTC %u, primary plane %u, %d overlays, "
+            "explicit sync %s", crtc_id, atomic->planes[0].id, overlays,
+            atomic->base.explicit_sync ? "yes" : "no");
+    return &atomic->base;
+
+error:
+    atomic_destroy(&atomic->base);
+    return NULL;
+}
+
+// Mock backend
+
+struct mock_backend {
+    struct kms_backend base;
+    int timer_fd;
+    uint32_t next_fb_id;
+    unsigned int sequence;
+    // Time of the last simulated vblank
+    struct timespec last_vblank;
+};
+
+static struct mock_backend *mock_from_kms(struct kms_backend *kms) {
+    return (struct mock_backend *)kms;
+}
+
+static int mock_add_fb(struct kms_backend *kms, struct gbm_bo *bo,
+        uint32_t *fb_id) {
+    *fb_id = ++mock_from_kms(kms)->next_fb_id;
+    return 0;
+}
+
+static void mock_rm_fb(struct kms_backend *kms, uint32_t fb_id) {
+}
+
+static int mock_set_crtc(struct kms_backend *kms, uint32_t fb_id) {
+    struct mock_backend *mock = mock_from_kms(kms);
+    clock_gettime(CLOCK_MONOTONIC, &mock->last_vblank);
+    return 0;
+}
+
+static int mock_page_flip(struct kms_backend *kms, uint32_t fb_id,
+        void *user_data) {
+    struct mock_backend *mock = mock_from_kms(kms);
+    if (kms->flip_pending) {
+        return -EBUSY;
+    }
+
+    // Latch on the first vblank after now, like a real CRTC would
+    int64_t period = kms_refresh_nsec(kms);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t last = mock->last_vblank.tv_sec * NSEC_PER_SEC +
+        mock->last_vblank.tv_nsec;
+    int64_t elapsed = now.tv_sec * NSEC_PER_SEC + now.tv_nsec - last;
+    int64_t next = last + (elapsed / period + 1) * period;
+
+    struct itimerspec its = {
+        .it_value = {
+            .tv_sec = next / NSEC_PER_SEC,
+            .tv_nsec = next % NSEC_PER_SEC,
+        },
+    };
+    if (timerfd_settime(mock->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        fake_log_errno(ERROR, "timerfd_settime failed");
+        return -errno;
+    }
+    kms->pending_data = user_data;
+    kms->flip_pending = true;
+    return 0;
+}
+
+static int mock_get_event_fd(struct kms_backend *kms) {
+    return mock_from_kms(kms)->timer_fd;
+}
+
+static int mock_dispatch(struct kms_backend *kms) {
+    struct mock_backend *mock = mock_from_kms(kms);
+    uint64_t expirations;
+    if (read(mock->timer_fd, &expirations, sizeof(expirations)) < 0) {
+        if (errno == EAGAIN) {
+            return 0;
+        }
+        fake_log_errno(ERROR, "read on mock timerfd failed");
+        return -1;
+    }
+    if (!kms->flip_pending) {
+        return 0;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t period = kms_refresh_nsec(kms);
+    int64_t last = mock->last_vblank.tv_sec * NSEC_PER_SEC +
+        mock->last_vblank.tv_nsec;
+    int64_t elapsed = now.tv_sec * NSEC_PER_SEC + now.tv_nsec - last;
+    int64_t vblanks = elapsed / period;
+    if (vblanks < 1) {
+        vblanks = 1;
+    }
+    int64_t vblank = last + vblanks * period;
+    mock->last_vblank.tv_sec = vblank / NSEC_PER_SEC;
+    mock->last_vblank.tv_nsec = vblank % NSEC_PER_SEC;
+    mock->sequence += vblanks;
+
+    void *user_data = kms->pending_data;
+    kms->pending_data = NULL;
+    kms->flip_pending = false;
+    if (kms->flip_handler) {
+        kms->flip_handler(mock->sequence, mock->last_vblank.tv_sec,
+                mock->last_vblank.tv_nsec / 1000, user_data);
+    }
+    return 0;
+}
+
+static void mock_destroy(struct kms_backend *kms) {
+    struct mock_backend *mock = mock_from_kms(kms);
+    close(mock->timer_fd);
+    free(mock);
+}
+
+static const struct kms_backend_impl mock_impl = {
+    .name = "mock",
+    .add_fb = mock_add_fb,
+    .rm_fb = mock_rm_fb,
+    .set_crtc = mock_set_crtc,
+    .page_flip = mock_page_flip,
+    .get_event_fd = mock_get_event_fd,
+    .dispatch = mock_dispatch,
+    .destroy = mock_destroy,
+};
+
+struct kms_backend *kms_backend_create_mock(int fd,
+        const drmModeModeInfo *mode) {
+    struct mock_backend *mock = calloc(1, sizeof(*mock));
+    if (!mock) {
+        fake_log(ERROR, "Allocation failed");
+        return NULL;
+    }
+    mock->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+            TFD_CLOEXEC | TFD_NONBLOCK);
+    if (mock->timer_fd < 0) {
+        fake_log_errno(ERROR, "timerfd_create failed");
+        free(mock);
+        return NULL;
+    }
+    mock->base.impl = &mock_impl;
+    mock->base.fd = fd;
+    mock->base.mode = *mode;
+    mock->base.in_fence_fd = -1;
+    mock->base.out_fence_fd = -1;
+    clock_gettime(CLOCK_MONOTONIC, &mock->last_vblank);
+    return &mock->base;
+}
@@ -0,0 +1,168 @@
+#ifndef FAKE_CHEN_KMS_H
+#define FAKE_CHEN_KMS_H
+#include "egl_gbm.h"
+#include <gbm.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <xf86drmMode.h>
+
+struct kms_backend;
+
+/** A client buffer shown whole, scaled to a rectangle in CRTC pixels. */
+struct kms_layer {
+    struct gbm_bo *bo;
+    int32_t x, y;
+    uint32_t width, height;
+};
+
+/**
+ * Called once per completed flip, with the vblank sequence and timestamp of
+ * the vblank the new framebuffer was latched on.
+ */
+typedef void (*kms_flip_handler_t)(unsigned int sequence, unsigned int tv_sec,
+        unsigned int tv_usec, void *user_data);
+
+struct kms_backend_impl {
+    const char *name;
+    int (*add_fb)(struct kms_backend *kms, struct gbm_bo *bo, uint32_t *fb_id);
+    void (*rm_fb)(struct kms_backend *kms, uint32_t fb_id);
+    // Full modeset, only used for the first frame
+    int (*set_crtc)(struct kms_backend *kms, uint32_t fb_id);
+    // Queue a flip to fb_id on the next vblank, user_data comes back through
+    // the flip handler
+    int (*page_flip)(struct kms_backend *kms, uint32_t fb_id, void *user_data);
+    // Pollable fd, readable when dispatch() has events to deliver
+    int (*get_event_fd)(struct kms_backend *kms);
+    int (*dispatch)(struct kms_backend *kms);
+    void (*destroy)(struct kms_backend *kms);
+    // Formats and modifiers of the primary plane, optional
+    bool (*get_formats)(struct kms_backend *kms, struct drm_format_set *set);
+    // Put a client buffer on a plane for the next vblank, completing like
+    // page_flip. Fails without touching the display when no plane takes it.
+    // Optional.
+    int (*scanout)(struct kms_backend *kms, const struct kms_layer *layer,
+            void *user_data);
+    // Check that fb_id can be the primary plane of the mode, run once per
+    // framebuffer before kms_fb_from_bo() hands it out. Optional.
+    int (*test_fb)(struct kms_backend *kms, uint32_t fb_id);
+};
+
+struct kms_backend {
+    const struct kms_backend_impl *impl;
+    int fd;
+    uint32_t crtc_id;
+    uint32_t connector_id;
+    drmModeModeInfo mode;
+
+    // Framebuffer cache, see kms_fb_from_bo()
+    uint64_t fb_cache_hits;
+    uint64_t fb_cache_misses;
+
+    kms_flip_handler_t flip_handler;
+    // user_data of the flip currently queued, NULL if none
+    void *pending_data;
+    bool flip_pending;
+
+    // Explicit sync, only when the backend sets explicit_sync. The next
+    // set_crtc, page_flip or scanout takes in_fence_fd, a sync_file the display
+    // waits on before reading the new framebuffer, and closes it either
+    // way. When it succeeds, out_fence_fd is a sync_file signalled once the
+    // framebuffer it replaced is no longer read, for the caller to take
+    // and reset to -1. Both -1 when unused.
+    bool explicit_sync;
+    int in_fence_fd;
+    int out_fence_fd;
+};
+
+/** Drives a real DRM device (any KMS driver, vkms included). */
+struct kms_backend *kms_backend_create_drm(int fd, uint32_t crtc_id,
+        uint32_t connector_id, const drmModeModeInfo *mode);
+/**
+ * Same through atomic commits: every framebuffer is validated with a
+ * TEST_ONLY modeset before kms_fb_from_bo() first returns it, also one a
+ * scanout created, and flips are nonblocking commits completing
+ * through page-flip events. Has explicit sync when the primary plane has
+ * IN_FENCE_FD and the CRTC OUT_FENCE_PTR. NULL when the driver has no
+ * atomic support or lacks a property, callers then fall back to
+ * kms_backend_create_drm().
+ */
+struct kms_backend *kms_backend_create_atomic(int fd, uint32_t crtc_id,
+        uint32_t connector_id, const drmModeModeInfo *mode);
+/**
+ * No display at all: framebuffers are never created and flips complete on a
+ * timerfd ticking at the mode refresh rate. fd is only used for GBM.
+ */
+struct kms_backend *kms_backend_create_mock(int fd,
+        const drmModeModeInfo *mode);
+void kms_backend_destroy(struct kms_backend *kms);
+
+/**
+ * Framebuffer ID of a buffer object, created on first use and attached to the
+ * bo, so a buffer is only added once no matter how often it is presented.
+ * The framebuffer is removed when the bo is destroyed, which must happen
+ * before the backend is destroyed. Returns 0 on failure.
+ */
+uint32_t kms_fb_from_bo(struct kms_backend *kms, struct gbm_bo *bo);
+
+/** Fill a mode of the given size and rate, for backends without a connector. */
+void kms_mock_mode(drmModeModeInfo *mode, uint16_t width, uint16_t height,
+        uint32_t refresh_hz);
+
+#define KMS_MAX_OUTPUTS 8
+
+/** A connector to drive, with the CRTC it got and the mode to set. */
+struct kms_output_config {
+    uint32_t connector_id;
+    uint32_t crtc_id;
+    drmModeModeInfo mode;
+    // e.g. "HDMI-A-1", for logs
+    char name[32];
+};
+
+/**
+ * Find every connected connector, at most max, and give each a CRTC of its
+ * own through the possible_crtcs of its encoders, keeping the CRTC already
+ * driving it where possible. Connectors left without a CRTC are logged and
+ * skipped. Each gets its preferred mode. Returns the number of outputs.
+ */
+int kms_find_outputs(int fd, struct kms_output_config *outputs, int max);
+
+/**
+ * Add the formats and modifiers the primary plane of the CRTC can scan out
+ * to set. Returns false when the backend has no such restriction.
+ */
+bool kms_get_formats(struct kms_backend *kms, struct drm_format_set *set);
+
+/**
+ * Show layer without composing it: on the primary plane when it covers the
+ * mode, else on an overlay above the last flipped frame, which the next
+ * page_flip hides again. Planes are picked by their IN_FORMATS and a
+ * TEST_ONLY commit. Returns 0 with a flip queued, or a negative errno with
+ * nothing changed, -ENOTSUP when the backend cannot scan out client
+ * buffers. The caller then composes the buffer.
+ */
+int kms_scanout(struct kms_backend *kms, const struct kms_layer *layer,
+        void *user_data);
+
+/** Block until at least one event was dispatched. Returns false on error. */
+bool kms_wait_event(struct kms_backend *kms, int timeout_ms);
+/**
+ * Same over several backends, dispatching every one whose event fd is
+ * readable. Backends sharing a DRM fd are dispatched once, the kernel
+ * routes each flip event to its own backend.
+ */
+bool kms_wait_events(struct kms_backend **backends, int count,
+        int timeout_ms);
+/**
+ * Same but a timeout is no error, and the fds in wait_fds (up to
+ * KMS_MAX_OUTPUTS) end the wait too when readable, left to the caller.
+ * Returns the number of fds ready, 0 on timeout and -1 on error. A
+ * negative timeout_ns waits forever.
+ */
+int kms_poll_events(struct kms_backend **backends, int count,
+        const int *wait_fds, int wait_count, int64_t timeout_ns);
+
+/** Refresh period of the backend mode, in nanoseconds. */
+int64_t kms_refresh_nsec(const struct kms_backend *kms);
+
+#endif
@@ -1,16 +1,28 @@
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
-#include "log.h" 
+#include "log.h"
 
 static const long NSEC_PER_SEC = 1000000000;
 static struct timespec start_time = {-1};
 static enum log_importance log_importance = ERROR;
 static bool colored = true;
+// isatty() once, not twice per message
+static bool use_colors = false;
 static const char *verbosity_colors[] = {
 	[SILENT] = "",
 	[ERROR] = "\x1B[1;31m",
@@ -24,11 +36,61 @@ static const char *verbosity_headers[] = {
 	[DEBUG] = "[DEBUG]",
 };
 
+// Async mode: a bounded MPSC ring of formatted lines. Each slot carries a
+// sequence number, slot i is free for position pos when seq == pos and
+// holds a line when seq == pos + 1.
+#define LOG_RING_SIZE 4096
+#define LOG_LINE_SIZE 256
+#define LOG_BATCH 64
+// Queued lines at which a producer wakes a sleeping writer, a quarter of
+// the ring leaves room for the burst to go on while it gets scheduled
+#define LOG_WAKE_WATERMARK (LOG_RING_SIZE / 4)
+
+// The caller only formats the message itself, the writer adds the
+// timestamp and level around it. Binary records are complete in text and
+// go to binary_fd instead.
+struct log_record {
+	_Atomic size_t seq;
+	bool binary;
+	struct timespec ts;
+	enum log_importance verbosity;
+	size_t len;
+	// Messages longer than text, freed by the writer
+	char *heap;
+	char text[LOG_LINE_SIZE];
+};
+
+static struct {
+	struct log_record records[LOG_RING_SIZE];
+	_Atomic size_t tail;
+	// Only touched by the writer thread
+	size_t head;
+	// head as of the last batch written, for producers to see the fill
+	_Atomic size_t drained;
+	// Set while the writer waits on wake_fd, cleared by whoever wakes it
+	atomic_bool sleeping;
+	int wake_fd;
+	_Atomic uint64_t dropped;
+	// Everything dropped since the first start, for log_async_dropped()
+	_Atomic uint64_t dropped_total;
+	atomic_bool stop;
+	pthread_t writer;
+	atomic_bool running;
+} ring;
+
+bool log_binary_enabled = false;
+static int binary_fd = -1;
+
+// Every fake_log() call site, placed there by the linker
+extern struct log_site __start_log_sites[] __attribute__((weak));
+extern struct log_site __stop_log_sites[] __attribute__((weak));
+
 static void init_start_time(void) {
 	if (start_time.tv_sec >= 0) {
 		return;
 	}
 	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	use_colors = colored && isatty(STDERR_FILENO);
 }
 
 void timespec_sub(struct timespec *r, const struct timespec *a,
@@ -41,36 +103,277 @@ void timespec_sub(struct timespec *r, const struct timespec *a,
 	}
 }
 
-static void log_stderr(enum log_importance verbosity, const char *fmt,
+// Timestamp and level, ts is since start_time
+static size_t format_header(char *buf, size_t size,
+		enum log_importance verbosity, const struct timespec *ts) {
+	unsigned c = (verbosity < LOG_IMPORTANCE_LAST) ? verbosity : LOG_IMPORTANCE_LAST - 1;
+
+	return snprintf(buf, size, "%02d:%02d:%02d.%03ld %s%s",
+		(int)(ts->tv_sec / 60 / 60), (int)(ts->tv_sec / 60 % 60),
+		(int)(ts->tv_sec % 60), ts->tv_nsec / 1000000,
+		use_colors ? verbosity_colors[c] : verbosity_headers[c],
+		use_colors ? "" : " ");
+}
+
+static const char *line_end(void) {
+	return use_colors ? "\x1B[0m\n" : "\n";
+}
+
+static void get_log_time(struct timespec *ts) {
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	timespec_sub(ts, ts, &start_time);
+}
+
+static void write_all(const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(STDERR_FILENO, buf, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+static struct log_record *ring_try_claim(size_t *pos_out) {
+	size_t pos = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+	for (;;) {
+		struct log_record *rec = &ring.records[pos % LOG_RING_SIZE];
+		size_t seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&ring.tail, &pos,
+					pos + 1, memory_order_relaxed,
+					memory_order_relaxed)) {
+				*pos_out = pos;
+				return rec;
+			}
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+		}
+	}
+}
+
+static void ring_wake_writer(void) {
+	if (atomic_exchange_explicit(&ring.sleeping, false,
+			memory_order_acq_rel)) {
+		uint64_t one = 1;
+		while (write(ring.wake_fd, &one, sizeof(one)) < 0 &&
+				errno == EINTR) {
+		}
+	}
+}
+
+// Errors wait for room, anything else is only counted. NULL for an error
+// too once the writer is stopped, nothing would make room any more.
+static struct log_record *ring_claim(enum log_importance verbosity,
+		size_t *pos) {
+	struct log_record *rec;
+	while (!(rec = ring_try_claim(pos))) {
+		if (verbosity > ERROR) {
+			atomic_fetch_add_explicit(&ring.dropped, 1,
+				memory_order_relaxed);
+			atomic_fetch_add_explicit(&ring.dropped_total, 1,
+				memory_order_relaxed);
+			return NULL;
+		}
+		if (!atomic_load_explicit(&ring.running, memory_order_acquire)) {
+			return NULL;
+		}
+		ring_wake_writer();
+		sched_yield();
+	}
+	return rec;
+}
+
+// Errors wake the writer right away, other lines once enough queued up
+static void ring_publish(struct log_record *rec, size_t pos,
+		enum log_importance verbosity) {
+	atomic_store_explicit(&rec->seq, pos + 1, memory_order_release);
+	size_t drained = atomic_load_explicit(&ring.drained,
+		memory_order_relaxed);
+	if (verbosity <= ERROR || pos + 1 - drained >= LOG_WAKE_WATERMARK) {
+		ring_wake_writer();
+	}
+}
+
+// False when the line did not go in and should be written synchronously
+static bool ring_push(enum log_importance verbosity, const char *fmt,
 		va_list args) {
-	init_start_time();
+	size_t pos;
+	struct log_record *rec = ring_claim(verbosity, &pos);
+	if (!rec) {
+		return verbosity > ERROR;
+	}
 
-	if (verbosity > log_importance) {
-		return;
+	rec->binary = false;
+	get_log_time(&rec->ts);
+	rec->verbosity = verbosity;
+	rec->heap = NULL;
+	va_list copy;
+	va_copy(copy, args);
+	int n = vsnprintf(rec->text, sizeof(rec->text), fmt, args);
+	rec->len = n > 0 ? n : 0;
+	if (rec->len >= sizeof(rec->text)) {
+		// Startup dumps extension lists, worth a malloc to keep them whole
+		rec->heap = malloc(rec->len + 1);
+		if (rec->heap) {
+			vsnprintf(rec->heap, rec->len + 1, fmt, copy);
+		} else {
+			rec->len = sizeof(rec->text) - 1;
+		}
 	}
+	va_end(copy);
+	ring_publish(rec, pos, verbosity);
+	return true;
+}
 
-	struct timespec ts = {0};
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	timespec_sub(&ts, &ts, &start_time);
+// Write every line published so far, in batches. Returns false when the
+// ring was empty.
+static bool ring_drain(void) {
+	// Header, message and line end of each record
+	struct iovec iov[LOG_BATCH * 3];
+	char headers[LOG_BATCH][48];
+	struct iovec binary_iov[LOG_BATCH];
+	const char *end = line_end();
+	bool wrote = false;
+	for (;;) {
+		int count = 0, binary_count = 0;
+		size_t head = ring.head;
+		while (count + binary_count < LOG_BATCH) {
+			struct log_record *rec = &ring.records[head % LOG_RING_SIZE];
+			if (atomic_load_explicit(&rec->seq, memory_order_acquire) !=
+					head + 1) {
+				break;
+			}
+			head++;
+			if (rec->binary) {
+				binary_iov[binary_count].iov_base = rec->text;
+				binary_iov[binary_count].iov_len = rec->len;
+				binary_count++;
+				continue;
+			}
+			struct iovec *v = &iov[count * 3];
+			v[0].iov_base = headers[count];
+			v[0].iov_len = format_header(headers[count],
+				sizeof(headers[count]), rec->verbosity, &rec->ts);
+			v[1].iov_base = rec->heap ? rec->heap : rec->text;
+			v[1].iov_len = rec->len;
+			v[2].iov_base = (void *)end;
+			v[2].iov_len = strlen(end);
+			count++;
+		}
+		if (head == ring.head) {
+			break;
+		}
+		// A short write only loses the rest of this batch
+		while (count && writev(STDERR_FILENO, iov, count * 3) < 0 &&
+				errno == EINTR) {
+		}
+		while (binary_count && writev(binary_fd, binary_iov,
+				binary_count) < 0 && errno == EINTR) {
+		}
+		for (; ring.head != head; ring.head++) {
+			struct log_record *rec = &ring.records[ring.head % LOG_RING_SIZE];
+			free(rec->heap);
+			rec->heap = NULL;
+			atomic_store_explicit(&rec->seq, ring.head + LOG_RING_SIZE,
+				memory_order_release);
+		}
+		atomic_store_explicit(&ring.drained, ring.head,
+			memory_order_relaxed);
+		wrote = true;
+	}
 
-	fprintf(stderr, "%02d:%02d:%02d.%03ld ", (int)(ts.tv_sec / 60 / 60),
-		(int)(ts.tv_sec / 60 % 60), (int)(ts.tv_sec % 60),
-		ts.tv_nsec / 1000000);
+	uint64_t dropped = atomic_exchange_explicit(&ring.dropped, 0,
+		memory_order_relaxed);
+	if (dropped) {
+		char line[64];
+		int n = snprintf(line, sizeof(line), "[log] %lu messages dropped\n",
+			(unsigned long)dropped);
+		write_all(line, n);
+	}
+	return wrote;
+}
 
-	unsigned c = (verbosity < LOG_IMPORTANCE_LAST) ? verbosity : LOG_IMPORTANCE_LAST - 1;
+// Lines under the watermark still go out after at most this long
+static const int LOG_FLUSH_MSEC = 10;
 
-	if (colored && isatty(STDERR_FILENO)) {
-		fprintf(stderr, "%s", verbosity_colors[c]);
-	} else {
-		fprintf(stderr, "%s ", verbosity_headers[c]);
+static bool ring_empty(void) {
+	struct log_record *rec = &ring.records[ring.head % LOG_RING_SIZE];
+	return atomic_load_explicit(&rec->seq, memory_order_acquire) !=
+		ring.head + 1;
+}
+
+// Sleeps on wake_fd between drains, producers write it at the watermark,
+// on errors and while waiting for room
+static void *log_writer_thread(void *data) {
+	while (!atomic_load_explicit(&ring.stop, memory_order_acquire)) {
+		if (ring_drain()) {
+			continue;
+		}
+		atomic_store_explicit(&ring.sleeping, true, memory_order_seq_cst);
+		// A line published before sleeping was set woke nobody
+		if (ring_empty() &&
+				!atomic_load_explicit(&ring.stop, memory_order_acquire)) {
+			struct pollfd pfd = { .fd = ring.wake_fd, .events = POLLIN };
+			poll(&pfd, 1, LOG_FLUSH_MSEC);
+		}
+		atomic_store_explicit(&ring.sleeping, false, memory_order_relaxed);
+		uint64_t count;
+		while (read(ring.wake_fd, &count, sizeof(count)) < 0 &&
+				errno == EINTR) {
+		}
 	}
+	ring_drain();
+	return NULL;
+}
 
-	vfprintf(stderr, fmt, args);
+static void log_stderr(enum log_importance verbosity, const char *fmt,
+		va_list args) {
+	init_start_time();
 
-	if (colored && isatty(STDERR_FILENO)) {
-		fprintf(stderr, "\x1B[0m");
+	if (verbosity > log_importance) {
+		return;
+	}
+
+	if (atomic_load_explicit(&ring.running, memory_order_relaxed) &&
+			ring_push(verbosity, fmt, args)) {
+		return;
 	}
-	fprintf(stderr, "\n");
+
+	// One write per line instead of a handful of unbuffered fprintf()
+	struct timespec ts;
+	get_log_time(&ts);
+	char header[48], line[1024];
+	va_list copy;
+	va_copy(copy, args);
+	int n = vsnprintf(line, sizeof(line), fmt, args);
+	size_t len = n > 0 ? n : 0;
+	char *heap = NULL;
+	if (len >= sizeof(line)) {
+		heap = malloc(len + 1);
+		if (heap) {
+			vsnprintf(heap, len + 1, fmt, copy);
+		} else {
+			len = sizeof(line) - 1;
+		}
+	}
+	va_end(copy);
+	const char *end = line_end();
+	struct iovec iov[3] = {
+		{ header, format_header(header, sizeof(header), verbosity, &ts) },
+		{ heap ? heap : line, len },
+		{ (void *)end, strlen(end) },
+	};
+	while (writev(STDERR_FILENO, iov, 3) < 0 && errno == EINTR) {
+	}
+	free(heap);
 }
 
 static log_func_t log_callback = log_stderr;
@@ -104,3 +407,377 @@ void log_init(enum log_importance verbosity, log_func_t callback) {
 
 }
 
+bool log_start_async(void) {
+	if (atomic_load(&ring.running)) {
+		return true;
+	}
+	init_start_time();
+	for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+		atomic_init(&ring.records[i].seq, i);
+	}
+	atomic_init(&ring.tail, 0);
+	ring.head = 0;
+	atomic_init(&ring.drained, 0);
+	atomic_init(&ring.sleeping, false);
+	atomic_init(&ring.stop, false);
+	ring.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (ring.wake_fd < 0) {
+		return false;
+	}
+	if (pthread_create(&ring.writer, NULL, log_writer_thread, NULL)) {
+		close(ring.wake_fd);
+		return false;
+	}
+	atomic_store(&ring.running, true);
+	atexit(log_stop_async);
+	return true;
+}
+
+void log_stop_async(void) {
+	if (!atomic_load(&ring.running)) {
+		return;
+	}
+	// New messages go straight out, the writer drains what is queued
+	log_binary_enabled = false;
+	atomic_store(&ring.running, false);
+	atomic_store_explicit(&ring.stop, true, memory_order_release);
+	ring_wake_writer();
+	pthread_join(ring.writer, NULL);
+	close(ring.wake_fd);
+	ring.wake_fd = -1;
+	if (binary_fd >= 0) {
+		close(binary_fd);
+		binary_fd = -1;
+	}
+}
+
+uint64_t log_async_dropped(void) {
+	return atomic_load(&ring.dropped_total);
+}
+
+const char *log_next_conversion(const char *fmt, const char **start,
+		uint8_t types[3], int *count) {
+	*count = 0;
+	const char *p = strchr(fmt, '%');
+	if (!p) {
+		return NULL;
+	}
+	*start = p++;
+	if (*p == '%') {
+		return p + 1;
+	}
+	while (*p && strchr("-+ #0'", *p)) {
+		p++;
+	}
+	for (int field = 0; field < 2; field++) {
+		if (field == 1) {
+			if (*p != '.') {
+				break;
+			}
+			p++;
+		}
+		if (*p == '*') {
+			types[(*count)++] = LOG_ARG_INT;
+			p++;
+		}
+		while (isdigit((unsigned char)*p)) {
+			p++;
+		}
+	}
+
+	enum log_arg_type int_type = LOG_ARG_INT;
+	bool long_double = false, wide = false;
+	switch (*p) {
+	case 'h':
+		p += p[1] == 'h' ? 2 : 1;
+		break;
+	case 'l':
+		wide = p[1] != 'l';
+		int_type = p[1] == 'l' ? LOG_ARG_LLONG : LOG_ARG_LONG;
+		p += p[1] == 'l' ? 2 : 1;
+		break;
+	case 'q':
+		int_type = LOG_ARG_LLONG;
+		p++;
+		break;
+	case 'L':
+		long_double = true;
+		p++;
+		break;
+	case 'j':
+		int_type = LOG_ARG_INTMAX;
+		p++;
+		break;
+	case 'z':
+		int_type = LOG_ARG_SIZE;
+		p++;
+		break;
+	case 't':
+		int_type = LOG_ARG_PTRDIFF;
+		p++;
+		break;
+	}
+
+	switch (*p) {
+	case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+		types[(*count)++] = int_type;
+		break;
+	case 'c':
+		if (wide) {
+			*count = -1;
+		} else {
+			types[(*count)++] = LOG_ARG_INT;
+		}
+		break;
+	case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a':
+	case 'A':
+		types[(*count)++] = long_double ? LOG_ARG_LDOUBLE : LOG_ARG_DOUBLE;
+		break;
+	case 's':
+		if (wide) {
+			*count = -1;
+		} else {
+			types[(*count)++] = LOG_ARG_STRING;
+		}
+		break;
+	case 'p':
+		types[(*count)++] = LOG_ARG_POINTER;
+		break;
+	default:
+		*count = -1;
+		return *p ? p + 1 : p;
+	}
+	return p + 1;
+}
+
+enum {
+	SITE_UNPARSED,
+	SITE_READY,
+	// Formatted in place and recorded as one string
+	SITE_TEXT,
+	// Another thread is filling in the types
+	SITE_PARSING,
+};
+
+static int parse_site(const char *format, uint8_t *types, int *nargs) {
+	*nargs = 0;
+	const char *p = format, *start;
+	uint8_t conv[3];
+	int count;
+	while ((p = log_next_conversion(p, &start, conv, &count))) {
+		if (count < 0 || *nargs + count > LOG_SITE_MAX_ARGS) {
+			return SITE_TEXT;
+		}
+		memcpy(types + *nargs, conv, count);
+		*nargs += count;
+	}
+	return SITE_READY;
+}
+
+static size_t put(char *buf, size_t pos, size_t size, const void *data,
+		size_t len) {
+	if (pos + len > size) {
+		return size + 1;
+	}
+	memcpy(buf + pos, data, len);
+	return pos + len;
+}
+
+// Strings are cut to what is left of the slot once reserve bytes are kept
+// for the arguments after them
+static size_t put_string(char *buf, size_t pos, size_t size,
+		const char *str, size_t reserve) {
+	size_t len = str ? strlen(str) : 6;
+	if (pos + 2 + len + reserve > size) {
+		len = pos + 2 + reserve < size ? size - pos - 2 - reserve : 0;
+	}
+	uint16_t len16 = len;
+	pos = put(buf, pos, size, &len16, sizeof(len16));
+	return put(buf, pos, size, str ? str : "(null)", len);
+}
+
+// Encoded size of types, strings counted as empty
+static size_t min_args_size(const uint8_t *types, int nargs) {
+	size_t size = 0;
+	for (int i = 0; i < nargs; i++) {
+		size += types[i] == LOG_ARG_INT ? sizeof(int32_t) :
+			types[i] == LOG_ARG_STRING ? sizeof(uint16_t) : sizeof(int64_t);
+	}
+	return size;
+}
+
+static size_t encode_args(char *buf, size_t pos, size_t size,
+		const uint8_t *types, int nargs, va_list args) {
+	for (int i = 0; i < nargs; i++) {
+		int32_t i32;
+		int64_t i64;
+		double d;
+		switch (types[i]) {
+		case LOG_ARG_INT:
+			i32 = va_arg(args, int);
+			pos = put(buf, pos, size, &i32, sizeof(i32));
+			continue;
+		case LOG_ARG_LONG:
+			i64 = va_arg(args, long);
+			break;
+		case LOG_ARG_LLONG:
+			i64 = va_arg(args, long long);
+			break;
+		case LOG_ARG_SIZE:
+			i64 = va_arg(args, size_t);
+			break;
+		case LOG_ARG_INTMAX:
+			i64 = va_arg(args, intmax_t);
+			break;
+		case LOG_ARG_PTRDIFF:
+			i64 = va_arg(args, ptrdiff_t);
+			break;
+		case LOG_ARG_POINTER:
+			i64 = (uintptr_t)va_arg(args, void *);
+			break;
+		case LOG_ARG_DOUBLE:
+			d = va_arg(args, double);
+			pos = put(buf, pos, size, &d, sizeof(d));
+			continue;
+		case LOG_ARG_LDOUBLE:
+			d = va_arg(args, long double);
+			pos = put(buf, pos, size, &d, sizeof(d));
+			continue;
+		case LOG_ARG_STRING:
+			pos = put_string(buf, pos, size, va_arg(args, const char *),
+				min_args_size(types + i + 1, nargs - i - 1));
+			continue;
+		default:
+			// parse_site() only records the types above
+			continue;
+		}
+		pos = put(buf, pos, size, &i64, sizeof(i64));
+	}
+	return pos;
+}
+
+void _log_binary(struct log_site *site, ...) {
+	init_start_time();
+	if (site->level > log_importance) {
+		return;
+	}
+
+	int state = __atomic_load_n(&site->state, __ATOMIC_ACQUIRE);
+	uint8_t types[LOG_SITE_MAX_ARGS];
+	int nargs = 0;
+	if (state == SITE_UNPARSED || state == SITE_PARSING) {
+		// Racing threads parse the same thing, only one publishes it
+		state = parse_site(site->format, types, &nargs);
+		int expected = SITE_UNPARSED;
+		if (__atomic_compare_exchange_n(&site->state, &expected,
+				SITE_PARSING, false, __ATOMIC_ACQUIRE,
+				__ATOMIC_RELAXED)) {
+			memcpy(site->types, types, nargs);
+			site->nargs = nargs;
+			__atomic_store_n(&site->state, state, __ATOMIC_RELEASE);
+		}
+	} else {
+		nargs = site->nargs;
+		memcpy(types, site->types, nargs);
+	}
+
+	size_t pos;
+	struct log_record *rec = ring_claim(site->level, &pos);
+	if (!rec) {
+		if (site->level <= ERROR) {
+			// The writer is gone, still get the error out as text
+			char text[LOG_LINE_SIZE];
+			va_list args;
+			va_start(args, site);
+			vsnprintf(text, sizeof(text), site->format, args);
+			va_end(args);
+			_debug_log(site->level, "[%s:%d] %s", site->file, site->line,
+				text);
+		}
+		return;
+	}
+	rec->binary = true;
+	rec->heap = NULL;
+
+	struct timespec ts;
+	get_log_time(&ts);
+	uint32_t site_id = (char *)site - (char *)__start_log_sites;
+	uint64_t ns = ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+	size_t size = sizeof(rec->text);
+	size_t len = sizeof(uint32_t);
+	len = put(rec->text, len, size, &site_id, sizeof(site_id));
+	len = put(rec->text, len, size, &ns, sizeof(ns));
+
+	va_list args;
+	va_start(args, site);
+	if (state == SITE_TEXT) {
+		char text[LOG_LINE_SIZE];
+		vsnprintf(text, sizeof(text), site->format, args);
+		len = put_string(rec->text, len, size, text, 0);
+	} else {
+		len = encode_args(rec->text, len, size, types, nargs, args);
+	}
+	va_end(args);
+	if (len > size) {
+		// Only fixed-size arguments past the end, keep the site and time
+		len = sizeof(uint32_t) * 2 + sizeof(uint64_t);
+	}
+	uint32_t len32 = len;
+	memcpy(rec->text, &len32, sizeof(len32));
+	rec->len = len;
+	ring_publish(rec, pos, site->level);
+}
+
+static bool write_site_table(int fd) {
+	size_t count = __stop_log_sites - __start_log_sites;
+	size_t size = 16;
+	for (size_t i = 0; i < count; i++) {
+		size += 16 + strlen(__start_log_sites[i].file) +
+			strlen(__start_log_sites[i].format);
+	}
+	char *buf = malloc(size);
+	if (!buf) {
+		return false;
+	}
+	size_t pos = 0;
+	uint32_t header[2] = { LOG_BINARY_VERSION, count };
+	pos = put(buf, pos, size, LOG_BINARY_MAGIC, 8);
+	pos = put(buf, pos, size, header, sizeof(header));
+	for (size_t i = 0; i < count; i++) {
+		const struct log_site *site = &__start_log_sites[i];
+		uint32_t fields[3] = {
+			(char *)site - (char *)__start_log_sites, site->level,
+			site->line,
+		};
+		uint16_t lens[2] = { strlen(site->file), strlen(site->format) };
+		pos = put(buf, pos, size, fields, sizeof(fields));
+		pos = put(buf, pos, size, lens, sizeof(lens));
+		pos = put(buf, pos, size, site->file, lens[0]);
+		pos = put(buf, pos, size, site->format, lens[1]);
+	}
+	bool ok = pos == size;
+	while (ok && write(fd, buf, size) < 0 && errno == EINTR) {
+	}
+	free(buf);
+	return ok;
+}
+
+bool log_start_binary(const char *path) {
+	if (log_binary_enabled) {
+		return true;
+	}
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fake_log_errno(ERROR, "Failed to open binary log %s", path);
+		return false;
+	}
+	if (!write_site_table(fd) || !log_start_async()) {
+		fake_log(ERROR, "Failed to start binary log %s", path);
+		close(fd);
+		return false;
+	}
+	binary_fd = fd;
+	log_binary_enabled = true;
+	fake_log(INFO, "Binary log in %s, decode with log_decode", path);
+	return true;
+}
@@ -1,6 +1,7 @@
 #ifndef FAKE_CHEN_LOG_H
 #define FAKE_CHEN_LOG_H
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <string.h>
 #include <errno.h>
@@ -33,12 +34,105 @@ typedef void (*log_func_t)(enum log_importance importance,
 void _debug_log(enum log_importance verbosity, const char *format, ...) _ATTRIB_PRINTF(2, 3);
 void _debug_vlog(enum log_importance verbosity, const char *format, va_list args) _ATTRIB_PRINTF(2, 0);
 
-#define fake_log(verb, fmt, ...) \
-	_debug_log(verb, "[%s:%d] " fmt, __FILE__, __LINE__, ##__VA_ARGS__)
+// Messages above this level are compiled out, e.g. -DLOG_MAX_LEVEL=INFO
+// for builds where DEBUG output is never wanted
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL DEBUG
+#endif
+
+#define LOG_SITE_MAX_ARGS 16
+
+enum log_arg_type {
+	LOG_ARG_INT,
+	LOG_ARG_LONG,
+	LOG_ARG_LLONG,
+	LOG_ARG_SIZE,
+	LOG_ARG_INTMAX,
+	LOG_ARG_PTRDIFF,
+	LOG_ARG_DOUBLE,
+	LOG_ARG_LDOUBLE,
+	LOG_ARG_STRING,
+	LOG_ARG_POINTER,
+};
+
+/**
+ * One fake_log() call, static and collected in the log_sites section so
+ * the binary log can name it by ID and list them all up front.
+ */
+struct log_site {
+	enum log_importance level;
+	int line;
+	const char *file;
+	const char *format;
+	// Argument types, parsed from format on first use
+	int state;
+	int nargs;
+	uint8_t types[LOG_SITE_MAX_ARGS];
+};
+
+// Set by log_start_binary()
+extern bool log_binary_enabled;
+
+void _log_binary(struct log_site *site, ...);
+
+/**
+ * Next conversion at or after fmt, NULL when there is none. *start points
+ * at its '%', types gets the arguments it takes, '*' widths first, and
+ * *count their number or -1 when it cannot be recorded (%n, wide chars).
+ */
+const char *log_next_conversion(const char *fmt, const char **start,
+	uint8_t types[3], int *count);
+
+#define fake_log(verb, fmt, ...) ({ \
+	static struct log_site _log_site \
+		__attribute__((section("log_sites"), aligned(8))) = { \
+		.level = (verb), .line = __LINE__, .file = __FILE__, \
+		.format = fmt, \
+	}; \
+	if ((verb) <= LOG_MAX_LEVEL) { \
+		if (__builtin_expect(log_binary_enabled, 0)) { \
+			_log_binary(&_log_site, ##__VA_ARGS__); \
+		} else { \
+			_debug_log(verb, "[%s:%d] " fmt, __FILE__, __LINE__, \
+				##__VA_ARGS__); \
+		} \
+	} \
+})
 #define fake_vlog(verb, fmt, args) \
-	_debug_vlog(verb, "[%s:%d] " fmt, __FILE__E, __LINE__, args)
+	((verb) <= LOG_MAX_LEVEL ? _debug_vlog(verb, "[%s:%d] " fmt, __FILE__, \
+		__LINE__, args) : (void)0)
 #define fake_log_errno(verb, fmt, ...) \
 	fake_log(verb, fmt ": %s", ##__VA_ARGS__, strerror(errno))
 
 void log_init(enum log_importance verbosity, log_func_t callback);
+/**
+ * Hand messages to a writer thread instead of writing them on the calling
+ * thread. Callers format into a lock-free ring and never block, except for
+ * ERROR messages while the ring is full; other messages are then dropped
+ * and counted. A caller only makes a syscall to wake a sleeping writer,
+ * once a quarter of the ring is queued or for an ERROR. Stopped at exit,
+ * lines still queued are lost on abort().
+ */
+bool log_start_async(void);
+/** Write out everything queued and go back to synchronous writes. */
+void log_stop_async(void);
+/** Messages dropped on a full ring so far. */
+uint64_t log_async_dropped(void);
+/**
+ * Record fake_log() messages into path as call-site IDs and raw argument
+ * bytes, leaving the formatting to log_decode. Starts the async writer.
+ * Direct _debug_log() callers still go to stderr as text.
+ */
+bool log_start_binary(const char *path);
+
+/*
+ * Binary log layout, native endianness: LOG_BINARY_MAGIC, u32 version,
+ * u32 site count, then per site u32 id, u32 level, u32 line, u16 file
+ * length, u16 format length and both strings. Records follow: u32 record
+ * length, u32 site id, u64 ns since start, then each argument, 4 bytes for
+ * LOG_ARG_INT, u16 length and bytes for strings, 8 bytes otherwise. Sites
+ * whose format cannot be recorded carry one string, the formatted text.
+ */
+#define LOG_BINARY_MAGIC "EGLGBMLG"
+#define LOG_BINARY_VERSION 1
 #endif 
@@ -0,0 +1,282 @@
+#include "log.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// log_decode [file]: turn a log_start_binary() file back into the text
+// log_stderr() would have written, reading stdin without a file
+
+struct site {
+    uint32_t id, level, line;
+    char *file, *format;
+};
+
+static const char *level_names[] = {
+    [SILENT] = "",
+    [ERROR] = "[ERROR]",
+    [INFO] = "[INFO]",
+    [DEBUG] = "[DEBUG]",
+};
+
+struct reader {
+    const uint8_t *data;
+    size_t len, pos;
+};
+
+static bool read_bytes(struct reader *r, void *out, size_t len) {
+    if (r->len - r->pos < len) {
+        return false;
+    }
+    memcpy(out, r->data + r->pos, len);
+    r->pos += len;
+    return true;
+}
+
+static char *read_string(struct reader *r, size_t len) {
+    char *str = malloc(len + 1);
+    if (!str || !read_bytes(r, str, len)) {
+        free(str);
+        return NULL;
+    }
+    str[len] = '\0';
+    return str;
+}
+
+static uint8_t *read_file(FILE *f, size_t *len) {
+    size_t capacity = 1 << 16;
+    uint8_t *data = malloc(capacity);
+    *len = 0;
+    while (data) {
+        *len += fread(data + *len, 1, capacity - *len, f);
+        if (*len < capacity) {
+            break;
+        }
+        capacity *= 2;
+        uint8_t *tmp = realloc(data, capacity);
+        if (!tmp) {
+            free(data);
+            return NULL;
+        }
+        data = tmp;
+    }
+    return data;
+}
+
+static int compare_sites(const void *a, const void *b) {
+    const struct site *x = a, *y = b;
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+static const struct site *find_site(const struct site *sites, size_t count,
+        uint32_t id) {
+    struct site key = { .id = id };
+    return bsearch(&key, sites, count, sizeof(*sites), compare_sites);
+}
+
+// One conversion spec with its '*' widths filled in from the record
+static void print_conversion(const char *start, const char *end,
+        const uint8_t *types, int count, struct reader *r) {
+    int stars[2], nstars = 0;
+    for (int i = 0; i < count - 1; i++) {
+        int32_t v = 0;
+        read_bytes(r, &v, sizeof(v));
+        stars[nstars++] = v;
+    }
+    char spec[64];
+    size_t n = 0;
+    int used = 0;
+    for (const char *p = start; p < end && n < sizeof(spec) - 16; p++) {
+        if (*p == '*' && used < nstars) {
+            n += snprintf(spec + n, sizeof(spec) - n, "%d", stars[used++]);
+        } else {
+            spec[n++] = *p;
+        }
+    }
+    spec[n] = '\0';
+
+    int32_t i32 = 0;
+    int64_t i64 = 0;
+    double d = 0;
+    switch (types[count - 1]) {
+    case LOG_ARG_INT:
+        read_bytes(r, &i32, sizeof(i32));
+        printf(spec, i32);
+        return;
+    case LOG_ARG_DOUBLE:
+        read_bytes(r, &d, sizeof(d));
+        printf(spec, d);
+        return;
+    case LOG_ARG_LDOUBLE:
+        read_bytes(r, &d, sizeof(d));
+        printf(spec, (long double)d);
+        return;
+    case LOG_ARG_STRING: {
+        uint16_t len = 0;
+        read_bytes(r, &len, sizeof(len));
+        char *str = read_string(r, len);
+        printf(spec, str ? str : "");
+        free(str);
+        return;
+    }
+    }
+    read_bytes(r, &i64, sizeof(i64));
+    switch (types[count - 1]) {
+    case LOG_ARG_LONG:
+        printf(spec, (long)i64);
+        break;
+    case LOG_ARG_LLONG:
+        printf(spec, (long long)i64);
+        break;
+    case LOG_ARG_SIZE:
+        printf(spec, (size_t)i64);
+        break;
+    case LOG_ARG_INTMAX:
+        printf(spec, (intmax_t)i64);
+        break;
+    case LOG_ARG_PTRDIFF:
+        printf(spec, (ptrdiff_t)i64);
+        break;
+    case LOG_ARG_POINTER:
+        printf(spec, (void *)(uintptr_t)i64);
+        break;
+    }
+}
+
+static bool site_is_text(const char *format) {
+    const char *p = format, *start;
+    uint8_t types[3];
+    int count, total = 0;
+    while ((p = log_next_conversion(p, &start, types, &count))) {
+        if (count < 0 || (total += count) > LOG_SITE_MAX_ARGS) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void print_record(const struct site *site, uint64_t ns,
+        struct reader *r) {
+    uint64_t sec = ns / 1000000000;
+    printf("%02d:%02d:%02d.%03d %s [%s:%u] ", (int)(sec / 60 / 60),
+            (int)(sec / 60 % 60), (int)(sec % 60),
+            (int)(ns % 1000000000 / 1000000),
+            site->level < LOG_IMPORTANCE_LAST ? level_names[site->level] : "",
+            site->file, site->line);
+
+    if (site_is_text(site->format)) {
+        uint16_t len = 0;
+        read_bytes(r, &len, sizeof(len));
+        char *str = read_string(r, len);
+        fputs(str ? str : "", stdout);
+        free(str);
+        putchar('\n');
+        return;
+    }
+
+    const char *p = site->format, *start, *next;
+    uint8_t types[3];
+    int count;
+    while ((next = log_next_conversion(p, &start, types, &count))) {
+        fwrite(p, 1, start - p, stdout);
+        if (count == 0) {
+            putchar('%');
+        } else {
+            print_conversion(start, next, types, count, r);
+        }
+        p = next;
+    }
+    fputs(p, stdout);
+    putchar('\n');
+}
+
+int main(int argc, char **argv) {
+    FILE *f = argc > 1 ? fopen(argv[1], "rb") : stdin;
+    if (!f) {
+        perror(argv[1]);
+        return 1;
+    }
+    size_t len;
+    uint8_t *data = read_file(f, &len);
+    if (f != stdin) {
+        fclose(f);
+    }
+    if (!data) {
+        fprintf(stderr, "Allocation failed\n");
+        return 1;
+    }
+
+    struct reader r = { .data = data, .len = len };
+    char magic[8];
+    uint32_t header[2];
+    if (!read_bytes(&r, magic, sizeof(magic)) ||
+            memcmp(magic, LOG_BINARY_MAGIC, sizeof(magic)) != 0 ||
+            !read_bytes(&r, header, sizeof(header)) ||
+            header[0] != LOG_BINARY_VERSION) {
+        fprintf(stderr, "Not a version %d binary log\n", LOG_BINARY_VERSION);
+        free(data);
+        return 1;
+    }
+
+    size_t count = header[1];
+    struct site *sites = calloc(count, sizeof(*sites));
+    if (!sites && count) {
+        fprintf(stderr, "Allocation failed\n");
+        free(data);
+        return 1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        uint32_t fields[3];
+        uint16_t lens[2];
+        if (!read_bytes(&r, fields, sizeof(fields)) ||
+                !read_bytes(&r, lens, sizeof(lens)) ||
+                !(sites[i].file = read_string(&r, lens[0])) ||
+                !(sites[i].format = read_string(&r, lens[1]))) {
+            fprintf(stderr, "Truncated site table\n");
+            free(sites[i].file);
+            count = i;
+            break;
+        }
+        sites[i].id = fields[0];
+        sites[i].level = fields[1];
+        sites[i].line = fields[2];
+    }
+    qsort(sites, count, sizeof(*sites), compare_sites);
+
+    uint64_t records = 0;
+    while (r.pos < r.len) {
+        uint32_t rec_len, id;
+        uint64_t ns;
+        size_t rec_start = r.pos;
+        if (!read_bytes(&r, &rec_len, sizeof(rec_len)) ||
+                rec_len < 16 || rec_len > r.len - rec_start ||
+                !read_bytes(&r, &id, sizeof(id)) ||
+                !read_bytes(&r, &ns, sizeof(ns))) {
+            fprintf(stderr, "Truncated record at offset %zu\n", rec_start);
+            break;
+        }
+        // Arguments never read past their own record
+        struct reader args = {
+            .data = data + r.pos,
+            .len = rec_len - (r.pos - rec_start),
+        };
+        r.pos = rec_start + rec_len;
+        const struct site *site = find_site(sites, count, id);
+        if (!site) {
+            fprintf(stderr, "Unknown call site %u\n", id);
+            continue;
+        }
+        print_record(site, ns, &args);
+        records++;
+    }
+    fprintf(stderr, "%lu records, %zu call sites\n", (unsigned long)records,
+            count);
+
+    for (size_t i = 0; i < count; i++) {
+        free(sites[i].file);
+        free(sites[i].format);
+    }
+    free(sites);
+    free(data);
+    return 0;
+}
@@ -1,4 +1,16 @@
+#include "batch.h"
+#include "ctx_pool.h"
+#include "egl_gbm.h"
+#include "frame_map.h"
+#include "kms.h"
 #include "log.h"
+#include "present.h"
+#include "readback.h"
+#include "sink.h"
+#include "target_pool.h"
+#include "trace.h"
+#include "worker.h"
+#include "yuv.h"
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
 #include <GLES2/gl2.h>
@@ -12,1004 +24,490 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
-/** A single DRM format, with a set of modifiers attached. */
-struct drm_format {
-    // The actual DRM format, from `drm_fourcc.h`
-    uint32_t format;
-    // The number of modifiers
-    size_t len;
-    // The capacity of the array; do not use.
-    size_t capacity;
-    // The actual modifiers
-    uint64_t modifiers[];
-};
-
-struct drm_format_set {
-    // The number of formats
-    size_t len;
-    // The capacity of the array; private to wlroots
-    size_t capacity;
-    // A pointer to an array of `struct wlr_drm_format *` of length `len`.
-    struct drm_format **formats;
-};
-
-struct gles2_tex_shader {
-    GLuint program;
-    GLint proj;
-    GLint tex;
-    GLint alpha;
-    GLint pos_attrib;
-    GLint tex_attrib;
-};
-
-#define MAX_BUFFER_PLANES 4
-struct egl {
-    int card_fd;
-    int render_fd;
-
-    EGLDisplay display;
-    EGLContext context;
-    EGLContext off_screen_context;
-    EGLSurface window_surface;
-    EGLDeviceEXT device; // may be EGL_NO_DEVICE_EXT
-
-    struct gbm_device *gbm_device;
-    struct gbm_surface *gbm_surface;
-    struct gbm_bo *gbm_bo;
-    struct gbm_bo *gbm_rbo;
-    EGLImageKHR egl_image;
-    int plane_count;
-    int dmabuf_fds[MAX_BUFFER_PLANES];
-    uint32_t strides[MAX_BUFFER_PLANES];
-    uint32_t offsets[MAX_BUFFER_PLANES];
-
-
-    unsigned int handle;
-    unsigned int pitch;
-    unsigned int fb_id;
-    uint64_t modifier;
-
-    unsigned int connector_id;
-    drmModeResPtr resources;
-    drmModeConnectorPtr connector;
-    drmModeModeInfo mode;
-    drmModeEncoderPtr encoder;
-    drmModeCrtcPtr crtc;
-
-    bool has_modifiers;
-    struct drm_format_set dmabuf_texture_formats;
-    struct drm_format_set dmabuf_render_formats;
-
-    struct {
-        PFNEGLGETPLATFORMDISPLAYEXTPROC eglGetPlatformDisplayEXT;
-        PFNEGLCREATEPLATFORMWINDOWSURFACEEXTPROC
-            eglCreatePlatformWindowSurfaceEXT;
-        PFNEGLCREATEIMAGEKHRPROC eglCreateImageKHR;
-        PFNEGLDESTROYIMAGEKHRPROC eglDestroyImageKHR;
-        PFNEGLQUERYWAYLANDBUFFERWL eglQueryWaylandBufferWL;
-        PFNEGLBINDWAYLANDDISPLAYWL eglBindWaylandDisplayWL;
-        PFNEGLUNBINDWAYLANDDISPLAYWL eglUnbindWaylandDisplayWL;
-        PFNEGLQUERYDMABUFFORMATSEXTPROC eglQueryDmaBufFormatsEXT;
-        PFNEGLQUERYDMABUFMODIFIERSEXTPROC eglQueryDmaBufModifiersEXT;
-        PFNEGLDEBUGMESSAGECONTROLKHRPROC eglDebugMessageControlKHR;
-        PFNEGLQUERYDISPLAYATTRIBEXTPROC eglQueryDisplayAttribEXT;
-        PFNEGLQUERYDEVICESTRINGEXTPROC eglQueryDeviceStringEXT;
-        PFNEGLQUERYDEVICESEXTPROC eglQueryDevicesEXT;
-    } procs;
-
-    struct {
-        // Display extensions
-        bool KHR_image_base;
-        bool EXT_image_dma_buf_import;
-        bool EXT_image_dma_buf_import_modifiers;
-        bool IMG_context_priority;
-        bool EGL_bind_display;
-
-        // Device extensions
-        bool EXT_device_drm;
-        bool EXT_device_drm_render_node;
-
-        // Client extensions
-        bool EXT_device_query;
-        bool KHR_platform_gbm;
-        bool EXT_platform_device;
-    } exts;
-
-    // FBO
-    GLuint fbo;
-    GLuint texture_target_1;
-    GLuint renderbuffer;
-    GLuint texture_load;
-    GLuint texture_render;
-
-    // EGLImage image;
-    uint16_t m_width;
-    uint16_t m_height;
-    // uint16_t m_handle;
-    uint32_t m_frame_cnt;
-    int m_data[4];
-};
-
-struct gles_renderer {
-    float projection[9];
-    struct egl *egl;
-    int drm_fd;
-
-    const char *exts_str;
-    struct {
-        bool EXT_read_format_bgra;
-        bool KHR_debug;
-        bool OES_egl_image_external;
-        bool OES_egl_image;
-        bool EXT_texture_type_2_10_10_10_REV;
-        bool OES_texture_half_float_linear;
-        bool EXT_texture_norm16;
-    } exts;
-
-    struct {
-        PFNGLEGLIMAGETARGETTEXTURE2DOESPROC glEGLImageTargetTexture2DOES;
-        PFNGLDEBUGMESSAGECALLBACKKHRPROC glDebugMessageCallbackKHR;
-        PFNGLDEBUGMESSAGECONTROLKHRPROC glDebugMessageControlKHR;
-        PFNGLPOPDEBUGGROUPKHRPROC glPopDebugGroupKHR;
-        PFNGLPUSHDEBUGGROUPKHRPROC glPushDebugGroupKHR;
-        PFNGLEGLIMAGETARGETRENDERBUFFERSTORAGEOESPROC
-            glEGLImageTargetRenderbufferStorageOES;
-    } procs;
-
-    struct {
-        struct {
-            GLuint program;
-            GLint proj;
-            GLint color;
-            GLint pos_attrib;
-        } quad;
-        struct gles2_tex_shader tex_rgba;
-        struct gles2_tex_shader tex_rgbx;
-        struct gles2_tex_shader tex_ext;
-    } shaders;
-    uint32_t viewport_width, viewport_height;
-};
-
-struct dmabuf_dumb_buffer {
-	uint32_t handle;
-	uint32_t stride;
-	uint64_t size;
-	int prime_fd;
-    uint32_t fb_id;
-};
-
-enum egl_image_target {
-    texture,
-    renderbuffer,
-};
-
 // struct
 struct egl egl_gbm;
 struct gles_renderer gles_fake;
-// function
-static bool check_gl_ext(const char *exts, const char *ext);
-static void load_gl_proc(void *proc_ptr, const char *name);
-bool egl_make_current(struct egl *egl);
-static bool check_egl_ext(const char *exts, const char *ext);
-static void load_egl_proc(void *proc_ptr, const char *name);
-static bool device_has_name(const drmDevice *device, const char *name);
-static bool env_parse_bool(const char *option);
-static int get_egl_dmabuf_formats(struct egl *egl, int **formats);
-static int get_egl_dmabuf_modifiers(struct egl *egl, int format,
-        uint64_t **modifiers,
-        EGLBoolean **external_only);
-static struct drm_format **format_set_get_ref(struct drm_format_set *set,
-        uint32_t format);
-
-// egl debug
-static enum log_importance egl_log_importance(EGLint type);
-static const char *egl_error_str(EGLint error);
-static void egl_log(EGLenum error, const char *command, EGLint msg_type,
-        EGLLabelKHR thread, EGLLabelKHR obj, const char *msg);
-
-struct drm_format *drm_format_create(uint32_t format) {
-    size_t capacity = 4;
-    struct drm_format *fmt =
-        calloc(1, sizeof(*fmt) + sizeof(fmt->modifiers[0]) * capacity);
-    if (!fmt) {
-        fake_log(ERROR, "Allocation failed");
-        return NULL;
-    }
-    fmt->format = format;
-    fmt->capacity = capacity;
-    return fmt;
-}
-
-bool drm_format_has(const struct drm_format *fmt, uint64_t modifier) {
-    for (size_t i = 0; i < fmt->len; ++i) {
-        if (fmt->modifiers[i] == modifier) {
-            return true;
-        }
-    }
-    return false;
-}
-
-bool drm_format_add(struct drm_format **fmt_ptr, uint64_t modifier) {
-    struct drm_format *fmt = *fmt_ptr;
-
-    if (drm_format_has(fmt, modifier)) {
-        return true;
-    }
+bool init_gbm(const char *path) {
 
-    if (fmt->len == fmt->capacity) {
-        size_t capacity = fmt->capacity ? fmt->capacity * 2 : 4;
+    egl_gbm.render_fd = open(path, O_RDWR | O_CLOEXEC);
+    assert(-1 != egl_gbm.render_fd);
 
-        fmt = realloc(fmt, sizeof(*fmt) + sizeof(fmt->modifiers[0]) * capacity);
-        if (!fmt) {
-            fake_log(ERROR, "Allocation failed");
-            return false;
-        }
+    egl_gbm.gbm_device = gbm_create_device(egl_gbm.render_fd);
+    assert(NULL != egl_gbm.gbm_device);
 
-        fmt->capacity = capacity;
-        *fmt_ptr = fmt;
-    }
+    // https://mlog.club/article/1818788
+    // https://cgit.freedesktop.org/mesa/mesa/commit/src/egl/main?id=468cc866b4b308cee40470f06b31002c6c56da96
+    // use surface to manage buffer
+    egl_gbm.gbm_surface = gbm_surface_create(
+            egl_gbm.gbm_device, egl_gbm.mode.hdisplay, egl_gbm.mode.vdisplay,
+            GBM_FORMAT_XRGB8888, GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
+    assert(NULL != egl_gbm.gbm_surface);
 
-    fmt->modifiers[fmt->len++] = modifier;
     return true;
 }
 
-bool drm_format_set_add(struct drm_format_set *set, uint32_t format,
-        uint64_t modifier) {
-    assert(format != DRM_FORMAT_INVALID);
+static struct kms_output_config kms_outputs[KMS_MAX_OUTPUTS];
+static int kms_output_count = 0;
 
-    struct drm_format **ptr = format_set_get_ref(set, format);
-    if (ptr) {
-        return drm_format_add(ptr, modifier);
-    }
-
-    struct drm_format *fmt = drm_format_create(format);
-    if (!fmt) {
-        return false;
-    }
+bool init_kms(const char *path) {
+    egl_gbm.card_fd = open(path, O_RDWR | O_CLOEXEC);
+    assert(-1 != egl_gbm.card_fd);
 
-    if (!drm_format_add(&fmt, modifier)) {
-        return false;
-    }
+    kms_output_count = kms_find_outputs(egl_gbm.card_fd, kms_outputs,
+            KMS_MAX_OUTPUTS);
+    assert(kms_output_count > 0);
 
-    if (set->len == set->capacity) {
-        size_t new = set->capacity ? set->capacity * 2 : 4;
+    // The first output sizes the window surface and the offscreen draws
+    egl_gbm.connector_id = kms_outputs[0].connector_id;
+    egl_gbm.mode = kms_outputs[0].mode;
 
-        struct drm_format **tmp = realloc(
-                set->formats, sizeof(*fmt) + sizeof(fmt->modifiers[0]) * new);
-        if (!tmp) {
-            fake_log(ERROR, "Allocation failed");
-            free(fmt);
-            return false;
-        }
-
-        set->capacity = new;
-        set->formats = tmp;
-    }
+    egl_gbm.crtc = drmModeGetCrtc(egl_gbm.card_fd, kms_outputs[0].crtc_id);
+    assert(NULL != egl_gbm.crtc);
 
-    set->formats[set->len++] = fmt;
     return true;
 }
 
-static void init_dmabuf_formats(struct egl *egl) {
-    int *formats;
-    int formats_len = get_egl_dmabuf_formats(egl, &formats);
-    if (formats_len < 0) {
-        return;
+// No connector to drive: only open a node for GBM and make up a mode, flips
+// are then completed by the mock KMS backend.
+// EGL_GBM_KMS_MOCK_OUTPUTS=WxH[@Hz],...: mock several outputs, 1920x1080@60
+// by default.
+bool init_kms_mock(const char *path) {
+    egl_gbm.card_fd = open(path, O_RDWR | O_CLOEXEC);
+    if (egl_gbm.card_fd < 0) {
+        fake_log_errno(ERROR, "Failed to open '%s'", path);
+        return false;
     }
-    fake_log(ERROR, "egl support formats num = %d", formats_len);
-
-    bool has_modifiers = false;
-    for (int i = 0; i < formats_len; i++) {
-        uint32_t fmt = formats[i];
-
-        uint64_t *modifiers;
-        EGLBoolean *external_only;
-        int modifiers_len =
-            get_egl_dmabuf_modifiers(egl, fmt, &modifiers, &external_only);
-        if (modifiers_len < 0) {
-            continue;
+    const char *spec = getenv("EGL_GBM_KMS_MOCK_OUTPUTS");
+    if (!spec) {
+        spec = "1920x1080@60";
+    }
+    kms_output_count = 0;
+    while (*spec && kms_output_count < KMS_MAX_OUTPUTS) {
+        unsigned int width, height, refresh = 60;
+        int len = 0;
+        if (sscanf(spec, "%ux%u%n@%u%n", &width, &height, &len, &refresh,
+                    &len) < 2 || !width || !height || !refresh ||
+                width > UINT16_MAX || height > UINT16_MAX) {
+            fake_log(ERROR, "Invalid EGL_GBM_KMS_MOCK_OUTPUTS entry '%s'",
+                    spec);
+            return false;
         }
-
-        has_modifiers = has_modifiers || modifiers_len > 0;
-
-        // EGL始终支持隐式修饰符
-        drm_format_set_add(&egl_gbm.dmabuf_texture_formats, fmt,
-                DRM_FORMAT_MOD_INVALID);
-        drm_format_set_add(&egl->dmabuf_render_formats, fmt,
-                DRM_FORMAT_MOD_INVALID);
-
-        // 如果驱动程序没有明确说明，则假设支持线性布局
-        if (modifiers_len == 0) {
-            // Asume the linear layout is supported if the driver doesn't
-            // explicitly say otherwise
-            drm_format_set_add(&egl->dmabuf_texture_formats, fmt,
-                    DRM_FORMAT_MOD_LINEAR);
-            drm_format_set_add(&egl->dmabuf_render_formats, fmt,
-                    DRM_FORMAT_MOD_LINEAR);
+        struct kms_output_config *out = &kms_outputs[kms_output_count];
+        kms_mock_mode(&out->mode, width, height, refresh);
+        snprintf(out->name, sizeof(out->name), "Mock-%d",
+                kms_output_count + 1);
+        fake_log(INFO, "Using mock KMS on %s, output %s mode %s@%u", path,
+                out->name, out->mode.name, refresh);
+        kms_output_count++;
+        spec += len;
+        if (*spec == ',') {
+            spec++;
         }
-
-        for (int j = 0; j < modifiers_len; j++) {
-            drm_format_set_add(&egl->dmabuf_texture_formats, fmt, modifiers[j]);
-            if (!external_only[j]) {
-                drm_format_set_add(&egl->dmabuf_render_formats, fmt,
-                        modifiers[j]);
-            }
-        }
-
-        free(modifiers);
-        free(external_only);
     }
+    egl_gbm.mode = kms_outputs[0].mode;
+    return kms_output_count > 0;
+}
 
-    char *str_formats = malloc(formats_len * 5 + 1);
-    if (str_formats == NULL) {
-        goto out;
-    }
-    for (int i = 0; i < formats_len; i++) {
-        snprintf(&str_formats[i * 5], (formats_len - i) * 5 + 1, "%.4s ",
-                (char *)&formats[i]);
-    }
-    fake_log(INFO, "Supported DMA-BUF formats: %s", str_formats);
-    fake_log(INFO, "EGL DMA-BUF format modifiers %s",
-            has_modifiers ? "supported" : "unsupported");
-    free(str_formats);
+static void draw_color_use_window_surface() {
+    eglMakeCurrent(egl_gbm.display, egl_gbm.window_surface,
+            egl_gbm.window_surface, egl_gbm.context);
+    glClearColor(1.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+    eglSwapBuffers(egl_gbm.display, egl_gbm.window_surface);
+    eglMakeCurrent(egl_gbm.display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+            EGL_NO_CONTEXT);
+}
 
-    egl->has_modifiers = has_modifiers;
+static struct frame_sink *frame_sink = NULL;
 
-out:
-    free(formats);
+// EGL_GBM_SINK picks the output, see frame_sink_create_from_spec()
+static struct frame_sink *get_frame_sink(void)
+{
+    if (!frame_sink) {
+        const char *spec = getenv("EGL_GBM_SINK");
+        frame_sink = frame_sink_create_from_spec(spec ? spec : "raw:rgba.bin");
+        assert(frame_sink);
+    }
+    return frame_sink;
 }
 
-static int open_render_node(int drm_fd) {
-    char *render_name = drmGetRenderDeviceNameFromFd(drm_fd);
+// Set while frame_readback reads YUV planes back
+static struct yuv_converter *frame_yuv = NULL;
 
-    if (render_name == NULL) {
-        // This can happen on split render/display platforms, fallback to
-        // primary node
-        render_name = drmGetPrimaryDeviceNameFromFd(drm_fd);
-        if (render_name == NULL) {
-            fake_log(ERROR, "drmGetPrimaryDeviceNameFromFd failed");
-            return -1;
+static void write_frame_to_sink(const void *pixels, uint32_t width,
+        uint32_t height, uint32_t stride, uint64_t frame, void *data)
+{
+    struct frame out = {
+        .pixels = pixels,
+        .width = width,
+        .height = height,
+        .stride = stride,
+        .format = DRM_FORMAT_ABGR8888,
+        .bottom_up = true,
+        .seq = frame,
+    };
+    if (frame_yuv) {
+        out.format = yuv_converter_format(frame_yuv);
+        out.bottom_up = false;
+        for (int i = 1; i < frame_yuv->plane_count; i++) {
+            out.plane_offsets[i - 1] = frame_yuv->offsets[i];
+            out.plane_strides[i - 1] = frame_yuv->strides[i];
         }
-        fake_log(DEBUG,
-                "DRM device '%s' has no render node, "
-                "falling back to primary node",
-                render_name);
     }
+    frame_sink_write(data, &out);
+}
 
-    int render_fd = open(render_name, O_RDWR | O_CLOEXEC);
-    if (render_fd < 0) {
-        fake_log(ERROR, "Failed to open DRM node '%s'", render_name);
-    }
-    free(render_name);
-    return render_fd;
+static int readback_depth_from_env(void)
+{
+    const char *env = getenv("EGL_GBM_READBACK_DEPTH");
+    return env ? atoi(env) : 3;
 }
 
-EGLDeviceEXT get_egl_device_from_fd(int fd) {
-    if (egl_gbm.procs.eglQueryDevicesEXT == NULL) {
-        fake_log(DEBUG, "EGL_EXT_device_enumeration not supported");
-        return EGL_NO_DEVICE_EXT;
+// EGL_GBM_READBACK_YUV=nv12|i420[,bt601|bt709][,limited|full]: convert on
+// the GPU and read back only the YUV planes. NULL when not enabled.
+static struct yuv_converter *readback_yuv_from_env(struct readback *rb)
+{
+    const char *spec = getenv("EGL_GBM_READBACK_YUV");
+    enum yuv_layout layout;
+    enum yuv_matrix matrix;
+    enum yuv_range range;
+    if (!spec || !yuv_parse_spec(spec, &layout, &matrix, &range)) {
+        return NULL;
     }
-
-    EGLint nb_devices = 0;
-    // NULL -> to get supported devices num in the system
-    if (!egl_gbm.procs.eglQueryDevicesEXT(0, NULL, &nb_devices)) {
-        fake_log(ERROR, "Failed to query EGL devices");
-        return EGL_NO_DEVICE_EXT;
+    struct yuv_converter *conv = yuv_converter_create(&gles_fake, rb->width,
+            rb->height, layout, matrix, range);
+    if (conv && !readback_use_yuv(rb, conv)) {
+        yuv_converter_destroy(conv);
+        conv = NULL;
     }
+    return conv;
+}
 
-    fake_log(INFO, "supported devices num is %d in the system", nb_devices);
-
-    EGLDeviceEXT *devices = calloc(nb_devices, sizeof(EGLDeviceEXT));
-    if (devices == NULL) {
-        fake_log_errno(ERROR, "Failed to allocate EGL device list");
-        return EGL_NO_DEVICE_EXT;
-    }
+static struct readback *frame_readback = NULL;
 
-    if (!egl_gbm.procs.eglQueryDevicesEXT(nb_devices, devices, &nb_devices)) {
-        fake_log(ERROR, "Failed to query EGL devices");
-        return EGL_NO_DEVICE_EXT;
+// Deliver every frame still in flight and drop the readback ring, which
+// belongs to the context it was created on.
+static void read_draw_finish(void)
+{
+    if (!frame_readback) {
+        return;
     }
-
-    drmDevice *device = NULL;
-    int ret = drmGetDevice(fd, &device);
-    if (ret < 0) {
-        fake_log(ERROR, "Failed to get DRM device: %s", strerror(-ret));
-        return EGL_NO_DEVICE_EXT;
+    EGLContext current = eglGetCurrentContext();
+    EGLSurface draw = eglGetCurrentSurface(EGL_DRAW);
+    EGLSurface read = eglGetCurrentSurface(EGL_READ);
+    if (current != frame_readback->context) {
+        eglMakeCurrent(egl_gbm.display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                frame_readback->context);
     }
-
-    EGLDeviceEXT egl_device = NULL;
-    for (int i = 0; i < nb_devices; i++) {
-        const char *egl_device_name = egl_gbm.procs.eglQueryDeviceStringEXT(
-                devices[i], EGL_DRM_DEVICE_FILE_EXT);
-        /* const char *egl_device_name = egl_gbm.procs.eglQueryDeviceStringEXT(
-        */
-        /* 		devices[i], EGL_DRM_RENDER_NODE_FILE_EXT); */
-        if (egl_device_name == NULL) {
-            continue;
-        }
-        if (device_has_name(device, egl_device_name)) {
-            fake_log(DEBUG, "Using EGL device %s", egl_device_name);
-            egl_device = devices[i];
-            break;
-        }
+    readback_log_stats(frame_readback);
+    readback_destroy(frame_readback);
+    frame_readback = NULL;
+    yuv_converter_destroy(frame_yuv);
+    frame_yuv = NULL;
+    if (current != EGL_NO_CONTEXT) {
+        eglMakeCurrent(egl_gbm.display, draw, read, current);
     }
-
-    drmFreeDevice(&device);
-    free(devices);
-    return egl_device;
 }
 
-static bool egl_init_display(EGLDisplay display) {
-    egl_gbm.display = display;
-
-    EGLint major, minor;
-    if (eglInitialize(egl_gbm.display, &major, &minor) == EGL_FALSE) {
-        fake_log(ERROR, "Failed to initialize EGL");
-        return false;
+static void read_draw_to_file(EGLSurface draw, EGLSurface read, EGLContext context)
+{
+    if (frame_readback && frame_readback->context != context) {
+        read_draw_finish();
     }
+    eglMakeCurrent(egl_gbm.display, draw, read , context);
+    if (!frame_readback) {
+        frame_readback = readback_create(&egl_gbm, &gles_fake,
+                egl_gbm.mode.hdisplay, egl_gbm.mode.vdisplay,
+                readback_depth_from_env(), write_frame_to_sink,
+                get_frame_sink());
+        assert(frame_readback);
+        frame_yuv = readback_yuv_from_env(frame_readback);
+    }
+    // The frame reaches rgba.bin a few frames later, or at read_draw_finish()
+    readback_frame(frame_readback);
+}
+
+enum capture_mode {
+    CAPTURE_READBACK,
+    CAPTURE_DUMB,
+    CAPTURE_DMABUF,
+};
 
-    const char *display_exts_str =
-        eglQueryString(egl_gbm.display, EGL_EXTENSIONS);
-    if (display_exts_str == NULL) {
-        fake_log(ERROR, "Failed to query EGL display extensions");
-        return false;
+// EGL_GBM_CAPTURE=dumb|dmabuf: hand the consumer the mapped buffer itself
+// instead of reading it back through GL
+static enum capture_mode capture_mode_from_env(void)
+{
+    const char *mode = getenv("EGL_GBM_CAPTURE");
+    if (!mode || strcmp(mode, "readback") == 0) {
+        return CAPTURE_READBACK;
     }
-
-    if (check_egl_ext(display_exts_str, "EGL_KHR_image_base")) {
-        egl_gbm.exts.KHR_image_base = true;
-        load_egl_proc(&egl_gbm.procs.eglCreateImageKHR, "eglCreateImageKHR");
-        load_egl_proc(&egl_gbm.procs.eglDestroyImageKHR, "eglDestroyImageKHR");
+    if (strcmp(mode, "dumb") == 0) {
+        return CAPTURE_DUMB;
     }
-
-    egl_gbm.exts.EXT_image_dma_buf_import =
-        check_egl_ext(display_exts_str, "EGL_EXT_image_dma_buf_import");
-    if (check_egl_ext(display_exts_str,
-                "EGL_EXT_image_dma_buf_import_modifiers")) {
-        egl_gbm.exts.EXT_image_dma_buf_import_modifiers = true;
-        load_egl_proc(&egl_gbm.procs.eglQueryDmaBufFormatsEXT,
-                "eglQueryDmaBufFormatsEXT");
-        load_egl_proc(&egl_gbm.procs.eglQueryDmaBufModifiersEXT,
-                "eglQueryDmaBufModifiersEXT");
+    if (strcmp(mode, "dmabuf") == 0) {
+        return CAPTURE_DMABUF;
     }
+    fake_log(ERROR, "Unknown EGL_GBM_CAPTURE mode: %s", mode);
+    return CAPTURE_READBACK;
+}
 
-    const char *device_exts_str = NULL, *driver_name = NULL;
-    if (egl_gbm.exts.EXT_device_query) {
-        EGLAttrib device_attrib;
-        if (!egl_gbm.procs.eglQueryDisplayAttribEXT(
-                    egl_gbm.display, EGL_DEVICE_EXT, &device_attrib)) {
-            fake_log(ERROR, "eglQueryDisplayAttribEXT(EGL_DEVICE_EXT) failed");
-            return false;
-        }
-        egl_gbm.device = (EGLDeviceEXT)device_attrib;
-
-        device_exts_str = egl_gbm.procs.eglQueryDeviceStringEXT(egl_gbm.device,
-                EGL_EXTENSIONS);
-        if (device_exts_str == NULL) {
-            fake_log(ERROR, "eglQueryDeviceStringEXT(EGL_EXTENSIONS) failed");
-            return false;
-        }
-
-        if (check_egl_ext(device_exts_str, "EGL_MESA_device_software")) {
-            if (env_parse_bool("EGL_RENDERER_ALLOW_SOFTWARE")) {
-                fake_log(INFO, "Using software rendering");
-            } else {
-                fake_log(ERROR,
-                        "Software rendering detected, please use "
-                        "the WLR_RENDERER_ALLOW_SOFTWARE environment variable "
-                        "to proceed");
-                return false;
-            }
-        }
+static enum capture_mode capture_mode = CAPTURE_READBACK;
 
-#ifdef EGL_DRIVER_NAME_EXT
-        if (check_egl_ext(device_exts_str, "EGL_EXT_device_persistent_id")) {
-            driver_name = egl_gbm.procs.eglQueryDeviceStringEXT(
-                    egl_gbm.device, EGL_DRIVER_NAME_EXT);
-        }
-#endif
-        egl_gbm.exts.EXT_device_drm =
-            check_egl_ext(device_exts_str, "EGL_EXT_device_drm");
-        egl_gbm.exts.EXT_device_drm_render_node =
-            check_egl_ext(device_exts_str, "EGL_EXT_device_drm_render_node");
-    }
-
-    if (!check_egl_ext(display_exts_str, "EGL_KHR_no_config_context") &&
-            !check_egl_ext(display_exts_str, "EGL_MESA_configless_context")) {
-        fake_log(ERROR, "EGL_KHR_no_config_context or "
-                "EGL_MESA_configless_context not supported");
+// Returns false when capture through a mapping is not enabled. The mapping
+// lives with the pooled target, a frame only syncs around the read.
+static bool capture_frame_mapped(struct render_target *target)
+{
+    if (capture_mode == CAPTURE_READBACK) {
         return false;
     }
-
-    if (!check_egl_ext(display_exts_str, "EGL_KHR_surfaceless_context")) {
-        fake_log(ERROR, "EGL_KHR_surfaceless_context not supported");
+    struct frame_map *map = render_target_map(target,
+            capture_mode == CAPTURE_DUMB ? FRAME_MAP_DUMB : FRAME_MAP_DMABUF);
+    if (!map) {
         return false;
     }
 
-    egl_gbm.exts.IMG_context_priority =
-        check_egl_ext(display_exts_str, "EGL_IMG_context_priority");
-
-    fake_log(INFO, "Using EGL %d.%d", (int)major, (int)minor);
-    fake_log(INFO, "Supported EGL display extensions:\n %s", display_exts_str);
-    if (device_exts_str != NULL) {
-        fake_log(INFO, "Supported EGL device extensions: %s", device_exts_str);
-    }
-    fake_log(INFO, "EGL vendor: %s",
-            eglQueryString(egl_gbm.display, EGL_VENDOR));
-    if (driver_name != NULL) {
-        fake_log(INFO, "EGL driver name: %s", driver_name);
+    if (frame_map_begin_read(map, &egl_gbm)) {
+        struct frame out = {
+            .pixels = map->data,
+            .width = map->width,
+            .height = map->height,
+            .stride = map->stride,
+            .format = DRM_FORMAT_ARGB8888,
+        };
+        frame_sink_write(get_frame_sink(), &out);
+        frame_map_end_read(map);
     }
-
-    init_dmabuf_formats(&egl_gbm);
-
     return true;
 }
 
-static int match_config_to_visual(EGLDisplay egl_display, EGLint visual_id,
-        EGLConfig *configs, int count) {
-
-    EGLint id;
-    for (int i = 0; i < count; ++i) {
-        if (!eglGetConfigAttrib(egl_display, configs[i], EGL_NATIVE_VISUAL_ID,
-                    &id))
-            continue;
-        if (id == visual_id)
-            return i;
+static void sum_frame(const void *pixels, uint32_t width, uint32_t height,
+        uint32_t stride, uint64_t frame, void *data)
+{
+    const uint8_t *row = pixels;
+    uint64_t *sum = data;
+    for (uint32_t y = 0; y < height; y += 64) {
+        *sum += row[(size_t)y * stride];
     }
-    return -1;
 }
 
-static bool egl_init(EGLenum platform, void *remote_display) {
-    EGLDisplay display =
-        egl_gbm.procs.eglGetPlatformDisplayEXT(platform, remote_display, NULL);
-    if (display == EGL_NO_DISPLAY) {
-        fake_log(ERROR, "Failed to create EGL Display");
-        return false;
-    }
-    if (!egl_init_display(display)) {
-        eglTerminate(display);
-        return false;
-    }
-    // use surface specify config
-    const EGLint attribList[] = {
-        EGL_RENDER_BUFFER, EGL_BACK_BUFFER,
-        EGL_NONE,
-    };
-    const EGLint config_attribs[] = {
-        EGL_BUFFER_SIZE, 32, // color component bit 32
-        EGL_DEPTH_SIZE, EGL_DONT_CARE,
-        EGL_STENCIL_SIZE, EGL_DONT_CARE,
-        EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
-        EGL_RED_SIZE, 8,
-        EGL_GREEN_SIZE, 8,
-        EGL_BLUE_SIZE, 8,
-        EGL_ALPHA_SIZE, 8,
-        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
-        EGL_NONE,
-    };
-    EGLint max_num_configs, num_configs, config_index;
-    if (!eglGetConfigs(display, NULL, 0, &max_num_configs)) {
-        fake_log(ERROR, "Failed to get display configs");
-        return false;
-    }
-    fake_log(INFO, "Display config max num = %d", max_num_configs);
-    EGLConfig *configs = malloc(num_configs * sizeof(EGLConfig));
-    if (!eglChooseConfig(display, config_attribs, configs, max_num_configs,
-                &num_configs)) {
-        fake_log(ERROR, "Failed to choose specify configs");
+// egl_gbm readback [frames] [depth]: render to a texture FBO and read every
+// frame back, to compare the render thread stall across ring depths
+static bool draw_readback_loop(uint64_t frames, int depth)
+{
+    if (!egl_make_current(&egl_gbm)) {
         return false;
     }
-    fake_log(INFO, "匹配 config_attribs Display choose config num = %d",
-            num_configs);
-    config_index = match_config_to_visual(display, GBM_FORMAT_ARGB8888, configs,
-            num_configs);
-    fake_log(INFO, "index = %d", config_index);
-    // 1. egl_gbm.window_surface = eglCreateWindowSurface(egl_gbm.display,
-    // configs[config_index], (EGLNativeWindowType)egl_gbm.gbm_surface,
-    // attribList);
-    // 2. egl_gbm.window_surface =
-    // eglCreatePlatformWindowSurface(egl_gbm.display, configs[config_index],
-    // egl_gbm.gbm_surface, (EGLAttrib *)attribList);
-    egl_gbm.window_surface = egl_gbm.procs.eglCreatePlatformWindowSurfaceEXT(
-            egl_gbm.display, configs[config_index], egl_gbm.gbm_surface,
-            attribList);
-    if (egl_gbm.window_surface == EGL_NO_SURFACE) {
-        fake_log(ERROR, "Failed to create EGL Surface");
+    GLuint tex, fbo;
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, egl_gbm.mode.hdisplay,
+            egl_gbm.mode.vdisplay, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+            GL_TEXTURE_2D, tex, 0);
+    glViewport(0, 0, egl_gbm.mode.hdisplay, egl_gbm.mode.vdisplay);
+
+    uint64_t sum = 0;
+    struct readback *rb = readback_create(&egl_gbm, &gles_fake,
+            egl_gbm.mode.hdisplay, egl_gbm.mode.vdisplay, depth, sum_frame,
+            &sum);
+    if (!rb) {
         return false;
     }
+    struct yuv_converter *yuv = readback_yuv_from_env(rb);
+    struct trace_gpu *gpu = trace_gpu_create(&gles_fake);
+    for (uint64_t i = 0; i < frames; i++) {
+        TRACE_SCOPE("frame");
+        float t = (float)(i % 60) / 60.0f;
+        trace_gpu_begin(gpu, "clear");
+        glClearColor(t, 1.0f - t, 0.0f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+        trace_gpu_end(gpu);
+        trace_gpu_begin(gpu, "readback");
+        readback_frame(rb);
+        trace_gpu_end(gpu);
+        trace_gpu_collect(gpu, false);
+    }
+    trace_gpu_destroy(gpu);
+    readback_flush(rb);
+    readback_log_stats(rb);
+    readback_destroy(rb);
+    yuv_converter_destroy(yuv);
 
-    size_t atti = 0;
-    EGLint attribs[5];
-    attribs[atti++] = EGL_CONTEXT_CLIENT_VERSION;
-    attribs[atti++] = 2;
-
-    // Request a high priority context if possible
-    // TODO: only do this if we're running as the DRM master
-    bool request_high_priority = egl_gbm.exts.IMG_context_priority;
-
-    // Try to reschedule all of our rendering to be completed first. If it
-    // fails, it will fallback to the default priority (MEDIUM).
-    if (request_high_priority) {
-        attribs[atti++] = EGL_CONTEXT_PRIORITY_LEVEL_IMG;
-        attribs[atti++] = EGL_CONTEXT_PRIORITY_HIGH_IMG;
-    }
-
-    attribs[atti++] = EGL_NONE;
-    assert(atti <= sizeof(attribs) / sizeof(attribs[0]));
-
-    egl_gbm.context = eglCreateContext(egl_gbm.display, configs[config_index],
-            EGL_NO_CONTEXT, attribs);
-    if (egl_gbm.context == EGL_NO_CONTEXT) {
-        fake_log(ERROR, "Failed to create EGL context");
-        return false;
-    }
-
-    if (request_high_priority) {
-        EGLint priority = EGL_CONTEXT_PRIORITY_MEDIUM_IMG;
-        eglQueryContext(egl_gbm.display, egl_gbm.context,
-                EGL_CONTEXT_PRIORITY_LEVEL_IMG, &priority);
-        if (priority != EGL_CONTEXT_PRIORITY_HIGH_IMG) {
-            fake_log(INFO, "Failed to obtain a high priority context");
-        } else {
-            fake_log(DEBUG, "Obtained high priority context");
-        }
-    }
-
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteTextures(1, &tex);
+    eglMakeCurrent(egl_gbm.display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+            EGL_NO_CONTEXT);
     return true;
 }
 
-bool check_basic_egl() {
-    const char *client_exts_str =
-        eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
-    if (client_exts_str == NULL) {
-        if (eglGetError() == EGL_BAD_DISPLAY) {
-            fake_log(ERROR, "EGL_EXT_client_extensions not supported");
-        } else {
-            fake_log(ERROR, "Failed to query EGL client extensions");
-        }
-        return false;
-    }
-
-    fake_log(INFO, "Supported EGL client extensions:\n %s", client_exts_str);
+// Surface buffer on screen, handed back to the surface once replaced
+static struct gbm_bo *front_bo = NULL;
 
-    if (!check_egl_ext(client_exts_str, "EGL_EXT_platform_base")) {
-        fake_log(ERROR, " EGL_EXT_platform_base not supported");
-        return false;
+static void scan_output_surface_to_display(struct kms_backend *kms)
+{
+    eglMakeCurrent(egl_gbm.display, egl_gbm.window_surface,
+            egl_gbm.window_surface, egl_gbm.context);
+    egl_gbm.gbm_bo = gbm_surface_lock_front_buffer(egl_gbm.gbm_surface);
+    if (!egl_gbm.gbm_bo) {
+        fake_log(ERROR, "gbm_surface_lock_front_buffer failed");
+        return;
     }
-
-    load_egl_proc(&egl_gbm.procs.eglGetPlatformDisplayEXT,
-            "eglGetPlatformDisplayEXT");
-
-    load_egl_proc(&egl_gbm.procs.eglCreatePlatformWindowSurfaceEXT,
-            "eglCreatePlatformWindowSurfaceEXT");
-
-    egl_gbm.exts.KHR_platform_gbm =
-        check_egl_ext(client_exts_str, "EGL_KHR_platform_gbm");
-
-    egl_gbm.exts.EXT_platform_device =
-        check_egl_ext(client_exts_str, "EGL_EXT_platform_device");
-
-    if (check_egl_ext(client_exts_str, "EGL_EXT_device_base") ||
-            check_egl_ext(client_exts_str, "EGL_EXT_device_enumeration")) {
-        load_egl_proc(&egl_gbm.procs.eglQueryDevicesEXT, "eglQueryDevicesEXT");
+    // The surface cycles through a handful of bos, only the first lock of
+    // each one creates a framebuffer
+    egl_gbm.fb_id = kms_fb_from_bo(kms, egl_gbm.gbm_bo);
+    if (!egl_gbm.fb_id) {
+        gbm_surface_release_buffer(egl_gbm.gbm_surface, egl_gbm.gbm_bo);
+        return;
     }
 
-    if (check_egl_ext(client_exts_str, "EGL_EXT_device_base") ||
-            check_egl_ext(client_exts_str, "EGL_EXT_device_query")) {
-        egl_gbm.exts.EXT_device_query = true;
-        load_egl_proc(&egl_gbm.procs.eglQueryDeviceStringEXT,
-                "eglQueryDeviceStringEXT");
-        load_egl_proc(&egl_gbm.procs.eglQueryDisplayAttribEXT,
-                "eglQueryDisplayAttribEXT");
+    bool shown;
+    if (!front_bo) {
+        shown = kms->impl->set_crtc(kms, egl_gbm.fb_id) == 0;
+    } else {
+        shown = kms->impl->page_flip(kms, egl_gbm.fb_id, NULL) == 0;
+        while (shown && kms->flip_pending) {
+            shown = kms_wait_event(kms, 1000);
+        }
     }
-
-    if (check_egl_ext(client_exts_str, "EGL_KHR_debug")) {
-        load_egl_proc(&egl_gbm.procs.eglDebugMessageControlKHR,
-                "eglDebugMessageControlKHR");
-
-        static const EGLAttrib debug_attribs[] = {
-            EGL_DEBUG_MSG_CRITICAL_KHR,
-            EGL_TRUE,
-            EGL_DEBUG_MSG_ERROR_KHR,
-            EGL_TRUE,
-            EGL_DEBUG_MSG_WARN_KHR,
-            EGL_TRUE,
-            EGL_DEBUG_MSG_INFO_KHR,
-            EGL_TRUE,
-            EGL_NONE,
-        };
-        egl_gbm.procs.eglDebugMessageControlKHR(egl_log, debug_attribs);
+    // front_bo goes back to the surface after the flip event, by then no
+    // release fence is needed
+    if (kms->out_fence_fd >= 0) {
+        close(kms->out_fence_fd);
+        kms->out_fence_fd = -1;
     }
 
-    if (EGL_FALSE == eglBindAPI(EGL_OPENGL_ES_API)) {
-        fake_log(ERROR, "Failed to bind to the OpenGL ES API");
-        return false;
+    // The old buffer is still on screen unless the new one made it there
+    if (!shown) {
+        fake_log(ERROR, "Failed to show surface buffer, keeping the previous "
+                "one on screen");
+        gbm_surface_release_buffer(egl_gbm.gbm_surface, egl_gbm.gbm_bo);
+        return;
     }
-
-    return true;
+    if (front_bo) {
+        gbm_surface_release_buffer(egl_gbm.gbm_surface, front_bo);
+    }
+    front_bo = egl_gbm.gbm_bo;
 }
 
-bool init_egl() {
+static struct ctx_pool *ctx_pool = NULL;
+static struct target_pool *target_pool = NULL;
+static uint64_t draw_count = 0;
+static int64_t draw_ns = 0, draw_max_ns = 0;
+// GPU track of the pooled context draws last ran on
+static struct trace_gpu *draw_gpu = NULL;
+static EGLContext draw_gpu_context = EGL_NO_CONTEXT;
 
-    // basic check egl
-    if (!check_basic_egl()) {
-        return false;
+// Collect every span still in flight and drop the GPU track, which belongs
+// to the context it was created on.
+static void draw_gpu_finish(void)
+{
+    if (!draw_gpu) {
+        return;
     }
-
-    // create egl device
-    egl_gbm.exts.EXT_platform_device = false;
-    if (egl_gbm.exts.EXT_platform_device) {
-        /*
-         * Search for the EGL device matching the DRM fd using the
-         * EXT_device_enumeration extension.
-         */
-        EGLDeviceEXT egl_device = get_egl_device_from_fd(egl_gbm.card_fd);
-        if (egl_device != EGL_NO_DEVICE_EXT) {
-            if (egl_init(EGL_PLATFORM_DEVICE_EXT, egl_device)) {
-                fake_log(DEBUG, "Using EGL_PLATFORM_DEVICE_EXT");
-                return true;
-            }
-            goto error;
-        }
-
-    } else {
-        fake_log(DEBUG, "EXT_platform_device not supported");
+    EGLContext current = eglGetCurrentContext();
+    EGLSurface draw = eglGetCurrentSurface(EGL_DRAW);
+    EGLSurface read = eglGetCurrentSurface(EGL_READ);
+    if (current != draw_gpu_context) {
+        eglMakeCurrent(egl_gbm.display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                draw_gpu_context);
     }
-
-    if (egl_gbm.exts.KHR_platform_gbm) {
-        // we use egl swapbuffer to set crtc muse card fd
-        int gbm_fd = egl_gbm.card_fd;//open_render_node(egl_gbm.card_fd);
-        if (gbm_fd < 0) {
-            fake_log(ERROR, "Failed to open DRM render node");
-            goto error;
-        }
-
-        egl_gbm.gbm_device = gbm_create_device(gbm_fd);
-        if (!egl_gbm.gbm_device) {
-            close(gbm_fd);
-            fake_log(ERROR, "Failed to create GBM device");
-            goto error;
-        }
-
-        // use gbm surface to gen window surface
-        egl_gbm.gbm_surface = gbm_surface_create(
-                egl_gbm.gbm_device, egl_gbm.mode.hdisplay, egl_gbm.mode.vdisplay,
-                GBM_FORMAT_XRGB8888, GBM_BO_USE_SCANOUT |  GBM_BO_USE_RENDERING);
-        if (!egl_gbm.gbm_surface) {
-            gbm_device_destroy(egl_gbm.gbm_device);
-            close(gbm_fd);
-            fake_log(ERROR, "Failed to create GBM Surface");
-            goto error;
-        }
-
-        // 这里注意，后面需要有一些显卡需要用card节点创建
-        // 比如Mali-G76是要用car0来创建gbm_device，才能拿到EGL display的
-        // 后面在修改代码；
-        if (egl_init(EGL_PLATFORM_GBM_KHR, egl_gbm.gbm_device)) {
-            fake_log(DEBUG, "Using EGL_PLATFORM_GBM_KHR");
-            return true;
-        }
-
-        gbm_surface_destroy(egl_gbm.gbm_surface);
-        gbm_device_destroy(egl_gbm.gbm_device);
-        close(gbm_fd);
+    trace_gpu_destroy(draw_gpu);
+    draw_gpu = NULL;
+    draw_gpu_context = EGL_NO_CONTEXT;
+    if (current != EGL_NO_CONTEXT) {
+        eglMakeCurrent(egl_gbm.display, draw, read, current);
     } else {
-        fake_log(DEBUG, "KHR_platform_gbm not supported");
-    }
-
-error:
-    fake_log(ERROR, "Failed to initialize EGL context");
-    if (egl_gbm.display) {
         eglMakeCurrent(egl_gbm.display, EGL_NO_SURFACE, EGL_NO_SURFACE,
                 EGL_NO_CONTEXT);
-        eglTerminate(egl_gbm.display);
     }
-    eglReleaseThread();
-
-    return false;
 }
 
-bool init_gbm(const char *path) {
-
-    egl_gbm.render_fd = open(path, O_RDWR | O_CLOEXEC);
-    assert(-1 != egl_gbm.render_fd);
-
-    egl_gbm.gbm_device = gbm_create_device(egl_gbm.render_fd);
-    assert(NULL != egl_gbm.gbm_device);
-
-    // https://mlog.club/article/1818788
-    // https://cgit.freedesktop.org/mesa/mesa/commit/src/egl/main?id=468cc866b4b308cee40470f06b31002c6c56da96
-    // use surface to manage buffer
-    egl_gbm.gbm_surface = gbm_surface_create(
-            egl_gbm.gbm_device, egl_gbm.mode.hdisplay, egl_gbm.mode.vdisplay,
-            GBM_FORMAT_XRGB8888, GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
-    assert(NULL != egl_gbm.gbm_surface);
-
-    return true;
+static int64_t get_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
-static drmModeConnector *find_connector(int fd, drmModeRes *resources) {
-
-    for (int i = 0; i < resources->count_connectors; i++) {
-        drmModeConnector *connector =
-            drmModeGetConnector(fd, resources->connectors[i]);
-        if (connector->connection == DRM_MODE_CONNECTED) {
-            return connector;
-        }
-        drmModeFreeConnector(connector);
+// Make a pooled context current as egl_gbm.off_screen_context, NULL if none
+// is left. The returned start time covers the draw only, creating contexts
+// is accounted for by the pool.
+static int64_t draw_begin(void)
+{
+    egl_gbm.off_screen_context = ctx_pool_acquire(ctx_pool);
+    if (!egl_gbm.off_screen_context) {
+        return 0;
     }
-    return NULL; // if no connector found
-}
-
-static drmModeEncoder *find_encoder(int fd, drmModeRes *resources,
-        drmModeConnector *connector) {
-
-    if (connector->encoder_id) {
-        return drmModeGetEncoder(fd, connector->encoder_id);
+    eglMakeCurrent(egl_gbm.display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+            egl_gbm.off_screen_context);
+    if (trace_enabled() && draw_gpu_context != egl_gbm.off_screen_context) {
+        draw_gpu_finish();
+        draw_gpu = trace_gpu_create(&gles_fake);
+        draw_gpu_context = egl_gbm.off_screen_context;
     }
-    return NULL; // if no encoder found
+    return get_time_ns();
 }
 
-bool init_kms(const char *path) {
-    egl_gbm.card_fd = open(path, O_RDWR | O_CLOEXEC);
-    assert(-1 != egl_gbm.card_fd);
-
-    egl_gbm.resources = drmModeGetResources(egl_gbm.card_fd);
-    assert(NULL != egl_gbm.resources);
-
-    egl_gbm.connector = find_connector(egl_gbm.card_fd, egl_gbm.resources);
-    assert(NULL != egl_gbm.connector);
-
-    fake_log(INFO, "Modes list:");
-    for (int i = 0; i < egl_gbm.connector->count_modes; i++) {
-        fake_log(INFO, "    Mode %d: %s", i, egl_gbm.connector->modes[i].name);
+static void draw_end(int64_t start)
+{
+    int64_t elapsed = get_time_ns() - start;
+    draw_count++;
+    draw_ns += elapsed;
+    if (elapsed > draw_max_ns) {
+        draw_max_ns = elapsed;
     }
-
-    egl_gbm.connector_id = egl_gbm.connector->connector_id;
-    egl_gbm.mode = egl_gbm.connector->modes[0];
-
-    egl_gbm.encoder =
-        find_encoder(egl_gbm.card_fd, egl_gbm.resources, egl_gbm.connector);
-    assert(NULL != egl_gbm.encoder);
-
-    egl_gbm.crtc = drmModeGetCrtc(egl_gbm.card_fd, egl_gbm.encoder->crtc_id);
-    assert(NULL != egl_gbm.crtc);
-
-    drmModeFreeEncoder(egl_gbm.encoder);
-    drmModeFreeConnector(egl_gbm.connector);
-    drmModeFreeResources(egl_gbm.resources);
-
-    return true;
+    trace_gpu_collect(draw_gpu, false);
+    // Unbinds it too. The readback ring stays tied to the context, which the
+    // next draw most likely gets back.
+    ctx_pool_release(ctx_pool, egl_gbm.off_screen_context);
 }
 
-bool init_opengles(struct egl *egl) {
-    if (!egl_make_current(egl)) {
-        goto error;
-    }
-
-    const char *exts_str = (const char *)glGetString(GL_EXTENSIONS);
-    if (exts_str == NULL) {
-        fake_log(ERROR, "Failed to get GL_EXTENSIONS");
-        goto error;
-    }
-    gles_fake.egl = egl;
-    gles_fake.exts_str = exts_str;
-    gles_fake.drm_fd = -1;
-
-    if (!gles_fake.egl->exts.EXT_image_dma_buf_import) {
-        fake_log(ERROR, "EGL_EXT_image_dma_buf_import not supported");
-        goto error;
-    }
-
-    if (!check_gl_ext(exts_str, "GL_EXT_texture_format_BGRA8888")) {
-        fake_log(ERROR, "BGRA8888 format not supported by GLES2");
-        goto error;
-    }
-    if (!check_gl_ext(exts_str, "GL_EXT_unpack_subimage")) {
-        fake_log(ERROR, "GL_EXT_unpack_subimage not supported");
-        goto error;
-    }
-
-    gles_fake.exts.EXT_read_format_bgra =
-        check_gl_ext(exts_str, "GL_EXT_read_format_bgra");
-
-    gles_fake.exts.EXT_texture_type_2_10_10_10_REV =
-        check_gl_ext(exts_str, "GL_EXT_texture_type_2_10_10_10_REV");
-
-    gles_fake.exts.OES_texture_half_float_linear =
-        check_gl_ext(exts_str, "GL_OES_texture_half_float_linear");
-
-    gles_fake.exts.EXT_texture_norm16 =
-        check_gl_ext(exts_str, "GL_EXT_texture_norm16");
-
-    if (check_gl_ext(exts_str, "GL_KHR_debug")) {
-        gles_fake.exts.KHR_debug = true;
-        load_gl_proc(&gles_fake.procs.glDebugMessageCallbackKHR,
-                "glDebugMessageCallbackKHR");
-        load_gl_proc(&gles_fake.procs.glDebugMessageControlKHR,
-                "glDebugMessageControlKHR");
-    }
-
-    if (check_gl_ext(exts_str, "GL_OES_EGL_image_external")) {
-        gles_fake.exts.OES_egl_image_external = true;
-        load_gl_proc(&gles_fake.procs.glEGLImageTargetTexture2DOES,
-                "glEGLImageTargetTexture2DOES");
+static void draw_log_stats(void)
+{
+    if (draw_count) {
+        fake_log(INFO, "%lu draws, avg %.3f ms, max %.3f ms",
+                (unsigned long)draw_count,
+                (double)draw_ns / draw_count / 1000000,
+                (double)draw_max_ns / 1000000);
     }
-
-    if (check_gl_ext(exts_str, "GL_OES_EGL_image")) {
-        gles_fake.exts.OES_egl_image = true;
-        load_gl_proc(&gles_fake.procs.glEGLImageTargetRenderbufferStorageOES,
-                "glEGLImageTargetRenderbufferStorageOES");
+    ctx_pool_log_stats(ctx_pool);
+    if (target_pool) {
+        target_pool_log_stats(target_pool);
     }
-
-    fake_log(INFO, "Using %s", glGetString(GL_VERSION));
-    fake_log(INFO, "GL vendor: %s", glGetString(GL_VENDOR));
-    fake_log(INFO, "GL renderer: %s", glGetString(GL_RENDERER));
-    fake_log(INFO, "Supported GLES2 extensions: %s", exts_str);
-
-    return true;
-
-error:
-    return false;
 }
 
-static void draw_color_use_window_surface() {
-    eglMakeCurrent(egl_gbm.display, egl_gbm.window_surface,
-            egl_gbm.window_surface, egl_gbm.context);
-    glClearColor(1.0f, 0.0f, 0.0f, 0.0f);
-    glClear(GL_COLOR_BUFFER_BIT);
-    eglSwapBuffers(egl_gbm.display, egl_gbm.window_surface);
-    eglMakeCurrent(egl_gbm.display, EGL_NO_SURFACE, EGL_NO_SURFACE,
-            EGL_NO_CONTEXT);
-}
-
-static void read_draw_to_file(EGLSurface draw, EGLSurface read, EGLContext context)
+// The clear every pooled draw does, timed on the CPU and GPU side
+static void draw_clear_and_flush(float r, float g, float b)
 {
-    eglMakeCurrent(egl_gbm.display, draw, read , context);
-    static FILE *file = NULL;
-    static GLbyte *pbits = NULL;  /* CPU memory to save image */
-    static uint32_t frame_cnt = 0;
-    uint32_t frame_size = 10 * 10 * 4;
-    if (!file) {
-        file = fopen("rgba.bin", "w+");
-        assert(file);
-        pbits = (GLbyte *)malloc(frame_size);
-        assert(pbits);
-    }
-    glReadPixels(0, 0, 10, 10, GL_RGBA, GL_UNSIGNED_BYTE, pbits);
-    size_t ret = fwrite(pbits, 1, frame_size, file);
-}
+    trace_gpu_begin(draw_gpu, "clear");
+    struct trace_scope scope = trace_scope_begin("glClear");
+    glClearColor(r, g, b, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+    trace_scope_end(&scope);
+    trace_gpu_end(draw_gpu);
 
-static void scan_output_surface_to_display()
-{
-    eglMakeCurrent(egl_gbm.display, egl_gbm.window_surface,
-            egl_gbm.window_surface, egl_gbm.context);
-    egl_gbm.gbm_bo = gbm_surface_lock_front_buffer(egl_gbm.gbm_surface);
-    egl_gbm.handle = gbm_bo_get_handle(egl_gbm.gbm_bo).u32;
-    egl_gbm.pitch =
-        gbm_bo_get_stride(egl_gbm.gbm_bo); // pitch = mode.hdisplay * 4
-    // fake_log(ERROR, "handle = %d pitch = %d", egl_gbm.handle, egl_gbm.pitch);
-    drmModeAddFB(egl_gbm.card_fd, egl_gbm.mode.hdisplay, egl_gbm.mode.vdisplay,
-            24, 32, egl_gbm.pitch, egl_gbm.handle, &egl_gbm.fb_id);
-    drmModeSetCrtc(egl_gbm.card_fd, egl_gbm.crtc->crtc_id, egl_gbm.fb_id, 0, 0,
-            &egl_gbm.connector_id, 1, &egl_gbm.mode);
-    getchar();
+    scope = trace_scope_begin("glFlush");
+    glFlush();
+    trace_scope_end(&scope);
 }
 
 static void draw_color_to_fbo_texture(){
+    TRACE_SCOPE("draw_color_to_fbo_texture");
 
     // Texture
-    //off_screen_context
-    static const EGLint context_attribs[] = {
-        EGL_CONTEXT_CLIENT_VERSION, 2,
-        EGL_NONE
-    };
-    egl_gbm.off_screen_context = eglCreateContext(egl_gbm.display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, context_attribs);
-    eglMakeCurrent(egl_gbm.display, EGL_NO_SURFACE, EGL_NO_SURFACE,
-            egl_gbm.off_screen_context);
+    // off_screen_context
+    int64_t draw_start = draw_begin();
+    if (!egl_gbm.off_screen_context) {
+        return;
+    }
 
     glGenTextures(1, &egl_gbm.texture_target_1);
     glBindTexture(GL_TEXTURE_2D, egl_gbm.texture_target_1);
@@ -1025,465 +523,356 @@ static void draw_color_to_fbo_texture(){
     }
 
 
-    glClearColor(0.0f, 1.0f, 0.0f, 0.0f);
-    glClear(GL_COLOR_BUFFER_BIT);
-    glFlush();
+    draw_clear_and_flush(0.0f, 1.0f, 0.0f);
     read_draw_to_file(EGL_NO_SURFACE, EGL_NO_SURFACE, egl_gbm.off_screen_context);
 
 
     glBindTexture(GL_TEXTURE_2D, 0);
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    eglMakeCurrent(egl_gbm.display, EGL_NO_SURFACE, EGL_NO_SURFACE,
-            EGL_NO_CONTEXT);
+    // The context outlives this draw now, do not pile up objects in it
+    glDeleteFramebuffers(1, &egl_gbm.fbo);
+    glDeleteTextures(1, &egl_gbm.texture_target_1);
+    draw_end(draw_start);
 
 }
 
-static void draw_color_to_fbo_renderbuffer_display(){
+// Cleared by benchmark loops, which cannot stop at every frame
+static bool wait_for_key = true;
 
-    // dmabuf: create gbm_bo
-    egl_gbm.gbm_rbo = gbm_bo_create(
-            egl_gbm.gbm_device, egl_gbm.mode.hdisplay, egl_gbm.mode.vdisplay,
-            GBM_FORMAT_XRGB8888, GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
-    assert(NULL != egl_gbm.gbm_rbo);
-    // RGB plane count = 1
-    // YUY may be plane count = 3
-    egl_gbm.plane_count = gbm_bo_get_plane_count(egl_gbm.gbm_rbo);
-    egl_gbm.strides[0] = gbm_bo_get_stride(egl_gbm.gbm_rbo);
-	egl_gbm.dmabuf_fds[0] = gbm_bo_get_fd(egl_gbm.gbm_rbo);
-    egl_gbm.offsets[0] = gbm_bo_get_offset(egl_gbm.gbm_rbo,0);
-    fake_log(ERROR, "plane_count = %d offset = %d strides = %d dmabuf_fds = %d", egl_gbm.plane_count, egl_gbm.offsets[0], egl_gbm.strides[0], egl_gbm.dmabuf_fds[0]);
-
-
-   // egl_image create
-    const EGLint attribs_test[] = {
-        EGL_WIDTH, egl_gbm.mode.hdisplay,
-        EGL_HEIGHT, egl_gbm.mode.vdisplay,
-        EGL_LINUX_DRM_FOURCC_EXT, GBM_FORMAT_ARGB8888,
-        EGL_DMA_BUF_PLANE0_FD_EXT, egl_gbm.dmabuf_fds[0],
-        EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0,
-        EGL_DMA_BUF_PLANE0_PITCH_EXT, egl_gbm.strides[0],
-        EGL_NONE,
+static struct render_target *acquire_display_target(
+        enum render_target_alloc alloc, enum egl_image_target attach)
+{
+    const struct render_target_key key = {
+        .width = egl_gbm.mode.hdisplay,
+        .height = egl_gbm.mode.vdisplay,
+        .format = DRM_FORMAT_ARGB8888,
+        .modifier = DRM_FORMAT_MOD_INVALID,
+        .alloc = alloc,
+        .attach = attach,
     };
+    return target_pool_acquire(target_pool, &key);
+}
 
-    // EGL_KHR_image_base + EGL_EXT_image_dma_buf_import
-    egl_gbm.egl_image = egl_gbm.procs.eglCreateImageKHR(egl_gbm.display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs_test);
-    assert(EGL_NO_IMAGE_KHR != egl_gbm.egl_image);
+// What show_target() sets the CRTC through, NULL until main() made it
+static struct kms_backend *display_kms = NULL;
 
-    // Render Buffer
-    //off_screen_context
-    static const EGLint context_attribs[] = {
-        EGL_CONTEXT_CLIENT_VERSION, 2,
-        EGL_NONE
-    };
-    egl_gbm.off_screen_context = eglCreateContext(egl_gbm.display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, context_attribs);
+static void show_target(struct render_target *target)
+{
+    fake_log(DEBUG, "handle = %d pitch = %d", target->handle, target->stride);
+    uint32_t fb_id = render_target_fb_id(target);
+    if (fb_id && display_kms) {
+        TRACE_SCOPE("show_target set_crtc");
+        // The display waits for the draw, not the CPU
+        if (display_kms->explicit_sync) {
+            display_kms->in_fence_fd = egl_dup_render_fence(&egl_gbm);
+        }
+        display_kms->impl->set_crtc(display_kms, fb_id);
+        if (display_kms->out_fence_fd >= 0) {
+            close(display_kms->out_fence_fd);
+            display_kms->out_fence_fd = -1;
+        }
+    }
+    if (wait_for_key) {
+        getchar();
+    }
+}
+
+// Pooled targets hold textures and FBOs, so one of the contexts they were
+// made on has to be current while they go
+static void release_draw_pools(void)
+{
+    draw_gpu_finish();
+    EGLContext context = ctx_pool_acquire(ctx_pool);
+    if (context) {
+        eglMakeCurrent(egl_gbm.display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                context);
+    }
+    target_pool_destroy(target_pool);
+    target_pool = NULL;
+    ctx_pool_destroy(ctx_pool);
+    ctx_pool = NULL;
+}
+
+// The surface bos carry framebuffers of the backend that showed them
+static void release_window_surface(void)
+{
     eglMakeCurrent(egl_gbm.display, EGL_NO_SURFACE, EGL_NO_SURFACE,
-            egl_gbm.off_screen_context);
+            EGL_NO_CONTEXT);
+    if (front_bo) {
+        gbm_surface_release_buffer(egl_gbm.gbm_surface, front_bo);
+        front_bo = NULL;
+    }
+    eglDestroySurface(egl_gbm.display, egl_gbm.window_surface);
+    egl_gbm.window_surface = EGL_NO_SURFACE;
+    gbm_surface_destroy(egl_gbm.gbm_surface);
+    egl_gbm.gbm_surface = NULL;
+}
 
-	glGenRenderbuffers(1, &egl_gbm.renderbuffer);
-	glBindRenderbuffer(GL_RENDERBUFFER, egl_gbm.renderbuffer);
-    // GL_OES_EGL_image
-    gles_fake.procs.glEGLImageTargetRenderbufferStorageOES(GL_RENDERBUFFER, egl_gbm.egl_image);
+// Pools and sink first, buffers must be gone before their backend
+static void release_outputs(struct kms_backend **outputs, int count)
+{
+    release_draw_pools();
+    frame_sink_destroy(frame_sink);
+    frame_sink = NULL;
+    display_kms = NULL;
+    for (int i = 0; i < count; i++) {
+        kms_backend_destroy(outputs[i]);
+    }
+}
 
-    // Fbo
-    glGenFramebuffers(1, &egl_gbm.fbo);
-    glBindFramebuffer(GL_FRAMEBUFFER, egl_gbm.fbo);
-    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-            GL_RENDERBUFFER, egl_gbm.renderbuffer);
+static void draw_color_to_fbo_renderbuffer_display(){
+    TRACE_SCOPE("draw_color_to_fbo_renderbuffer_display");
 
-    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
-        fprintf(stderr, "FBO creation failed\n");
+    // Render Buffer
+    // off_screen_context
+    int64_t draw_start = draw_begin();
+    if (!egl_gbm.off_screen_context) {
+        return;
     }
 
+    // gbm_bo, EGLImage, renderbuffer and FBO, kept alive by the pool
+    struct render_target *target =
+        acquire_display_target(RENDER_TARGET_GBM, renderbuffer);
+    if (!target) {
+        draw_end(draw_start);
+        return;
+    }
 
-    glClearColor(0.0f, 0.0f, 1.0f, 0.0f);
-    glClear(GL_COLOR_BUFFER_BIT);
-    glFlush();
+    draw_clear_and_flush(0.0f, 0.0f, 1.0f);
     read_draw_to_file(EGL_NO_SURFACE, EGL_NO_SURFACE, egl_gbm.off_screen_context);
-    egl_gbm.handle = gbm_bo_get_handle(egl_gbm.gbm_rbo).u32;
-    egl_gbm.pitch =
-        gbm_bo_get_stride(egl_gbm.gbm_rbo); // pitch = mode.hdisplay * 4
-    fake_log(ERROR, "handle = %d pitch = %d", egl_gbm.handle, egl_gbm.pitch);
-    drmModeAddFB(egl_gbm.card_fd, egl_gbm.mode.hdisplay, egl_gbm.mode.vdisplay,
-            24, 32, egl_gbm.pitch, egl_gbm.handle, &egl_gbm.fb_id);
-    drmModeSetCrtc(egl_gbm.card_fd, egl_gbm.crtc->crtc_id, egl_gbm.fb_id, 0, 0,
-            &egl_gbm.connector_id, 1, &egl_gbm.mode);
-    getchar();
-
-    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    show_target(target);
+
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    eglDestroyImage(egl_gbm.display, egl_gbm.egl_image);
-    eglMakeCurrent(egl_gbm.display, EGL_NO_SURFACE, EGL_NO_SURFACE,
-            EGL_NO_CONTEXT);
+    target_pool_release(target);
+    draw_end(draw_start);
 
 }
-static void draw_color_to_fbo_dumb_buffer_display(enum egl_image_target target ) {
-
-    // dmabuf: use dumb buffer
-    struct dmabuf_dumb_buffer dumb_buffer_dmabuf = {0};
-    drmModeCreateDumbBuffer(egl_gbm.card_fd, egl_gbm.mode.hdisplay, egl_gbm.mode.vdisplay, 32,
-            0 , &dumb_buffer_dmabuf.handle, &dumb_buffer_dmabuf.stride,
-            &dumb_buffer_dmabuf.size);
-    // get prime_fd by dma-buf
-    drmPrimeHandleToFD(egl_gbm.card_fd, dumb_buffer_dmabuf.handle, DRM_CLOEXEC, &dumb_buffer_dmabuf.prime_fd);
-
-
-   // egl_image create
-    const EGLint attribs_test[] = {
-        EGL_WIDTH, egl_gbm.mode.hdisplay,
-        EGL_HEIGHT, egl_gbm.mode.vdisplay,
-        EGL_LINUX_DRM_FOURCC_EXT, GBM_FORMAT_ARGB8888,
-        EGL_DMA_BUF_PLANE0_FD_EXT, dumb_buffer_dmabuf.prime_fd,
-        EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0,
-        EGL_DMA_BUF_PLANE0_PITCH_EXT, dumb_buffer_dmabuf.stride,
-        EGL_NONE,
-    };
-
-    // EGL_KHR_image_base + EGL_EXT_image_dma_buf_import
-    egl_gbm.egl_image = egl_gbm.procs.eglCreateImageKHR(egl_gbm.display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs_test);
-    assert(EGL_NO_IMAGE_KHR != egl_gbm.egl_image);
+static void draw_color_to_fbo_dumb_buffer_display(enum egl_image_target attach) {
+    TRACE_SCOPE("draw_color_to_fbo_dumb_buffer_display");
 
     // Texture or Render Buffer
     // off_screen_context
-    static const EGLint context_attribs[] = {
-        EGL_CONTEXT_CLIENT_VERSION, 2,
-        EGL_NONE
-    };
-    egl_gbm.off_screen_context = eglCreateContext(egl_gbm.display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, context_attribs);
-    eglMakeCurrent(egl_gbm.display, EGL_NO_SURFACE, EGL_NO_SURFACE,
-            egl_gbm.off_screen_context);
-
-    // Fbo
-    glGenFramebuffers(1, &egl_gbm.fbo);
-    glBindFramebuffer(GL_FRAMEBUFFER, egl_gbm.fbo);
-
-    if (target == texture)
-    {
-        glGenTextures(1, &egl_gbm.texture_render);
-        glBindTexture(GL_TEXTURE_2D, egl_gbm.texture_render);
-        // GL_OES_EGL_image
-        gles_fake.procs.glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, egl_gbm.egl_image);
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, egl_gbm.texture_render, 0);
-    } else if (target == renderbuffer) {
-        glGenRenderbuffers(1, &egl_gbm.renderbuffer);
-        glBindRenderbuffer(GL_RENDERBUFFER, egl_gbm.renderbuffer);
-        // GL_OES_EGL_image
-        gles_fake.procs.glEGLImageTargetRenderbufferStorageOES(GL_RENDERBUFFER, egl_gbm.egl_image);
-        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-                GL_RENDERBUFFER, egl_gbm.renderbuffer);
+    int64_t draw_start = draw_begin();
+    if (!egl_gbm.off_screen_context) {
+        return;
     }
 
-
-    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
-        fprintf(stderr, "FBO creation failed\n");
+    // dmabuf: use dumb buffer, imported once and reused by the pool
+    struct render_target *target =
+        acquire_display_target(RENDER_TARGET_DUMB, attach);
+    if (!target) {
+        draw_end(draw_start);
+        return;
     }
 
+    draw_clear_and_flush(0.0f, 0.0f, 1.0f);
+    if (!capture_frame_mapped(target)) {
+        read_draw_to_file(EGL_NO_SURFACE, EGL_NO_SURFACE, egl_gbm.off_screen_context);
+    }
+    show_target(target);
 
-    glClearColor(0.0f, 0.0f, 1.0f, 0.0f);
-    glClear(GL_COLOR_BUFFER_BIT);
-    glFlush();
-    read_draw_to_file(EGL_NO_SURFACE, EGL_NO_SURFACE, egl_gbm.off_screen_context);
-    fake_log(ERROR, "handle = %d pitch = %d", dumb_buffer_dmabuf.handle, dumb_buffer_dmabuf.stride);
-    drmModeAddFB(egl_gbm.card_fd, egl_gbm.mode.hdisplay, egl_gbm.mode.vdisplay,
-            24, 32, dumb_buffer_dmabuf.stride, dumb_buffer_dmabuf.handle, &dumb_buffer_dmabuf.fb_id);
-    drmModeSetCrtc(egl_gbm.card_fd, egl_gbm.crtc->crtc_id, dumb_buffer_dmabuf.fb_id, 0, 0,
-            &egl_gbm.connector_id, 1, &egl_gbm.mode);
-    getchar();
-
-    glBindTexture(GL_TEXTURE_2D, 0);
-    glBindRenderbuffer(GL_RENDERBUFFER, 0);
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    eglDestroyImage(egl_gbm.display, egl_gbm.egl_image);
-    eglMakeCurrent(egl_gbm.display, EGL_NO_SURFACE, EGL_NO_SURFACE,
-            EGL_NO_CONTEXT);
+    target_pool_release(target);
+    draw_end(draw_start);
 
 }
 
-
 int main(int argc, char **argv) {
 
     log_init(DEBUG, NULL);
+    // EGL_GBM_LOG_ASYNC=1: keep log writes off the render thread.
+    // EGL_GBM_LOG_BINARY=<file>: also skip formatting, read the file back
+    // with egl_gbm_log_decode.
+    const char *binary_log = getenv("EGL_GBM_LOG_BINARY");
+    if (binary_log) {
+        log_start_binary(binary_log);
+    } else if (env_parse_bool("EGL_GBM_LOG_ASYNC")) {
+        log_start_async();
+    }
 
     fake_log(ERROR, "hello check!");
 
-    init_kms("/dev/dri/card0");
+    // EGL_GBM_TRACE=<file>: Chrome trace JSON of the whole run
+    const char *trace_path = getenv("EGL_GBM_TRACE");
+    if (trace_path) {
+        trace_init(trace_path);
+    }
+
+    capture_mode = capture_mode_from_env();
+
+    const char *cmd = argc > 1 ? argv[1] : NULL;
+    bool mock_kms = env_parse_bool("EGL_GBM_KMS_MOCK");
+    if (mock_kms) {
+        const char *node = getenv("EGL_GBM_RENDER_NODE");
+        if (!init_kms_mock(node ? node : "/dev/dri/renderD128")) {
+            return 1;
+        }
+    } else {
+        init_kms("/dev/dri/card0");
+    }
 
     // gbm init move to init_egl
     // init_gbm("/dev/dri/renderD128");
 
-    if (!init_egl())
+    if (!init_egl(&egl_gbm))
         fake_log(ERROR, "The current device egl cannot meet the operating "
                 "conditions of wlroots!!!");
 
-    if (!init_opengles(&egl_gbm))
+    if (!init_opengles(&gles_fake, &egl_gbm))
         fake_log(ERROR, "The current device opengles cannot meet the operating "
                 "conditions of wlroots!!!");
 
     fake_log(ERROR, "hello world!");
-    fake_log(ERROR, "start off-scrren draw!!!");
-    //draw_color_use_window_surface();
-    //scan_output_surface_to_display();
-    //read_draw_to_file(egl_gbm.window_surface, egl_gbm.window_surface, egl_gbm.context);
-
-    //draw_color_to_fbo_texture();
-    //draw_color_to_fbo_renderbuffer_display();
 
-    draw_color_to_fbo_dumb_buffer_display(texture);
-    return 0;
-}
-
-bool egl_make_current(struct egl *egl) {
-    if (!eglMakeCurrent(egl->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
-                egl->context)) {
-        fake_log(ERROR, "eglMakeCurrent failed");
-        return false;
-    }
-    return true;
-}
-
-static bool check_gl_ext(const char *exts, const char *ext) {
-    size_t extlen = strlen(ext);
-    const char *end = exts + strlen(exts);
-
-    while (exts < end) {
-        if (exts[0] == ' ') {
-            exts++;
-            continue;
-        }
-        size_t n = strcspn(exts, " ");
-        if (n == extlen && strncmp(ext, exts, n) == 0) {
-            return true;
+    // One backend per output, they share the card fd and its events.
+    // Atomic when the driver has it, EGL_GBM_KMS_LEGACY=1 forces the legacy
+    // drmModeSetCrtc/drmModePageFlip path.
+    bool legacy_kms = env_parse_bool("EGL_GBM_KMS_LEGACY");
+    struct kms_backend *outputs[KMS_MAX_OUTPUTS];
+    for (int i = 0; i < kms_output_count; i++) {
+        const struct kms_output_config *out = &kms_outputs[i];
+        outputs[i] = NULL;
+        if (mock_kms) {
+            outputs[i] = kms_backend_create_mock(egl_gbm.card_fd, &out->mode);
+        } else if (!legacy_kms) {
+            outputs[i] = kms_backend_create_atomic(egl_gbm.card_fd,
+                    out->crtc_id, out->connector_id, &out->mode);
         }
-        exts += n;
-    }
-    return false;
-}
-
-static void load_gl_proc(void *proc_ptr, const char *name) {
-    void *proc = (void *)eglGetProcAddress(name);
-    if (proc == NULL) {
-        fake_log(ERROR, "glGetProcAddress(%s) failed", name);
-        abort();
-    }
-    *(void **)proc_ptr = proc;
-}
-
-static bool check_egl_ext(const char *exts, const char *ext) {
-    size_t extlen = strlen(ext);
-    const char *end = exts + strlen(exts);
-
-    while (exts < end) {
-        if (*exts == ' ') {
-            exts++;
-            continue;
+        if (!outputs[i] && !mock_kms) {
+            outputs[i] = kms_backend_create_drm(egl_gbm.card_fd, out->crtc_id,
+                    out->connector_id, &out->mode);
         }
-        size_t n = strcspn(exts, " ");
-        if (n == extlen && strncmp(ext, exts, n) == 0) {
-            return true;
+        if (!outputs[i]) {
+            return 1;
         }
-        exts += n;
     }
-    return false;
-}
-
-static void load_egl_proc(void *proc_ptr, const char *name) {
-    void *proc = (void *)eglGetProcAddress(name);
-    if (proc == NULL) {
-        fake_log(ERROR, "eglGetProcAddress(%s) failed", name);
-        abort();
-    }
-    *(void **)proc_ptr = proc;
-}
-
-static bool device_has_name(const drmDevice *device, const char *name) {
-    for (size_t i = 0; i < DRM_NODE_MAX; i++) {
-        if (!(device->available_nodes & (1 << i))) {
-            continue;
+    struct kms_backend *kms = outputs[0];
+    display_kms = kms;
+
+    // Lets the allocator pick tiled or compressed layouts the display takes
+    static struct drm_format_set scanout_formats = {0};
+    bool has_scanout_formats = kms_get_formats(kms, &scanout_formats);
+
+    ctx_pool = ctx_pool_create(&egl_gbm, egl_gbm.context, 1);
+    const char *budget_env = getenv("EGL_GBM_TARGET_BUDGET_MB");
+    uint64_t budget_mb = budget_env ? strtoull(budget_env, NULL, 10) : 64;
+    target_pool = target_pool_create(&gles_fake, budget_mb << 20,
+            has_scanout_formats ? &scanout_formats : NULL);
+    if (!ctx_pool || !target_pool) {
+        return 1;
+    }
+
+    // egl_gbm flip [frames] [buffers]: page-flip loop through a buffer ring
+    // on every output. EGL_GBM_FRAME_PACING=1: start each frame just in time
+    // for its vblank instead of as soon as a buffer is free.
+    if (cmd && strcmp(cmd, "flip") == 0) {
+        uint64_t frames = argc > 2 ? strtoull(argv[2], NULL, 10) : 600;
+        int buffers = argc > 3 ? atoi(argv[3]) : 3;
+        bool ok = present_run_loop(&gles_fake, outputs, kms_output_count,
+                buffers, frames, env_parse_bool("EGL_GBM_FRAME_PACING"));
+        release_outputs(outputs, kms_output_count);
+        return ok ? 0 : 1;
+    }
+
+    // egl_gbm scanout [frames] [WxH] [buffers]: client buffers put straight
+    // on a plane of the first output, composed with GL when none takes them
+    if (cmd && strcmp(cmd, "scanout") == 0) {
+        uint64_t frames = argc > 2 ? strtoull(argv[2], NULL, 10) : 600;
+        unsigned int width = kms->mode.hdisplay / 2;
+        unsigned int height = kms->mode.vdisplay / 2;
+        if (argc > 3 && sscanf(argv[3], "%ux%u", &width, &height) != 2) {
+            fake_log(ERROR, "Invalid client buffer size '%s'", argv[3]);
+            return 1;
         }
-        if (strcmp(device->nodes[i], name) == 0) {
-            return true;
+        int buffers = argc > 4 ? atoi(argv[4]) : 3;
+        bool ok = present_client_loop(&gles_fake, kms, buffers, frames,
+                width, height);
+        release_outputs(outputs, kms_output_count);
+        return ok ? 0 : 1;
+    }
+
+    if (cmd && strcmp(cmd, "readback") == 0) {
+        uint64_t frames = argc > 2 ? strtoull(argv[2], NULL, 10) : 300;
+        int depth = argc > 3 ? atoi(argv[3]) : readback_depth_from_env();
+        return draw_readback_loop(frames, depth) ? 0 : 1;
+    }
+
+    // egl_gbm workers [jobs] [max_threads] [size]: parallel offscreen jobs,
+    // one shared context per thread
+    if (cmd && strcmp(cmd, "workers") == 0) {
+        uint64_t jobs = argc > 2 ? strtoull(argv[2], NULL, 10) : 2000;
+        int threads = argc > 3 ? atoi(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+        uint32_t size = argc > 4 ? strtoul(argv[4], NULL, 10) : 256;
+        return worker_pool_benchmark(&gles_fake, threads, jobs, size, size) ?
+            0 : 1;
+    }
+
+    // egl_gbm batch [jobs] [batch_jobs] [size] [atlas]: small offscreen jobs
+    // set up one by one, then grouped into batches with one flush and fence
+    // each, then packed into an atlas with one readback per fill
+    if (cmd && strcmp(cmd, "batch") == 0) {
+        uint64_t jobs = argc > 2 ? strtoull(argv[2], NULL, 10) : 2000;
+        size_t batch_jobs = argc > 3 ? strtoul(argv[3], NULL, 10) : 64;
+        uint32_t size = argc > 4 ? strtoul(argv[4], NULL, 10) : 128;
+        uint32_t atlas = argc > 5 ? strtoul(argv[5], NULL, 10) : 2048;
+        return render_batcher_benchmark(&gles_fake, jobs, batch_jobs, size,
+                size, atlas) ? 0 : 1;
+    }
+
+    // egl_gbm contexts [jobs]: repeated offscreen draws on pooled contexts,
+    // context creation and draw latency reported apart
+    if (cmd && strcmp(cmd, "contexts") == 0) {
+        uint64_t jobs = argc > 2 ? strtoull(argv[2], NULL, 10) : 100;
+        for (uint64_t i = 0; i < jobs; i++) {
+            draw_color_to_fbo_texture();
         }
+        read_draw_finish();
+        draw_log_stats();
+        release_outputs(outputs, kms_output_count);
+        return 0;
     }
-    return false;
-}
-
-static enum log_importance egl_log_importance(EGLint type) {
-    switch (type) {
-        case EGL_DEBUG_MSG_CRITICAL_KHR:
-            return ERROR;
-        case EGL_DEBUG_MSG_ERROR_KHR:
-            return ERROR;
-        case EGL_DEBUG_MSG_WARN_KHR:
-            return ERROR;
-        case EGL_DEBUG_MSG_INFO_KHR:
-            return INFO;
-        default:
-            return INFO;
-    }
-}
-static const char *egl_error_str(EGLint error) {
-    switch (error) {
-        case EGL_SUCCESS:
-            return "EGL_SUCCESS";
-        case EGL_NOT_INITIALIZED:
-            return "EGL_NOT_INITIALIZED";
-        case EGL_BAD_ACCESS:
-            return "EGL_BAD_ACCESS";
-        case EGL_BAD_ALLOC:
-            return "EGL_BAD_ALLOC";
-        case EGL_BAD_ATTRIBUTE:
-            return "EGL_BAD_ATTRIBUTE";
-        case EGL_BAD_CONTEXT:
-            return "EGL_BAD_CONTEXT";
-        case EGL_BAD_CONFIG:
-            return "EGL_BAD_CONFIG";
-        case EGL_BAD_CURRENT_SURFACE:
-            return "EGL_BAD_CURRENT_SURFACE";
-        case EGL_BAD_DISPLAY:
-            return "EGL_BAD_DISPLAY";
-        case EGL_BAD_DEVICE_EXT:
-            return "EGL_BAD_DEVICE_EXT";
-        case EGL_BAD_SURFACE:
-            return "EGL_BAD_SURFACE";
-        case EGL_BAD_MATCH:
-            return "EGL_BAD_MATCH";
-        case EGL_BAD_PARAMETER:
-            return "EGL_BAD_PARAMETER";
-        case EGL_BAD_NATIVE_PIXMAP:
-            return "EGL_BAD_NATIVE_PIXMAP";
-        case EGL_BAD_NATIVE_WINDOW:
-            return "EGL_BAD_NATIVE_WINDOW";
-        case EGL_CONTEXT_LOST:
-            return "EGL_CONTEXT_LOST";
-    }
-    return "unknown error";
-}
-
-static void egl_log(EGLenum error, const char *command, EGLint msg_type,
-        EGLLabelKHR thread, EGLLabelKHR obj, const char *msg) {
-    _debug_log(egl_log_importance(msg_type),
-            "[EGL] command: %s, error: %s (0x%x), message: \"%s\"", command,
-            egl_error_str(error), error, msg);
-}
-
-static bool env_parse_bool(const char *option) {
-    const char *env = getenv(option);
-    if (env) {
-        fake_log(INFO, "Loading %s option: %s", option, env);
-    }
-
-    if (!env || strcmp(env, "0") == 0) {
-        return false;
-    } else if (strcmp(env, "1") == 0) {
-        return true;
-    }
-
-    fake_log(ERROR, "Unknown %s option: %s", option, env);
-    return false;
-}
-
-static int get_egl_dmabuf_formats(struct egl *egl, int **formats) {
-    if (!egl->exts.EXT_image_dma_buf_import) {
-        fake_log(DEBUG, "DMA-BUF import extension not present");
-        return -1;
-    }
-
-    // 当我们只有image_dmabuf_import扩展时，我们无法查询支持哪些格式。
-    // DRM_FORMAT_ARGB8888和DRM_FORMAT_XRGB8888这两个是一直被支持的,这是尝试创建缓冲区的预定方式。
-    // 当然只是一个猜测，但总比完全不支持dmabufs好，因为修改器扩展并不是到处都支持。
-    if (!egl->exts.EXT_image_dma_buf_import_modifiers) {
-        static const int fallback_formats[] = {
-            DRM_FORMAT_ARGB8888,
-            DRM_FORMAT_XRGB8888,
-        };
-        static unsigned num =
-            sizeof(fallback_formats) / sizeof(fallback_formats[0]);
 
-        *formats = calloc(num, sizeof(int));
-        if (!*formats) {
-            fake_log(ERROR, "Allocation failed");
-            return -1;
+    // egl_gbm targets [frames]: steady-state dumb-buffer draws, every frame
+    // after the first reuses the pooled target
+    if (cmd && strcmp(cmd, "targets") == 0) {
+        uint64_t frames = argc > 2 ? strtoull(argv[2], NULL, 10) : 100;
+        wait_for_key = false;
+        for (uint64_t i = 0; i < frames; i++) {
+            draw_color_to_fbo_dumb_buffer_display(
+                    i % 2 ? renderbuffer : texture);
         }
-
-        memcpy(*formats, fallback_formats, num * sizeof(**formats));
-        return num;
-    }
-
-    EGLint num;
-    if (!egl->procs.eglQueryDmaBufFormatsEXT(egl->display, 0, NULL, &num)) {
-        fake_log(ERROR, "Failed to query number of dmabuf formats");
-        return -1;
-    }
-
-    *formats = calloc(num, sizeof(int));
-    if (*formats == NULL) {
-        fake_log(ERROR, "Allocation failed: %s", strerror(errno));
-        return -1;
-    }
-
-    if (!egl->procs.eglQueryDmaBufFormatsEXT(egl->display, num, *formats,
-                &num)) {
-        fake_log(ERROR, "Failed to query dmabuf format");
-        free(*formats);
-        return -1;
-    }
-    return num;
-}
-
-static int get_egl_dmabuf_modifiers(struct egl *egl, int format,
-        uint64_t **modifiers,
-        EGLBoolean **external_only) {
-    *modifiers = NULL;
-    *external_only = NULL;
-
-    if (!egl->exts.EXT_image_dma_buf_import) {
-        fake_log(DEBUG, "DMA-BUF extension not present");
-        return -1;
-    }
-    if (!egl->exts.EXT_image_dma_buf_import_modifiers) {
+        read_draw_finish();
+        draw_log_stats();
+        release_outputs(outputs, kms_output_count);
         return 0;
     }
 
-    EGLint num;
-    if (!egl->procs.eglQueryDmaBufModifiersEXT(egl->display, format, 0, NULL,
-                NULL, &num)) {
-        fake_log(ERROR, "Failed to query dmabuf number of modifiers");
-        return -1;
-    }
-    if (num == 0) {
+    // egl_gbm surface [frames]: present the EGL window surface
+    if (cmd && strcmp(cmd, "surface") == 0) {
+        uint64_t frames = argc > 2 ? strtoull(argv[2], NULL, 10) : 600;
+        for (uint64_t i = 0; i < frames; i++) {
+            draw_color_use_window_surface();
+            scan_output_surface_to_display(kms);
+        }
+        fake_log(INFO, "Framebuffer cache: %lu hits, %lu misses",
+                (unsigned long)kms->fb_cache_hits,
+                (unsigned long)kms->fb_cache_misses);
+        release_window_surface();
+        release_outputs(outputs, kms_output_count);
         return 0;
     }
 
-    *modifiers = calloc(num, sizeof(uint64_t));
-    if (*modifiers == NULL) {
-        fake_log(ERROR, "Allocation failed");
-        return -1;
-    }
-    *external_only = calloc(num, sizeof(EGLBoolean));
-    if (*external_only == NULL) {
-        fake_log(ERROR, "Allocation failed");
-        free(*modifiers);
-        *modifiers = NULL;
-        return -1;
-    }
-
-    if (!egl->procs.eglQueryDmaBufModifiersEXT(
-                egl->display, format, num, *modifiers, *external_only, &num)) {
-        fake_log(ERROR, "Failed to query dmabuf modifiers");
-        free(*modifiers);
-        free(*external_only);
-        return -1;
-    }
-    return num;
-}
+    fake_log(ERROR, "start off-scrren draw!!!");
+    //draw_color_use_window_surface();
+    //scan_output_surface_to_display(kms);
+    //read_draw_to_file(egl_gbm.window_surface, egl_gbm.window_surface, egl_gbm.context);
 
-static struct drm_format **format_set_get_ref(struct drm_format_set *set,
-        uint32_t format) {
-    for (size_t i = 0; i < set->len; ++i) {
-        if (set->formats[i]->format == format) {
-            return &set->formats[i];
-        }
-    }
+    //draw_color_to_fbo_texture();
+    //draw_color_to_fbo_renderbuffer_display();
 
-    return NULL;
+    draw_color_to_fbo_dumb_buffer_display(texture);
+    read_draw_finish();
+    draw_log_stats();
+    release_outputs(outputs, kms_output_count);
+    return 0;
 }
-
@@ -0,0 +1,380 @@
+#include "pixconv.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const int64_t NSEC_PER_SEC = 1000000000;
+
+static int64_t get_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+// Scalar kernels, the reference every variant has to match
+
+static void scalar_swap_rb(uint8_t *dst, const uint8_t *src, uint32_t width) {
+    for (uint32_t x = 0; x < width; x++, src += 4, dst += 4) {
+        uint8_t r = src[0], g = src[1], b = src[2], a = src[3];
+        dst[0] = b, dst[1] = g, dst[2] = r, dst[3] = a;
+    }
+}
+
+static void scalar_xrgb8888_to_rgb888(uint8_t *dst, const uint8_t *src,
+        uint32_t width) {
+    for (uint32_t x = 0; x < width; x++, src += 4, dst += 3) {
+        dst[0] = src[0], dst[1] = src[1], dst[2] = src[2];
+    }
+}
+
+static void scalar_x2101010_to_8888(uint8_t *dst, const uint8_t *src,
+        uint32_t width) {
+    for (uint32_t x = 0; x < width; x++, src += 4, dst += 4) {
+        uint32_t p;
+        memcpy(&p, src, sizeof(p));
+        dst[0] = (uint8_t)(p >> 2);
+        dst[1] = (uint8_t)(p >> 12);
+        dst[2] = (uint8_t)(p >> 22);
+        dst[3] = (uint8_t)((p >> 30) * 0x55);
+    }
+}
+
+static void scalar_rgb_to_y(uint8_t *y, const uint8_t *src, uint32_t width,
+        bool bgra) {
+    int ro = bgra ? 2 : 0, bo = bgra ? 0 : 2;
+    for (uint32_t x = 0; x < width; x++, src += 4) {
+        y[x] = (uint8_t)((66 * src[ro] + 129 * src[1] + 25 * src[bo] + 128)
+                >> 8) + 16;
+    }
+}
+
+static void scalar_rgb_to_uv(uint8_t *u, uint8_t *v, uint32_t step,
+        const uint8_t *row0, const uint8_t *row1, uint32_t width, bool bgra) {
+    int ro = bgra ? 2 : 0, bo = bgra ? 0 : 2;
+    for (uint32_t x = 0; x < width; x += 2, u += step, v += step) {
+        uint32_t x1 = x + 1 < width ? x + 1 : x;
+        const uint8_t *a = row0 + x * 4, *b = row0 + x1 * 4;
+        const uint8_t *c = row1 + x * 4, *d = row1 + x1 * 4;
+        int r = a[ro] + b[ro] + c[ro] + d[ro];
+        int g = a[1] + b[1] + c[1] + d[1];
+        int bl = a[bo] + b[bo] + c[bo] + d[bo];
+        *u = (uint8_t)(((-38 * r - 74 * g + 112 * bl + 512) >> 10) + 128);
+        *v = (uint8_t)(((112 * r - 94 * g - 18 * bl + 512) >> 10) + 128);
+    }
+}
+
+const struct pixconv_funcs pixconv_scalar = {
+    .isa = PIXCONV_SCALAR,
+    .name = "scalar",
+    .swap_rb = scalar_swap_rb,
+    .xrgb8888_to_rgb888 = scalar_xrgb8888_to_rgb888,
+    .x2101010_to_8888 = scalar_x2101010_to_8888,
+    .rgb_to_y = scalar_rgb_to_y,
+    .rgb_to_uv = scalar_rgb_to_uv,
+};
+
+// Dispatch
+
+static bool isa_supported(enum pixconv_isa isa) {
+    switch (isa) {
+    case PIXCONV_SCALAR:
+        return true;
+#if defined(__x86_64__) || defined(__i386__)
+    case PIXCONV_SSE4:
+        return __builtin_cpu_supports("sse4.1");
+    case PIXCONV_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+#if defined(__ARM_NEON)
+    case PIXCONV_NEON:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+const struct pixconv_funcs *pixconv_get_isa(enum pixconv_isa isa) {
+    if (!isa_supported(isa)) {
+        return NULL;
+    }
+    switch (isa) {
+    case PIXCONV_SCALAR:
+        return &pixconv_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    case PIXCONV_SSE4:
+        return &pixconv_sse4;
+    case PIXCONV_AVX2:
+        return &pixconv_avx2;
+#endif
+#if defined(__ARM_NEON)
+    case PIXCONV_NEON:
+        return &pixconv_neon;
+#endif
+    default:
+        return NULL;
+    }
+}
+
+static const char *isa_names[] = {
+    [PIXCONV_SCALAR] = "scalar",
+    [PIXCONV_SSE4] = "sse4",
+    [PIXCONV_AVX2] = "avx2",
+    [PIXCONV_NEON] = "neon",
+};
+
+const struct pixconv_funcs *pixconv_get(void) {
+    static const struct pixconv_funcs *funcs = NULL;
+    if (funcs) {
+        return funcs;
+    }
+
+    int max = PIXCONV_NEON;
+    const char *env = getenv("EGL_GBM_PIXCONV");
+    if (env) {
+        for (max = PIXCONV_NEON; max > PIXCONV_SCALAR; max--) {
+            if (strcmp(env, isa_names[max]) == 0) {
+                break;
+            }
+        }
+        if (max == PIXCONV_SCALAR && strcmp(env, "scalar") != 0) {
+            fake_log(ERROR, "Unknown EGL_GBM_PIXCONV '%s', using scalar", env);
+        }
+    }
+    // Racing threads pick the same table, so the unlocked store is fine
+    const struct pixconv_funcs *best = &pixconv_scalar;
+    for (int isa = PIXCONV_SCALAR; isa <= max; isa++) {
+        const struct pixconv_funcs *f = pixconv_get_isa(isa);
+        if (f) {
+            best = f;
+        }
+    }
+    fake_log(DEBUG, "Pixel conversion kernels: %s", best->name);
+    funcs = best;
+    return funcs;
+}
+
+// Frame helpers
+
+void pixconv_swap_rb(const struct pixconv_funcs *funcs, void *dst,
+        uint32_t dst_stride, const void *src, uint32_t src_stride,
+        uint32_t width, uint32_t height) {
+    for (uint32_t y = 0; y < height; y++) {
+        funcs->swap_rb((uint8_t *)dst + (size_t)y * dst_stride,
+                (const uint8_t *)src + (size_t)y * src_stride, width);
+    }
+}
+
+void pixconv_rgb_to_yuv420(const struct pixconv_funcs *funcs,
+        uint8_t *y_plane, uint32_t y_stride, uint8_t *u_plane,
+        uint8_t *v_plane, uint32_t uv_stride, const void *src,
+        uint32_t src_stride, uint32_t width, uint32_t height, bool bgra) {
+    const uint8_t *pixels = src;
+    for (uint32_t y = 0; y < height; y++) {
+        funcs->rgb_to_y(y_plane + (size_t)y * y_stride,
+                pixels + (size_t)y * src_stride, width, bgra);
+    }
+    uint32_t step = v_plane ? 1 : 2;
+    for (uint32_t y = 0; y < height; y += 2) {
+        const uint8_t *row0 = pixels + (size_t)y * src_stride;
+        const uint8_t *row1 = y + 1 < height ? row0 + src_stride : row0;
+        size_t offset = (size_t)(y / 2) * uv_stride;
+        funcs->rgb_to_uv(u_plane + offset,
+                v_plane ? v_plane + offset : u_plane + offset + 1, step,
+                row0, row1, width, bgra);
+    }
+}
+
+// Benchmark
+
+typedef void (*pixconv_row_t)(uint8_t *dst, const uint8_t *src,
+        uint32_t width);
+
+enum bench_kernel {
+    BENCH_SWAP_RB,
+    BENCH_XRGB_TO_RGB888,
+    BENCH_2101010_TO_8888,
+    BENCH_RGBA_TO_NV12,
+    BENCH_BGRA_TO_I420,
+    BENCH_KERNEL_COUNT,
+};
+
+static const char *kernel_names[] = {
+    [BENCH_SWAP_RB] = "rgba->bgra",
+    [BENCH_XRGB_TO_RGB888] = "xrgb8888->rgb888",
+    [BENCH_2101010_TO_8888] = "2101010->8888",
+    [BENCH_RGBA_TO_NV12] = "rgba->nv12",
+    [BENCH_BGRA_TO_I420] = "bgra->i420",
+};
+
+struct bench_frame {
+    uint32_t width, height;
+    uint8_t *src;
+    uint32_t src_stride;
+    // Packed output rows, dst_stride apart, then chroma
+    uint8_t *dst;
+    uint32_t dst_stride, uv_stride;
+    size_t dst_size;
+};
+
+static void run_rows(pixconv_row_t kernel, struct bench_frame *f) {
+    for (uint32_t y = 0; y < f->height; y++) {
+        kernel(f->dst + (size_t)y * f->dst_stride,
+                f->src + (size_t)y * f->src_stride, f->width);
+    }
+}
+
+static void run_kernel(const struct pixconv_funcs *funcs,
+        enum bench_kernel kernel, struct bench_frame *f) {
+    uint8_t *chroma = f->dst + (size_t)f->dst_stride * f->height;
+    size_t c_size = (size_t)f->uv_stride * ((f->height + 1) / 2);
+    switch (kernel) {
+    case BENCH_SWAP_RB:
+        run_rows(funcs->swap_rb, f);
+        break;
+    case BENCH_XRGB_TO_RGB888:
+        run_rows(funcs->xrgb8888_to_rgb888, f);
+        break;
+    case BENCH_2101010_TO_8888:
+        run_rows(funcs->x2101010_to_8888, f);
+        break;
+    case BENCH_RGBA_TO_NV12:
+        pixconv_rgb_to_yuv420(funcs, f->dst, f->dst_stride, chroma, NULL,
+                f->uv_stride, f->src, f->src_stride, f->width, f->height,
+                false);
+        break;
+    case BENCH_BGRA_TO_I420:
+        pixconv_rgb_to_yuv420(funcs, f->dst, f->dst_stride, chroma,
+                chroma + c_size, f->uv_stride, f->src, f->src_stride,
+                f->width, f->height, true);
+        break;
+    default:
+        break;
+    }
+}
+
+// Bytes of each output row a kernel writes, the rest is padding
+static void kernel_row_bytes(enum bench_kernel kernel, uint32_t width,
+        size_t *row_bytes, size_t *uv_bytes) {
+    uint32_t cw = (width + 1) / 2;
+    *uv_bytes = 0;
+    switch (kernel) {
+    case BENCH_XRGB_TO_RGB888:
+        *row_bytes = (size_t)width * 3;
+        break;
+    case BENCH_RGBA_TO_NV12:
+        *row_bytes = width;
+        *uv_bytes = (size_t)cw * 2;
+        break;
+    case BENCH_BGRA_TO_I420:
+        *row_bytes = width;
+        *uv_bytes = cw;
+        break;
+    default:
+        *row_bytes = (size_t)width * 4;
+        break;
+    }
+}
+
+static bool same_output(enum bench_kernel kernel, const struct bench_frame *f,
+        const uint8_t *a, const uint8_t *b) {
+    size_t row_bytes, uv_bytes;
+    kernel_row_bytes(kernel, f->width, &row_bytes, &uv_bytes);
+    for (uint32_t y = 0; y < f->height; y++) {
+        size_t offset = (size_t)y * f->dst_stride;
+        if (memcmp(a + offset, b + offset, row_bytes) != 0) {
+            return false;
+        }
+    }
+    if (uv_bytes == 0) {
+        return true;
+    }
+    // U and V, or just the NV12 plane, one after another
+    size_t base = (size_t)f->dst_stride * f->height;
+    uint32_t rows = (f->height + 1) / 2;
+    if (kernel == BENCH_BGRA_TO_I420) {
+        rows *= 2;
+    }
+    for (uint32_t y = 0; y < rows; y++) {
+        size_t offset = base + (size_t)y * f->uv_stride;
+        if (memcmp(a + offset, b + offset, uv_bytes) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool pixconv_benchmark(uint32_t width, uint32_t height, uint64_t iterations) {
+    // Odd padding keeps rows off any alignment the kernels might rely on
+    struct bench_frame f = {
+        .width = width,
+        .height = height,
+        .src_stride = width * 4 + 68,
+        .dst_stride = width * 4 + 36,
+        .uv_stride = (width + 1) / 2 * 2 + 20,
+    };
+    f.dst_size = (size_t)f.dst_stride * height +
+        (size_t)f.uv_stride * (height + 1);
+    size_t src_size = (size_t)f.src_stride * height;
+    f.src = malloc(src_size);
+    f.dst = calloc(1, f.dst_size);
+    uint8_t *reference = calloc(1, f.dst_size);
+    if (!f.src || !f.dst || !reference) {
+        fake_log(ERROR, "Allocation failed");
+        free(f.src);
+        free(f.dst);
+        free(reference);
+        return false;
+    }
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < src_size; i++) {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        f.src[i] = (uint8_t)((state * 2685821657736338717ull) >> 56);
+    }
+
+    fake_log(INFO, "%ux%u, %lu iterations, best kernels %s", width, height,
+            (unsigned long)iterations, pixconv_get()->name);
+    bool ok = true;
+    for (int kernel = 0; kernel < BENCH_KERNEL_COUNT; kernel++) {
+        run_kernel(&pixconv_scalar, kernel, &(struct bench_frame){
+                .width = width, .height = height, .src = f.src,
+                .src_stride = f.src_stride, .dst = reference,
+                .dst_stride = f.dst_stride, .uv_stride = f.uv_stride });
+        double scalar_mpix = 0;
+        for (int isa = PIXCONV_SCALAR; isa <= PIXCONV_NEON; isa++) {
+            const struct pixconv_funcs *funcs = pixconv_get_isa(isa);
+            if (!funcs) {
+                continue;
+            }
+            memset(f.dst, 0, f.dst_size);
+            run_kernel(funcs, kernel, &f);
+            bool same = same_output(kernel, &f, reference, f.dst);
+            ok = ok && same;
+
+            int64_t start = get_time_ns();
+            for (uint64_t i = 0; i < iterations; i++) {
+                run_kernel(funcs, kernel, &f);
+            }
+            int64_t elapsed = get_time_ns() - start;
+            double mpix = elapsed > 0 ?
+                (double)width * height * iterations * 1e3 / elapsed : 0;
+            if (isa == PIXCONV_SCALAR) {
+                scalar_mpix = mpix;
+            }
+            fake_log(INFO, "  %-16s %-6s %9.1f Mpix/s  %5.2fx",
+                    kernel_names[kernel], funcs->name, mpix,
+                    scalar_mpix > 0 ? mpix / scalar_mpix : 0.0);
+            if (!same) {
+                fake_log(ERROR, "  %s %s output differs from scalar",
+                        kernel_names[kernel], funcs->name);
+            }
+        }
+    }
+    free(f.src);
+    free(f.dst);
+    free(reference);
+    return ok;
+}
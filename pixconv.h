@@ -0,0 +1,85 @@
+#ifndef FAKE_CHEN_PIXCONV_H
+#define FAKE_CHEN_PIXCONV_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum pixconv_isa {
+    PIXCONV_SCALAR,
+    PIXCONV_SSE4,
+    PIXCONV_AVX2,
+    PIXCONV_NEON,
+};
+
+/**
+ * CPU pixel conversion for when the GPU cannot hand over the layout a
+ * consumer wants, one row per call. Every variant gives the same bytes as
+ * the scalar one, rows may be any width and need no alignment, and dst may
+ * be src for the same-size conversions.
+ *
+ * 8888 formats are four bytes per pixel in memory order: RGBA for
+ * DRM_FORMAT_ABGR8888, glReadPixels GL_RGBA output, and BGRA when bgra is
+ * set, DRM_FORMAT_ARGB8888/XRGB8888 as scanout buffers map.
+ */
+struct pixconv_funcs {
+    enum pixconv_isa isa;
+    const char *name;
+    // RGBA <-> BGRA
+    void (*swap_rb)(uint8_t *dst, const uint8_t *src, uint32_t width);
+    // DRM_FORMAT_XRGB8888 to DRM_FORMAT_RGB888, dropping X
+    void (*xrgb8888_to_rgb888)(uint8_t *dst, const uint8_t *src,
+            uint32_t width);
+    // 2_10_10_10 to 8888 with the same channel order, e.g.
+    // DRM_FORMAT_ABGR2101010 to DRM_FORMAT_ABGR8888, by the top 8 bits
+    void (*x2101010_to_8888)(uint8_t *dst, const uint8_t *src,
+            uint32_t width);
+    // BT.601 limited range luma of one row
+    void (*rgb_to_y)(uint8_t *y, const uint8_t *src, uint32_t width,
+            bool bgra);
+    // Chroma of two rows, 2x2 averaged, (width + 1) / 2 samples. step is 1
+    // for separate U and V planes and 2 for NV12 with v = u + 1. row1 may be
+    // row0 for the last row of an odd height.
+    void (*rgb_to_uv)(uint8_t *u, uint8_t *v, uint32_t step,
+            const uint8_t *row0, const uint8_t *row1, uint32_t width,
+            bool bgra);
+};
+
+/**
+ * The fastest variant this CPU runs, picked once. EGL_GBM_PIXCONV=scalar,
+ * sse4, avx2 or neon caps it, e.g. to compare output.
+ */
+const struct pixconv_funcs *pixconv_get(void);
+/** A given variant, NULL when not built in or not supported here. */
+const struct pixconv_funcs *pixconv_get_isa(enum pixconv_isa isa);
+
+/** Frame helpers, strides in bytes, calling funcs once per row. */
+void pixconv_swap_rb(const struct pixconv_funcs *funcs, void *dst,
+        uint32_t dst_stride, const void *src, uint32_t src_stride,
+        uint32_t width, uint32_t height);
+/**
+ * RGB to NV12, or to I420 when v_plane is non-NULL. uv_stride is that of
+ * the NV12 chroma plane or of each of U and V.
+ */
+void pixconv_rgb_to_yuv420(const struct pixconv_funcs *funcs,
+        uint8_t *y_plane, uint32_t y_stride, uint8_t *u_plane,
+        uint8_t *v_plane, uint32_t uv_stride, const void *src,
+        uint32_t src_stride, uint32_t width, uint32_t height, bool bgra);
+
+/**
+ * Time every kernel of every supported variant on a width x height frame
+ * with padded strides and log throughput against scalar. Fails when a
+ * variant's output differs from scalar.
+ */
+bool pixconv_benchmark(uint32_t width, uint32_t height, uint64_t iterations);
+
+// The variants, SIMD ones leaving row tails to pixconv_scalar
+extern const struct pixconv_funcs pixconv_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+extern const struct pixconv_funcs pixconv_sse4;
+extern const struct pixconv_funcs pixconv_avx2;
+#endif
+#if defined(__ARM_NEON)
+extern const struct pixconv_funcs pixconv_neon;
+#endif
+
+#endif
@@ -0,0 +1,133 @@
+#include "pixconv.h"
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+
+// NEON is part of every AArch64 CPU, and 32-bit builds only define
+// __ARM_NEON when built for it, so there is nothing to detect at runtime.
+// vld4/vst4 split pixels into one register per channel, so unlike the x86
+// variants nothing needs shuffling back into order.
+
+static void neon_swap_rb(uint8_t *dst, const uint8_t *src, uint32_t width) {
+    uint32_t x = 0;
+    for (; x + 16 <= width; x += 16) {
+        uint8x16x4_t p = vld4q_u8(src + x * 4);
+        uint8x16_t r = p.val[0];
+        p.val[0] = p.val[2];
+        p.val[2] = r;
+        vst4q_u8(dst + x * 4, p);
+    }
+    pixconv_scalar.swap_rb(dst + x * 4, src + x * 4, width - x);
+}
+
+static void neon_xrgb8888_to_rgb888(uint8_t *dst, const uint8_t *src,
+        uint32_t width) {
+    uint32_t x = 0;
+    for (; x + 16 <= width; x += 16) {
+        uint8x16x4_t p = vld4q_u8(src + x * 4);
+        uint8x16x3_t out = { { p.val[0], p.val[1], p.val[2] } };
+        vst3q_u8(dst + x * 3, out);
+    }
+    pixconv_scalar.xrgb8888_to_rgb888(dst + x * 3, src + x * 4, width - x);
+}
+
+static void neon_x2101010_to_8888(uint8_t *dst, const uint8_t *src,
+        uint32_t width) {
+    const uint32x4_t r_mask = vdupq_n_u32(0xff);
+    const uint32x4_t g_mask = vdupq_n_u32(0xff00);
+    const uint32x4_t b_mask = vdupq_n_u32(0xff0000);
+    uint32_t x = 0;
+    for (; x + 4 <= width; x += 4) {
+        uint32x4_t p = vreinterpretq_u32_u8(vld1q_u8(src + x * 4));
+        uint32x4_t r = vandq_u32(vshrq_n_u32(p, 2), r_mask);
+        uint32x4_t g = vandq_u32(vshrq_n_u32(p, 4), g_mask);
+        uint32x4_t b = vandq_u32(vshrq_n_u32(p, 6), b_mask);
+        uint32x4_t a = vshlq_n_u32(vmulq_n_u32(vshrq_n_u32(p, 30), 0x55), 24);
+        p = vorrq_u32(vorrq_u32(r, g), vorrq_u32(b, a));
+        vst1q_u8(dst + x * 4, vreinterpretq_u8_u32(p));
+    }
+    pixconv_scalar.x2101010_to_8888(dst + x * 4, src + x * 4, width - x);
+}
+
+static inline uint8x8_t neon_luma(uint8x8_t r, uint8x8_t g, uint8x8_t b) {
+    // At most 220 * 255, fits 16 bits unsigned
+    uint16x8_t acc = vmull_u8(r, vdup_n_u8(66));
+    acc = vmlal_u8(acc, g, vdup_n_u8(129));
+    acc = vmlal_u8(acc, b, vdup_n_u8(25));
+    // (acc + 128) >> 8
+    return vadd_u8(vrshrn_n_u16(acc, 8), vdup_n_u8(16));
+}
+
+static void neon_rgb_to_y(uint8_t *y, const uint8_t *src, uint32_t width,
+        bool bgra) {
+    int ro = bgra ? 2 : 0, bo = bgra ? 0 : 2;
+    uint32_t x = 0;
+    for (; x + 16 <= width; x += 16) {
+        uint8x16x4_t p = vld4q_u8(src + x * 4);
+        uint8x8_t lo = neon_luma(vget_low_u8(p.val[ro]),
+                vget_low_u8(p.val[1]), vget_low_u8(p.val[bo]));
+        uint8x8_t hi = neon_luma(vget_high_u8(p.val[ro]),
+                vget_high_u8(p.val[1]), vget_high_u8(p.val[bo]));
+        vst1q_u8(y + x, vcombine_u8(lo, hi));
+    }
+    pixconv_scalar.rgb_to_y(y + x, src + x * 4, width - x, bgra);
+}
+
+// ((cr * r + cg * g + cb * b + 512) >> 10) + 128 of four 2x2 sums
+static inline int16x4_t neon_chroma(int16x4_t r, int16x4_t g, int16x4_t b,
+        int16_t cr, int16_t cg, int16_t cb) {
+    int32x4_t acc = vmull_n_s16(r, cr);
+    acc = vmlal_n_s16(acc, g, cg);
+    acc = vmlal_n_s16(acc, b, cb);
+    acc = vshrq_n_s32(vaddq_s32(acc, vdupq_n_s32(512)), 10);
+    return vmovn_s32(vaddq_s32(acc, vdupq_n_s32(128)));
+}
+
+static void neon_rgb_to_uv(uint8_t *u, uint8_t *v, uint32_t step,
+        const uint8_t *row0, const uint8_t *row1, uint32_t width, bool bgra) {
+    int ro = bgra ? 2 : 0, bo = bgra ? 0 : 2;
+    uint32_t x = 0;
+    for (; x + 16 <= width; x += 16, u += 8 * step, v += 8 * step) {
+        uint8x16x4_t p0 = vld4q_u8(row0 + x * 4);
+        uint8x16x4_t p1 = vld4q_u8(row1 + x * 4);
+        // Pairwise across, then down: eight 2x2 sums of at most 1020
+        int16x8_t r = vreinterpretq_s16_u16(
+                vpadalq_u8(vpaddlq_u8(p0.val[ro]), p1.val[ro]));
+        int16x8_t g = vreinterpretq_s16_u16(
+                vpadalq_u8(vpaddlq_u8(p0.val[1]), p1.val[1]));
+        int16x8_t b = vreinterpretq_s16_u16(
+                vpadalq_u8(vpaddlq_u8(p0.val[bo]), p1.val[bo]));
+
+        int16x8_t u16 = vcombine_s16(
+                neon_chroma(vget_low_s16(r), vget_low_s16(g),
+                    vget_low_s16(b), -38, -74, 112),
+                neon_chroma(vget_high_s16(r), vget_high_s16(g),
+                    vget_high_s16(b), -38, -74, 112));
+        int16x8_t v16 = vcombine_s16(
+                neon_chroma(vget_low_s16(r), vget_low_s16(g),
+                    vget_low_s16(b), 112, -94, -18),
+                neon_chroma(vget_high_s16(r), vget_high_s16(g),
+                    vget_high_s16(b), 112, -94, -18));
+        uint8x8x2_t uv = { { vqmovun_s16(u16), vqmovun_s16(v16) } };
+        if (step == 2) {
+            vst2_u8(u, uv);
+        } else {
+            vst1_u8(u, uv.val[0]);
+            vst1_u8(v, uv.val[1]);
+        }
+    }
+    pixconv_scalar.rgb_to_uv(u, v, step, row0 + x * 4, row1 + x * 4,
+            width - x, bgra);
+}
+
+const struct pixconv_funcs pixconv_neon = {
+    .isa = PIXCONV_NEON,
+    .name = "neon",
+    .swap_rb = neon_swap_rb,
+    .xrgb8888_to_rgb888 = neon_xrgb8888_to_rgb888,
+    .x2101010_to_8888 = neon_x2101010_to_8888,
+    .rgb_to_y = neon_rgb_to_y,
+    .rgb_to_uv = neon_rgb_to_uv,
+};
+
+#endif
@@ -0,0 +1,306 @@
+#include "pixconv.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <string.h>
+
+// Built with target attributes rather than -msse4.1/-mavx2 so one binary
+// runs everywhere, pixconv_get() only hands these out once cpuid agrees.
+
+// RGBA order weights, R and B swapped for BGRA
+#define Y_COEF(bgra) ((bgra) ? 25 : 66), 129, ((bgra) ? 66 : 25), 0
+#define U_COEF(bgra) ((bgra) ? 112 : -38), -74, ((bgra) ? -38 : 112), 0
+#define V_COEF(bgra) ((bgra) ? -18 : 112), -94, ((bgra) ? 112 : -18), 0
+
+// SSE4.1
+
+#pragma GCC push_options
+#pragma GCC target("sse4.1")
+
+static void sse4_swap_rb(uint8_t *dst, const uint8_t *src, uint32_t width) {
+    const __m128i mask = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+            10, 9, 8, 11, 14, 13, 12, 15);
+    uint32_t x = 0;
+    for (; x + 4 <= width; x += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(src + x * 4));
+        _mm_storeu_si128((__m128i *)(dst + x * 4), _mm_shuffle_epi8(p, mask));
+    }
+    pixconv_scalar.swap_rb(dst + x * 4, src + x * 4, width - x);
+}
+
+static void sse4_xrgb8888_to_rgb888(uint8_t *dst, const uint8_t *src,
+        uint32_t width) {
+    const __m128i mask = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9,
+            10, 12, 13, 14, -1, -1, -1, -1);
+    uint32_t x = 0;
+    // 12 bytes out per 4 pixels but 16 stored, the next block or the
+    // scalar tail overwrites the extra, so stop while 16 still fit
+    for (; x + 6 <= width; x += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(src + x * 4));
+        _mm_storeu_si128((__m128i *)(dst + x * 3), _mm_shuffle_epi8(p, mask));
+    }
+    pixconv_scalar.xrgb8888_to_rgb888(dst + x * 3, src + x * 4, width - x);
+}
+
+static inline __m128i sse4_2101010_block(__m128i p) {
+    const __m128i r_mask = _mm_set1_epi32(0xff);
+    const __m128i g_mask = _mm_set1_epi32(0xff00);
+    const __m128i b_mask = _mm_set1_epi32(0xff0000);
+    __m128i r = _mm_and_si128(_mm_srli_epi32(p, 2), r_mask);
+    __m128i g = _mm_and_si128(_mm_srli_epi32(p, 4), g_mask);
+    __m128i b = _mm_and_si128(_mm_srli_epi32(p, 6), b_mask);
+    __m128i a = _mm_mullo_epi16(_mm_srli_epi32(p, 30), _mm_set1_epi32(0x55));
+    return _mm_or_si128(_mm_or_si128(r, g),
+            _mm_or_si128(b, _mm_slli_epi32(a, 24)));
+}
+
+static void sse4_x2101010_to_8888(uint8_t *dst, const uint8_t *src,
+        uint32_t width) {
+    uint32_t x = 0;
+    for (; x + 4 <= width; x += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(src + x * 4));
+        _mm_storeu_si128((__m128i *)(dst + x * 4), sse4_2101010_block(p));
+    }
+    pixconv_scalar.x2101010_to_8888(dst + x * 4, src + x * 4, width - x);
+}
+
+// Unrounded weighted sums of four pixels, one per 32-bit lane
+static inline __m128i sse4_dot4(const uint8_t *src, __m128i coef) {
+    __m128i p = _mm_loadu_si128((const __m128i *)src);
+    __m128i lo = _mm_madd_epi16(_mm_cvtepu8_epi16(p), coef);
+    __m128i hi = _mm_madd_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(p, 8)),
+            coef);
+    return _mm_hadd_epi32(lo, hi);
+}
+
+static void sse4_rgb_to_y(uint8_t *y, const uint8_t *src, uint32_t width,
+        bool bgra) {
+    const __m128i coef = _mm_setr_epi16(Y_COEF(bgra), Y_COEF(bgra));
+    const __m128i round = _mm_set1_epi32(128);
+    const __m128i offset = _mm_set1_epi16(16);
+    uint32_t x = 0;
+    for (; x + 16 <= width; x += 16) {
+        const uint8_t *p = src + x * 4;
+        __m128i y0 = _mm_srai_epi32(_mm_add_epi32(sse4_dot4(p, coef), round),
+                8);
+        __m128i y1 = _mm_srai_epi32(_mm_add_epi32(sse4_dot4(p + 16, coef),
+                    round), 8);
+        __m128i y2 = _mm_srai_epi32(_mm_add_epi32(sse4_dot4(p + 32, coef),
+                    round), 8);
+        __m128i y3 = _mm_srai_epi32(_mm_add_epi32(sse4_dot4(p + 48, coef),
+                    round), 8);
+        __m128i lo = _mm_add_epi16(_mm_packs_epi32(y0, y1), offset);
+        __m128i hi = _mm_add_epi16(_mm_packs_epi32(y2, y3), offset);
+        _mm_storeu_si128((__m128i *)(y + x), _mm_packus_epi16(lo, hi));
+    }
+    pixconv_scalar.rgb_to_y(y + x, src + x * 4, width - x, bgra);
+}
+
+// 2x2 sums of pixels 0-1 and 2-3 of both rows, R G B A of each in 16 bits
+static inline __m128i sse4_sum2x2(const uint8_t *row0, const uint8_t *row1) {
+    __m128i p0 = _mm_loadu_si128((const __m128i *)row0);
+    __m128i p1 = _mm_loadu_si128((const __m128i *)row1);
+    __m128i a = _mm_add_epi16(_mm_cvtepu8_epi16(p0), _mm_cvtepu8_epi16(p1));
+    __m128i b = _mm_add_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(p0, 8)),
+            _mm_cvtepu8_epi16(_mm_srli_si128(p1, 8)));
+    a = _mm_add_epi16(a, _mm_srli_si128(a, 8));
+    b = _mm_add_epi16(b, _mm_srli_si128(b, 8));
+    return _mm_unpacklo_epi64(a, b);
+}
+
+static inline __m128i sse4_chroma(__m128i s01, __m128i s23, __m128i coef) {
+    __m128i c = _mm_hadd_epi32(_mm_madd_epi16(s01, coef),
+            _mm_madd_epi16(s23, coef));
+    c = _mm_srai_epi32(_mm_add_epi32(c, _mm_set1_epi32(512)), 10);
+    return _mm_add_epi32(c, _mm_set1_epi32(128));
+}
+
+static void sse4_rgb_to_uv(uint8_t *u, uint8_t *v, uint32_t step,
+        const uint8_t *row0, const uint8_t *row1, uint32_t width, bool bgra) {
+    const __m128i u_coef = _mm_setr_epi16(U_COEF(bgra), U_COEF(bgra));
+    const __m128i v_coef = _mm_setr_epi16(V_COEF(bgra), V_COEF(bgra));
+    uint32_t x = 0;
+    for (; x + 8 <= width; x += 8, u += 4 * step, v += 4 * step) {
+        __m128i s01 = sse4_sum2x2(row0 + x * 4, row1 + x * 4);
+        __m128i s23 = sse4_sum2x2(row0 + x * 4 + 16, row1 + x * 4 + 16);
+        // u0-3 then v0-3
+        __m128i uv = _mm_packs_epi32(sse4_chroma(s01, s23, u_coef),
+                sse4_chroma(s01, s23, v_coef));
+        uv = _mm_packus_epi16(uv, uv);
+        if (step == 2) {
+            _mm_storel_epi64((__m128i *)u,
+                    _mm_unpacklo_epi8(uv, _mm_srli_si128(uv, 4)));
+        } else {
+            int32_t out = _mm_cvtsi128_si32(uv);
+            memcpy(u, &out, sizeof(out));
+            out = _mm_cvtsi128_si32(_mm_srli_si128(uv, 4));
+            memcpy(v, &out, sizeof(out));
+        }
+    }
+    pixconv_scalar.rgb_to_uv(u, v, step, row0 + x * 4, row1 + x * 4,
+            width - x, bgra);
+}
+
+#pragma GCC pop_options
+
+const struct pixconv_funcs pixconv_sse4 = {
+    .isa = PIXCONV_SSE4,
+    .name = "sse4",
+    .swap_rb = sse4_swap_rb,
+    .xrgb8888_to_rgb888 = sse4_xrgb8888_to_rgb888,
+    .x2101010_to_8888 = sse4_x2101010_to_8888,
+    .rgb_to_y = sse4_rgb_to_y,
+    .rgb_to_uv = sse4_rgb_to_uv,
+};
+
+// AVX2, twice the pixels per step. Most AVX2 instructions stay within
+// their 128-bit lane, so results come out lane-interleaved and get put
+// back in order once at the end.
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+static void avx2_swap_rb(uint8_t *dst, const uint8_t *src, uint32_t width) {
+    const __m256i mask = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+            10, 9, 8, 11, 14, 13, 12, 15, 2, 1, 0, 3, 6, 5, 4, 7,
+            10, 9, 8, 11, 14, 13, 12, 15);
+    uint32_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m256i p = _mm256_loadu_si256((const __m256i *)(src + x * 4));
+        _mm256_storeu_si256((__m256i *)(dst + x * 4),
+                _mm256_shuffle_epi8(p, mask));
+    }
+    sse4_swap_rb(dst + x * 4, src + x * 4, width - x);
+}
+
+static void avx2_xrgb8888_to_rgb888(uint8_t *dst, const uint8_t *src,
+        uint32_t width) {
+    const __m256i mask = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9,
+            10, 12, 13, 14, -1, -1, -1, -1, 0, 1, 2, 4, 5, 6, 8, 9,
+            10, 12, 13, 14, -1, -1, -1, -1);
+    // The two 12 byte halves next to each other
+    const __m256i pack = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+    uint32_t x = 0;
+    for (; x + 11 <= width; x += 8) {
+        __m256i p = _mm256_loadu_si256((const __m256i *)(src + x * 4));
+        p = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(p, mask), pack);
+        _mm256_storeu_si256((__m256i *)(dst + x * 3), p);
+    }
+    sse4_xrgb8888_to_rgb888(dst + x * 3, src + x * 4, width - x);
+}
+
+static void avx2_x2101010_to_8888(uint8_t *dst, const uint8_t *src,
+        uint32_t width) {
+    const __m256i r_mask = _mm256_set1_epi32(0xff);
+    const __m256i g_mask = _mm256_set1_epi32(0xff00);
+    const __m256i b_mask = _mm256_set1_epi32(0xff0000);
+    const __m256i a_scale = _mm256_set1_epi32(0x55);
+    uint32_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m256i p = _mm256_loadu_si256((const __m256i *)(src + x * 4));
+        __m256i r = _mm256_and_si256(_mm256_srli_epi32(p, 2), r_mask);
+        __m256i g = _mm256_and_si256(_mm256_srli_epi32(p, 4), g_mask);
+        __m256i b = _mm256_and_si256(_mm256_srli_epi32(p, 6), b_mask);
+        __m256i a = _mm256_mullo_epi16(_mm256_srli_epi32(p, 30), a_scale);
+        p = _mm256_or_si256(_mm256_or_si256(r, g),
+                _mm256_or_si256(b, _mm256_slli_epi32(a, 24)));
+        _mm256_storeu_si256((__m256i *)(dst + x * 4), p);
+    }
+    sse4_x2101010_to_8888(dst + x * 4, src + x * 4, width - x);
+}
+
+// Weighted sums of four pixels per 128-bit lane pair: pixels 0-1 in the
+// low lane and 2-3 in the high one
+static inline __m256i avx2_madd4(const uint8_t *src, __m256i coef) {
+    __m128i p = _mm_loadu_si128((const __m128i *)src);
+    return _mm256_madd_epi16(_mm256_cvtepu8_epi16(p), coef);
+}
+
+static void avx2_rgb_to_y(uint8_t *y, const uint8_t *src, uint32_t width,
+        bool bgra) {
+    const __m256i coef = _mm256_setr_epi16(Y_COEF(bgra), Y_COEF(bgra),
+            Y_COEF(bgra), Y_COEF(bgra));
+    const __m256i round = _mm256_set1_epi32(128);
+    const __m256i offset = _mm256_set1_epi16(16);
+    uint32_t x = 0;
+    for (; x + 16 <= width; x += 16) {
+        const uint8_t *p = src + x * 4;
+        // Pixels 0 1 4 5 | 2 3 6 7 and 8 9 12 13 | 10 11 14 15
+        __m256i a = _mm256_hadd_epi32(avx2_madd4(p, coef),
+                avx2_madd4(p + 16, coef));
+        __m256i b = _mm256_hadd_epi32(avx2_madd4(p + 32, coef),
+                avx2_madd4(p + 48, coef));
+        a = _mm256_srai_epi32(_mm256_add_epi32(a, round), 8);
+        b = _mm256_srai_epi32(_mm256_add_epi32(b, round), 8);
+        __m256i packed = _mm256_add_epi16(_mm256_packs_epi32(a, b), offset);
+        packed = _mm256_packus_epi16(packed, packed);
+        // Low lane has pixel pairs 0 4 8 12, the high one 2 6 10 14
+        __m128i out = _mm_unpacklo_epi16(_mm256_castsi256_si128(packed),
+                _mm256_extracti128_si256(packed, 1));
+        _mm_storeu_si128((__m128i *)(y + x), out);
+    }
+    sse4_rgb_to_y(y + x, src + x * 4, width - x, bgra);
+}
+
+// 2x2 sums for chroma samples c and c + 2 in the low lane, c + 1 and c + 3
+// in the high one, from pixels 2c to 2c + 7 of both rows
+static inline __m256i avx2_sum2x2(const uint8_t *row0, const uint8_t *row1) {
+    __m256i a = _mm256_add_epi16(
+            _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)row0)),
+            _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)row1)));
+    __m256i b = _mm256_add_epi16(
+            _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row0 + 16))),
+            _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row1 + 16))));
+    a = _mm256_add_epi16(a, _mm256_srli_si256(a, 8));
+    b = _mm256_add_epi16(b, _mm256_srli_si256(b, 8));
+    return _mm256_unpacklo_epi64(a, b);
+}
+
+static inline __m256i avx2_chroma(__m256i s0, __m256i s1, __m256i coef) {
+    __m256i c = _mm256_hadd_epi32(_mm256_madd_epi16(s0, coef),
+            _mm256_madd_epi16(s1, coef));
+    c = _mm256_srai_epi32(_mm256_add_epi32(c, _mm256_set1_epi32(512)), 10);
+    return _mm256_add_epi32(c, _mm256_set1_epi32(128));
+}
+
+static void avx2_rgb_to_uv(uint8_t *u, uint8_t *v, uint32_t step,
+        const uint8_t *row0, const uint8_t *row1, uint32_t width, bool bgra) {
+    const __m256i u_coef = _mm256_setr_epi16(U_COEF(bgra), U_COEF(bgra),
+            U_COEF(bgra), U_COEF(bgra));
+    const __m256i v_coef = _mm256_setr_epi16(V_COEF(bgra), V_COEF(bgra),
+            V_COEF(bgra), V_COEF(bgra));
+    uint32_t x = 0;
+    for (; x + 16 <= width; x += 16, u += 8 * step, v += 8 * step) {
+        __m256i s0 = avx2_sum2x2(row0 + x * 4, row1 + x * 4);
+        __m256i s1 = avx2_sum2x2(row0 + x * 4 + 32, row1 + x * 4 + 32);
+        // u0 2 4 6 v0 2 4 6 | u1 3 5 7 v1 3 5 7
+        __m256i uv = _mm256_packs_epi32(avx2_chroma(s0, s1, u_coef),
+                avx2_chroma(s0, s1, v_coef));
+        uv = _mm256_packus_epi16(uv, uv);
+        // u0-7 then v0-7
+        __m128i planar = _mm_unpacklo_epi8(_mm256_castsi256_si128(uv),
+                _mm256_extracti128_si256(uv, 1));
+        if (step == 2) {
+            _mm_storeu_si128((__m128i *)u,
+                    _mm_unpacklo_epi8(planar, _mm_srli_si128(planar, 8)));
+        } else {
+            _mm_storel_epi64((__m128i *)u, planar);
+            _mm_storel_epi64((__m128i *)v, _mm_srli_si128(planar, 8));
+        }
+    }
+    sse4_rgb_to_uv(u, v, step, row0 + x * 4, row1 + x * 4, width - x, bgra);
+}
+
+#pragma GCC pop_options
+
+const struct pixconv_funcs pixconv_avx2 = {
+    .isa = PIXCONV_AVX2,
+    .name = "avx2",
+    .swap_rb = avx2_swap_rb,
+    .xrgb8888_to_rgb888 = avx2_xrgb8888_to_rgb888,
+    .x2101010_to_8888 = avx2_x2101010_to_8888,
+    .rgb_to_y = avx2_rgb_to_y,
+    .rgb_to_uv = avx2_rgb_to_uv,
+};
+
+#endif
@@ -0,0 +1,705 @@
+#include "present.h"
+#include "dmabuf.h"
+#include "log.h"
+#include "trace.h"
+#include <assert.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static const long NSEC_PER_SEC = 1000000000;
+// Render end to vblank, for the commit to reach the display in time
+static const int64_t PACING_MARGIN_NS = 1500000;
+
+static int64_t get_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void present_flip_handler(unsigned int sequence, unsigned int tv_sec,
+        unsigned int tv_usec, void *user_data) {
+    struct present_buffer *buffer = user_data;
+    struct present_ring *ring = buffer->ring;
+
+    if (ring->last_sequence != 0 && sequence > ring->last_sequence + 1) {
+        ring->missed_vblanks += sequence - ring->last_sequence - 1;
+    }
+    ring->last_sequence = sequence;
+    frame_sched_vblank(&ring->sched,
+            (int64_t)tv_sec * NSEC_PER_SEC + (int64_t)tv_usec * 1000);
+
+    // The previous client buffer is released, the ring front stays busy:
+    // an overlay scanout leaves it showing underneath
+    if (buffer == &ring->client_flip) {
+        ring->client_front = ring->client_queued;
+        ring->client_queued = NULL;
+        return;
+    }
+
+    // The previous front buffer is free to render again from here on, and
+    // a composed frame hides any client plane
+    ring->front = buffer;
+    ring->queued = NULL;
+    ring->client_front = NULL;
+}
+
+static bool buffer_init(struct present_ring *ring,
+        struct present_buffer *buffer) {
+    struct egl *egl = ring->egl;
+    struct kms_backend *kms = ring->kms;
+
+    buffer->ring = ring;
+    buffer->release_fence_fd = -1;
+    buffer->bo = dmabuf_alloc_bo(egl, kms->mode.hdisplay, kms->mode.vdisplay,
+            GBM_FORMAT_XRGB8888, ring->has_scanout_formats ?
+                &ring->scanout_formats : NULL);
+    if (!buffer->bo) {
+        fake_log(ERROR, "Failed to allocate scanout buffer");
+        return false;
+    }
+
+    // Add the framebuffer now rather than on the first flip
+    if (!kms_fb_from_bo(kms, buffer->bo)) {
+        return false;
+    }
+
+    buffer->image = dmabuf_import_bo(egl, buffer->bo);
+    if (buffer->image == EGL_NO_IMAGE_KHR) {
+        fake_log(ERROR, "Failed to import scanout buffer into EGL");
+        return false;
+    }
+
+    glGenRenderbuffers(1, &buffer->rbo);
+    glBindRenderbuffer(GL_RENDERBUFFER, buffer->rbo);
+    ring->gles->procs.glEGLImageTargetRenderbufferStorageOES(GL_RENDERBUFFER,
+            buffer->image);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glGenFramebuffers(1, &buffer->fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, buffer->fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+            GL_RENDERBUFFER, buffer->rbo);
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        fake_log(ERROR, "Scanout FBO incomplete: 0x%x", status);
+        return false;
+    }
+    return true;
+}
+
+static void buffer_finish(struct present_buffer *buffer) {
+    struct present_ring *ring = buffer->ring;
+    if (!ring) {
+        return;
+    }
+    if (buffer->fbo) {
+        glDeleteFramebuffers(1, &buffer->fbo);
+    }
+    if (buffer->rbo) {
+        glDeleteRenderbuffers(1, &buffer->rbo);
+    }
+    if (buffer->image != EGL_NO_IMAGE_KHR) {
+        ring->egl->procs.eglDestroyImageKHR(ring->egl->display, buffer->image);
+    }
+    if (buffer->release_fence_fd >= 0) {
+        close(buffer->release_fence_fd);
+    }
+    // Also removes the framebuffer
+    if (buffer->bo) {
+        gbm_bo_destroy(buffer->bo);
+    }
+}
+
+struct present_ring *present_ring_create(struct gles_renderer *gles,
+        struct kms_backend *kms, int count) {
+    if (count < 2 || count > PRESENT_MAX_BUFFERS) {
+        fake_log(ERROR, "Invalid buffer ring size %d", count);
+        return NULL;
+    }
+
+    struct present_ring *ring = calloc(1, sizeof(*ring));
+    if (!ring) {
+        fake_log(ERROR, "Allocation failed");
+        return NULL;
+    }
+    ring->gles = gles;
+    ring->egl = gles->egl;
+    ring->kms = kms;
+    ring->count = count;
+    ring->client_flip.ring = ring;
+    ring->render_fence_fd = -1;
+    frame_sched_init(&ring->sched, kms_refresh_nsec(kms), PACING_MARGIN_NS);
+    ring->has_scanout_formats = kms_get_formats(kms, &ring->scanout_formats);
+    ring->explicit_sync = kms->explicit_sync &&
+        ring->egl->exts.ANDROID_native_fence_sync &&
+        ring->egl->exts.KHR_wait_sync;
+    kms->flip_handler = present_flip_handler;
+
+    for (int i = 0; i < count; i++) {
+        if (!buffer_init(ring, &ring->buffers[i])) {
+            present_ring_destroy(ring);
+            return NULL;
+        }
+    }
+    fake_log(INFO, "Created %d scanout buffers on %s backend (%dx%d), %s "
+            "sync", count, kms->impl->name, kms->mode.hdisplay,
+            kms->mode.vdisplay, ring->explicit_sync ? "explicit" : "implicit");
+    return ring;
+}
+
+void present_ring_destroy(struct present_ring *ring) {
+    if (!ring) {
+        return;
+    }
+    // Never free a buffer the display may still be reading
+    while (ring->kms->flip_pending) {
+        if (!kms_wait_event(ring->kms, 1000)) {
+            break;
+        }
+    }
+    for (int i = 0; i < ring->count; i++) {
+        buffer_finish(&ring->buffers[i]);
+    }
+    ring->kms->flip_handler = NULL;
+    if (ring->render_fence_fd >= 0) {
+        close(ring->render_fence_fd);
+    }
+    drm_format_set_finish(&ring->scanout_formats);
+    free(ring);
+}
+
+static struct present_buffer *find_free_buffer(struct present_ring *ring) {
+    for (int i = 0; i < ring->count; i++) {
+        struct present_buffer *buffer = &ring->buffers[i];
+        if (buffer != ring->front && buffer != ring->queued) {
+            return buffer;
+        }
+    }
+    // The front buffer has a release fence once the flip replacing it is
+    // queued, the GPU can wait for it
+    struct present_buffer *front = ring->front;
+    if (front && front != ring->queued && front->release_fence_fd >= 0) {
+        return front;
+    }
+    return NULL;
+}
+
+struct present_buffer *present_ring_acquire(struct present_ring *ring) {
+    struct present_buffer *buffer;
+    // Only waits with a ring of 2 and implicit sync: for the queued flip
+    while (!(buffer = find_free_buffer(ring))) {
+        if (!kms_wait_event(ring->kms, 1000)) {
+            return NULL;
+        }
+    }
+    // Usually long signalled, unless this is the front buffer
+    if (buffer->release_fence_fd >= 0) {
+        int fd = buffer->release_fence_fd;
+        buffer->release_fence_fd = -1;
+        if (!egl_wait_fence_fd(ring->egl, fd)) {
+            return NULL;
+        }
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, buffer->fbo);
+    glViewport(0, 0, ring->kms->mode.hdisplay, ring->kms->mode.vdisplay);
+    return buffer;
+}
+
+// The out-fence of the commit that took buffer off the screen
+static void set_release_fence(struct present_buffer *buffer, int fd) {
+    if (buffer->release_fence_fd >= 0) {
+        close(buffer->release_fence_fd);
+    }
+    buffer->release_fence_fd = fd;
+}
+
+bool present_ring_render_done(struct present_ring *ring) {
+    if (ring->render_fence_fd < 0) {
+        return true;
+    }
+    struct pollfd pfd = { .fd = ring->render_fence_fd, .events = POLLIN };
+    if (poll(&pfd, 1, 0) == 0) {
+        return false;
+    }
+    frame_sched_rendered(&ring->sched, ring->render_start_ns, get_time_ns());
+    close(ring->render_fence_fd);
+    ring->render_fence_fd = -1;
+    return true;
+}
+
+// Keeps a copy of the render fence to time the frame by, or without one
+// takes the submission as the end: a CPU time, short of the GPU work
+static int track_render(struct present_ring *ring, int render_fence) {
+    // The last frame is on screen by now, so its fence signaled; if not,
+    // its sample is dropped rather than waited for
+    if (!present_ring_render_done(ring)) {
+        close(ring->render_fence_fd);
+        ring->render_fence_fd = -1;
+    }
+    if (render_fence < 0) {
+        frame_sched_rendered(&ring->sched, ring->render_start_ns,
+                get_time_ns());
+        return -1;
+    }
+    if (!ring->explicit_sync) {
+        ring->render_fence_fd = render_fence;
+        return -1;
+    }
+    ring->render_fence_fd = dup(render_fence);
+    return render_fence;
+}
+
+bool present_ring_submit(struct present_ring *ring,
+        struct present_buffer *buffer) {
+    TRACE_SCOPE("present_ring_submit");
+    struct kms_backend *kms = ring->kms;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    // Flushes too
+    int render_fence = ring->explicit_sync || ring->time_render ?
+        egl_dup_render_fence(ring->egl) : -1;
+    if (render_fence < 0) {
+        glFlush();
+    }
+    if (ring->time_render) {
+        render_fence = track_render(ring, render_fence);
+    }
+
+    uint32_t fb_id = kms_fb_from_bo(kms, buffer->bo);
+    if (!fb_id) {
+        if (render_fence >= 0) {
+            close(render_fence);
+        }
+        return false;
+    }
+
+    if (!ring->modeset_done) {
+        kms->in_fence_fd = render_fence;
+        if (kms->impl->set_crtc(kms, fb_id)) {
+            return false;
+        }
+        // Nothing was on screen before
+        if (kms->out_fence_fd >= 0) {
+            close(kms->out_fence_fd);
+            kms->out_fence_fd = -1;
+        }
+        ring->modeset_done = true;
+        ring->front = buffer;
+        clock_gettime(CLOCK_MONOTONIC, &ring->start);
+        ring->frames++;
+        return true;
+    }
+
+    // One flip per vblank: the next one is queued once the previous landed
+    while (kms->flip_pending) {
+        if (!kms_wait_event(kms, 1000)) {
+            if (render_fence >= 0) {
+                close(render_fence);
+            }
+            return false;
+        }
+    }
+    kms->in_fence_fd = render_fence;
+    if (kms->impl->page_flip(kms, fb_id, buffer)) {
+        return false;
+    }
+    if (kms->out_fence_fd >= 0) {
+        set_release_fence(ring->front, kms->out_fence_fd);
+        kms->out_fence_fd = -1;
+    }
+    ring->queued = buffer;
+    ring->frames++;
+    return true;
+}
+
+static bool client_import(struct present_ring *ring,
+        struct present_client *client) {
+    struct gles_renderer *gles = ring->gles;
+    client->image = dmabuf_import_bo(ring->egl, client->bo);
+    if (client->image == EGL_NO_IMAGE_KHR) {
+        fake_log(ERROR, "Failed to import client buffer into EGL");
+        return false;
+    }
+    // External textures sample any format the driver imports, YUV included
+    client->texture_target = gles->exts.OES_egl_image_external ?
+        GL_TEXTURE_EXTERNAL_OES : GL_TEXTURE_2D;
+    glGenTextures(1, &client->texture);
+    glBindTexture(client->texture_target, client->texture);
+    glTexParameteri(client->texture_target, GL_TEXTURE_MIN_FILTER,
+            GL_LINEAR);
+    glTexParameteri(client->texture_target, GL_TEXTURE_MAG_FILTER,
+            GL_LINEAR);
+    gles->procs.glEGLImageTargetTexture2DOES(client->texture_target,
+            client->image);
+    glBindTexture(client->texture_target, 0);
+    return true;
+}
+
+void present_client_finish(struct egl *egl, struct present_client *client) {
+    if (client->texture) {
+        glDeleteTextures(1, &client->texture);
+        client->texture = 0;
+    }
+    if (client->image != EGL_NO_IMAGE_KHR) {
+        egl->procs.eglDestroyImageKHR(egl->display, client->image);
+        client->image = EGL_NO_IMAGE_KHR;
+    }
+}
+
+// The fallback: draw client into a ring buffer and flip that
+static bool client_compose(struct present_ring *ring,
+        struct present_client *client) {
+    TRACE_SCOPE("client_compose");
+    if (!client->texture && !client_import(ring, client)) {
+        return false;
+    }
+    struct present_buffer *buffer = present_ring_acquire(ring);
+    if (!buffer) {
+        return false;
+    }
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    const struct gles2_tex_shader *shader =
+        client->texture_target == GL_TEXTURE_EXTERNAL_OES ?
+        &ring->gles->shaders.tex_ext : &ring->gles->shaders.tex_rgbx;
+    // Pixels to clip space, row 0 of the buffer being the top of the screen
+    // the way KMS scans it out
+    const GLfloat proj[9] = {
+        2.0f / ring->kms->mode.hdisplay, 0.0f, 0.0f,
+        0.0f, 2.0f / ring->kms->mode.vdisplay, 0.0f,
+        -1.0f, -1.0f, 1.0f,
+    };
+    GLfloat x0 = client->x, y0 = client->y;
+    GLfloat x1 = x0 + client->width, y1 = y0 + client->height;
+    const GLfloat pos[] = { x0, y0, x1, y0, x0, y1, x1, y1 };
+    static const GLfloat texcoord[] = { 0, 0, 1, 0, 0, 1, 1, 1 };
+
+    glUseProgram(shader->program);
+    glUniformMatrix3fv(shader->proj, 1, GL_FALSE, proj);
+    glUniform1i(shader->tex, 0);
+    glUniform1f(shader->alpha, 1.0f);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(client->texture_target, client->texture);
+    glVertexAttribPointer(shader->pos_attrib, 2, GL_FLOAT, GL_FALSE, 0, pos);
+    glVertexAttribPointer(shader->tex_attrib, 2, GL_FLOAT, GL_FALSE, 0,
+            texcoord);
+    glEnableVertexAttribArray(shader->pos_attrib);
+    glEnableVertexAttribArray(shader->tex_attrib);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glDisableVertexAttribArray(shader->pos_attrib);
+    glDisableVertexAttribArray(shader->tex_attrib);
+    glBindTexture(client->texture_target, 0);
+    glUseProgram(0);
+
+    return present_ring_submit(ring, buffer);
+}
+
+bool present_ring_submit_client(struct present_ring *ring,
+        struct present_client *client) {
+    TRACE_SCOPE("present_ring_submit_client");
+    struct kms_backend *kms = ring->kms;
+    // The CRTC is lit by a composed frame first
+    if (!ring->modeset_done) {
+        return client_compose(ring, client);
+    }
+
+    while (kms->flip_pending) {
+        if (!kms_wait_event(kms, 1000)) {
+            return false;
+        }
+    }
+    const struct kms_layer layer = {
+        .bo = client->bo,
+        .x = client->x,
+        .y = client->y,
+        .width = client->width,
+        .height = client->height,
+    };
+    // Only the primary plane takes it, scanout() closes it otherwise
+    if (ring->explicit_sync) {
+        kms->in_fence_fd = egl_dup_render_fence(ring->egl);
+    }
+    if (kms_scanout(kms, &layer, &ring->client_flip) == 0) {
+        // A fullscreen client took the composed frame off the screen
+        if (kms->out_fence_fd >= 0) {
+            set_release_fence(ring->front, kms->out_fence_fd);
+            kms->out_fence_fd = -1;
+        }
+        ring->client_queued = client;
+        ring->frames++;
+        ring->scanout_frames++;
+        return true;
+    }
+    return client_compose(ring, client);
+}
+
+bool present_ring_client_busy(const struct present_ring *ring,
+        const struct present_client *client) {
+    return client == ring->client_front || client == ring->client_queued;
+}
+
+bool present_ring_ready(const struct present_ring *ring) {
+    return !ring->modeset_done || !ring->kms->flip_pending;
+}
+
+static void log_ring_stats(const struct present_ring *ring) {
+    struct kms_backend *kms = ring->kms;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - ring->start.tv_sec) +
+        (double)(end.tv_nsec - ring->start.tv_nsec) / NSEC_PER_SEC;
+    double refresh = (double)NSEC_PER_SEC / kms_refresh_nsec(kms);
+    if (elapsed > 0) {
+        fake_log(INFO, "CRTC %u: presented %lu frames in %.3fs: %.2f fps "
+                "(mode %.2f Hz), %lu missed vblanks", kms->crtc_id,
+                (unsigned long)ring->frames, elapsed, ring->frames / elapsed,
+                refresh, (unsigned long)ring->missed_vblanks);
+    }
+    if (ring->scanout_frames) {
+        fake_log(INFO, "CRTC %u: %lu of %lu frames scanned out directly",
+                kms->crtc_id, (unsigned long)ring->scanout_frames,
+                (unsigned long)ring->frames);
+    }
+    frame_sched_log_stats(&ring->sched, kms->crtc_id);
+}
+
+bool present_run_loop(struct gles_renderer *gles,
+        struct kms_backend **outputs, int output_count, int count,
+        uint64_t frames, bool paced) {
+    struct egl *egl = gles->egl;
+    if (output_count < 1 || output_count > KMS_MAX_OUTPUTS) {
+        fake_log(ERROR, "Invalid output count %d", output_count);
+        return false;
+    }
+    if (!egl_make_current(egl)) {
+        return false;
+    }
+
+    struct present_ring *rings[KMS_MAX_OUTPUTS] = {0};
+    bool ok = true;
+    for (int i = 0; i < output_count && ok; i++) {
+        rings[i] = present_ring_create(gles, outputs[i], count);
+        ok = rings[i] != NULL;
+        if (ok) {
+            rings[i]->time_render = paced;
+        }
+    }
+
+    struct trace_gpu *gpu = ok ? trace_gpu_create(gles) : NULL;
+    while (ok) {
+        bool done = true, drawn = false;
+        // Earliest paced start still to come, -1 if none
+        int64_t next_start = -1;
+        // Render fences still to signal, woken up on like flip events
+        int fences[KMS_MAX_OUTPUTS];
+        int fence_count = 0;
+        for (int i = 0; i < output_count && ok; i++) {
+            struct present_ring *ring = rings[i];
+            if (!present_ring_render_done(ring)) {
+                fences[fence_count++] = ring->render_fence_fd;
+            }
+            if (frames != 0 && ring->frames >= frames) {
+                continue;
+            }
+            done = false;
+            if (!present_ring_ready(ring)) {
+                continue;
+            }
+            int64_t now = get_time_ns();
+            if (paced) {
+                if (!ring->start_planned) {
+                    ring->paced_start_ns =
+                        frame_sched_begin(&ring->sched, now);
+                    ring->start_planned = true;
+                }
+                if (ring->paced_start_ns > now) {
+                    if (next_start < 0 || ring->paced_start_ns < next_start) {
+                        next_start = ring->paced_start_ns;
+                    }
+                    continue;
+                }
+                ring->start_planned = false;
+            }
+
+            TRACE_SCOPE("frame");
+            // A free buffer is there without waiting, only front is busy
+            struct present_buffer *buffer = present_ring_acquire(ring);
+            if (!buffer) {
+                ok = false;
+                break;
+            }
+            // Outputs a third of the cycle apart, to tell them apart
+            float t = (float)((ring->frames + i * 40) % 120) / 120.0f;
+            trace_gpu_begin(gpu, "clear");
+            glClearColor(t, 0.0f, 1.0f - t, 1.0f);
+            glClear(GL_COLOR_BUFFER_BIT);
+            trace_gpu_end(gpu);
+
+            ring->render_start_ns = now;
+            ok = present_ring_submit(ring, buffer);
+            drawn = true;
+            trace_gpu_collect(gpu, false);
+        }
+        if (done || !ok) {
+            break;
+        }
+        // Every output still going has a flip queued or is early for its
+        // next frame: sleep until a flip lands, a frame is due or rendering
+        // finishes
+        if (drawn) {
+            continue;
+        }
+        int64_t timeout = next_start >= 0 ? next_start - get_time_ns() : -1;
+        if (next_start >= 0 && timeout <= 0) {
+            continue;
+        }
+        if (next_start >= 0 || fence_count) {
+            ok = kms_poll_events(outputs, output_count, fences, fence_count,
+                    timeout) >= 0;
+        } else {
+            ok = kms_wait_events(outputs, output_count, 1000);
+        }
+    }
+    trace_gpu_destroy(gpu);
+
+    for (int i = 0; i < output_count; i++) {
+        if (rings[i]) {
+            log_ring_stats(rings[i]);
+            present_ring_destroy(rings[i]);
+        }
+    }
+    eglMakeCurrent(egl->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+            EGL_NO_CONTEXT);
+    return ok;
+}
+
+// A client buffer with what renders into it
+struct client_target {
+    struct present_client client;
+    EGLImageKHR image;
+    GLuint rbo;
+    GLuint fbo;
+};
+
+static bool client_target_init(struct present_ring *ring,
+        struct client_target *target, uint32_t width, uint32_t height) {
+    struct kms_backend *kms = ring->kms;
+    struct present_client *client = &target->client;
+    client->image = EGL_NO_IMAGE_KHR;
+    target->image = EGL_NO_IMAGE_KHR;
+    // No scanout formats: a client knows nothing of the display, it is up
+    // to the planes to take what it made
+    client->bo = dmabuf_alloc_bo(ring->egl, width, height,
+            GBM_FORMAT_XRGB8888, NULL);
+    if (!client->bo) {
+        fake_log(ERROR, "Failed to allocate client buffer");
+        return false;
+    }
+    client->width = width;
+    client->height = height;
+    client->x = ((int32_t)kms->mode.hdisplay - (int32_t)width) / 2;
+    client->y = ((int32_t)kms->mode.vdisplay - (int32_t)height) / 2;
+
+    target->image = dmabuf_import_bo(ring->egl, client->bo);
+    if (target->image == EGL_NO_IMAGE_KHR) {
+        fake_log(ERROR, "Failed to import client buffer into EGL");
+        return false;
+    }
+    glGenRenderbuffers(1, &target->rbo);
+    glBindRenderbuffer(GL_RENDERBUFFER, target->rbo);
+    ring->gles->procs.glEGLImageTargetRenderbufferStorageOES(GL_RENDERBUFFER,
+            target->image);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    glGenFramebuffers(1, &target->fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, target->fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+            GL_RENDERBUFFER, target->rbo);
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        fake_log(ERROR, "Client FBO incomplete: 0x%x", status);
+        return false;
+    }
+    return true;
+}
+
+static void client_target_finish(struct egl *egl,
+        struct client_target *target) {
+    present_client_finish(egl, &target->client);
+    if (target->fbo) {
+        glDeleteFramebuffers(1, &target->fbo);
+    }
+    if (target->rbo) {
+        glDeleteRenderbuffers(1, &target->rbo);
+    }
+    if (target->image != EGL_NO_IMAGE_KHR) {
+        egl->procs.eglDestroyImageKHR(egl->display, target->image);
+    }
+    // Also removes the framebuffer a scanout added
+    if (target->client.bo) {
+        gbm_bo_destroy(target->client.bo);
+    }
+}
+
+bool present_client_loop(struct gles_renderer *gles, struct kms_backend *kms,
+        int count, uint64_t frames, uint32_t width, uint32_t height) {
+    struct egl *egl = gles->egl;
+    if (count < 2 || count > PRESENT_MAX_BUFFERS) {
+        fake_log(ERROR, "Invalid client buffer count %d", count);
+        return false;
+    }
+    if (width == 0 || height == 0 || width > kms->mode.hdisplay ||
+            height > kms->mode.vdisplay) {
+        fake_log(ERROR, "Client buffer %ux%u does not fit the %s mode",
+                width, height, kms->mode.name);
+        return false;
+    }
+    if (!egl_make_current(egl)) {
+        return false;
+    }
+
+    struct client_target targets[PRESENT_MAX_BUFFERS] = {0};
+    // Ring buffers for the frames that have to be composed
+    struct present_ring *ring = present_ring_create(gles, kms, 3);
+    bool ok = ring != NULL;
+    for (int i = 0; i < count && ok; i++) {
+        ok = client_target_init(ring, &targets[i], width, height);
+    }
+
+    for (uint64_t frame = 0; ok && (frames == 0 || frame < frames);
+            frame++) {
+        TRACE_SCOPE("frame");
+        struct client_target *target = &targets[frame % count];
+        // The decoder waits for the display to let go of the buffer
+        while (ok && present_ring_client_busy(ring, &target->client)) {
+            ok = kms_wait_event(kms, 1000);
+        }
+        if (!ok) {
+            break;
+        }
+        float t = (float)(frame % 120) / 120.0f;
+        glBindFramebuffer(GL_FRAMEBUFFER, target->fbo);
+        glViewport(0, 0, width, height);
+        glClearColor(1.0f - t, t, 0.5f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glFlush();
+
+        ok = present_ring_submit_client(ring, &target->client);
+    }
+
+    if (ring) {
+        log_ring_stats(ring);
+    }
+    // Waits for the last flip, no buffer is read past this
+    present_ring_destroy(ring);
+    for (int i = 0; i < count; i++) {
+        client_target_finish(egl, &targets[i]);
+    }
+    eglMakeCurrent(egl->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+            EGL_NO_CONTEXT);
+    return ok;
+}
@@ -0,0 +1,149 @@
+#ifndef FAKE_CHEN_PRESENT_H
+#define FAKE_CHEN_PRESENT_H
+#include "egl_gbm.h"
+#include "frame_sched.h"
+#include "kms.h"
+#include <time.h>
+
+#define PRESENT_MAX_BUFFERS 4
+
+struct present_ring;
+
+/**
+ * A scanout buffer, imported once into GL. Its KMS framebuffer lives in the
+ * bo user data, see kms_fb_from_bo().
+ */
+struct present_buffer {
+    struct present_ring *ring;
+    struct gbm_bo *bo;
+    EGLImageKHR image;
+    GLuint rbo;
+    GLuint fbo;
+    // Explicit sync: signalled once the display stopped reading the buffer,
+    // -1 if there is nothing to wait for
+    int release_fence_fd;
+};
+
+/**
+ * A buffer rendered elsewhere, by a video decoder or a client, shown at a
+ * rectangle of the output. Only imported into GL once it has to be
+ * composed.
+ */
+struct present_client {
+    struct gbm_bo *bo;
+    int32_t x, y;
+    uint32_t width, height;
+
+    EGLImageKHR image;
+    GLuint texture;
+    GLenum texture_target;
+};
+
+struct present_ring {
+    struct gles_renderer *gles;
+    struct egl *egl;
+    struct kms_backend *kms;
+    // What the primary plane can scan out, allocations are limited to it
+    struct drm_format_set scanout_formats;
+    bool has_scanout_formats;
+    // Render fences go to KMS as IN_FENCE_FD and the commit out-fences
+    // recycle buffers, nothing waits on the CPU for the GPU
+    bool explicit_sync;
+
+    int count;
+    struct present_buffer buffers[PRESENT_MAX_BUFFERS];
+    // Currently scanned out
+    struct present_buffer *front;
+    // Flip queued, waiting for the next vblank
+    struct present_buffer *queued;
+    bool modeset_done;
+    // Client buffer on a plane, and queued for one. Scanouts complete
+    // through client_flip rather than a ring buffer.
+    struct present_client *client_front;
+    struct present_client *client_queued;
+    struct present_buffer client_flip;
+
+    // Vblank pacing, fed by every flip event, used by paced loops
+    struct frame_sched sched;
+    int64_t paced_start_ns;
+    bool start_planned;
+    // Paced loops time each frame by its render fence, polled along with
+    // the flip events instead of waited on. -1 when none is pending.
+    bool time_render;
+    int render_fence_fd;
+    int64_t render_start_ns;
+
+    uint64_t frames;
+    uint64_t scanout_frames;
+    uint64_t missed_vblanks;
+    unsigned int last_sequence;
+    struct timespec start;
+};
+
+/**
+ * Allocate count scanout buffers of the KMS mode size and import each into
+ * EGL and KMS up front, so presenting a frame never creates anything.
+ */
+struct present_ring *present_ring_create(struct gles_renderer *gles,
+        struct kms_backend *kms, int count);
+void present_ring_destroy(struct present_ring *ring);
+
+/**
+ * Returns a buffer that is neither on screen nor queued for flip, with its
+ * FBO bound. Waits for a flip event if all buffers are busy. With explicit
+ * sync the buffer on screen is handed out as soon as the flip replacing it
+ * is queued, the GPU waiting on its release fence before drawing into it.
+ */
+struct present_buffer *present_ring_acquire(struct present_ring *ring);
+/**
+ * Queue the buffer for the next vblank. The first call does a modeset.
+ * With explicit sync the display waits on a fence for rendering to finish,
+ * else on the implicit fences of the buffer.
+ */
+bool present_ring_submit(struct present_ring *ring,
+        struct present_buffer *buffer);
+
+/**
+ * Show client for the next vblank: on a plane as it is when the display
+ * takes it, else drawn over black into a ring buffer which is flipped. The
+ * first frame is always composed, it does the modeset.
+ */
+bool present_ring_submit_client(struct present_ring *ring,
+        struct present_client *client);
+/** True while the display may still read client, do not render to it. */
+bool present_ring_client_busy(const struct present_ring *ring,
+        const struct present_client *client);
+/** Free the GL import of client, with the ring's context current. */
+void present_client_finish(struct egl *egl, struct present_client *client);
+
+/** True when submitting now would not wait for an earlier flip. */
+bool present_ring_ready(const struct present_ring *ring);
+/**
+ * Whether the last frame of a time_render ring finished rendering, feeding
+ * its render time to the scheduler once it did. Never blocks.
+ */
+bool present_ring_render_done(struct present_ring *ring);
+
+/**
+ * Render and flip frames frames (0 = forever) on every output, each through
+ * a ring of count. An output is drawn as soon as its previous flip landed,
+ * so each flips on its own vblank and a slow or stalled one holds up no
+ * other. When paced, each frame instead starts as late as its ring's
+ * frame_sched allows. Its render time comes from a sync_file polled along
+ * with the flip events, see present_ring_render_done(), with the submit
+ * time standing in when there is no fence. Nothing waits on the GPU.
+ */
+bool present_run_loop(struct gles_renderer *gles,
+        struct kms_backend **outputs, int output_count, int count,
+        uint64_t frames, bool paced);
+
+/**
+ * Render frames frames into a ring of count client buffers of width x
+ * height, standing in for a video decoder, and show each centred on the
+ * output through present_ring_submit_client(). Logs how many went straight
+ * to a plane.
+ */
+bool present_client_loop(struct gles_renderer *gles, struct kms_backend *kms,
+        int count, uint64_t frames, uint32_t width, uint32_t height);
+
+#endif
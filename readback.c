@@ -0,0 +1,246 @@
+#include "readback.h"
+#include "log.h"
+#include "trace.h"
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef GL_STREAM_READ
+#define GL_STREAM_READ 0x88E1
+#endif
+
+static const long NSEC_PER_SEC = 1000000000;
+
+static uint64_t get_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static bool alloc_buffers(struct readback *rb, size_t size) {
+    rb->size = size;
+    if (rb->depth == 0) {
+        rb->cpu_buffer = malloc(size);
+        if (!rb->cpu_buffer) {
+            fake_log(ERROR, "Allocation failed");
+            return false;
+        }
+        return true;
+    }
+
+    for (int i = 0; i < rb->depth; i++) {
+        glGenBuffers(1, &rb->slots[i].pbo);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER_NV, rb->slots[i].pbo);
+        glBufferData(GL_PIXEL_PACK_BUFFER_NV, size, NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER_NV, 0);
+    fake_log(DEBUG, "Readback ring of %d PBOs, %zu bytes each, fences %s",
+            rb->depth, size, rb->egl->exts.KHR_fence_sync ? "on" : "off");
+    return true;
+}
+
+static void free_buffers(struct readback *rb) {
+    for (int i = 0; i < rb->depth; i++) {
+        glDeleteBuffers(1, &rb->slots[i].pbo);
+        rb->slots[i].pbo = 0;
+    }
+    free(rb->cpu_buffer);
+    rb->cpu_buffer = NULL;
+}
+
+struct readback *readback_create(struct egl *egl, struct gles_renderer *gles,
+        uint32_t width, uint32_t height, int depth,
+        readback_consumer_t consumer, void *data) {
+    if (depth < 0 || depth > READBACK_MAX_DEPTH) {
+        fake_log(ERROR, "Invalid readback depth %d", depth);
+        return NULL;
+    }
+    if (depth > 0 && !gles->exts.pixel_buffer_object) {
+        fake_log(INFO, "Pixel pack buffers not supported, "
+                "falling back to synchronous readback");
+        depth = 0;
+    }
+
+    struct readback *rb = calloc(1, sizeof(*rb));
+    if (!rb) {
+        fake_log(ERROR, "Allocation failed");
+        return NULL;
+    }
+    rb->egl = egl;
+    rb->gles = gles;
+    rb->context = eglGetCurrentContext();
+    rb->width = width;
+    rb->height = height;
+    rb->stride = width * 4;
+    rb->depth = depth;
+    rb->consumer = consumer;
+    rb->consumer_data = data;
+
+    if (!alloc_buffers(rb, (size_t)rb->stride * height)) {
+        free(rb);
+        return NULL;
+    }
+    return rb;
+}
+
+bool readback_use_yuv(struct readback *rb, struct yuv_converter *conv) {
+    if (rb->frames > 0) {
+        fake_log(ERROR, "YUV readback must be set before the first frame");
+        return false;
+    }
+    if (conv->width != rb->width || conv->height != rb->height) {
+        fake_log(ERROR, "YUV converter is %ux%u, readback %ux%u",
+                conv->width, conv->height, rb->width, rb->height);
+        return false;
+    }
+    free_buffers(rb);
+    if (!alloc_buffers(rb, conv->size)) {
+        return false;
+    }
+    rb->yuv = conv;
+    rb->stride = conv->strides[0];
+    return true;
+}
+
+// Hands the oldest in-flight frame to the consumer. Without wait, gives up
+// if its fence has not signalled yet. Returns the consumer time in ns, or
+// -1 if nothing was delivered.
+static int64_t deliver_oldest(struct readback *rb, bool wait) {
+    struct readback_slot *slot = &rb->slots[rb->tail];
+    struct egl *egl = rb->egl;
+
+    if (slot->fence != EGL_NO_SYNC_KHR) {
+        EGLint ret = egl->procs.eglClientWaitSyncKHR(egl->display, slot->fence,
+                wait ? EGL_SYNC_FLUSH_COMMANDS_BIT_KHR : 0,
+                wait ? EGL_FOREVER_KHR : 0);
+        if (ret == EGL_TIMEOUT_EXPIRED_KHR) {
+            return -1;
+        }
+        if (ret == EGL_FALSE) {
+            fake_log(ERROR, "eglClientWaitSyncKHR failed");
+        }
+        egl->procs.eglDestroySyncKHR(egl->display, slot->fence);
+        slot->fence = EGL_NO_SYNC_KHR;
+    } else if (!wait) {
+        // No way to tell whether it is done without blocking in the map
+        return -1;
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER_NV, slot->pbo);
+    void *pixels = rb->gles->procs.glMapBufferRange(GL_PIXEL_PACK_BUFFER_NV, 0,
+            rb->size, GL_MAP_READ_BIT_EXT);
+    int64_t consumer_ns = 0;
+    if (pixels) {
+        uint64_t start = get_time_ns();
+        rb->consumer(pixels, rb->width, rb->height, rb->stride, slot->frame,
+                rb->consumer_data);
+        consumer_ns = get_time_ns() - start;
+        rb->gles->procs.glUnmapBuffer(GL_PIXEL_PACK_BUFFER_NV);
+    } else {
+        fake_log(ERROR, "Failed to map readback buffer of frame %lu",
+                (unsigned long)slot->frame);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER_NV, 0);
+
+    rb->tail = (rb->tail + 1) % rb->depth;
+    rb->in_flight--;
+    return consumer_ns;
+}
+
+static void account_stall(struct readback *rb, uint64_t start,
+        int64_t consumer_ns) {
+    uint64_t stall = get_time_ns() - start - consumer_ns;
+    rb->stall_ns += stall;
+    if (stall > rb->stall_max_ns) {
+        rb->stall_max_ns = stall;
+    }
+}
+
+static void read_pixels(struct readback *rb, void *dst) {
+    if (rb->yuv) {
+        yuv_converter_read(rb->yuv, dst);
+    } else {
+        glReadPixels(0, 0, rb->width, rb->height, GL_RGBA, GL_UNSIGNED_BYTE,
+                dst);
+    }
+}
+
+bool readback_frame(struct readback *rb) {
+    TRACE_SCOPE("readback_frame");
+    uint64_t start = get_time_ns();
+    int64_t consumer_ns = 0;
+
+    if (rb->yuv && !yuv_converter_draw(rb->yuv, 0)) {
+        fake_log(ERROR, "YUV conversion of frame %lu failed",
+                (unsigned long)rb->frames);
+    }
+
+    if (rb->depth == 0) {
+        read_pixels(rb, rb->cpu_buffer);
+        uint64_t read_end = get_time_ns();
+        rb->consumer(rb->cpu_buffer, rb->width, rb->height, rb->stride,
+                rb->frames, rb->consumer_data);
+        consumer_ns = get_time_ns() - read_end;
+        rb->frames++;
+        account_stall(rb, start, consumer_ns);
+        return true;
+    }
+
+    // Anything the GPU already finished goes out first, for free
+    while (rb->in_flight > 0) {
+        int64_t ns = deliver_oldest(rb, false);
+        if (ns < 0) {
+            break;
+        }
+        consumer_ns += ns;
+    }
+    if (rb->in_flight == rb->depth) {
+        rb->fence_waits++;
+        consumer_ns += deliver_oldest(rb, true);
+    }
+
+    int index = (rb->tail + rb->in_flight) % rb->depth;
+    struct readback_slot *slot = &rb->slots[index];
+    glBindBuffer(GL_PIXEL_PACK_BUFFER_NV, slot->pbo);
+    // With a pack buffer bound this only queues the copy
+    read_pixels(rb, NULL);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER_NV, 0);
+
+    if (rb->egl->exts.KHR_fence_sync) {
+        slot->fence = rb->egl->procs.eglCreateSyncKHR(rb->egl->display,
+                EGL_SYNC_FENCE_KHR, NULL);
+    }
+    glFlush();
+    slot->frame = rb->frames++;
+    rb->in_flight++;
+
+    account_stall(rb, start, consumer_ns);
+    return glGetError() == GL_NO_ERROR;
+}
+
+void readback_flush(struct readback *rb) {
+    while (rb->depth > 0 && rb->in_flight > 0) {
+        deliver_oldest(rb, true);
+    }
+}
+
+void readback_log_stats(const struct readback *rb) {
+    if (rb->frames == 0) {
+        return;
+    }
+    fake_log(INFO, "Readback %ux%u %s depth %d: %lu frames, %zu bytes/frame, "
+            "stall %.3f ms/frame avg, %.3f ms max, %lu fence waits",
+            rb->width, rb->height,
+            rb->yuv ? (rb->yuv->layout == YUV_NV12 ? "NV12" : "I420") : "RGBA",
+            rb->depth, (unsigned long)rb->frames, rb->size,
+            (double)rb->stall_ns / rb->frames / 1e6,
+            (double)rb->stall_max_ns / 1e6, (unsigned long)rb->fence_waits);
+}
+
+void readback_destroy(struct readback *rb) {
+    if (!rb) {
+        return;
+    }
+    readback_flush(rb);
+    free_buffers(rb);
+    free(rb);
+}
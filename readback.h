@@ -0,0 +1,72 @@
+#ifndef FAKE_CHEN_READBACK_H
+#define FAKE_CHEN_READBACK_H
+#include "egl_gbm.h"
+#include "yuv.h"
+
+#define READBACK_MAX_DEPTH 8
+
+/**
+ * Receives a finished frame. pixels is only valid for the duration of the
+ * call, rows are stride bytes apart, bottom row first like glReadPixels.
+ * With a YUV converter pixels holds its planes at their offsets instead,
+ * top row first, and stride is that of the Y plane.
+ */
+typedef void (*readback_consumer_t)(const void *pixels, uint32_t width,
+        uint32_t height, uint32_t stride, uint64_t frame, void *data);
+
+struct readback_slot {
+    GLuint pbo;
+    EGLSyncKHR fence;
+    uint64_t frame;
+};
+
+struct readback {
+    struct egl *egl;
+    struct gles_renderer *gles;
+    EGLContext context;
+    uint32_t width, height, stride;
+    // Bytes read back per frame
+    size_t size;
+    // Converts on the GPU and reads only the YUV planes back, NULL for RGBA
+    struct yuv_converter *yuv;
+
+    // 0 means synchronous glReadPixels into cpu_buffer
+    int depth;
+    struct readback_slot slots[READBACK_MAX_DEPTH];
+    // Oldest slot in flight and number of slots in flight
+    int tail, in_flight;
+    void *cpu_buffer;
+
+    readback_consumer_t consumer;
+    void *consumer_data;
+
+    uint64_t frames;
+    // Render thread time spent inside readback, GL and fence waits only
+    uint64_t stall_ns, stall_max_ns;
+    // Times the ring was full and the oldest fence had not signalled yet
+    uint64_t fence_waits;
+};
+
+/**
+ * Full-frame readback of the bound read framebuffer through depth pixel pack
+ * buffers, each frame reaching the consumer depth frames later. depth 0, or
+ * no PBO support, falls back to a blocking glReadPixels. The context must be
+ * current for every call, including destroy.
+ */
+struct readback *readback_create(struct egl *egl, struct gles_renderer *gles,
+        uint32_t width, uint32_t height, int depth,
+        readback_consumer_t consumer, void *data);
+/**
+ * Read frames back as conv's planes from now on, conv staying owned by
+ * the caller. Only before the first frame, and for a converter of the
+ * ring's size.
+ */
+bool readback_use_yuv(struct readback *rb, struct yuv_converter *conv);
+/** Start reading the current frame, delivering any older finished ones. */
+bool readback_frame(struct readback *rb);
+/** Wait for and deliver every frame still in flight. */
+void readback_flush(struct readback *rb);
+void readback_log_stats(const struct readback *rb);
+void readback_destroy(struct readback *rb);
+
+#endif
@@ -0,0 +1,224 @@
+#include "render_bench.h"
+#include "egl_gbm.h"
+#include "log.h"
+#include "target_pool.h"
+#include <drm_fourcc.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+enum bench_path {
+    BENCH_TEXTURE_FBO,
+    BENCH_GBM_RENDERBUFFER,
+    BENCH_DUMB_BUFFER,
+};
+
+static const char *path_names[] = {
+    [BENCH_TEXTURE_FBO] = "texture-fbo",
+    [BENCH_GBM_RENDERBUFFER] = "gbm-rbo",
+    [BENCH_DUMB_BUFFER] = "dumb",
+};
+
+static int64_t get_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare_i64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// vgem hands out dumb buffers with no display behind them
+static int open_dumb_node(void) {
+    const char *env = getenv("EGL_GBM_DUMB_NODE");
+    if (env) {
+        int fd = open(env, O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+            fake_log_errno(ERROR, "Failed to open '%s'", env);
+        }
+        return fd;
+    }
+    for (int i = 0; i < 64; i++) {
+        char path[32];
+        snprintf(path, sizeof(path), "/dev/dri/card%d", i);
+        int fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        drmVersion *version = drmGetVersion(fd);
+        bool vgem = version && strcmp(version->name, "vgem") == 0;
+        drmFreeVersion(version);
+        if (vgem) {
+            fake_log(INFO, "Using vgem on %s for dumb buffers", path);
+            return fd;
+        }
+        close(fd);
+    }
+    return -1;
+}
+
+// Block until the GPU is done with the frame, a fence when there is one
+static void wait_frame(struct egl *egl) {
+    if (!egl->exts.KHR_fence_sync) {
+        glFinish();
+        return;
+    }
+    EGLSyncKHR fence = egl->procs.eglCreateSyncKHR(egl->display,
+            EGL_SYNC_FENCE_KHR, NULL);
+    if (fence == EGL_NO_SYNC_KHR) {
+        glFinish();
+        return;
+    }
+    egl->procs.eglClientWaitSyncKHR(egl->display, fence,
+            EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, EGL_FOREVER_KHR);
+    egl->procs.eglDestroySyncKHR(egl->display, fence);
+}
+
+// Like draw_color_to_fbo_texture(): storage and FBO made and dropped every
+// frame
+static bool texture_frame(uint32_t width, uint32_t height, uint64_t *bytes) {
+    GLuint tex, fbo;
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA,
+            GL_UNSIGNED_BYTE, NULL);
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+            GL_TEXTURE_2D, tex, 0);
+    bool complete =
+        glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    if (complete) {
+        glClear(GL_COLOR_BUFFER_BIT);
+        *bytes += (uint64_t)width * height * 4;
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteTextures(1, &tex);
+    return complete;
+}
+
+static bool run_path(struct gles_renderer *gles, enum bench_path path,
+        uint32_t width, uint32_t height, uint64_t frames) {
+    struct egl *egl = gles->egl;
+    struct target_pool *pool = NULL;
+    struct render_target_key key = {
+        .width = width,
+        .height = height,
+        .format = DRM_FORMAT_ARGB8888,
+        .modifier = DRM_FORMAT_MOD_INVALID,
+    };
+    if (path == BENCH_GBM_RENDERBUFFER) {
+        if (!egl->gbm_device) {
+            fake_log(INFO, "  %-12s skipped, no GBM device",
+                    path_names[path]);
+            return true;
+        }
+        key.alloc = RENDER_TARGET_GBM;
+        key.attach = renderbuffer;
+    } else if (path == BENCH_DUMB_BUFFER) {
+        if (egl->card_fd < 0) {
+            fake_log(INFO, "  %-12s skipped, no vgem or EGL_GBM_DUMB_NODE",
+                    path_names[path]);
+            return true;
+        }
+        key.alloc = RENDER_TARGET_DUMB;
+        key.attach = texture;
+    }
+    if (path != BENCH_TEXTURE_FBO) {
+        // One target in use at a time, nothing should ever be evicted
+        pool = target_pool_create(gles, UINT64_MAX, NULL);
+        if (!pool) {
+            return false;
+        }
+    }
+
+    int64_t *latency_ns = calloc(frames, sizeof(*latency_ns));
+    if (!latency_ns) {
+        fake_log(ERROR, "Allocation failed");
+        target_pool_destroy(pool);
+        return false;
+    }
+
+    bool ok = true;
+    uint64_t texture_bytes = 0;
+    int64_t start = get_time_ns();
+    for (uint64_t i = 0; i < frames && ok; i++) {
+        int64_t frame_start = get_time_ns();
+        float t = (float)(i % 60) / 60.0f;
+        glViewport(0, 0, width, height);
+        glClearColor(t, 1.0f - t, 0.0f, 1.0f);
+        if (pool) {
+            struct render_target *target = target_pool_acquire(pool, &key);
+            if (target) {
+                glClear(GL_COLOR_BUFFER_BIT);
+                wait_frame(egl);
+                glBindFramebuffer(GL_FRAMEBUFFER, 0);
+                target_pool_release(target);
+            }
+            ok = target != NULL;
+        } else {
+            ok = texture_frame(width, height, &texture_bytes);
+            wait_frame(egl);
+        }
+        latency_ns[i] = get_time_ns() - frame_start;
+    }
+    int64_t elapsed = get_time_ns() - start;
+
+    if (!ok) {
+        fake_log(ERROR, "  %-12s failed at %ux%u", path_names[path], width,
+                height);
+    } else if (frames > 0) {
+        // The first frame allocates for the pooled paths, shown apart
+        int64_t first_ns = latency_ns[0];
+        qsort(latency_ns, frames, sizeof(*latency_ns), compare_i64);
+        uint64_t allocs = pool ? pool->misses : frames;
+        uint64_t bytes = pool ? pool->bytes : texture_bytes;
+        fake_log(INFO, "  %-12s %8.1f fps  p50 %7.3f ms  p99 %7.3f ms  "
+                "first %7.3f ms  %lu allocs %9.1f MiB", path_names[path],
+                frames * 1e9 / elapsed, latency_ns[frames / 2] / 1e6,
+                latency_ns[frames * 99 / 100] / 1e6, first_ns / 1e6,
+                (unsigned long)allocs, bytes / 1048576.0);
+    }
+    free(latency_ns);
+    target_pool_destroy(pool);
+    return ok;
+}
+
+bool render_bench_run(const struct render_bench_size *sizes, size_t count,
+        uint64_t frames) {
+    static struct egl egl;
+    static struct gles_renderer gles;
+    egl.card_fd = -1;
+    if (!init_egl_headless(&egl) || !init_opengles(&gles, &egl)) {
+        return false;
+    }
+    // After EGL is up: with no card_fd the capability cache key describes
+    // the EGL device through its render node, not the vgem node
+    egl.card_fd = open_dumb_node();
+    fake_log(INFO, "Renderer: %s", (const char *)glGetString(GL_RENDERER));
+
+    bool ok = true;
+    for (size_t i = 0; i < count && ok; i++) {
+        fake_log(INFO, "%ux%u, %lu frames", sizes[i].width, sizes[i].height,
+                (unsigned long)frames);
+        for (int path = BENCH_TEXTURE_FBO; path <= BENCH_DUMB_BUFFER && ok;
+                path++) {
+            ok = run_path(&gles, path, sizes[i].width, sizes[i].height,
+                    frames);
+        }
+    }
+
+    eglMakeCurrent(egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+            EGL_NO_CONTEXT);
+    if (egl.card_fd >= 0) {
+        close(egl.card_fd);
+    }
+    return ok;
+}
@@ -0,0 +1,24 @@
+#ifndef FAKE_CHEN_RENDER_BENCH_H
+#define FAKE_CHEN_RENDER_BENCH_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct render_bench_size {
+    uint32_t width, height;
+};
+
+/**
+ * Frame loop over the three offscreen paths main() draws with, without a
+ * display: a fresh texture FBO per frame, a pooled GBM renderbuffer and a
+ * pooled dumb buffer. EGL comes from init_egl_headless(), dumb buffers
+ * from EGL_GBM_DUMB_NODE or else the first vgem node. Paths with no
+ * allocator on this machine are skipped.
+ *
+ * Every frame is a clear waited on with a fence, frames/s, p50/p99 latency
+ * and bytes allocated are logged for each path and size.
+ */
+bool render_bench_run(const struct render_bench_size *sizes, size_t count,
+        uint64_t frames);
+
+#endif
@@ -0,0 +1,1303 @@
+#include "caps_cache.h"
+#include "egl_gbm.h"
+#include "ext_set.h"
+#include "log.h"
+#include <assert.h>
+#include <drm_fourcc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+static void load_gl_proc(void *proc_ptr, const char *name);
+static void load_egl_proc(void *proc_ptr, const char *name);
+static bool device_has_name(const drmDevice *device, const char *name);
+
+static void init_dmabuf_formats(struct egl *egl);
+static int get_egl_dmabuf_formats(struct egl *egl, int **formats);
+static int get_egl_dmabuf_modifiers(struct egl *egl, int format,
+        uint64_t **modifiers,
+        EGLBoolean **external_only);
+
+// egl debug
+static enum log_importance egl_log_importance(EGLint type);
+static const char *egl_error_str(EGLint error);
+static void egl_log(EGLenum error, const char *command, EGLint msg_type,
+        EGLLabelKHR thread, EGLLabelKHR obj, const char *msg);
+
+static int64_t get_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Use the cached dmabuf formats when the driver did not change, probe and
+// refresh the cache otherwise
+static void load_dmabuf_formats(struct egl *egl) {
+    int64_t start = get_time_ns();
+    char key[512];
+    const char *path = caps_cache_path();
+    bool have_key = path && caps_cache_key(egl, key, sizeof(key));
+    egl->startup.formats_cached = have_key &&
+        caps_cache_load(egl, path, key);
+    if (egl->startup.formats_cached) {
+        fake_log(INFO, "Loaded %zu DMA-BUF formats from %s",
+                egl->dmabuf_texture_formats.len, path);
+    } else {
+        init_dmabuf_formats(egl);
+        if (have_key) {
+            caps_cache_store(egl, path, key);
+        }
+    }
+    egl->startup.formats_ns = get_time_ns() - start;
+}
+
+static void init_dmabuf_formats(struct egl *egl) {
+    int *formats;
+    int formats_len = get_egl_dmabuf_formats(egl, &formats);
+    if (formats_len < 0) {
+        return;
+    }
+    fake_log(ERROR, "egl support formats num = %d", formats_len);
+
+    bool has_modifiers = false;
+    for (int i = 0; i < formats_len; i++) {
+        uint32_t fmt = formats[i];
+
+        uint64_t *modifiers;
+        EGLBoolean *external_only;
+        int modifiers_len =
+            get_egl_dmabuf_modifiers(egl, fmt, &modifiers, &external_only);
+        if (modifiers_len < 0) {
+            continue;
+        }
+
+        has_modifiers = has_modifiers || modifiers_len > 0;
+
+        // EGL始终支持隐式修饰符
+        drm_format_set_add(&egl->dmabuf_texture_formats, fmt,
+                DRM_FORMAT_MOD_INVALID);
+        drm_format_set_add(&egl->dmabuf_render_formats, fmt,
+                DRM_FORMAT_MOD_INVALID);
+
+        // 如果驱动程序没有明确说明，则假设支持线性布局
+        if (modifiers_len == 0) {
+            // Asume the linear layout is supported if the driver doesn't
+            // explicitly say otherwise
+            drm_format_set_add(&egl->dmabuf_texture_formats, fmt,
+                    DRM_FORMAT_MOD_LINEAR);
+            drm_format_set_add(&egl->dmabuf_render_formats, fmt,
+                    DRM_FORMAT_MOD_LINEAR);
+        }
+
+        for (int j = 0; j < modifiers_len; j++) {
+            drm_format_set_add(&egl->dmabuf_texture_formats, fmt, modifiers[j]);
+            if (!external_only[j]) {
+                drm_format_set_add(&egl->dmabuf_render_formats, fmt,
+                        modifiers[j]);
+            }
+        }
+
+        free(modifiers);
+        free(external_only);
+    }
+
+    char *str_formats = malloc(formats_len * 5 + 1);
+    if (str_formats == NULL) {
+        goto out;
+    }
+    for (int i = 0; i < formats_len; i++) {
+        snprintf(&str_formats[i * 5], (formats_len - i) * 5 + 1, "%.4s ",
+                (char *)&formats[i]);
+    }
+    fake_log(INFO, "Supported DMA-BUF formats: %s", str_formats);
+    fake_log(INFO, "EGL DMA-BUF format modifiers %s",
+            has_modifiers ? "supported" : "unsupported");
+    free(str_formats);
+
+    egl->has_modifiers = has_modifiers;
+
+out:
+    free(formats);
+}
+
+static int open_render_node(int drm_fd) {
+    char *render_name = drmGetRenderDeviceNameFromFd(drm_fd);
+
+    if (render_name == NULL) {
+        // This can happen on split render/display platforms, fallback to
+        // primary node
+        render_name = drmGetPrimaryDeviceNameFromFd(drm_fd);
+        if (render_name == NULL) {
+            fake_log(ERROR, "drmGetPrimaryDeviceNameFromFd failed");
+            return -1;
+        }
+        fake_log(DEBUG,
+                "DRM device '%s' has no render node, "
+                "falling back to primary node",
+                render_name);
+    }
+
+    int render_fd = open(render_name, O_RDWR | O_CLOEXEC);
+    if (render_fd < 0) {
+        fake_log(ERROR, "Failed to open DRM node '%s'", render_name);
+    }
+    free(render_name);
+    return render_fd;
+}
+
+EGLDeviceEXT get_egl_device_from_fd(struct egl *egl, int fd) {
+    if (egl->procs.eglQueryDevicesEXT == NULL) {
+        fake_log(DEBUG, "EGL_EXT_device_enumeration not supported");
+        return EGL_NO_DEVICE_EXT;
+    }
+
+    EGLint nb_devices = 0;
+    // NULL -> to get supported devices num in the system
+    if (!egl->procs.eglQueryDevicesEXT(0, NULL, &nb_devices)) {
+        fake_log(ERROR, "Failed to query EGL devices");
+        return EGL_NO_DEVICE_EXT;
+    }
+
+    fake_log(INFO, "supported devices num is %d in the system", nb_devices);
+
+    EGLDeviceEXT *devices = calloc(nb_devices, sizeof(EGLDeviceEXT));
+    if (devices == NULL) {
+        fake_log_errno(ERROR, "Failed to allocate EGL device list");
+        return EGL_NO_DEVICE_EXT;
+    }
+
+    if (!egl->procs.eglQueryDevicesEXT(nb_devices, devices, &nb_devices)) {
+        fake_log(ERROR, "Failed to query EGL devices");
+        return EGL_NO_DEVICE_EXT;
+    }
+
+    drmDevice *device = NULL;
+    int ret = drmGetDevice(fd, &device);
+    if (ret < 0) {
+        fake_log(ERROR, "Failed to get DRM device: %s", strerror(-ret));
+        return EGL_NO_DEVICE_EXT;
+    }
+
+    EGLDeviceEXT egl_device = NULL;
+    for (int i = 0; i < nb_devices; i++) {
+        const char *egl_device_name = egl->procs.eglQueryDeviceStringEXT(
+                devices[i], EGL_DRM_DEVICE_FILE_EXT);
+        /* const char *egl_device_name = egl->procs.eglQueryDeviceStringEXT(
+        */
+        /* 		devices[i], EGL_DRM_RENDER_NODE_FILE_EXT); */
+        if (egl_device_name == NULL) {
+            continue;
+        }
+        if (device_has_name(device, egl_device_name)) {
+            fake_log(DEBUG, "Using EGL device %s", egl_device_name);
+            egl_device = devices[i];
+            break;
+        }
+    }
+
+    drmFreeDevice(&device);
+    free(devices);
+    return egl_device;
+}
+
+static bool egl_init_display(struct egl *egl, EGLDisplay display) {
+    int64_t start = get_time_ns();
+    egl->display = display;
+
+    EGLint major, minor;
+    if (eglInitialize(egl->display, &major, &minor) == EGL_FALSE) {
+        fake_log(ERROR, "Failed to initialize EGL");
+        return false;
+    }
+
+    const char *display_exts_str =
+        eglQueryString(egl->display, EGL_EXTENSIONS);
+    if (display_exts_str == NULL) {
+        fake_log(ERROR, "Failed to query EGL display extensions");
+        return false;
+    }
+    // Kept for later lookups, the string lives as long as the display
+    ext_set_finish(&egl->ext_set);
+    if (!ext_set_init(&egl->ext_set, display_exts_str)) {
+        return false;
+    }
+    const struct ext_set *exts = &egl->ext_set;
+
+    if (ext_set_has_known(exts, EXT_EGL_KHR_image_base)) {
+        egl->exts.KHR_image_base = true;
+        load_egl_proc(&egl->procs.eglCreateImageKHR, "eglCreateImageKHR");
+        load_egl_proc(&egl->procs.eglDestroyImageKHR, "eglDestroyImageKHR");
+    }
+
+    egl->exts.EXT_image_dma_buf_import =
+        ext_set_has_known(exts, EXT_EGL_EXT_image_dma_buf_import);
+    if (ext_set_has_known(exts, EXT_EGL_EXT_image_dma_buf_import_modifiers)) {
+        egl->exts.EXT_image_dma_buf_import_modifiers = true;
+        load_egl_proc(&egl->procs.eglQueryDmaBufFormatsEXT,
+                "eglQueryDmaBufFormatsEXT");
+        load_egl_proc(&egl->procs.eglQueryDmaBufModifiersEXT,
+                "eglQueryDmaBufModifiersEXT");
+    }
+
+    const char *device_exts_str = NULL, *driver_name = NULL;
+    struct ext_set device_exts = {0};
+    if (egl->exts.EXT_device_query) {
+        EGLAttrib device_attrib;
+        if (!egl->procs.eglQueryDisplayAttribEXT(
+                    egl->display, EGL_DEVICE_EXT, &device_attrib)) {
+            fake_log(ERROR, "eglQueryDisplayAttribEXT(EGL_DEVICE_EXT) failed");
+            return false;
+        }
+        egl->device = (EGLDeviceEXT)device_attrib;
+
+        device_exts_str = egl->procs.eglQueryDeviceStringEXT(egl->device,
+                EGL_EXTENSIONS);
+        if (device_exts_str == NULL) {
+            fake_log(ERROR, "eglQueryDeviceStringEXT(EGL_EXTENSIONS) failed");
+            return false;
+        }
+        if (!ext_set_init(&device_exts, device_exts_str)) {
+            return false;
+        }
+
+        if (ext_set_has_known(&device_exts, EXT_EGL_MESA_device_software)) {
+            if (env_parse_bool("EGL_RENDERER_ALLOW_SOFTWARE")) {
+                fake_log(INFO, "Using software rendering");
+            } else {
+                fake_log(ERROR,
+                        "Software rendering detected, please use "
+                        "the WLR_RENDERER_ALLOW_SOFTWARE environment variable "
+                        "to proceed");
+                ext_set_finish(&device_exts);
+                return false;
+            }
+        }
+
+#ifdef EGL_DRIVER_NAME_EXT
+        if (ext_set_has_known(&device_exts,
+                    EXT_EGL_EXT_device_persistent_id)) {
+            egl->exts.EXT_device_persistent_id = true;
+            load_egl_proc(&egl->procs.eglQueryDeviceBinaryEXT,
+                    "eglQueryDeviceBinaryEXT");
+            driver_name = egl->procs.eglQueryDeviceStringEXT(
+                    egl->device, EGL_DRIVER_NAME_EXT);
+        }
+#endif
+        egl->exts.EXT_device_drm =
+            ext_set_has_known(&device_exts, EXT_EGL_EXT_device_drm);
+        egl->exts.EXT_device_drm_render_node =
+            ext_set_has_known(&device_exts,
+                    EXT_EGL_EXT_device_drm_render_node);
+        ext_set_finish(&device_exts);
+    }
+
+    if (!ext_set_has_known(exts, EXT_EGL_KHR_no_config_context) &&
+            !ext_set_has_known(exts, EXT_EGL_MESA_configless_context)) {
+        fake_log(ERROR, "EGL_KHR_no_config_context or "
+                "EGL_MESA_configless_context not supported");
+        return false;
+    }
+
+    if (!ext_set_has_known(exts, EXT_EGL_KHR_surfaceless_context)) {
+        fake_log(ERROR, "EGL_KHR_surfaceless_context not supported");
+        return false;
+    }
+
+    egl->exts.IMG_context_priority =
+        ext_set_has_known(exts, EXT_EGL_IMG_context_priority);
+
+    if (ext_set_has_known(exts, EXT_EGL_KHR_fence_sync)) {
+        egl->exts.KHR_fence_sync = true;
+        load_egl_proc(&egl->procs.eglCreateSyncKHR, "eglCreateSyncKHR");
+        load_egl_proc(&egl->procs.eglDestroySyncKHR, "eglDestroySyncKHR");
+        load_egl_proc(&egl->procs.eglClientWaitSyncKHR,
+                "eglClientWaitSyncKHR");
+
+        if (ext_set_has_known(exts, EXT_EGL_ANDROID_native_fence_sync)) {
+            egl->exts.ANDROID_native_fence_sync = true;
+            load_egl_proc(&egl->procs.eglDupNativeFenceFDANDROID,
+                    "eglDupNativeFenceFDANDROID");
+        }
+        if (ext_set_has_known(exts, EXT_EGL_KHR_wait_sync)) {
+            egl->exts.KHR_wait_sync = true;
+            load_egl_proc(&egl->procs.eglWaitSyncKHR, "eglWaitSyncKHR");
+        }
+    }
+
+    fake_log(INFO, "Using EGL %d.%d", (int)major, (int)minor);
+    fake_log(INFO, "Supported EGL display extensions:\n %s", display_exts_str);
+    if (device_exts_str != NULL) {
+        fake_log(INFO, "Supported EGL device extensions: %s", device_exts_str);
+    }
+    fake_log(INFO, "EGL vendor: %s",
+            eglQueryString(egl->display, EGL_VENDOR));
+    if (driver_name != NULL) {
+        fake_log(INFO, "EGL driver name: %s", driver_name);
+    }
+
+    egl->startup.display_ns = get_time_ns() - start;
+    load_dmabuf_formats(egl);
+
+    return true;
+}
+
+static int match_config_to_visual(EGLDisplay egl_display, EGLint visual_id,
+        EGLConfig *configs, int count) {
+
+    EGLint id;
+    for (int i = 0; i < count; ++i) {
+        if (!eglGetConfigAttrib(egl_display, configs[i], EGL_NATIVE_VISUAL_ID,
+                    &id))
+            continue;
+        if (id == visual_id)
+            return i;
+    }
+    return -1;
+}
+
+// Config of the window surface created on egl->gbm_surface
+static EGLConfig egl_create_window_surface(struct egl *egl) {
+    // use surface specify config
+    const EGLint attribList[] = {
+        EGL_RENDER_BUFFER, EGL_BACK_BUFFER,
+        EGL_NONE,
+    };
+    const EGLint config_attribs[] = {
+        EGL_BUFFER_SIZE, 32, // color component bit 32
+        EGL_DEPTH_SIZE, EGL_DONT_CARE,
+        EGL_STENCIL_SIZE, EGL_DONT_CARE,
+        EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
+        EGL_RED_SIZE, 8,
+        EGL_GREEN_SIZE, 8,
+        EGL_BLUE_SIZE, 8,
+        EGL_ALPHA_SIZE, 8,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+        EGL_NONE,
+    };
+    EGLint max_num_configs, num_configs, config_index;
+    if (!eglGetConfigs(egl->display, NULL, 0, &max_num_configs)) {
+        fake_log(ERROR, "Failed to get display configs");
+        return EGL_NO_CONFIG_KHR;
+    }
+    fake_log(INFO, "Display config max num = %d", max_num_configs);
+    EGLConfig *configs = malloc(max_num_configs * sizeof(EGLConfig));
+    if (!eglChooseConfig(egl->display, config_attribs, configs,
+                max_num_configs, &num_configs)) {
+        fake_log(ERROR, "Failed to choose specify configs");
+        return EGL_NO_CONFIG_KHR;
+    }
+    fake_log(INFO, "匹配 config_attribs Display choose config num = %d",
+            num_configs);
+    config_index = match_config_to_visual(egl->display, GBM_FORMAT_ARGB8888,
+            configs, num_configs);
+    fake_log(INFO, "index = %d", config_index);
+    // 1. egl->window_surface = eglCreateWindowSurface(egl->display,
+    // configs[config_index], (EGLNativeWindowType)egl->gbm_surface,
+    // attribList);
+    // 2. egl->window_surface =
+    // eglCreatePlatformWindowSurface(egl->display, configs[config_index],
+    // egl->gbm_surface, (EGLAttrib *)attribList);
+    egl->window_surface = egl->procs.eglCreatePlatformWindowSurfaceEXT(
+            egl->display, configs[config_index], egl->gbm_surface,
+            attribList);
+    if (egl->window_surface == EGL_NO_SURFACE) {
+        fake_log(ERROR, "Failed to create EGL Surface");
+        return EGL_NO_CONFIG_KHR;
+    }
+    return configs[config_index];
+}
+
+static bool egl_init(struct egl *egl, EGLenum platform,
+        void *remote_display) {
+    EGLDisplay display =
+        egl->procs.eglGetPlatformDisplayEXT(platform, remote_display, NULL);
+    if (display == EGL_NO_DISPLAY) {
+        fake_log(ERROR, "Failed to create EGL Display");
+        return false;
+    }
+    if (!egl_init_display(egl, display)) {
+        eglTerminate(display);
+        return false;
+    }
+    int64_t context_start = get_time_ns();
+    // Headless: nothing to present, the context renders to FBOs only
+    EGLConfig config = EGL_NO_CONFIG_KHR;
+    if (egl->gbm_surface) {
+        config = egl_create_window_surface(egl);
+        if (egl->window_surface == EGL_NO_SURFACE) {
+            return false;
+        }
+    }
+
+    size_t atti = 0;
+    EGLint attribs[5];
+    attribs[atti++] = EGL_CONTEXT_CLIENT_VERSION;
+    attribs[atti++] = 2;
+
+    // Request a high priority context if possible
+    // TODO: only do this if we're running as the DRM master
+    bool request_high_priority = egl->exts.IMG_context_priority;
+
+    // Try to reschedule all of our rendering to be completed first. If it
+    // fails, it will fallback to the default priority (MEDIUM).
+    if (request_high_priority) {
+        attribs[atti++] = EGL_CONTEXT_PRIORITY_LEVEL_IMG;
+        attribs[atti++] = EGL_CONTEXT_PRIORITY_HIGH_IMG;
+    }
+
+    attribs[atti++] = EGL_NONE;
+    assert(atti <= sizeof(attribs) / sizeof(attribs[0]));
+
+    egl->context = eglCreateContext(egl->display, config, EGL_NO_CONTEXT,
+            attribs);
+    if (egl->context == EGL_NO_CONTEXT) {
+        fake_log(ERROR, "Failed to create EGL context");
+        return false;
+    }
+    egl->startup.context_ns = get_time_ns() - context_start;
+
+    if (request_high_priority) {
+        EGLint priority = EGL_CONTEXT_PRIORITY_MEDIUM_IMG;
+        eglQueryContext(egl->display, egl->context,
+                EGL_CONTEXT_PRIORITY_LEVEL_IMG, &priority);
+        if (priority != EGL_CONTEXT_PRIORITY_HIGH_IMG) {
+            fake_log(INFO, "Failed to obtain a high priority context");
+        } else {
+            fake_log(DEBUG, "Obtained high priority context");
+        }
+    }
+
+    return true;
+}
+
+bool check_basic_egl(struct egl *egl) {
+    const char *client_exts_str =
+        eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    if (client_exts_str == NULL) {
+        if (eglGetError() == EGL_BAD_DISPLAY) {
+            fake_log(ERROR, "EGL_EXT_client_extensions not supported");
+        } else {
+            fake_log(ERROR, "Failed to query EGL client extensions");
+        }
+        return false;
+    }
+
+    fake_log(INFO, "Supported EGL client extensions:\n %s", client_exts_str);
+
+    struct ext_set client_exts;
+    if (!ext_set_init(&client_exts, client_exts_str)) {
+        return false;
+    }
+
+    if (!ext_set_has_known(&client_exts, EXT_EGL_EXT_platform_base)) {
+        fake_log(ERROR, " EGL_EXT_platform_base not supported");
+        ext_set_finish(&client_exts);
+        return false;
+    }
+
+    load_egl_proc(&egl->procs.eglGetPlatformDisplayEXT,
+            "eglGetPlatformDisplayEXT");
+
+    load_egl_proc(&egl->procs.eglCreatePlatformWindowSurfaceEXT,
+            "eglCreatePlatformWindowSurfaceEXT");
+
+    egl->exts.KHR_platform_gbm =
+        ext_set_has_known(&client_exts, EXT_EGL_KHR_platform_gbm);
+
+    egl->exts.EXT_platform_device =
+        ext_set_has_known(&client_exts, EXT_EGL_EXT_platform_device);
+
+    egl->exts.MESA_platform_surfaceless =
+        ext_set_has_known(&client_exts, EXT_EGL_MESA_platform_surfaceless);
+
+    if (ext_set_has_known(&client_exts, EXT_EGL_EXT_device_base) ||
+            ext_set_has_known(&client_exts, EXT_EGL_EXT_device_enumeration)) {
+        load_egl_proc(&egl->procs.eglQueryDevicesEXT, "eglQueryDevicesEXT");
+    }
+
+    if (ext_set_has_known(&client_exts, EXT_EGL_EXT_device_base) ||
+            ext_set_has_known(&client_exts, EXT_EGL_EXT_device_query)) {
+        egl->exts.EXT_device_query = true;
+        load_egl_proc(&egl->procs.eglQueryDeviceStringEXT,
+                "eglQueryDeviceStringEXT");
+        load_egl_proc(&egl->procs.eglQueryDisplayAttribEXT,
+                "eglQueryDisplayAttribEXT");
+    }
+
+    if (ext_set_has_known(&client_exts, EXT_EGL_KHR_debug)) {
+        load_egl_proc(&egl->procs.eglDebugMessageControlKHR,
+                "eglDebugMessageControlKHR");
+
+        static const EGLAttrib debug_attribs[] = {
+            EGL_DEBUG_MSG_CRITICAL_KHR,
+            EGL_TRUE,
+            EGL_DEBUG_MSG_ERROR_KHR,
+            EGL_TRUE,
+            EGL_DEBUG_MSG_WARN_KHR,
+            EGL_TRUE,
+            EGL_DEBUG_MSG_INFO_KHR,
+            EGL_TRUE,
+            EGL_NONE,
+        };
+        egl->procs.eglDebugMessageControlKHR(egl_log, debug_attribs);
+    }
+    ext_set_finish(&client_exts);
+
+    if (EGL_FALSE == eglBindAPI(EGL_OPENGL_ES_API)) {
+        fake_log(ERROR, "Failed to bind to the OpenGL ES API");
+        return false;
+    }
+
+    return true;
+}
+
+bool init_egl(struct egl *egl) {
+
+    // basic check egl
+    int64_t start = get_time_ns();
+    if (!check_basic_egl(egl)) {
+        return false;
+    }
+    egl->startup.client_ns = get_time_ns() - start;
+
+    // create egl device
+    egl->exts.EXT_platform_device = false;
+    if (egl->exts.EXT_platform_device) {
+        /*
+         * Search for the EGL device matching the DRM fd using the
+         * EXT_device_enumeration extension.
+         */
+        EGLDeviceEXT egl_device = get_egl_device_from_fd(egl, egl->card_fd);
+        if (egl_device != EGL_NO_DEVICE_EXT) {
+            if (egl_init(egl, EGL_PLATFORM_DEVICE_EXT, egl_device)) {
+                fake_log(DEBUG, "Using EGL_PLATFORM_DEVICE_EXT");
+                return true;
+            }
+            goto error;
+        }
+
+    } else {
+        fake_log(DEBUG, "EXT_platform_device not supported");
+    }
+
+    if (egl->exts.KHR_platform_gbm) {
+        // we use egl swapbuffer to set crtc muse card fd
+        int gbm_fd = egl->card_fd;//open_render_node(egl->card_fd);
+        if (gbm_fd < 0) {
+            fake_log(ERROR, "Failed to open DRM render node");
+            goto error;
+        }
+
+        egl->gbm_device = gbm_create_device(gbm_fd);
+        if (!egl->gbm_device) {
+            close(gbm_fd);
+            fake_log(ERROR, "Failed to create GBM device");
+            goto error;
+        }
+
+        // use gbm surface to gen window surface
+        egl->gbm_surface = gbm_surface_create(
+                egl->gbm_device, egl->mode.hdisplay, egl->mode.vdisplay,
+                GBM_FORMAT_XRGB8888, GBM_BO_USE_SCANOUT |  GBM_BO_USE_RENDERING);
+        if (!egl->gbm_surface) {
+            gbm_device_destroy(egl->gbm_device);
+            close(gbm_fd);
+            fake_log(ERROR, "Failed to create GBM Surface");
+            goto error;
+        }
+
+        // 这里注意，后面需要有一些显卡需要用card节点创建
+        // 比如Mali-G76是要用car0来创建gbm_device，才能拿到EGL display的
+        // 后面在修改代码；
+        if (egl_init(egl, EGL_PLATFORM_GBM_KHR, egl->gbm_device)) {
+            fake_log(DEBUG, "Using EGL_PLATFORM_GBM_KHR");
+            return true;
+        }
+
+        gbm_surface_destroy(egl->gbm_surface);
+        gbm_device_destroy(egl->gbm_device);
+        close(gbm_fd);
+    } else {
+        fake_log(DEBUG, "KHR_platform_gbm not supported");
+    }
+
+error:
+    fake_log(ERROR, "Failed to initialize EGL context");
+    if (egl->display) {
+        eglMakeCurrent(egl->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                EGL_NO_CONTEXT);
+        eglTerminate(egl->display);
+    }
+    eglReleaseThread();
+
+    return false;
+}
+
+// First hardware device, or with allow_software the first software one
+// when there is any
+static EGLDeviceEXT get_headless_device(struct egl *egl, bool allow_software) {
+    if (egl->procs.eglQueryDevicesEXT == NULL ||
+            egl->procs.eglQueryDeviceStringEXT == NULL) {
+        fake_log(DEBUG, "EGL_EXT_device_enumeration not supported");
+        return EGL_NO_DEVICE_EXT;
+    }
+
+    EGLint nb_devices = 0;
+    if (!egl->procs.eglQueryDevicesEXT(0, NULL, &nb_devices) ||
+            nb_devices <= 0) {
+        fake_log(ERROR, "Failed to query EGL devices");
+        return EGL_NO_DEVICE_EXT;
+    }
+    EGLDeviceEXT *devices = calloc(nb_devices, sizeof(EGLDeviceEXT));
+    if (devices == NULL) {
+        fake_log_errno(ERROR, "Failed to allocate EGL device list");
+        return EGL_NO_DEVICE_EXT;
+    }
+    if (!egl->procs.eglQueryDevicesEXT(nb_devices, devices, &nb_devices)) {
+        fake_log(ERROR, "Failed to query EGL devices");
+        free(devices);
+        return EGL_NO_DEVICE_EXT;
+    }
+
+    EGLDeviceEXT hardware = EGL_NO_DEVICE_EXT, software = EGL_NO_DEVICE_EXT;
+    for (int i = 0; i < nb_devices; i++) {
+        const char *exts_str = egl->procs.eglQueryDeviceStringEXT(
+                devices[i], EGL_EXTENSIONS);
+        struct ext_set exts;
+        if (exts_str == NULL || !ext_set_init(&exts, exts_str)) {
+            continue;
+        }
+        if (ext_set_has_known(&exts, EXT_EGL_MESA_device_software)) {
+            if (software == EGL_NO_DEVICE_EXT) {
+                software = devices[i];
+            }
+        } else if (hardware == EGL_NO_DEVICE_EXT &&
+                ext_set_has_known(&exts, EXT_EGL_EXT_device_drm)) {
+            hardware = devices[i];
+        }
+        ext_set_finish(&exts);
+    }
+    free(devices);
+
+    if (allow_software && software != EGL_NO_DEVICE_EXT) {
+        return software;
+    }
+    return hardware;
+}
+
+static bool init_headless_gbm(struct egl *egl) {
+#ifdef EGL_DRM_RENDER_NODE_FILE_EXT
+    if (!egl->exts.EXT_device_drm_render_node) {
+        return false;
+    }
+    const char *name = egl->procs.eglQueryDeviceStringEXT(egl->device,
+            EGL_DRM_RENDER_NODE_FILE_EXT);
+    if (name == NULL) {
+        return false;
+    }
+    egl->render_fd = open(name, O_RDWR | O_CLOEXEC);
+    if (egl->render_fd < 0) {
+        fake_log_errno(ERROR, "Failed to open DRM render node '%s'", name);
+        return false;
+    }
+    egl->gbm_device = gbm_create_device(egl->render_fd);
+    if (!egl->gbm_device) {
+        fake_log(ERROR, "Failed to create GBM device on '%s'", name);
+        close(egl->render_fd);
+        egl->render_fd = -1;
+        return false;
+    }
+    fake_log(DEBUG, "Using GBM on %s", name);
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool init_egl_headless(struct egl *egl) {
+    int64_t start = get_time_ns();
+    if (!check_basic_egl(egl)) {
+        return false;
+    }
+    egl->startup.client_ns = get_time_ns() - start;
+    egl->render_fd = -1;
+
+    bool allow_software = env_parse_bool("EGL_RENDERER_ALLOW_SOFTWARE");
+    if (egl->exts.EXT_platform_device) {
+        EGLDeviceEXT egl_device = get_headless_device(egl, allow_software);
+        if (egl_device != EGL_NO_DEVICE_EXT) {
+            if (egl_init(egl, EGL_PLATFORM_DEVICE_EXT, egl_device)) {
+                fake_log(DEBUG, "Using EGL_PLATFORM_DEVICE_EXT");
+                goto out;
+            }
+            goto error;
+        }
+    } else {
+        fake_log(DEBUG, "EXT_platform_device not supported");
+    }
+
+    if (egl->exts.MESA_platform_surfaceless) {
+        if (egl_init(egl, EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY)) {
+            fake_log(DEBUG, "Using EGL_PLATFORM_SURFACELESS_MESA");
+            goto out;
+        }
+    } else {
+        fake_log(DEBUG, "MESA_platform_surfaceless not supported");
+    }
+
+error:
+    fake_log(ERROR, "Failed to initialize headless EGL context");
+    if (egl->display) {
+        eglMakeCurrent(egl->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                EGL_NO_CONTEXT);
+        eglTerminate(egl->display);
+    }
+    eglReleaseThread();
+    return false;
+
+out:
+    // Software devices have no node, their GBM paths are skipped
+    if (!init_headless_gbm(egl)) {
+        fake_log(INFO, "No DRM render node, GBM buffers unavailable");
+    }
+    return true;
+}
+
+static const GLchar quad_vertex_src[] =
+    "uniform mat3 proj;\n"
+    "attribute vec2 pos;\n"
+    "\n"
+    "void main() {\n"
+    "    gl_Position = vec4(proj * vec3(pos, 1.0), 1.0);\n"
+    "}\n";
+
+static const GLchar quad_fragment_src[] =
+    "precision mediump float;\n"
+    "uniform vec4 color;\n"
+    "\n"
+    "void main() {\n"
+    "    gl_FragColor = color;\n"
+    "}\n";
+
+static const GLchar tex_vertex_src[] =
+    "uniform mat3 proj;\n"
+    "attribute vec2 pos;\n"
+    "attribute vec2 texcoord;\n"
+    "varying vec2 v_texcoord;\n"
+    "\n"
+    "void main() {\n"
+    "    gl_Position = vec4(proj * vec3(pos, 1.0), 1.0);\n"
+    "    v_texcoord = texcoord;\n"
+    "}\n";
+
+static const GLchar tex_fragment_src_rgba[] =
+    "precision mediump float;\n"
+    "varying vec2 v_texcoord;\n"
+    "uniform sampler2D tex;\n"
+    "uniform float alpha;\n"
+    "\n"
+    "void main() {\n"
+    "    gl_FragColor = texture2D(tex, v_texcoord) * alpha;\n"
+    "}\n";
+
+static const GLchar tex_fragment_src_rgbx[] =
+    "precision mediump float;\n"
+    "varying vec2 v_texcoord;\n"
+    "uniform sampler2D tex;\n"
+    "uniform float alpha;\n"
+    "\n"
+    "void main() {\n"
+    "    gl_FragColor = vec4(texture2D(tex, v_texcoord).rgb, 1.0) * alpha;\n"
+    "}\n";
+
+static const GLchar tex_fragment_src_external[] =
+    "#extension GL_OES_EGL_image_external : require\n\n"
+    "precision mediump float;\n"
+    "varying vec2 v_texcoord;\n"
+    "uniform samplerExternalOES texture0;\n"
+    "uniform float alpha;\n"
+    "\n"
+    "void main() {\n"
+    "    gl_FragColor = texture2D(texture0, v_texcoord) * alpha;\n"
+    "}\n";
+
+static GLuint compile_shader(GLuint type, const GLchar *src) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &src, NULL);
+    glCompileShader(shader);
+
+    GLint ok;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (ok == GL_FALSE) {
+        GLchar log[512];
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        fake_log(ERROR, "Failed to compile shader: %s", log);
+        glDeleteShader(shader);
+        shader = 0;
+    }
+    return shader;
+}
+
+GLuint gles_link_program(const GLchar *vert_src, const GLchar *frag_src) {
+    GLuint vert = compile_shader(GL_VERTEX_SHADER, vert_src);
+    if (!vert) {
+        return 0;
+    }
+    GLuint frag = compile_shader(GL_FRAGMENT_SHADER, frag_src);
+    if (!frag) {
+        glDeleteShader(vert);
+        return 0;
+    }
+
+    GLuint prog = glCreateProgram();
+    glAttachShader(prog, vert);
+    glAttachShader(prog, frag);
+    glLinkProgram(prog);
+    glDetachShader(prog, vert);
+    glDetachShader(prog, frag);
+    glDeleteShader(vert);
+    glDeleteShader(frag);
+
+    GLint ok;
+    glGetProgramiv(prog, GL_LINK_STATUS, &ok);
+    if (ok == GL_FALSE) {
+        GLchar log[512];
+        glGetProgramInfoLog(prog, sizeof(log), NULL, log);
+        fake_log(ERROR, "Failed to link shader: %s", log);
+        glDeleteProgram(prog);
+        return 0;
+    }
+    return prog;
+}
+
+static bool link_tex_program(struct gles2_tex_shader *shader,
+        const GLchar *frag_src, const char *sampler) {
+    shader->program = gles_link_program(tex_vertex_src, frag_src);
+    if (!shader->program) {
+        return false;
+    }
+    shader->proj = glGetUniformLocation(shader->program, "proj");
+    shader->tex = glGetUniformLocation(shader->program, sampler);
+    shader->alpha = glGetUniformLocation(shader->program, "alpha");
+    shader->pos_attrib = glGetAttribLocation(shader->program, "pos");
+    shader->tex_attrib = glGetAttribLocation(shader->program, "texcoord");
+    return true;
+}
+
+static bool init_shaders(struct gles_renderer *gles) {
+    gles->shaders.quad.program =
+        gles_link_program(quad_vertex_src, quad_fragment_src);
+    if (!gles->shaders.quad.program) {
+        return false;
+    }
+    gles->shaders.quad.proj =
+        glGetUniformLocation(gles->shaders.quad.program, "proj");
+    gles->shaders.quad.color =
+        glGetUniformLocation(gles->shaders.quad.program, "color");
+    gles->shaders.quad.pos_attrib =
+        glGetAttribLocation(gles->shaders.quad.program, "pos");
+
+    if (!link_tex_program(&gles->shaders.tex_rgba, tex_fragment_src_rgba,
+                "tex") ||
+            !link_tex_program(&gles->shaders.tex_rgbx, tex_fragment_src_rgbx,
+                "tex")) {
+        return false;
+    }
+    if (gles->exts.OES_egl_image_external &&
+            !link_tex_program(&gles->shaders.tex_ext,
+                tex_fragment_src_external, "texture0")) {
+        return false;
+    }
+    return true;
+}
+
+bool init_opengles(struct gles_renderer *gles, struct egl *egl) {
+    int64_t start = get_time_ns();
+    if (!egl_make_current(egl)) {
+        goto error;
+    }
+
+    const char *exts_str = (const char *)glGetString(GL_EXTENSIONS);
+    if (exts_str == NULL) {
+        fake_log(ERROR, "Failed to get GL_EXTENSIONS");
+        goto error;
+    }
+    gles->egl = egl;
+    gles->exts_str = exts_str;
+    gles->drm_fd = -1;
+
+    ext_set_finish(&gles->ext_set);
+    if (!ext_set_init(&gles->ext_set, exts_str)) {
+        goto error;
+    }
+    const struct ext_set *exts = &gles->ext_set;
+
+    if (!gles->egl->exts.EXT_image_dma_buf_import) {
+        fake_log(ERROR, "EGL_EXT_image_dma_buf_import not supported");
+        goto error;
+    }
+
+    if (!ext_set_has_known(exts, EXT_GL_EXT_texture_format_BGRA8888)) {
+        fake_log(ERROR, "BGRA8888 format not supported by GLES2");
+        goto error;
+    }
+    if (!ext_set_has_known(exts, EXT_GL_EXT_unpack_subimage)) {
+        fake_log(ERROR, "GL_EXT_unpack_subimage not supported");
+        goto error;
+    }
+
+    gles->exts.EXT_read_format_bgra =
+        ext_set_has_known(exts, EXT_GL_EXT_read_format_bgra);
+
+    gles->exts.EXT_texture_type_2_10_10_10_REV =
+        ext_set_has_known(exts, EXT_GL_EXT_texture_type_2_10_10_10_REV);
+
+    gles->exts.OES_texture_half_float_linear =
+        ext_set_has_known(exts, EXT_GL_OES_texture_half_float_linear);
+
+    gles->exts.EXT_texture_norm16 =
+        ext_set_has_known(exts, EXT_GL_EXT_texture_norm16);
+
+    if (ext_set_has_known(exts, EXT_GL_KHR_debug)) {
+        gles->exts.KHR_debug = true;
+        load_gl_proc(&gles->procs.glDebugMessageCallbackKHR,
+                "glDebugMessageCallbackKHR");
+        load_gl_proc(&gles->procs.glDebugMessageControlKHR,
+                "glDebugMessageControlKHR");
+    }
+
+    if (ext_set_has_known(exts, EXT_GL_OES_EGL_image_external)) {
+        gles->exts.OES_egl_image_external = true;
+        load_gl_proc(&gles->procs.glEGLImageTargetTexture2DOES,
+                "glEGLImageTargetTexture2DOES");
+    }
+
+    if (ext_set_has_known(exts, EXT_GL_OES_EGL_image)) {
+        gles->exts.OES_egl_image = true;
+        load_gl_proc(&gles->procs.glEGLImageTargetRenderbufferStorageOES,
+                "glEGLImageTargetRenderbufferStorageOES");
+    }
+
+    // Used by trace.c for GPU timestamps
+    if (ext_set_has_known(exts, EXT_GL_EXT_disjoint_timer_query)) {
+        gles->exts.EXT_disjoint_timer_query = true;
+        load_gl_proc(&gles->procs.glGenQueriesEXT, "glGenQueriesEXT");
+        load_gl_proc(&gles->procs.glDeleteQueriesEXT, "glDeleteQueriesEXT");
+        load_gl_proc(&gles->procs.glQueryCounterEXT, "glQueryCounterEXT");
+        load_gl_proc(&gles->procs.glGetQueryivEXT, "glGetQueryivEXT");
+        load_gl_proc(&gles->procs.glGetQueryObjectivEXT,
+                "glGetQueryObjectivEXT");
+        load_gl_proc(&gles->procs.glGetQueryObjectui64vEXT,
+                "glGetQueryObjectui64vEXT");
+        load_gl_proc(&gles->procs.glGetInteger64vEXT, "glGetInteger64vEXT");
+    }
+
+    int gles_major = 0, gles_minor = 0;
+    sscanf((const char *)glGetString(GL_VERSION), "OpenGL ES %d.%d",
+            &gles_major, &gles_minor);
+    if (gles_major >= 3) {
+        gles->exts.pixel_buffer_object = true;
+        load_gl_proc(&gles->procs.glMapBufferRange, "glMapBufferRange");
+        load_gl_proc(&gles->procs.glUnmapBuffer, "glUnmapBuffer");
+    } else if (ext_set_has_known(exts, EXT_GL_NV_pixel_buffer_object) &&
+            ext_set_has_known(exts, EXT_GL_EXT_map_buffer_range)) {
+        gles->exts.pixel_buffer_object = true;
+        load_gl_proc(&gles->procs.glMapBufferRange, "glMapBufferRangeEXT");
+        load_gl_proc(&gles->procs.glUnmapBuffer, "glUnmapBufferOES");
+    }
+
+    if (!init_shaders(gles)) {
+        fake_log(ERROR, "Failed to compile the renderer shaders");
+        goto error;
+    }
+
+    fake_log(INFO, "Using %s", glGetString(GL_VERSION));
+    fake_log(INFO, "GL vendor: %s", glGetString(GL_VENDOR));
+    fake_log(INFO, "GL renderer: %s", glGetString(GL_RENDERER));
+    fake_log(INFO, "Supported GLES2 extensions: %s", exts_str);
+
+    egl->startup.gles_ns = get_time_ns() - start;
+    fake_log(INFO, "Startup: client %.3f ms, display %.3f ms, formats %.3f ms"
+            "%s, context %.3f ms, gles %.3f ms",
+            (double)egl->startup.client_ns / 1000000,
+            (double)egl->startup.display_ns / 1000000,
+            (double)egl->startup.formats_ns / 1000000,
+            egl->startup.formats_cached ? " (cached)" : "",
+            (double)egl->startup.context_ns / 1000000,
+            (double)egl->startup.gles_ns / 1000000);
+
+    return true;
+
+error:
+    return false;
+}
+
+bool egl_make_current(struct egl *egl) {
+    if (!eglMakeCurrent(egl->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                egl->context)) {
+        fake_log(ERROR, "eglMakeCurrent failed");
+        return false;
+    }
+    return true;
+}
+
+int egl_dup_render_fence(struct egl *egl) {
+    if (!egl->exts.ANDROID_native_fence_sync) {
+        return -1;
+    }
+    const EGLint attribs[] = {
+        EGL_SYNC_NATIVE_FENCE_FD_ANDROID, EGL_NO_NATIVE_FENCE_FD_ANDROID,
+        EGL_NONE,
+    };
+    EGLSyncKHR sync = egl->procs.eglCreateSyncKHR(egl->display,
+            EGL_SYNC_NATIVE_FENCE_ANDROID, attribs);
+    if (sync == EGL_NO_SYNC_KHR) {
+        fake_log(ERROR, "eglCreateSyncKHR(EGL_SYNC_NATIVE_FENCE_ANDROID) "
+                "failed");
+        return -1;
+    }
+    // The fence only gets an fd once it reached the driver
+    glFlush();
+    int fd = egl->procs.eglDupNativeFenceFDANDROID(egl->display, sync);
+    egl->procs.eglDestroySyncKHR(egl->display, sync);
+    if (fd == EGL_NO_NATIVE_FENCE_FD_ANDROID) {
+        fake_log(ERROR, "eglDupNativeFenceFDANDROID failed");
+        return -1;
+    }
+    return fd;
+}
+
+bool egl_wait_fence_fd(struct egl *egl, int fd) {
+    if (egl->exts.ANDROID_native_fence_sync && egl->exts.KHR_wait_sync) {
+        const EGLint attribs[] = {
+            EGL_SYNC_NATIVE_FENCE_FD_ANDROID, fd,
+            EGL_NONE,
+        };
+        // Owns fd from here on
+        EGLSyncKHR sync = egl->procs.eglCreateSyncKHR(egl->display,
+                EGL_SYNC_NATIVE_FENCE_ANDROID, attribs);
+        if (sync != EGL_NO_SYNC_KHR) {
+            EGLBoolean ok = egl->procs.eglWaitSyncKHR(egl->display, sync, 0);
+            egl->procs.eglDestroySyncKHR(egl->display, sync);
+            return ok == EGL_TRUE;
+        }
+        fake_log(ERROR, "Failed to import fence fd %d into EGL", fd);
+    }
+
+    // sync_file fds poll readable once signalled
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int ret;
+    do {
+        ret = poll(&pfd, 1, -1);
+    } while (ret < 0 && errno == EINTR);
+    close(fd);
+    if (ret < 0) {
+        fake_log_errno(ERROR, "poll on fence fd failed");
+        return false;
+    }
+    return true;
+}
+
+static void load_gl_proc(void *proc_ptr, const char *name) {
+    void *proc = (void *)eglGetProcAddress(name);
+    if (proc == NULL) {
+        fake_log(ERROR, "glGetProcAddress(%s) failed", name);
+        abort();
+    }
+    *(void **)proc_ptr = proc;
+}
+
+static void load_egl_proc(void *proc_ptr, const char *name) {
+    void *proc = (void *)eglGetProcAddress(name);
+    if (proc == NULL) {
+        fake_log(ERROR, "eglGetProcAddress(%s) failed", name);
+        abort();
+    }
+    *(void **)proc_ptr = proc;
+}
+
+static bool device_has_name(const drmDevice *device, const char *name) {
+    for (size_t i = 0; i < DRM_NODE_MAX; i++) {
+        if (!(device->available_nodes & (1 << i))) {
+            continue;
+        }
+        if (strcmp(device->nodes[i], name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static enum log_importance egl_log_importance(EGLint type) {
+    switch (type) {
+        case EGL_DEBUG_MSG_CRITICAL_KHR:
+            return ERROR;
+        case EGL_DEBUG_MSG_ERROR_KHR:
+            return ERROR;
+        case EGL_DEBUG_MSG_WARN_KHR:
+            return ERROR;
+        case EGL_DEBUG_MSG_INFO_KHR:
+            return INFO;
+        default:
+            return INFO;
+    }
+}
+static const char *egl_error_str(EGLint error) {
+    switch (error) {
+        case EGL_SUCCESS:
+            return "EGL_SUCCESS";
+        case EGL_NOT_INITIALIZED:
+            return "EGL_NOT_INITIALIZED";
+        case EGL_BAD_ACCESS:
+            return "EGL_BAD_ACCESS";
+        case EGL_BAD_ALLOC:
+            return "EGL_BAD_ALLOC";
+        case EGL_BAD_ATTRIBUTE:
+            return "EGL_BAD_ATTRIBUTE";
+        case EGL_BAD_CONTEXT:
+            return "EGL_BAD_CONTEXT";
+        case EGL_BAD_CONFIG:
+            return "EGL_BAD_CONFIG";
+        case EGL_BAD_CURRENT_SURFACE:
+            return "EGL_BAD_CURRENT_SURFACE";
+        case EGL_BAD_DISPLAY:
+            return "EGL_BAD_DISPLAY";
+        case EGL_BAD_DEVICE_EXT:
+            return "EGL_BAD_DEVICE_EXT";
+        case EGL_BAD_SURFACE:
+            return "EGL_BAD_SURFACE";
+        case EGL_BAD_MATCH:
+            return "EGL_BAD_MATCH";
+        case EGL_BAD_PARAMETER:
+            return "EGL_BAD_PARAMETER";
+        case EGL_BAD_NATIVE_PIXMAP:
+            return "EGL_BAD_NATIVE_PIXMAP";
+        case EGL_BAD_NATIVE_WINDOW:
+            return "EGL_BAD_NATIVE_WINDOW";
+        case EGL_CONTEXT_LOST:
+            return "EGL_CONTEXT_LOST";
+    }
+    return "unknown error";
+}
+
+static void egl_log(EGLenum error, const char *command, EGLint msg_type,
+        EGLLabelKHR thread, EGLLabelKHR obj, const char *msg) {
+    _debug_log(egl_log_importance(msg_type),
+            "[EGL] command: %s, error: %s (0x%x), message: \"%s\"", command,
+            egl_error_str(error), error, msg);
+}
+
+bool env_parse_bool(const char *option) {
+    const char *env = getenv(option);
+    if (env) {
+        fake_log(INFO, "Loading %s option: %s", option, env);
+    }
+
+    if (!env || strcmp(env, "0") == 0) {
+        return false;
+    } else if (strcmp(env, "1") == 0) {
+        return true;
+    }
+
+    fake_log(ERROR, "Unknown %s option: %s", option, env);
+    return false;
+}
+
+static int get_egl_dmabuf_formats(struct egl *egl, int **formats) {
+    if (!egl->exts.EXT_image_dma_buf_import) {
+        fake_log(DEBUG, "DMA-BUF import extension not present");
+        return -1;
+    }
+
+    // 当我们只有image_dmabuf_import扩展时，我们无法查询支持哪些格式。
+    // DRM_FORMAT_ARGB8888和DRM_FORMAT_XRGB8888这两个是一直被支持的,这是尝试创建缓冲区的预定方式。
+    // 当然只是一个猜测，但总比完全不支持dmabufs好，因为修改器扩展并不是到处都支持。
+    if (!egl->exts.EXT_image_dma_buf_import_modifiers) {
+        static const int fallback_formats[] = {
+            DRM_FORMAT_ARGB8888,
+            DRM_FORMAT_XRGB8888,
+        };
+        static unsigned num =
+            sizeof(fallback_formats) / sizeof(fallback_formats[0]);
+
+        *formats = calloc(num, sizeof(int));
+        if (!*formats) {
+            fake_log(ERROR, "Allocation failed");
+            return -1;
+        }
+
+        memcpy(*formats, fallback_formats, num * sizeof(**formats));
+        return num;
+    }
+
+    EGLint num;
+    if (!egl->procs.eglQueryDmaBufFormatsEXT(egl->display, 0, NULL, &num)) {
+        fake_log(ERROR, "Failed to query number of dmabuf formats");
+        return -1;
+    }
+
+    *formats = calloc(num, sizeof(int));
+    if (*formats == NULL) {
+        fake_log(ERROR, "Allocation failed: %s", strerror(errno));
+        return -1;
+    }
+
+    if (!egl->procs.eglQueryDmaBufFormatsEXT(egl->display, num, *formats,
+                &num)) {
+        fake_log(ERROR, "Failed to query dmabuf format");
+        free(*formats);
+        return -1;
+    }
+    return num;
+}
+
+static int get_egl_dmabuf_modifiers(struct egl *egl, int format,
+        uint64_t **modifiers,
+        EGLBoolean **external_only) {
+    *modifiers = NULL;
+    *external_only = NULL;
+
+    if (!egl->exts.EXT_image_dma_buf_import) {
+        fake_log(DEBUG, "DMA-BUF extension not present");
+        return -1;
+    }
+    if (!egl->exts.EXT_image_dma_buf_import_modifiers) {
+        return 0;
+    }
+
+    EGLint num;
+    if (!egl->procs.eglQueryDmaBufModifiersEXT(egl->display, format, 0, NULL,
+                NULL, &num)) {
+        fake_log(ERROR, "Failed to query dmabuf number of modifiers");
+        return -1;
+    }
+    if (num == 0) {
+        return 0;
+    }
+
+    *modifiers = calloc(num, sizeof(uint64_t));
+    if (*modifiers == NULL) {
+        fake_log(ERROR, "Allocation failed");
+        return -1;
+    }
+    *external_only = calloc(num, sizeof(EGLBoolean));
+    if (*external_only == NULL) {
+        fake_log(ERROR, "Allocation failed");
+        free(*modifiers);
+        *modifiers = NULL;
+        return -1;
+    }
+
+    if (!egl->procs.eglQueryDmaBufModifiersEXT(
+                egl->display, format, num, *modifiers, *external_only, &num)) {
+        fake_log(ERROR, "Failed to query dmabuf modifiers");
+        free(*modifiers);
+        free(*external_only);
+        return -1;
+    }
+    return num;
+}
@@ -0,0 +1,604 @@
+#define _GNU_SOURCE
+#include "sink.h"
+#include "log.h"
+#include "pixconv.h"
+#include <drm_fourcc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define DIRECT_ALIGN 4096
+
+static const long NSEC_PER_SEC = 1000000000;
+
+static void sink_init(struct frame_sink *sink,
+        const struct frame_sink_impl *impl) {
+    sink->impl = impl;
+    clock_gettime(CLOCK_MONOTONIC, &sink->stats.start);
+}
+
+static int frame_plane_count(const struct frame *frame) {
+    switch (frame->format) {
+    case DRM_FORMAT_NV12:
+        return 2;
+    case DRM_FORMAT_YUV420:
+        return 3;
+    default:
+        return 1;
+    }
+}
+
+// Bytes per row and rows of a plane as it is written out, no padding
+static size_t frame_plane_row_bytes(const struct frame *frame, int plane,
+        uint32_t *rows) {
+    if (frame_plane_count(frame) == 1) {
+        *rows = frame->height;
+        return (size_t)frame->width * 4;
+    }
+    if (plane == 0) {
+        *rows = frame->height;
+        return frame->width;
+    }
+    uint32_t cw = (frame->width + 1) / 2;
+    *rows = (frame->height + 1) / 2;
+    return frame->format == DRM_FORMAT_NV12 ? (size_t)cw * 2 : cw;
+}
+
+static const uint8_t *frame_plane_row(const struct frame *frame, int plane,
+        uint32_t y) {
+    uint32_t rows;
+    frame_plane_row_bytes(frame, plane, &rows);
+    uint32_t row = frame->bottom_up ? rows - 1 - y : y;
+    const uint8_t *base = frame->pixels;
+    uint32_t stride = frame->stride;
+    if (plane > 0) {
+        base += frame->plane_offsets[plane - 1];
+        stride = frame->plane_strides[plane - 1];
+    }
+    return base + (size_t)row * stride;
+}
+
+static const uint8_t *frame_row(const struct frame *frame, uint32_t y) {
+    return frame_plane_row(frame, 0, y);
+}
+
+static size_t frame_row_count(const struct frame *frame) {
+    size_t count = 0;
+    for (int plane = 0; plane < frame_plane_count(frame); plane++) {
+        uint32_t rows;
+        frame_plane_row_bytes(frame, plane, &rows);
+        count += rows;
+    }
+    return count;
+}
+
+static size_t frame_bytes(const struct frame *frame) {
+    size_t bytes = 0;
+    for (int plane = 0; plane < frame_plane_count(frame); plane++) {
+        uint32_t rows;
+        bytes += frame_plane_row_bytes(frame, plane, &rows) * rows;
+    }
+    return bytes;
+}
+
+// Copy every plane tightly packed to dst, top row first
+static void frame_pack(const struct frame *frame, uint8_t *dst) {
+    for (int plane = 0; plane < frame_plane_count(frame); plane++) {
+        uint32_t rows;
+        size_t row_bytes = frame_plane_row_bytes(frame, plane, &rows);
+        for (uint32_t y = 0; y < rows; y++) {
+            memcpy(dst, frame_plane_row(frame, plane, y), row_bytes);
+            dst += row_bytes;
+        }
+    }
+}
+
+static bool writev_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t ret = writev(fd, iov, count < IOV_MAX ? count : IOV_MAX);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fake_log_errno(ERROR, "writev failed");
+            return false;
+        }
+        while (count > 0 && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return true;
+}
+
+static int open_output(const char *path, int flags) {
+    if (strcmp(path, "-") == 0) {
+        return dup(STDOUT_FILENO);
+    }
+    // Works for named pipes too, blocking until the reader shows up
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | flags, 0644);
+    if (fd < 0) {
+        fake_log_errno(ERROR, "Failed to open sink output '%s'", path);
+    }
+    return fd;
+}
+
+// Raw sink
+
+struct raw_sink {
+    struct frame_sink base;
+    int fd;
+    bool direct;
+    // O_DIRECT staging, writes go out in DIRECT_ALIGN multiples
+    uint8_t *staging;
+    size_t staging_size, staging_fill;
+    struct iovec *iov;
+    uint32_t iov_len;
+};
+
+static bool raw_write_direct(struct raw_sink *raw, const struct frame *frame) {
+    size_t bytes = frame_bytes(frame);
+    size_t needed = raw->staging_fill + bytes;
+    if (needed > raw->staging_size) {
+        size_t size = (needed + 2 * DIRECT_ALIGN) & ~(size_t)(DIRECT_ALIGN - 1);
+        uint8_t *staging = aligned_alloc(DIRECT_ALIGN, size);
+        if (!staging) {
+            fake_log(ERROR, "Allocation failed");
+            return false;
+        }
+        if (raw->staging_fill) {
+            memcpy(staging, raw->staging, raw->staging_fill);
+        }
+        free(raw->staging);
+        raw->staging = staging;
+        raw->staging_size = size;
+    }
+
+    frame_pack(frame, raw->staging + raw->staging_fill);
+    raw->staging_fill += bytes;
+
+    size_t aligned = raw->staging_fill & ~(size_t)(DIRECT_ALIGN - 1);
+    size_t done = 0;
+    while (done < aligned) {
+        ssize_t ret = write(raw->fd, raw->staging + done, aligned - done);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fake_log_errno(ERROR, "O_DIRECT write failed");
+            return false;
+        }
+        done += ret;
+    }
+    raw->staging_fill -= aligned;
+    memmove(raw->staging, raw->staging + aligned, raw->staging_fill);
+    return true;
+}
+
+static bool raw_write(struct frame_sink *sink, const struct frame *frame) {
+    struct raw_sink *raw = (struct raw_sink *)sink;
+    if (raw->direct) {
+        return raw_write_direct(raw, frame);
+    }
+
+    uint32_t rows;
+    size_t row_bytes = frame_plane_row_bytes(frame, 0, &rows);
+    if (frame_plane_count(frame) == 1 && !frame->bottom_up &&
+            frame->stride == row_bytes) {
+        struct iovec iov = {
+            .iov_base = (void *)frame->pixels,
+            .iov_len = row_bytes * frame->height,
+        };
+        return writev_all(raw->fd, &iov, 1);
+    }
+
+    // Gather the rows of every plane in output order, no staging copy
+    size_t count = frame_row_count(frame);
+    if (raw->iov_len < count) {
+        free(raw->iov);
+        raw->iov = calloc(count, sizeof(*raw->iov));
+        if (!raw->iov) {
+            raw->iov_len = 0;
+            fake_log(ERROR, "Allocation failed");
+            return false;
+        }
+        raw->iov_len = count;
+    }
+    struct iovec *iov = raw->iov;
+    for (int plane = 0; plane < frame_plane_count(frame); plane++) {
+        row_bytes = frame_plane_row_bytes(frame, plane, &rows);
+        for (uint32_t y = 0; y < rows; y++, iov++) {
+            iov->iov_base = (void *)frame_plane_row(frame, plane, y);
+            iov->iov_len = row_bytes;
+        }
+    }
+    return writev_all(raw->fd, raw->iov, count);
+}
+
+static void raw_destroy(struct frame_sink *sink) {
+    struct raw_sink *raw = (struct raw_sink *)sink;
+    if (raw->direct && raw->staging_fill > 0) {
+        // The tail is not block sized, finish it without O_DIRECT
+        int flags = fcntl(raw->fd, F_GETFL);
+        fcntl(raw->fd, F_SETFL, flags & ~O_DIRECT);
+        struct iovec iov = {
+            .iov_base = raw->staging,
+            .iov_len = raw->staging_fill,
+        };
+        writev_all(raw->fd, &iov, 1);
+    }
+    if (fsync(raw->fd) < 0 && errno != EINVAL) {
+        fake_log_errno(ERROR, "fsync on raw sink failed");
+    }
+    close(raw->fd);
+    free(raw->staging);
+    free(raw->iov);
+    free(raw);
+}
+
+static const struct frame_sink_impl raw_impl = {
+    .name = "raw",
+    .write = raw_write,
+    .destroy = raw_destroy,
+};
+
+struct frame_sink *frame_sink_create_raw(const char *path, bool direct) {
+    struct raw_sink *raw = calloc(1, sizeof(*raw));
+    if (!raw) {
+        fake_log(ERROR, "Allocation failed");
+        return NULL;
+    }
+    raw->fd = open_output(path, direct ? O_DIRECT : 0);
+    if (raw->fd < 0 && direct) {
+        fake_log(INFO, "O_DIRECT not available for '%s', using buffered I/O",
+                path);
+        direct = false;
+        raw->fd = open_output(path, 0);
+    }
+    if (raw->fd < 0) {
+        free(raw);
+        return NULL;
+    }
+    raw->direct = direct;
+    sink_init(&raw->base, &raw_impl);
+    return &raw->base;
+}
+
+// YUV4MPEG2 sink
+
+struct y4m_sink {
+    struct frame_sink base;
+    int fd;
+    uint32_t width, height;
+    uint8_t *planes;
+};
+
+// BT.601 limited range, 2x2 chroma averaging
+static void frame_to_i420(const struct frame *frame, uint8_t *y_plane,
+        uint8_t *u_plane, uint8_t *v_plane) {
+    const struct pixconv_funcs *funcs = pixconv_get();
+    // ARGB8888/XRGB8888 are B, G, R, A in memory
+    bool bgra = frame->format != DRM_FORMAT_ABGR8888 &&
+        frame->format != DRM_FORMAT_XBGR8888;
+    uint32_t cw = (frame->width + 1) / 2;
+
+    for (uint32_t y = 0; y < frame->height; y++) {
+        funcs->rgb_to_y(y_plane + (size_t)y * frame->width,
+                frame_row(frame, y), frame->width, bgra);
+    }
+    for (uint32_t y = 0; y < frame->height; y += 2) {
+        const uint8_t *row0 = frame_row(frame, y);
+        const uint8_t *row1 = y + 1 < frame->height ?
+            frame_row(frame, y + 1) : row0;
+        size_t i = (size_t)(y / 2) * cw;
+        funcs->rgb_to_uv(u_plane + i, v_plane + i, 1, row0, row1,
+                frame->width, bgra);
+    }
+}
+
+// Converted on the GPU already, only U and V to split apart
+static void nv12_to_i420(const struct frame *frame, uint8_t *y_plane,
+        uint8_t *u_plane, uint8_t *v_plane) {
+    for (uint32_t y = 0; y < frame->height; y++) {
+        memcpy(y_plane + (size_t)y * frame->width, frame_row(frame, y),
+                frame->width);
+    }
+    uint32_t rows;
+    size_t cw = frame_plane_row_bytes(frame, 1, &rows) / 2;
+    for (uint32_t y = 0; y < rows; y++) {
+        const uint8_t *uv = frame_plane_row(frame, 1, y);
+        for (size_t x = 0; x < cw; x++) {
+            u_plane[y * cw + x] = uv[x * 2];
+            v_plane[y * cw + x] = uv[x * 2 + 1];
+        }
+    }
+}
+
+static bool y4m_write(struct frame_sink *sink, const struct frame *frame) {
+    struct y4m_sink *y4m = (struct y4m_sink *)sink;
+    uint32_t cw = (frame->width + 1) / 2, ch = (frame->height + 1) / 2;
+    size_t y_size = (size_t)frame->width * frame->height;
+    size_t c_size = (size_t)cw * ch;
+
+    char header[128];
+    int header_len = 0;
+    if (!y4m->planes) {
+        y4m->width = frame->width;
+        y4m->height = frame->height;
+        y4m->planes = malloc(y_size + 2 * c_size);
+        if (!y4m->planes) {
+            fake_log(ERROR, "Allocation failed");
+            return false;
+        }
+        header_len = snprintf(header, sizeof(header),
+                "YUV4MPEG2 W%u H%u F60:1 Ip A1:1 C420jpeg XYSCSS=420JPEG\n",
+                frame->width, frame->height);
+    } else if (frame->width != y4m->width || frame->height != y4m->height) {
+        fake_log(ERROR, "y4m sink: frame size changed to %ux%u",
+                frame->width, frame->height);
+        return false;
+    }
+
+    if (frame->format == DRM_FORMAT_YUV420) {
+        frame_pack(frame, y4m->planes);
+    } else if (frame->format == DRM_FORMAT_NV12) {
+        nv12_to_i420(frame, y4m->planes, y4m->planes + y_size,
+                y4m->planes + y_size + c_size);
+    } else {
+        frame_to_i420(frame, y4m->planes, y4m->planes + y_size,
+                y4m->planes + y_size + c_size);
+    }
+
+    static const char frame_tag[] = "FRAME\n";
+    struct iovec iov[] = {
+        { .iov_base = header, .iov_len = header_len },
+        { .iov_base = (void *)frame_tag, .iov_len = sizeof(frame_tag) - 1 },
+        { .iov_base = y4m->planes, .iov_len = y_size + 2 * c_size },
+    };
+    return writev_all(y4m->fd, iov, 3);
+}
+
+static void y4m_destroy(struct frame_sink *sink) {
+    struct y4m_sink *y4m = (struct y4m_sink *)sink;
+    close(y4m->fd);
+    free(y4m->planes);
+    free(y4m);
+}
+
+static const struct frame_sink_impl y4m_impl = {
+    .name = "y4m",
+    .write = y4m_write,
+    .destroy = y4m_destroy,
+};
+
+struct frame_sink *frame_sink_create_y4m(const char *path) {
+    struct y4m_sink *y4m = calloc(1, sizeof(*y4m));
+    if (!y4m) {
+        fake_log(ERROR, "Allocation failed");
+        return NULL;
+    }
+    y4m->fd = open_output(path, 0);
+    if (y4m->fd < 0) {
+        free(y4m);
+        return NULL;
+    }
+    // A reader going away should fail the write, not kill the renderer
+    signal(SIGPIPE, SIG_IGN);
+    sink_init(&y4m->base, &y4m_impl);
+    return &y4m->base;
+}
+
+// Threaded sink
+
+struct sink_buffer {
+    uint8_t *data;
+    size_t capacity;
+    struct frame frame;
+    bool queued;
+};
+
+struct threaded_sink {
+    struct frame_sink base;
+    struct frame_sink *inner;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct sink_buffer buffers[2];
+    // Next buffer the render thread fills / the writer drains
+    int fill_index, drain_index;
+    bool stop;
+};
+
+static void *threaded_sink_run(void *data) {
+    struct threaded_sink *ts = data;
+    pthread_mutex_lock(&ts->lock);
+    for (;;) {
+        struct sink_buffer *buffer = &ts->buffers[ts->drain_index];
+        while (!buffer->queued && !ts->stop) {
+            pthread_cond_wait(&ts->cond, &ts->lock);
+        }
+        if (!buffer->queued) {
+            break;
+        }
+        pthread_mutex_unlock(&ts->lock);
+
+        frame_sink_write(ts->inner, &buffer->frame);
+
+        pthread_mutex_lock(&ts->lock);
+        buffer->queued = false;
+        ts->drain_index = (ts->drain_index + 1) % 2;
+    }
+    pthread_mutex_unlock(&ts->lock);
+    return NULL;
+}
+
+static bool threaded_write(struct frame_sink *sink, const struct frame *frame) {
+    struct threaded_sink *ts = (struct threaded_sink *)sink;
+
+    pthread_mutex_lock(&ts->lock);
+    struct sink_buffer *buffer = &ts->buffers[ts->fill_index];
+    bool busy = buffer->queued;
+    pthread_mutex_unlock(&ts->lock);
+    if (busy) {
+        // The writer is two frames behind, never block the render thread
+        ts->base.stats.dropped++;
+        return true;
+    }
+
+    // The writer does not touch a buffer until it is queued
+    size_t size = frame_bytes(frame);
+    if (buffer->capacity < size) {
+        free(buffer->data);
+        buffer->data = malloc(size);
+        if (!buffer->data) {
+            buffer->capacity = 0;
+            fake_log(ERROR, "Allocation failed");
+            return false;
+        }
+        buffer->capacity = size;
+    }
+    frame_pack(frame, buffer->data);
+    buffer->frame = *frame;
+    buffer->frame.pixels = buffer->data;
+    buffer->frame.bottom_up = false;
+    // Planes back to back as frame_pack() left them
+    size_t offset = 0;
+    for (int plane = 0; plane < frame_plane_count(frame); plane++) {
+        uint32_t rows;
+        size_t row_bytes = frame_plane_row_bytes(frame, plane, &rows);
+        if (plane == 0) {
+            buffer->frame.stride = row_bytes;
+        } else {
+            buffer->frame.plane_offsets[plane - 1] = offset;
+            buffer->frame.plane_strides[plane - 1] = row_bytes;
+        }
+        offset += row_bytes * rows;
+    }
+
+    pthread_mutex_lock(&ts->lock);
+    buffer->queued = true;
+    ts->fill_index = (ts->fill_index + 1) % 2;
+    pthread_cond_signal(&ts->cond);
+    pthread_mutex_unlock(&ts->lock);
+    return true;
+}
+
+static void threaded_destroy(struct frame_sink *sink) {
+    struct threaded_sink *ts = (struct threaded_sink *)sink;
+    pthread_mutex_lock(&ts->lock);
+    ts->stop = true;
+    pthread_cond_signal(&ts->cond);
+    pthread_mutex_unlock(&ts->lock);
+    pthread_join(ts->thread, NULL);
+
+    frame_sink_destroy(ts->inner);
+    pthread_cond_destroy(&ts->cond);
+    pthread_mutex_destroy(&ts->lock);
+    free(ts->buffers[0].data);
+    free(ts->buffers[1].data);
+    free(ts);
+}
+
+static const struct frame_sink_impl threaded_impl = {
+    .name = "async",
+    .write = threaded_write,
+    .destroy = threaded_destroy,
+};
+
+struct frame_sink *frame_sink_create_threaded(struct frame_sink *inner) {
+    if (!inner) {
+        return NULL;
+    }
+    struct threaded_sink *ts = calloc(1, sizeof(*ts));
+    if (!ts) {
+        fake_log(ERROR, "Allocation failed");
+        frame_sink_destroy(inner);
+        return NULL;
+    }
+    ts->inner = inner;
+    pthread_mutex_init(&ts->lock, NULL);
+    pthread_cond_init(&ts->cond, NULL);
+    sink_init(&ts->base, &threaded_impl);
+    if (pthread_create(&ts->thread, NULL, threaded_sink_run, ts) != 0) {
+        fake_log(ERROR, "Failed to start sink writer thread");
+        pthread_cond_destroy(&ts->cond);
+        pthread_mutex_destroy(&ts->lock);
+        free(ts);
+        frame_sink_destroy(inner);
+        return NULL;
+    }
+    return &ts->base;
+}
+
+struct frame_sink *frame_sink_create_from_spec(const char *spec) {
+    bool async = false;
+    if (strncmp(spec, "async,", 6) == 0) {
+        async = true;
+        spec += 6;
+    }
+
+    const char *path = strchr(spec, ':');
+    if (!path) {
+        fake_log(ERROR, "Invalid sink '%s', expected kind:path", spec);
+        return NULL;
+    }
+    size_t kind_len = path - spec;
+    path++;
+
+    struct frame_sink *sink;
+    if (kind_len == 3 && strncmp(spec, "raw", 3) == 0) {
+        sink = frame_sink_create_raw(path, false);
+    } else if (kind_len == 10 && strncmp(spec, "raw-direct", 10) == 0) {
+        sink = frame_sink_create_raw(path, true);
+    } else if (kind_len == 3 && strncmp(spec, "y4m", 3) == 0) {
+        sink = frame_sink_create_y4m(path);
+    } else {
+        fake_log(ERROR, "Unknown sink kind '%.*s'", (int)kind_len, spec);
+        return NULL;
+    }
+    return async ? frame_sink_create_threaded(sink) : sink;
+}
+
+bool frame_sink_write(struct frame_sink *sink, const struct frame *frame) {
+    uint64_t dropped = sink->stats.dropped;
+    bool ok = sink->impl->write(sink, frame);
+    if (!ok) {
+        sink->stats.errors++;
+    } else if (sink->stats.dropped == dropped) {
+        sink->stats.frames++;
+        sink->stats.bytes += frame_bytes(frame);
+    }
+    return ok;
+}
+
+void frame_sink_destroy(struct frame_sink *sink) {
+    if (!sink) {
+        return;
+    }
+    // Destroying the threaded sink drains its queue, so log afterwards
+    struct frame_sink_stats stats = sink->stats;
+    const char *name = sink->impl->name;
+    sink->impl->destroy(sink);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - stats.start.tv_sec) +
+        (double)(now.tv_nsec - stats.start.tv_nsec) / NSEC_PER_SEC;
+    fake_log(INFO, "%s sink: %lu frames, %.1f MB in %.3fs (%.1f MB/s), "
+            "%lu dropped, %lu errors", name, (unsigned long)stats.frames,
+            stats.bytes / 1e6, elapsed,
+            elapsed > 0 ? stats.bytes / 1e6 / elapsed : 0.0,
+            (unsigned long)stats.dropped, (unsigned long)stats.errors);
+}
@@ -0,0 +1,71 @@
+#ifndef FAKE_CHEN_SINK_H
+#define FAKE_CHEN_SINK_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/** A frame handed to a sink, only valid for the duration of the write. */
+struct frame {
+    const void *pixels;
+    uint32_t width, height, stride;
+    // DRM fourcc: DRM_FORMAT_ABGR8888 for glReadPixels RGBA output,
+    // DRM_FORMAT_ARGB8888/XRGB8888 for mapped scanout buffers,
+    // DRM_FORMAT_NV12/YUV420 for GPU converted readback
+    uint32_t format;
+    // Chroma planes of the YUV formats, relative to pixels, the Y plane
+    // being pixels and stride
+    size_t plane_offsets[2];
+    uint32_t plane_strides[2];
+    // glReadPixels order, the sinks always write the top row first
+    bool bottom_up;
+    uint64_t seq;
+};
+
+struct frame_sink;
+
+struct frame_sink_impl {
+    const char *name;
+    bool (*write)(struct frame_sink *sink, const struct frame *frame);
+    void (*destroy)(struct frame_sink *sink);
+};
+
+struct frame_sink_stats {
+    uint64_t frames;
+    uint64_t bytes;
+    // Frames the sink had no room for, only the threaded sink drops
+    uint64_t dropped;
+    uint64_t errors;
+    struct timespec start;
+};
+
+struct frame_sink {
+    const struct frame_sink_impl *impl;
+    struct frame_sink_stats stats;
+};
+
+/** Raw frames back to back. direct opens the file with O_DIRECT. */
+struct frame_sink *frame_sink_create_raw(const char *path, bool direct);
+/**
+ * YUV4MPEG2 (I420) to a file, a named pipe, or stdout for "-". RGB frames
+ * are converted on the CPU, NV12 and YUV420 ones written as they are.
+ */
+struct frame_sink *frame_sink_create_y4m(const char *path);
+/**
+ * Copies each frame into one of two buffers and writes it to inner from a
+ * writer thread, dropping frames while both buffers are queued. Takes
+ * ownership of inner.
+ */
+struct frame_sink *frame_sink_create_threaded(struct frame_sink *inner);
+
+/**
+ * Build a sink from "[async,]kind:path", kind being raw, raw-direct or y4m,
+ * e.g. "async,y4m:-" or "raw:rgba.bin".
+ */
+struct frame_sink *frame_sink_create_from_spec(const char *spec);
+
+bool frame_sink_write(struct frame_sink *sink, const struct frame *frame);
+/** Flushes, closes and logs sustained throughput and drop counts. */
+void frame_sink_destroy(struct frame_sink *sink);
+
+#endif
@@ -0,0 +1,353 @@
+#include "target_pool.h"
+#include "dmabuf.h"
+#include "log.h"
+#include <drm_fourcc.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct target_pool *target_pool_create(struct gles_renderer *gles,
+        uint64_t budget, const struct drm_format_set *scanout_formats) {
+    struct target_pool *pool = calloc(1, sizeof(*pool));
+    if (!pool) {
+        fake_log(ERROR, "Allocation failed");
+        return NULL;
+    }
+    pool->gles = gles;
+    pool->egl = gles->egl;
+    pool->budget = budget;
+    pool->scanout_formats = scanout_formats;
+    return pool;
+}
+
+static void target_unlink(struct render_target *target) {
+    struct target_pool *pool = target->pool;
+    if (target->prev) {
+        target->prev->next = target->next;
+    } else {
+        pool->head = target->next;
+    }
+    if (target->next) {
+        target->next->prev = target->prev;
+    } else {
+        pool->tail = target->prev;
+    }
+    target->prev = target->next = NULL;
+}
+
+static void target_push_front(struct render_target *target) {
+    struct target_pool *pool = target->pool;
+    target->next = pool->head;
+    if (pool->head) {
+        pool->head->prev = target;
+    } else {
+        pool->tail = target;
+    }
+    pool->head = target;
+}
+
+static void target_destroy(struct render_target *target) {
+    struct target_pool *pool = target->pool;
+    struct egl *egl = pool->egl;
+    target_unlink(target);
+    pool->bytes -= target->size;
+
+    EGLContext current = eglGetCurrentContext();
+    for (size_t i = 0; i < target->fbo_count; i++) {
+        if (target->fbos[i].context == current) {
+            glDeleteFramebuffers(1, &target->fbos[i].fbo);
+        }
+    }
+    free(target->fbos);
+    if (target->tex) {
+        glDeleteTextures(1, &target->tex);
+    }
+    if (target->rbo) {
+        glDeleteRenderbuffers(1, &target->rbo);
+    }
+    if (target->image != EGL_NO_IMAGE_KHR) {
+        egl->procs.eglDestroyImageKHR(egl->display, target->image);
+    }
+    if (target->fb_id) {
+        drmModeRmFB(egl->card_fd, target->fb_id);
+    }
+    if (target->mapped) {
+        frame_map_unmap(&target->map);
+    }
+    if (target->prime_fd >= 0) {
+        close(target->prime_fd);
+    }
+    if (target->bo) {
+        gbm_bo_destroy(target->bo);
+    } else if (target->handle) {
+        drmModeDestroyDumbBuffer(egl->card_fd, target->handle);
+    }
+    free(target);
+}
+
+// Drop idle targets, least recently used first, until extra more bytes fit
+static void target_pool_evict(struct target_pool *pool, uint64_t extra) {
+    struct render_target *target = pool->tail;
+    while (target && pool->bytes + extra > pool->budget) {
+        struct render_target *prev = target->prev;
+        if (!target->in_use) {
+            target_destroy(target);
+            pool->evictions++;
+        }
+        target = prev;
+    }
+}
+
+static bool target_alloc(struct render_target *target) {
+    struct egl *egl = target->pool->egl;
+    const struct render_target_key *key = &target->key;
+
+    if (key->alloc == RENDER_TARGET_GBM) {
+        if (key->modifier != DRM_FORMAT_MOD_INVALID) {
+            // Exactly the modifier asked for
+            target->bo = gbm_bo_create_with_modifiers2(egl->gbm_device,
+                    key->width, key->height, key->format, &key->modifier, 1,
+                    GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
+        } else {
+            target->bo = dmabuf_alloc_bo(egl, key->width, key->height,
+                    key->format, target->pool->scanout_formats);
+        }
+        if (!target->bo) {
+            fake_log_errno(ERROR, "Render target allocation failed");
+            return false;
+        }
+        target->handle = gbm_bo_get_handle(target->bo).u32;
+        target->stride = gbm_bo_get_stride(target->bo);
+        target->modifier = gbm_bo_get_modifier(target->bo);
+        target->prime_fd = gbm_bo_get_fd(target->bo);
+        // Tiled and compressed layouts may take more than stride * height,
+        // the dma-buf knows its real size
+        off_t size = target->prime_fd >= 0 ?
+            lseek(target->prime_fd, 0, SEEK_END) : -1;
+        target->size = size > 0 ? (uint64_t)size :
+            (uint64_t)target->stride * key->height;
+    } else {
+        uint64_t size;
+        if (drmModeCreateDumbBuffer(egl->card_fd, key->width, key->height,
+                    32, 0, &target->handle, &target->stride, &size)) {
+            fake_log_errno(ERROR, "drmModeCreateDumbBuffer failed");
+            return false;
+        }
+        target->size = size;
+        target->modifier = DRM_FORMAT_MOD_LINEAR;
+        if (drmPrimeHandleToFD(egl->card_fd, target->handle, DRM_CLOEXEC,
+                    &target->prime_fd)) {
+            fake_log_errno(ERROR, "drmPrimeHandleToFD failed");
+            target->prime_fd = -1;
+        }
+    }
+    if (target->prime_fd < 0) {
+        fake_log(ERROR, "Failed to export render target dma-buf");
+        return false;
+    }
+    return true;
+}
+
+static bool target_import(struct render_target *target) {
+    struct egl *egl = target->pool->egl;
+    struct gles_renderer *gles = target->pool->gles;
+    const struct render_target_key *key = &target->key;
+
+    if (target->bo) {
+        target->image = dmabuf_import_bo(egl, target->bo);
+    } else {
+        const EGLint attribs[] = {
+            EGL_WIDTH, key->width,
+            EGL_HEIGHT, key->height,
+            EGL_LINUX_DRM_FOURCC_EXT, key->format,
+            EGL_DMA_BUF_PLANE0_FD_EXT, target->prime_fd,
+            EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0,
+            EGL_DMA_BUF_PLANE0_PITCH_EXT, target->stride,
+            EGL_NONE,
+        };
+        target->image = egl->procs.eglCreateImageKHR(egl->display,
+                EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+    }
+    if (target->image == EGL_NO_IMAGE_KHR) {
+        fake_log(ERROR, "Failed to import render target");
+        return false;
+    }
+
+    if (key->attach == texture) {
+        glGenTextures(1, &target->tex);
+        glBindTexture(GL_TEXTURE_2D, target->tex);
+        gles->procs.glEGLImageTargetTexture2DOES(GL_TEXTURE_2D,
+                target->image);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    } else {
+        glGenRenderbuffers(1, &target->rbo);
+        glBindRenderbuffer(GL_RENDERBUFFER, target->rbo);
+        gles->procs.glEGLImageTargetRenderbufferStorageOES(GL_RENDERBUFFER,
+                target->image);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    }
+    return true;
+}
+
+// Field by field, the padding before modifier is not initialized
+static bool target_key_equal(const struct render_target_key *a,
+        const struct render_target_key *b) {
+    return a->width == b->width && a->height == b->height &&
+        a->format == b->format && a->modifier == b->modifier &&
+        a->alloc == b->alloc && a->attach == b->attach;
+}
+
+static bool target_bind_fbo(struct render_target *target) {
+    EGLContext current = eglGetCurrentContext();
+    for (size_t i = 0; i < target->fbo_count; i++) {
+        if (target->fbos[i].context == current) {
+            glBindFramebuffer(GL_FRAMEBUFFER, target->fbos[i].fbo);
+            return true;
+        }
+    }
+    // First bind on this context, FBO names of the others mean nothing here
+    struct render_target_fbo *fbos = realloc(target->fbos,
+            (target->fbo_count + 1) * sizeof(*fbos));
+    if (!fbos) {
+        fake_log(ERROR, "Allocation failed");
+        return false;
+    }
+    target->fbos = fbos;
+    struct render_target_fbo *fbo = &fbos[target->fbo_count++];
+    fbo->context = current;
+    glGenFramebuffers(1, &fbo->fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo->fbo);
+    if (target->tex) {
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                GL_TEXTURE_2D, target->tex, 0);
+    } else {
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                GL_RENDERBUFFER, target->rbo);
+    }
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        fake_log(ERROR, "Render target FBO incomplete");
+        return false;
+    }
+    return true;
+}
+
+struct render_target *target_pool_acquire(struct target_pool *pool,
+        const struct render_target_key *key) {
+    for (struct render_target *target = pool->head; target;
+            target = target->next) {
+        if (!target->in_use && target_key_equal(&target->key, key)) {
+            if (!target_bind_fbo(target)) {
+                return NULL;
+            }
+            target->in_use = true;
+            pool->hits++;
+            return target;
+        }
+    }
+
+    pool->misses++;
+    struct render_target *target = calloc(1, sizeof(*target));
+    if (!target) {
+        fake_log(ERROR, "Allocation failed");
+        return NULL;
+    }
+    target->pool = pool;
+    target->key = *key;
+    target->prime_fd = -1;
+    target->image = EGL_NO_IMAGE_KHR;
+    target->in_use = true;
+    target_push_front(target);
+
+    if (!target_alloc(target)) {
+        // Nothing was accounted for yet
+        target->size = 0;
+        target_destroy(target);
+        return NULL;
+    }
+    // Make room before the memory is counted, the new target is in use and
+    // survives
+    target_pool_evict(pool, target->size);
+    pool->bytes += target->size;
+    if (pool->bytes > pool->budget) {
+        pool->over_budget++;
+    }
+    if (!target_import(target) || !target_bind_fbo(target)) {
+        target_destroy(target);
+        return NULL;
+    }
+    return target;
+}
+
+void target_pool_release(struct render_target *target) {
+    struct target_pool *pool = target->pool;
+    target->in_use = false;
+    target_unlink(target);
+    target_push_front(target);
+    if (pool->bytes > pool->budget) {
+        target_pool_evict(pool, 0);
+    }
+}
+
+uint32_t render_target_fb_id(struct render_target *target) {
+    if (target->fb_id) {
+        return target->fb_id;
+    }
+    int drm_fd = target->pool->egl->card_fd;
+    const struct render_target_key *key = &target->key;
+    if (target->bo) {
+        if (dmabuf_add_fb(drm_fd, target->bo, &target->fb_id)) {
+            target->fb_id = 0;
+        }
+    } else if (drmModeAddFB(drm_fd, key->width, key->height, 24, 32,
+                target->stride, target->handle, &target->fb_id)) {
+        fake_log_errno(ERROR, "drmModeAddFB failed");
+        target->fb_id = 0;
+    }
+    return target->fb_id;
+}
+
+struct frame_map *render_target_map(struct render_target *target,
+        enum frame_map_mode mode) {
+    if (target->mapped && target->map.mode == mode) {
+        return &target->map;
+    }
+    if (target->mapped) {
+        frame_map_unmap(&target->map);
+        target->mapped = false;
+    }
+    const struct render_target_key *key = &target->key;
+    if (mode == FRAME_MAP_DUMB) {
+        if (key->alloc != RENDER_TARGET_DUMB) {
+            fake_log(ERROR, "Dumb mapping of a GBM render target");
+            return NULL;
+        }
+        target->mapped = frame_map_dumb(&target->map,
+                target->pool->egl->card_fd, target->handle, target->size,
+                key->width, key->height, target->stride);
+    } else {
+        target->mapped = frame_map_dmabuf(&target->map, target->prime_fd,
+                target->size, key->width, key->height, target->stride);
+    }
+    return target->mapped ? &target->map : NULL;
+}
+
+void target_pool_log_stats(struct target_pool *pool) {
+    fake_log(INFO, "Render targets: %lu reused, %lu allocated, %lu evicted, "
+            "%lu over budget, %.1f of %.1f MiB held",
+            (unsigned long)pool->hits, (unsigned long)pool->misses,
+            (unsigned long)pool->evictions, (unsigned long)pool->over_budget,
+            (double)pool->bytes / (1 << 20),
+            (double)pool->budget / (1 << 20));
+}
+
+void target_pool_destroy(struct target_pool *pool) {
+    if (!pool) {
+        return;
+    }
+    while (pool->head) {
+        if (pool->head->in_use) {
+            fake_log(ERROR, "Destroying a render target still in use");
+        }
+        target_destroy(pool->head);
+    }
+    free(pool);
+}
@@ -0,0 +1,101 @@
+#ifndef FAKE_CHEN_TARGET_POOL_H
+#define FAKE_CHEN_TARGET_POOL_H
+#include "egl_gbm.h"
+#include "frame_map.h"
+
+enum render_target_alloc {
+    // gbm_bo_create on egl->gbm_device
+    RENDER_TARGET_GBM,
+    // drmModeCreateDumbBuffer on egl->card_fd, 32bpp formats only
+    RENDER_TARGET_DUMB,
+};
+
+struct render_target_fbo {
+    EGLContext context;
+    GLuint fbo;
+};
+
+struct render_target_key {
+    uint32_t width, height;
+    uint32_t format;
+    // DRM_FORMAT_MOD_INVALID picks from what EGL renders to and the
+    // primary plane scans out, see dmabuf_alloc_bo(). GBM targets only.
+    uint64_t modifier;
+    enum render_target_alloc alloc;
+    enum egl_image_target attach;
+};
+
+/**
+ * A dma-buf with everything needed to render into it and scan it out,
+ * kept alive together across frames.
+ */
+struct render_target {
+    struct target_pool *pool;
+    struct render_target_key key;
+
+    struct gbm_bo *bo;
+    uint32_t handle;
+    // Plane 0, further planes are only passed to EGL and KMS
+    uint32_t stride;
+    // The layout actually allocated
+    uint64_t modifier;
+    uint64_t size;
+    int prime_fd;
+
+    EGLImageKHR image;
+    // Texture or renderbuffer, shared across the share group
+    GLuint tex, rbo;
+    // FBOs are not shared, one per context that bound the target
+    struct render_target_fbo *fbos;
+    size_t fbo_count;
+    // Lazily created by render_target_fb_id()
+    uint32_t fb_id;
+    // CPU view, made by render_target_map() and kept until destroyed
+    struct frame_map map;
+    bool mapped;
+
+    bool in_use;
+    // LRU order, most recently released first
+    struct render_target *prev, *next;
+};
+
+struct target_pool {
+    struct egl *egl;
+    struct gles_renderer *gles;
+    // Idle targets are evicted, oldest first, to keep bytes under budget
+    uint64_t budget, bytes;
+    // Primary plane formats, NULL if anything goes
+    const struct drm_format_set *scanout_formats;
+    struct render_target *head, *tail;
+
+    uint64_t hits, misses, evictions, over_budget;
+};
+
+struct target_pool *target_pool_create(struct gles_renderer *gles,
+        uint64_t budget, const struct drm_format_set *scanout_formats);
+/**
+ * Return an idle target matching key, or allocate and import a new one.
+ * A context of the egl->context share group must be current; on return the
+ * target FBO is bound and complete.
+ */
+struct render_target *target_pool_acquire(struct target_pool *pool,
+        const struct render_target_key *key);
+/** Hand a target back for reuse. The same context rules apply. */
+void target_pool_release(struct render_target *target);
+/** A KMS framebuffer for the target, created once per target. */
+uint32_t render_target_fb_id(struct render_target *target);
+/**
+ * A CPU mapping of the target, created on first use and kept until the
+ * target is destroyed, so reusing a target costs no mmap or page faults.
+ * Dumb mappings need a dumb target. NULL on failure.
+ */
+struct frame_map *render_target_map(struct render_target *target,
+        enum frame_map_mode mode);
+void target_pool_log_stats(struct target_pool *pool);
+/**
+ * Destroy every target, which must all be released. FBOs are only deleted
+ * when their context is current, others go away with their context.
+ */
+void target_pool_destroy(struct target_pool *pool);
+
+#endif
@@ -0,0 +1,404 @@
+#include "trace.h"
+#include "log.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static const int64_t NSEC_PER_SEC = 1000000000;
+// How often the writer drains the rings
+static const int64_t TRACE_DRAIN_NSEC = 50000000;
+// GPU tracks are numbered apart from thread ids
+static const uint32_t TRACE_GPU_TRACK_BASE = 0x40000000;
+
+struct trace_event {
+    const char *name;
+    int64_t start_ns, dur_ns;
+    uint32_t track;
+    bool gpu;
+};
+
+// Single producer, the owning thread, and single consumer, the writer
+struct trace_ring {
+    struct trace_ring *next;
+    uint32_t tid;
+    _Atomic uint64_t head, tail;
+    _Atomic uint64_t dropped;
+    struct trace_event events[TRACE_RING_SIZE];
+};
+
+static bool enabled = false;
+static _Atomic(struct trace_ring *) rings = NULL;
+static __thread struct trace_ring *thread_ring = NULL;
+static atomic_uint gpu_tracks = 0;
+
+// Everything below belongs to the writer and is under lock
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t writer;
+static bool stop = false;
+static FILE *out = NULL;
+static bool first_event = true;
+static int pid;
+static uint64_t written = 0;
+
+static int64_t get_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static struct trace_ring *get_thread_ring(void) {
+    if (thread_ring) {
+        return thread_ring;
+    }
+    struct trace_ring *ring = calloc(1, sizeof(*ring));
+    if (!ring) {
+        return NULL;
+    }
+    ring->tid = syscall(SYS_gettid);
+    ring->next = atomic_load_explicit(&rings, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&rings, &ring->next, ring,
+                memory_order_release, memory_order_relaxed)) {
+    }
+    thread_ring = ring;
+    return ring;
+}
+
+static void trace_push(const char *name, int64_t start_ns, int64_t dur_ns,
+        uint32_t track, bool gpu) {
+    struct trace_ring *ring = get_thread_ring();
+    if (!ring) {
+        return;
+    }
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head == TRACE_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    ring->events[tail % TRACE_RING_SIZE] = (struct trace_event){
+        .name = name,
+        .start_ns = start_ns,
+        .dur_ns = dur_ns,
+        .track = track ? track : ring->tid,
+        .gpu = gpu,
+    };
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+static void write_string(const char *str) {
+    fputc('"', out);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            fputc('\\', out);
+        }
+        fputc(*str, out);
+    }
+    fputc('"', out);
+}
+
+static void write_separator(void) {
+    fputs(first_event ? "\n" : ",\n", out);
+    first_event = false;
+}
+
+static void write_event(const struct trace_event *event) {
+    write_separator();
+    fputs("{\"name\":", out);
+    write_string(event->name);
+    fprintf(out, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+            "\"pid\":%d,\"tid\":%u}", event->gpu ? "gpu" : "cpu",
+            (double)event->start_ns / 1000, (double)event->dur_ns / 1000, pid,
+            event->track);
+    written++;
+}
+
+static void drain_locked(void) {
+    struct trace_ring *ring = atomic_load_explicit(&rings,
+            memory_order_acquire);
+    for (; ring; ring = ring->next) {
+        uint64_t head = atomic_load_explicit(&ring->head,
+                memory_order_relaxed);
+        uint64_t tail = atomic_load_explicit(&ring->tail,
+                memory_order_acquire);
+        for (; head != tail; head++) {
+            write_event(&ring->events[head % TRACE_RING_SIZE]);
+        }
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+    }
+}
+
+static void *writer_thread(void *data) {
+    pthread_mutex_lock(&lock);
+    while (!stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += TRACE_DRAIN_NSEC;
+        if (deadline.tv_nsec >= NSEC_PER_SEC) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= NSEC_PER_SEC;
+        }
+        pthread_cond_timedwait(&stop_cond, &lock, &deadline);
+        drain_locked();
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+bool trace_init(const char *path) {
+    if (enabled) {
+        return true;
+    }
+    out = fopen(path, "w");
+    if (!out) {
+        fake_log_errno(ERROR, "Failed to open trace file %s", path);
+        return false;
+    }
+    pid = getpid();
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", out);
+    if (pthread_create(&writer, NULL, writer_thread, NULL)) {
+        fake_log(ERROR, "Failed to start trace writer");
+        fclose(out);
+        out = NULL;
+        return false;
+    }
+    enabled = true;
+    atexit(trace_finish);
+    fake_log(INFO, "Tracing to %s", path);
+    return true;
+}
+
+bool trace_enabled(void) {
+    return enabled;
+}
+
+void trace_finish(void) {
+    if (!enabled) {
+        return;
+    }
+    enabled = false;
+    pthread_mutex_lock(&lock);
+    stop = true;
+    pthread_cond_signal(&stop_cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(writer, NULL);
+
+    drain_locked();
+    uint64_t dropped = 0;
+    struct trace_ring *ring = atomic_exchange(&rings, NULL);
+    while (ring) {
+        struct trace_ring *next = ring->next;
+        dropped += atomic_load(&ring->dropped);
+        free(ring);
+        ring = next;
+    }
+    thread_ring = NULL;
+    fputs("\n]}\n", out);
+    fclose(out);
+    out = NULL;
+    fake_log(INFO, "Trace: %lu events written, %lu dropped on full rings",
+            (unsigned long)written, (unsigned long)dropped);
+}
+
+struct trace_scope trace_scope_begin(const char *name) {
+    return (struct trace_scope){
+        .name = name,
+        .start_ns = enabled ? get_time_ns() : 0,
+    };
+}
+
+void trace_scope_end(struct trace_scope *scope) {
+    if (scope->start_ns && enabled) {
+        trace_push(scope->name, scope->start_ns,
+                get_time_ns() - scope->start_ns, 0, false);
+    }
+}
+
+static void name_track(uint32_t track, const char *name) {
+    pthread_mutex_lock(&lock);
+    write_separator();
+    fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"tid\":%u,\"args\":{\"name\":", pid, track);
+    write_string(name);
+    fputs("}}", out);
+    pthread_mutex_unlock(&lock);
+}
+
+struct trace_gpu *trace_gpu_create(struct gles_renderer *gles) {
+    if (!enabled) {
+        return NULL;
+    }
+    struct trace_gpu *gpu = calloc(1, sizeof(*gpu));
+    if (!gpu) {
+        fake_log(ERROR, "Allocation failed");
+        return NULL;
+    }
+    gpu->egl = gles->egl;
+    gpu->gles = gles;
+    gpu->track = TRACE_GPU_TRACK_BASE + atomic_fetch_add(&gpu_tracks, 1);
+
+    // Some drivers expose the extension with no timestamp bits
+    if (gles->exts.EXT_disjoint_timer_query) {
+        GLint bits = 0;
+        gles->procs.glGetQueryivEXT(GL_TIMESTAMP_EXT,
+                GL_QUERY_COUNTER_BITS_EXT, &bits);
+        gpu->timer_query = bits > 0;
+    }
+    if (gpu->timer_query) {
+        // Reading the disjoint flag clears it
+        GLint disjoint = 0;
+        glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+        GLint64 gpu_now = 0;
+        gles->procs.glGetInteger64vEXT(GL_TIMESTAMP_EXT, &gpu_now);
+        gpu->offset_ns = get_time_ns() - gpu_now;
+        for (int i = 0; i < TRACE_GPU_MAX_SPANS; i++) {
+            gles->procs.glGenQueriesEXT(2, gpu->spans[i].queries);
+        }
+    } else if (!gpu->egl->exts.KHR_fence_sync) {
+        fake_log(ERROR, "GPU tracing needs GL_EXT_disjoint_timer_query or "
+                "EGL_KHR_fence_sync");
+        free(gpu);
+        return NULL;
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "GPU %u (%s)",
+            gpu->track - TRACE_GPU_TRACK_BASE,
+            gpu->timer_query ? "timer query" : "fence");
+    name_track(gpu->track, name);
+    return gpu;
+}
+
+void trace_gpu_begin(struct trace_gpu *gpu, const char *name) {
+    if (!gpu || gpu->open) {
+        return;
+    }
+    if (gpu->len == TRACE_GPU_MAX_SPANS) {
+        trace_gpu_collect(gpu, false);
+        if (gpu->len == TRACE_GPU_MAX_SPANS) {
+            gpu->dropped++;
+            return;
+        }
+    }
+    struct trace_gpu_span *span =
+        &gpu->spans[(gpu->head + gpu->len) % TRACE_GPU_MAX_SPANS];
+    span->name = name;
+    span->cpu_start_ns = get_time_ns();
+    if (gpu->timer_query) {
+        gpu->gles->procs.glQueryCounterEXT(span->queries[0], GL_TIMESTAMP_EXT);
+    }
+    gpu->len++;
+    gpu->open = true;
+}
+
+void trace_gpu_end(struct trace_gpu *gpu) {
+    if (!gpu || !gpu->open) {
+        return;
+    }
+    struct trace_gpu_span *span =
+        &gpu->spans[(gpu->head + gpu->len - 1) % TRACE_GPU_MAX_SPANS];
+    if (gpu->timer_query) {
+        gpu->gles->procs.glQueryCounterEXT(span->queries[1], GL_TIMESTAMP_EXT);
+    } else {
+        struct egl *egl = gpu->egl;
+        span->fence = egl->procs.eglCreateSyncKHR(egl->display,
+                EGL_SYNC_FENCE_KHR, NULL);
+        // Without a flush the fence may never reach the GPU
+        glFlush();
+    }
+    gpu->open = false;
+}
+
+// Returns false while the span is still running and wait is not set
+static bool collect_span(struct trace_gpu *gpu, struct trace_gpu_span *span,
+        bool wait, bool disjoint) {
+    if (gpu->timer_query) {
+        struct gles_renderer *gles = gpu->gles;
+        GLint available = 0;
+        gles->procs.glGetQueryObjectivEXT(span->queries[1],
+                GL_QUERY_RESULT_AVAILABLE_EXT, &available);
+        if (!available && !wait) {
+            return false;
+        }
+        GLuint64 start = 0, end = 0;
+        gles->procs.glGetQueryObjectui64vEXT(span->queries[0],
+                GL_QUERY_RESULT_EXT, &start);
+        gles->procs.glGetQueryObjectui64vEXT(span->queries[1],
+                GL_QUERY_RESULT_EXT, &end);
+        // A disjoint operation makes every pending result meaningless
+        if (!disjoint && end >= start) {
+            trace_push(span->name, (int64_t)start + gpu->offset_ns,
+                    end - start, gpu->track, true);
+        }
+        return true;
+    }
+
+    struct egl *egl = gpu->egl;
+    if (span->fence == EGL_NO_SYNC_KHR) {
+        return true;
+    }
+    EGLint ret = egl->procs.eglClientWaitSyncKHR(egl->display, span->fence,
+            0, wait ? EGL_FOREVER_KHR : 0);
+    if (ret == EGL_TIMEOUT_EXPIRED_KHR) {
+        return false;
+    }
+    if (ret == EGL_CONDITION_SATISFIED_KHR) {
+        trace_push(span->name, span->cpu_start_ns,
+                get_time_ns() - span->cpu_start_ns, gpu->track, true);
+    }
+    egl->procs.eglDestroySyncKHR(egl->display, span->fence);
+    span->fence = EGL_NO_SYNC_KHR;
+    return true;
+}
+
+void trace_gpu_collect(struct trace_gpu *gpu, bool wait) {
+    if (!gpu) {
+        return;
+    }
+    bool disjoint = false;
+    if (gpu->timer_query) {
+        GLint value = 0;
+        glGetIntegerv(GL_GPU_DISJOINT_EXT, &value);
+        disjoint = value;
+    }
+    int closed = gpu->len - gpu->open;
+    while (closed > 0) {
+        struct trace_gpu_span *span = &gpu->spans[gpu->head];
+        if (!collect_span(gpu, span, wait, disjoint)) {
+            break;
+        }
+        gpu->head = (gpu->head + 1) % TRACE_GPU_MAX_SPANS;
+        gpu->len--;
+        closed--;
+    }
+    if (disjoint) {
+        // The GPU clock may have jumped, take the offset again
+        GLint64 gpu_now = 0;
+        gpu->gles->procs.glGetInteger64vEXT(GL_TIMESTAMP_EXT, &gpu_now);
+        gpu->offset_ns = get_time_ns() - gpu_now;
+        gpu->disjoint++;
+    }
+}
+
+void trace_gpu_destroy(struct trace_gpu *gpu) {
+    if (!gpu) {
+        return;
+    }
+    trace_gpu_end(gpu);
+    trace_gpu_collect(gpu, true);
+    if (gpu->timer_query) {
+        for (int i = 0; i < TRACE_GPU_MAX_SPANS; i++) {
+            gpu->gles->procs.glDeleteQueriesEXT(2, gpu->spans[i].queries);
+        }
+    }
+    if (gpu->dropped || gpu->disjoint) {
+        fake_log(INFO, "GPU track %u: %lu spans dropped, %lu disjoint",
+                gpu->track - TRACE_GPU_TRACK_BASE,
+                (unsigned long)gpu->dropped, (unsigned long)gpu->disjoint);
+    }
+    free(gpu);
+}
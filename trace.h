@@ -0,0 +1,84 @@
+#ifndef FAKE_CHEN_TRACE_H
+#define FAKE_CHEN_TRACE_H
+#include "egl_gbm.h"
+
+// Events each thread can hold before the writer thread drains them
+#define TRACE_RING_SIZE 4096
+// GPU spans a context can have in flight before trace_gpu_collect()
+#define TRACE_GPU_MAX_SPANS 64
+
+/**
+ * Chrome trace output (chrome://tracing, ui.perfetto.dev). Every thread
+ * records into its own ring without locking, a writer thread appends them
+ * to the file. Event names are not copied, pass string literals.
+ *
+ * Starts the writer and registers trace_finish() with atexit(). Until
+ * this is called every trace function is a no-op.
+ */
+bool trace_init(const char *path);
+bool trace_enabled(void);
+/** Drain every ring and close the file. Traced threads must be done. */
+void trace_finish(void);
+
+struct trace_scope {
+    const char *name;
+    int64_t start_ns;
+};
+
+struct trace_scope trace_scope_begin(const char *name);
+void trace_scope_end(struct trace_scope *scope);
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+/**
+ * CPU time from here to the end of the enclosing block. Do not jump into
+ * the block past it.
+ */
+#define TRACE_SCOPE(name) \
+    struct trace_scope TRACE_CONCAT(trace_scope_, __LINE__) \
+        __attribute__((cleanup(trace_scope_end))) = trace_scope_begin(name)
+
+struct trace_gpu_span {
+    const char *name;
+    // GL_EXT_disjoint_timer_query timestamps at begin and end
+    GLuint queries[2];
+    // Fence fallback: signalled once the GPU is past the end
+    EGLSyncKHR fence;
+    int64_t cpu_start_ns;
+};
+
+/**
+ * GPU timing for one context, shown as its own track. With timestamp
+ * queries spans are exact and mapped onto CLOCK_MONOTONIC through an
+ * offset taken at creation. Otherwise a fence goes in at the end of each
+ * span and the span runs from the CPU-side begin to when the fence was
+ * seen signalled, so it is an upper bound.
+ */
+struct trace_gpu {
+    struct egl *egl;
+    struct gles_renderer *gles;
+    bool timer_query;
+    // CLOCK_MONOTONIC minus GPU time
+    int64_t offset_ns;
+    uint32_t track;
+
+    // Oldest pending span and number of spans, the last one may be open
+    struct trace_gpu_span spans[TRACE_GPU_MAX_SPANS];
+    int head, len;
+    bool open;
+
+    uint64_t dropped, disjoint;
+};
+
+/**
+ * For the current context, which must be current for every later call.
+ * NULL when tracing is off, and the functions below accept NULL.
+ */
+struct trace_gpu *trace_gpu_create(struct gles_renderer *gles);
+void trace_gpu_begin(struct trace_gpu *gpu, const char *name);
+void trace_gpu_end(struct trace_gpu *gpu);
+/** Record finished spans. With wait, block until all closed ones finish. */
+void trace_gpu_collect(struct trace_gpu *gpu, bool wait);
+void trace_gpu_destroy(struct trace_gpu *gpu);
+
+#endif
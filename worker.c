@@ -0,0 +1,312 @@
+#include "worker.h"
+#include "log.h"
+#include "pixconv.h"
+#include <drm_fourcc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const long NSEC_PER_SEC = 1000000000;
+
+bool render_job_read_format(const struct gles_renderer *gles,
+        const struct render_job *job, GLenum *gl_format) {
+    switch (job->format) {
+    case DRM_FORMAT_INVALID:
+    case DRM_FORMAT_ABGR8888:
+        *gl_format = GL_RGBA;
+        return true;
+    case DRM_FORMAT_ARGB8888:
+        *gl_format = GL_BGRA_EXT;
+        return gles->exts.EXT_read_format_bgra;
+    }
+    return false;
+}
+
+static bool worker_ensure_target(struct render_worker *worker,
+        uint32_t width, uint32_t height) {
+    if (worker->fbo && worker->width == width && worker->height == height) {
+        return true;
+    }
+    if (!worker->fbo) {
+        glGenFramebuffers(1, &worker->fbo);
+        glGenTextures(1, &worker->texture);
+    }
+    glBindTexture(GL_TEXTURE_2D, worker->texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA,
+            GL_UNSIGNED_BYTE, NULL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, worker->fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+            GL_TEXTURE_2D, worker->texture, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        fake_log(ERROR, "Worker %d: FBO creation failed", worker->index);
+        return false;
+    }
+
+    size_t size = (size_t)width * height * 4;
+    if (worker->pixels_size < size) {
+        free(worker->pixels);
+        worker->pixels = malloc(size);
+        if (!worker->pixels) {
+            worker->pixels_size = 0;
+            fake_log(ERROR, "Allocation failed");
+            return false;
+        }
+        worker->pixels_size = size;
+    }
+    worker->width = width;
+    worker->height = height;
+    return true;
+}
+
+static void worker_run_job(struct render_worker *worker,
+        const struct render_job *job) {
+    struct worker_pool *pool = worker->pool;
+    GLenum gl_format;
+    bool swap_rb = false;
+    if (!render_job_read_format(pool->gles, job, &gl_format)) {
+        if (job->format != DRM_FORMAT_ARGB8888) {
+            fake_log(ERROR, "Job %lu: unsupported format 0x%08x",
+                    (unsigned long)job->id, job->format);
+            return;
+        }
+        // No EXT_read_format_bgra, read RGBA and swap on the CPU
+        gl_format = GL_RGBA;
+        swap_rb = true;
+    }
+    if (!worker_ensure_target(worker, job->width, job->height)) {
+        return;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, worker->fbo);
+    glViewport(0, 0, job->width, job->height);
+    glClearColor(job->color[0], job->color[1], job->color[2], job->color[3]);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glReadPixels(0, 0, job->width, job->height, gl_format, GL_UNSIGNED_BYTE,
+            worker->pixels);
+    if (swap_rb) {
+        pixconv_swap_rb(pixconv_get(), worker->pixels, job->width * 4,
+                worker->pixels, job->width * 4, job->width, job->height);
+    }
+
+    if (pool->done) {
+        pool->done(job, worker->pixels, job->width * 4, pool->done_data);
+    }
+}
+
+static void *worker_thread(void *data) {
+    struct render_worker *worker = data;
+    struct worker_pool *pool = worker->pool;
+    struct egl *egl = pool->egl;
+
+    // The bound API is per thread
+    eglBindAPI(EGL_OPENGL_ES_API);
+    bool current = eglMakeCurrent(egl->display, EGL_NO_SURFACE,
+            EGL_NO_SURFACE, worker->context);
+    if (!current) {
+        // Keep draining the queue so waiters do not hang
+        fake_log(ERROR, "Worker %d: eglMakeCurrent failed", worker->index);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->queue_len == 0 && !pool->stop) {
+            pthread_cond_wait(&pool->job_cond, &pool->lock);
+        }
+        if (pool->queue_len == 0) {
+            break;
+        }
+        struct render_job job = pool->queue[pool->queue_head];
+        pool->queue_head = (pool->queue_head + 1) % pool->queue_capacity;
+        pool->queue_len--;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (current) {
+            worker_run_job(worker, &job);
+            worker->jobs_done++;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        pool->completed++;
+        if (pool->completed == pool->submitted) {
+            pthread_cond_broadcast(&pool->idle_cond);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (worker->fbo) {
+        glDeleteFramebuffers(1, &worker->fbo);
+        glDeleteTextures(1, &worker->texture);
+    }
+    eglMakeCurrent(egl->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+            EGL_NO_CONTEXT);
+    eglReleaseThread();
+    return NULL;
+}
+
+struct worker_pool *worker_pool_create(struct gles_renderer *gles, int count,
+        render_job_done_t done, void *data) {
+    if (count < 1) {
+        fake_log(ERROR, "Invalid worker count %d", count);
+        return NULL;
+    }
+    struct worker_pool *pool = calloc(1, sizeof(*pool));
+    if (!pool) {
+        fake_log(ERROR, "Allocation failed");
+        return NULL;
+    }
+    pool->gles = gles;
+    pool->egl = gles->egl;
+    pool->done = done;
+    pool->done_data = data;
+    pool->queue_capacity = 64;
+    pool->queue = calloc(pool->queue_capacity, sizeof(*pool->queue));
+    pool->workers = calloc(count, sizeof(*pool->workers));
+    if (!pool->queue || !pool->workers) {
+        fake_log(ERROR, "Allocation failed");
+        free(pool->queue);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->job_cond, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+
+    static const EGLint context_attribs[] = {
+        EGL_CONTEXT_CLIENT_VERSION, 2,
+        EGL_NONE
+    };
+    for (int i = 0; i < count; i++) {
+        struct render_worker *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->index = i;
+        worker->context = eglCreateContext(pool->egl->display,
+                EGL_NO_CONFIG_KHR, pool->egl->context, context_attribs);
+        if (worker->context == EGL_NO_CONTEXT) {
+            fake_log(ERROR, "Worker %d: failed to create EGL context", i);
+            break;
+        }
+        if (pthread_create(&worker->thread, NULL, worker_thread, worker)) {
+            fake_log(ERROR, "Worker %d: failed to start thread", i);
+            eglDestroyContext(pool->egl->display, worker->context);
+            break;
+        }
+        pool->count++;
+    }
+    if (pool->count != count) {
+        worker_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+bool worker_pool_submit(struct worker_pool *pool,
+        const struct render_job *job) {
+    pthread_mutex_lock(&pool->lock);
+    if (pool->queue_len == pool->queue_capacity) {
+        size_t capacity = pool->queue_capacity * 2;
+        struct render_job *queue = calloc(capacity, sizeof(*queue));
+        if (!queue) {
+            pthread_mutex_unlock(&pool->lock);
+            fake_log(ERROR, "Allocation failed");
+            return false;
+        }
+        for (size_t i = 0; i < pool->queue_len; i++) {
+            queue[i] = pool->queue[(pool->queue_head + i) %
+                pool->queue_capacity];
+        }
+        free(pool->queue);
+        pool->queue = queue;
+        pool->queue_capacity = capacity;
+        pool->queue_head = 0;
+    }
+    size_t tail = (pool->queue_head + pool->queue_len) % pool->queue_capacity;
+    pool->queue[tail] = *job;
+    pool->queue_len++;
+    pool->submitted++;
+    pthread_cond_signal(&pool->job_cond);
+    pthread_mutex_unlock(&pool->lock);
+    return true;
+}
+
+void worker_pool_wait_idle(struct worker_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->completed != pool->submitted) {
+        pthread_cond_wait(&pool->idle_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void worker_pool_destroy(struct worker_pool *pool) {
+    if (!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->job_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->count; i++) {
+        struct render_worker *worker = &pool->workers[i];
+        pthread_join(worker->thread, NULL);
+        eglDestroyContext(pool->egl->display, worker->context);
+        free(worker->pixels);
+    }
+    pthread_cond_destroy(&pool->idle_cond);
+    pthread_cond_destroy(&pool->job_cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool->queue);
+    free(pool);
+}
+
+bool worker_pool_benchmark(struct gles_renderer *gles, int max_threads,
+        uint64_t jobs, uint32_t width, uint32_t height) {
+    if (max_threads < 1) {
+        fake_log(ERROR, "Invalid thread count %d", max_threads);
+        return false;
+    }
+    double base_rate = 0;
+    int threads = 1;
+    while (threads <= max_threads) {
+        struct worker_pool *pool = worker_pool_create(gles, threads, NULL,
+                NULL);
+        if (!pool) {
+            return false;
+        }
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (uint64_t i = 0; i < jobs; i++) {
+            float t = (float)(i % 16) / 16.0f;
+            struct render_job job = {
+                .id = i,
+                .width = width,
+                .height = height,
+                .color = { t, 1.0f - t, 0.5f, 1.0f },
+            };
+            worker_pool_submit(pool, &job);
+        }
+        worker_pool_wait_idle(pool);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double elapsed = (end.tv_sec - start.tv_sec) +
+            (double)(end.tv_nsec - start.tv_nsec) / NSEC_PER_SEC;
+        double rate = jobs / elapsed;
+        if (threads == 1) {
+            base_rate = rate;
+        }
+        fake_log(INFO, "%d worker(s): %lu jobs of %ux%u in %.3fs, "
+                "%.1f jobs/s, %.2fx", threads, (unsigned long)jobs, width,
+                height, elapsed, rate, base_rate > 0 ? rate / base_rate : 0.0);
+        worker_pool_destroy(pool);
+
+        // Powers of two, always finishing on exactly max_threads
+        int next = threads * 2;
+        if (threads < max_threads && next > max_threads) {
+            next = max_threads;
+        }
+        threads = next;
+    }
+    return true;
+}
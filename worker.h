@@ -0,0 +1,79 @@
+#ifndef FAKE_CHEN_WORKER_H
+#define FAKE_CHEN_WORKER_H
+#include "egl_gbm.h"
+#include <pthread.h>
+
+/** An independent offscreen render: clear a target and read it back. */
+struct render_job {
+    uint64_t id;
+    uint32_t width, height;
+    // DRM fourcc of the pixels handed back, DRM_FORMAT_INVALID (0) for
+    // DRM_FORMAT_ABGR8888, the byte order of GL_RGBA
+    uint32_t format;
+    float color[4];
+};
+
+/** glReadPixels format for job->format, false if it cannot be read. */
+bool render_job_read_format(const struct gles_renderer *gles,
+        const struct render_job *job, GLenum *gl_format);
+
+/**
+ * Called on the worker thread once a job is done. pixels holds the job
+ * target, bottom row first, and is only valid during the call.
+ */
+typedef void (*render_job_done_t)(const struct render_job *job,
+        const void *pixels, uint32_t stride, void *data);
+
+struct worker_pool;
+
+struct render_worker {
+    struct worker_pool *pool;
+    pthread_t thread;
+    int index;
+    // Shares objects with egl->context, only ever current on this thread
+    EGLContext context;
+    // Render target, reallocated when the job size changes
+    GLuint fbo, texture;
+    uint32_t width, height;
+    uint8_t *pixels;
+    size_t pixels_size;
+    uint64_t jobs_done;
+};
+
+struct worker_pool {
+    struct gles_renderer *gles;
+    struct egl *egl;
+    int count;
+    struct render_worker *workers;
+
+    pthread_mutex_t lock;
+    // Signalled when a job is queued / when the queue drained
+    pthread_cond_t job_cond, idle_cond;
+    struct render_job *queue;
+    size_t queue_capacity, queue_head, queue_len;
+    uint64_t submitted, completed;
+    bool stop;
+
+    render_job_done_t done;
+    void *done_data;
+};
+
+/**
+ * Start count threads, each with its own context created up front on the
+ * calling thread, sharing with gles->egl->context.
+ */
+struct worker_pool *worker_pool_create(struct gles_renderer *gles, int count,
+        render_job_done_t done, void *data);
+bool worker_pool_submit(struct worker_pool *pool, const struct render_job *job);
+/** Block until every submitted job completed. */
+void worker_pool_wait_idle(struct worker_pool *pool);
+void worker_pool_destroy(struct worker_pool *pool);
+
+/**
+ * Run jobs jobs of width x height with 1, 2, 4... up to max_threads workers
+ * and log throughput and scaling against one thread.
+ */
+bool worker_pool_benchmark(struct gles_renderer *gles, int max_threads,
+        uint64_t jobs, uint32_t width, uint32_t height);
+
+#endif
@@ -0,0 +1,331 @@
+#include "yuv.h"
+#include "log.h"
+#include <drm_fourcc.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const GLchar yuv_vertex_src[] =
+    "attribute vec2 pos;\n"
+    "\n"
+    "void main() {\n"
+    "    gl_Position = vec4(pos, 0.0, 1.0);\n"
+    "}\n";
+
+// Sample s of target row row, scale source pixels per sample. The source
+// is bottom row first, row 0 of the target is its top row.
+#define YUV_FRAGMENT_PRELUDE \
+    "#ifdef GL_FRAGMENT_PRECISION_HIGH\n" \
+    "precision highp float;\n" \
+    "#else\n" \
+    "precision mediump float;\n" \
+    "#endif\n" \
+    "uniform sampler2D tex;\n" \
+    "uniform vec2 src_size;\n" \
+    "\n" \
+    "vec3 fetch(float s, float row, float scale) {\n" \
+    "    vec2 pos = vec2((s + 0.5) * scale / src_size.x,\n" \
+    "            1.0 - (row + 0.5) * scale / src_size.y);\n" \
+    "    return texture2D(tex, pos).rgb;\n" \
+    "}\n" \
+    "\n"
+
+static const GLchar pack4_fragment_src[] =
+    YUV_FRAGMENT_PRELUDE
+    "uniform float scale;\n"
+    "uniform vec4 coef;\n"
+    "\n"
+    "float pack(float s, float row) {\n"
+    "    return dot(coef.rgb, fetch(s, row, scale)) + coef.a;\n"
+    "}\n"
+    "\n"
+    "void main() {\n"
+    "    float s = floor(gl_FragCoord.x) * 4.0;\n"
+    "    float row = floor(gl_FragCoord.y);\n"
+    "    gl_FragColor = vec4(pack(s, row), pack(s + 1.0, row),\n"
+    "            pack(s + 2.0, row), pack(s + 3.0, row));\n"
+    "}\n";
+
+static const GLchar pack_uv_fragment_src[] =
+    YUV_FRAGMENT_PRELUDE
+    "uniform vec4 coef_u;\n"
+    "uniform vec4 coef_v;\n"
+    "\n"
+    "void main() {\n"
+    "    float s = floor(gl_FragCoord.x) * 2.0;\n"
+    "    float row = floor(gl_FragCoord.y);\n"
+    "    vec3 a = fetch(s, row, 2.0);\n"
+    "    vec3 b = fetch(s + 1.0, row, 2.0);\n"
+    "    gl_FragColor = vec4(dot(coef_u.rgb, a), dot(coef_v.rgb, a),\n"
+    "            dot(coef_u.rgb, b), dot(coef_v.rgb, b)) +\n"
+    "        vec4(coef_u.a, coef_v.a, coef_u.a, coef_v.a);\n"
+    "}\n";
+
+static const GLfloat quad_verts[] = {
+    -1.0f, -1.0f,
+    1.0f, -1.0f,
+    -1.0f, 1.0f,
+    1.0f, 1.0f,
+};
+
+// RGB weights and offset of Y, U and V, all in 0-1
+static void yuv_coefficients(enum yuv_matrix matrix, enum yuv_range range,
+        GLfloat y[4], GLfloat u[4], GLfloat v[4]) {
+    float kr = matrix == YUV_BT709 ? 0.2126f : 0.299f;
+    float kb = matrix == YUV_BT709 ? 0.0722f : 0.114f;
+    float kg = 1.0f - kr - kb;
+    float y_scale = 1.0f, y_offset = 0.0f, c_scale = 1.0f;
+    if (range == YUV_RANGE_LIMITED) {
+        y_scale = 219.0f / 255.0f;
+        y_offset = 16.0f / 255.0f;
+        c_scale = 224.0f / 255.0f;
+    }
+    float cb = 0.5f / (1.0f - kb) * c_scale;
+    float cr = 0.5f / (1.0f - kr) * c_scale;
+
+    y[0] = kr * y_scale, y[1] = kg * y_scale, y[2] = kb * y_scale;
+    y[3] = y_offset;
+    u[0] = -kr * cb, u[1] = -kg * cb, u[2] = (1.0f - kb) * cb;
+    u[3] = 128.0f / 255.0f;
+    v[0] = (1.0f - kr) * cr, v[1] = -kg * cr, v[2] = -kb * cr;
+    v[3] = 128.0f / 255.0f;
+}
+
+static bool plane_init(struct yuv_plane *plane, uint32_t width,
+        uint32_t height) {
+    plane->width = width;
+    plane->height = height;
+    glGenTextures(1, &plane->texture);
+    glBindTexture(GL_TEXTURE_2D, plane->texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA,
+            GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &plane->fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, plane->fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+            GL_TEXTURE_2D, plane->texture, 0);
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        fake_log(ERROR, "YUV plane FBO %ux%u incomplete: 0x%x", width,
+                height, status);
+        return false;
+    }
+    return true;
+}
+
+struct yuv_converter *yuv_converter_create(struct gles_renderer *gles,
+        uint32_t width, uint32_t height, enum yuv_layout layout,
+        enum yuv_matrix matrix, enum yuv_range range) {
+    if (width == 0 || height == 0) {
+        fake_log(ERROR, "Invalid YUV frame size %ux%u", width, height);
+        return NULL;
+    }
+    struct yuv_converter *conv = calloc(1, sizeof(*conv));
+    if (!conv) {
+        fake_log(ERROR, "Allocation failed");
+        return NULL;
+    }
+    conv->gles = gles;
+    conv->context = eglGetCurrentContext();
+    conv->width = width;
+    conv->height = height;
+    conv->layout = layout;
+    conv->matrix = matrix;
+    conv->range = range;
+
+    conv->pack4 = gles_link_program(yuv_vertex_src, pack4_fragment_src);
+    if (!conv->pack4) {
+        goto error;
+    }
+    conv->pack4_loc.tex = glGetUniformLocation(conv->pack4, "tex");
+    conv->pack4_loc.src_size = glGetUniformLocation(conv->pack4, "src_size");
+    conv->pack4_loc.scale = glGetUniformLocation(conv->pack4, "scale");
+    conv->pack4_loc.coef = glGetUniformLocation(conv->pack4, "coef");
+    conv->pack4_pos = glGetAttribLocation(conv->pack4, "pos");
+    if (layout == YUV_NV12) {
+        conv->pack_uv = gles_link_program(yuv_vertex_src,
+                pack_uv_fragment_src);
+        if (!conv->pack_uv) {
+            goto error;
+        }
+        conv->pack_uv_loc.tex = glGetUniformLocation(conv->pack_uv, "tex");
+        conv->pack_uv_loc.src_size =
+            glGetUniformLocation(conv->pack_uv, "src_size");
+        conv->pack_uv_loc.coef_u =
+            glGetUniformLocation(conv->pack_uv, "coef_u");
+        conv->pack_uv_loc.coef_v =
+            glGetUniformLocation(conv->pack_uv, "coef_v");
+        conv->pack_uv_pos = glGetAttribLocation(conv->pack_uv, "pos");
+    }
+
+    GLint prev_fbo;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &prev_fbo);
+    uint32_t cw = (width + 1) / 2, ch = (height + 1) / 2;
+    bool ok = plane_init(&conv->planes[0], (width + 3) / 4, height);
+    if (layout == YUV_NV12) {
+        conv->plane_count = 2;
+        ok = ok && plane_init(&conv->planes[1], (cw + 1) / 2, ch);
+    } else {
+        conv->plane_count = 3;
+        ok = ok && plane_init(&conv->planes[1], (cw + 3) / 4, ch) &&
+            plane_init(&conv->planes[2], (cw + 3) / 4, ch);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, prev_fbo);
+    if (!ok) {
+        goto error;
+    }
+    for (int i = 0; i < conv->plane_count; i++) {
+        conv->offsets[i] = conv->size;
+        conv->strides[i] = conv->planes[i].width * 4;
+        conv->size += (size_t)conv->strides[i] * conv->planes[i].height;
+    }
+
+    fake_log(DEBUG, "YUV converter %ux%u %s %s %s range, %zu bytes/frame",
+            width, height, layout == YUV_NV12 ? "NV12" : "I420",
+            matrix == YUV_BT709 ? "BT.709" : "BT.601",
+            range == YUV_RANGE_FULL ? "full" : "limited", conv->size);
+    return conv;
+
+error:
+    yuv_converter_destroy(conv);
+    return NULL;
+}
+
+bool yuv_parse_spec(const char *spec, enum yuv_layout *layout,
+        enum yuv_matrix *matrix, enum yuv_range *range) {
+    *matrix = YUV_BT601;
+    *range = YUV_RANGE_LIMITED;
+    bool have_layout = false;
+    while (*spec) {
+        size_t len = strcspn(spec, ",");
+        if (len == 4 && strncmp(spec, "nv12", 4) == 0) {
+            *layout = YUV_NV12;
+            have_layout = true;
+        } else if (len == 4 && strncmp(spec, "i420", 4) == 0) {
+            *layout = YUV_I420;
+            have_layout = true;
+        } else if (len == 5 && strncmp(spec, "bt601", 5) == 0) {
+            *matrix = YUV_BT601;
+        } else if (len == 5 && strncmp(spec, "bt709", 5) == 0) {
+            *matrix = YUV_BT709;
+        } else if (len == 7 && strncmp(spec, "limited", 7) == 0) {
+            *range = YUV_RANGE_LIMITED;
+        } else if (len == 4 && strncmp(spec, "full", 4) == 0) {
+            *range = YUV_RANGE_FULL;
+        } else {
+            fake_log(ERROR, "Unknown YUV option '%.*s'", (int)len, spec);
+            return false;
+        }
+        spec += len;
+        if (*spec == ',') {
+            spec++;
+        }
+    }
+    if (!have_layout) {
+        fake_log(ERROR, "YUV spec needs nv12 or i420");
+    }
+    return have_layout;
+}
+
+uint32_t yuv_converter_format(const struct yuv_converter *conv) {
+    return conv->layout == YUV_NV12 ? DRM_FORMAT_NV12 : DRM_FORMAT_YUV420;
+}
+
+static void draw_plane(const struct yuv_plane *plane, GLint pos) {
+    glBindFramebuffer(GL_FRAMEBUFFER, plane->fbo);
+    glViewport(0, 0, plane->width, plane->height);
+    glVertexAttribPointer(pos, 2, GL_FLOAT, GL_FALSE, 0, quad_verts);
+    glEnableVertexAttribArray(pos);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glDisableVertexAttribArray(pos);
+}
+
+bool yuv_converter_draw(struct yuv_converter *conv, GLuint texture) {
+    GLint prev_fbo, prev_program, prev_viewport[4];
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &prev_fbo);
+    glGetIntegerv(GL_CURRENT_PROGRAM, &prev_program);
+    glGetIntegerv(GL_VIEWPORT, prev_viewport);
+
+    glActiveTexture(GL_TEXTURE0);
+    if (texture == 0) {
+        if (!conv->source) {
+            glGenTextures(1, &conv->source);
+            glBindTexture(GL_TEXTURE_2D, conv->source);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, conv->width, conv->height,
+                    0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S,
+                    GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T,
+                    GL_CLAMP_TO_EDGE);
+        }
+        // GPU to GPU, the RGBA frame never leaves video memory
+        glBindTexture(GL_TEXTURE_2D, conv->source);
+        glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, conv->width,
+                conv->height);
+        texture = conv->source;
+    } else {
+        glBindTexture(GL_TEXTURE_2D, texture);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    GLfloat y[4], u[4], v[4];
+    yuv_coefficients(conv->matrix, conv->range, y, u, v);
+
+    glUseProgram(conv->pack4);
+    glUniform1i(conv->pack4_loc.tex, 0);
+    glUniform2f(conv->pack4_loc.src_size, conv->width, conv->height);
+    glUniform1f(conv->pack4_loc.scale, 1.0f);
+    glUniform4fv(conv->pack4_loc.coef, 1, y);
+    draw_plane(&conv->planes[0], conv->pack4_pos);
+    if (conv->layout == YUV_NV12) {
+        glUseProgram(conv->pack_uv);
+        glUniform1i(conv->pack_uv_loc.tex, 0);
+        glUniform2f(conv->pack_uv_loc.src_size, conv->width, conv->height);
+        glUniform4fv(conv->pack_uv_loc.coef_u, 1, u);
+        glUniform4fv(conv->pack_uv_loc.coef_v, 1, v);
+        draw_plane(&conv->planes[1], conv->pack_uv_pos);
+    } else {
+        glUniform1f(conv->pack4_loc.scale, 2.0f);
+        glUniform4fv(conv->pack4_loc.coef, 1, u);
+        draw_plane(&conv->planes[1], conv->pack4_pos);
+        glUniform4fv(conv->pack4_loc.coef, 1, v);
+        draw_plane(&conv->planes[2], conv->pack4_pos);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glUseProgram(prev_program);
+    glBindFramebuffer(GL_FRAMEBUFFER, prev_fbo);
+    glViewport(prev_viewport[0], prev_viewport[1], prev_viewport[2],
+            prev_viewport[3]);
+    return glGetError() == GL_NO_ERROR;
+}
+
+void yuv_converter_read(struct yuv_converter *conv, void *dst) {
+    GLint prev_fbo;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &prev_fbo);
+    for (int i = 0; i < conv->plane_count; i++) {
+        const struct yuv_plane *plane = &conv->planes[i];
+        glBindFramebuffer(GL_FRAMEBUFFER, plane->fbo);
+        glReadPixels(0, 0, plane->width, plane->height, GL_RGBA,
+                GL_UNSIGNED_BYTE, (uint8_t *)dst + conv->offsets[i]);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, prev_fbo);
+}
+
+void yuv_converter_destroy(struct yuv_converter *conv) {
+    if (!conv) {
+        return;
+    }
+    for (int i = 0; i < YUV_MAX_PLANES; i++) {
+        glDeleteFramebuffers(1, &conv->planes[i].fbo);
+        glDeleteTextures(1, &conv->planes[i].texture);
+    }
+    glDeleteTextures(1, &conv->source);
+    glDeleteProgram(conv->pack4);
+    glDeleteProgram(conv->pack_uv);
+    free(conv);
+}
@@ -0,0 +1,95 @@
+#ifndef FAKE_CHEN_YUV_H
+#define FAKE_CHEN_YUV_H
+#include "egl_gbm.h"
+
+enum yuv_layout {
+    // Y plane, then one plane of interleaved U and V
+    YUV_NV12,
+    // Y, U and V planes
+    YUV_I420,
+};
+
+enum yuv_matrix {
+    YUV_BT601,
+    YUV_BT709,
+};
+
+enum yuv_range {
+    // Y in 16-235, U and V in 16-240
+    YUV_RANGE_LIMITED,
+    YUV_RANGE_FULL,
+};
+
+#define YUV_MAX_PLANES 3
+
+struct yuv_plane {
+    GLuint fbo, texture;
+    // Render target size in RGBA texels, four samples each
+    uint32_t width, height;
+};
+
+/**
+ * Converts an RGBA frame to NV12 or I420 on the GPU so only 12 bits per
+ * pixel are read back and nothing converts colours on the CPU. Every plane
+ * is an RGBA8 FBO holding four 8-bit samples per texel, which GLES2 can
+ * render to without EXT_texture_rg; chroma is the 2x2 average through
+ * GL_LINEAR on the source. The planes read back top row first.
+ *
+ * Like the readback ring, the context current at creation must be current
+ * for every call, including destroy.
+ */
+struct yuv_converter {
+    struct gles_renderer *gles;
+    EGLContext context;
+    uint32_t width, height;
+    enum yuv_layout layout;
+    enum yuv_matrix matrix;
+    enum yuv_range range;
+
+    struct yuv_plane planes[YUV_MAX_PLANES];
+    int plane_count;
+    // Where each plane starts in yuv_converter_read() output, and its
+    // stride, every plane a multiple of four bytes wide
+    size_t offsets[YUV_MAX_PLANES];
+    uint32_t strides[YUV_MAX_PLANES];
+    size_t size;
+
+    // Copy of the read framebuffer when converting what was drawn
+    GLuint source;
+    // Samples four texels of one plane, and U and V pairs for NV12
+    GLuint pack4, pack_uv;
+    struct {
+        GLint tex, src_size, scale, coef;
+    } pack4_loc;
+    struct {
+        GLint tex, src_size, coef_u, coef_v;
+    } pack_uv_loc;
+    GLint pack4_pos, pack_uv_pos;
+};
+
+struct yuv_converter *yuv_converter_create(struct gles_renderer *gles,
+        uint32_t width, uint32_t height, enum yuv_layout layout,
+        enum yuv_matrix matrix, enum yuv_range range);
+/**
+ * Parse "nv12|i420[,bt601|bt709][,limited|full]", BT.601 limited range
+ * unless given.
+ */
+bool yuv_parse_spec(const char *spec, enum yuv_layout *layout,
+        enum yuv_matrix *matrix, enum yuv_range *range);
+/** DRM_FORMAT_NV12 or DRM_FORMAT_YUV420. */
+uint32_t yuv_converter_format(const struct yuv_converter *conv);
+/**
+ * Convert texture, or with 0 a copy of the bound read framebuffer, into
+ * the planes. texture is sampled bottom row first, as rendered, and must
+ * be complete with GL_LINEAR filtering. The framebuffer binding, viewport
+ * and program are left as they were.
+ */
+bool yuv_converter_draw(struct yuv_converter *conv, GLuint texture);
+/**
+ * glReadPixels every plane into dst at its offset, size bytes in all. With
+ * a pixel pack buffer bound dst is an offset into it, usually NULL.
+ */
+void yuv_converter_read(struct yuv_converter *conv, void *dst);
+void yuv_converter_destroy(struct yuv_converter *conv);
+
+#endif